@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lcurses
+LIBS := -lcurses -lpthread
 
@@ -4,29 +4,65 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 CC_SRCS += \
+../bench.cc \
+../discovery.cc \
+../fleet.cc \
 ../level_bed.cc \
+../line_framer.cc \
 ../machine.cc \
 ../main.cc \
+../mesh.cc \
 ../mesh_builder.cc \
 ../serial.cc \
+../serial_adapter.cc \
+../serial_baud.cc \
+../serial_router.cc \
+../serial_stats.cc \
+../serial_thread.cc \
+../temperature.cc \
+../transcript.cc \
 ../tui.cc \
 ../utility.cc 
 
 CC_DEPS += \
+./bench.d \
+./discovery.d \
+./fleet.d \
 ./level_bed.d \
+./line_framer.d \
 ./machine.d \
 ./main.d \
+./mesh.d \
 ./mesh_builder.d \
 ./serial.d \
+./serial_adapter.d \
+./serial_baud.d \
+./serial_router.d \
+./serial_stats.d \
+./serial_thread.d \
+./temperature.d \
+./transcript.d \
 ./tui.d \
 ./utility.d 
 
 OBJS += \
+./bench.o \
+./discovery.o \
+./fleet.o \
 ./level_bed.o \
+./line_framer.o \
 ./machine.o \
 ./main.o \
+./mesh.o \
 ./mesh_builder.o \
 ./serial.o \
+./serial_adapter.o \
+./serial_baud.o \
+./serial_router.o \
+./serial_stats.o \
+./serial_thread.o \
+./temperature.o \
+./transcript.o \
 ./tui.o \
 ./utility.o 
 
@@ -0,0 +1,307 @@
+/*
+ * bench.cc - Benchmarks of the serial link to a printer: how many commands and bytes per second get
+ * through at a given baud rate and how long a round trip takes, against a printer or the printer simulator.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_stats.h"
+#include "machine.h"
+#include "bench.h"
+
+#define BENCH_ROUNDTRIPS 100	// M105 commands sent one by one
+#define BENCH_STREAMED 200		// M117 commands sent in batches
+#define BENCH_REPLIES 20		// M115 commands with long replies
+#define BENCH_PROBE_TIMEOUT 2000	// Time the printer gets to answer at a new rate in milliseconds
+#define BENCH_LATENCY 200		// Round trips measured, alternating M400 and G4 P0
+#define BENCH_MOVES 200			// Short G1 moves sent back and forth
+#define BENCH_MOVE "G1 X%.1f F6000\n"	// A move of 0.1 mm takes about a millisecond
+
+/**
+ * Measure the throughput of the serial link at a baud rate. The port is switched to the rate first, so
+ * the printer has to run at the same rate (the simulator follows the host with -S host).
+ * @param baud Baud rate to measure
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_baud(int baud, ty_bench_baud *r, ty_serial_conn *conn) {
+	ty_serial_counters before, after;
+	char cmd[SERIAL_MAX_CMD_SIZE];
+	ty_serial_batch batch;
+	uint64_t start;
+
+	memset(r, 0, sizeof(*r));
+	r->baud = baud;
+	if((r->result = serial_change_baud(baud, conn)) < 0) return r->result;
+	r->baud = serial_conn_baud(conn);
+
+	// A printer at another rate only produces garbage; do not wait long for it
+	int timeout = serial_cmd_timeout("M105\n");
+	serial_set_timeout(SERIAL_CLASS_QUICK, BENCH_PROBE_TIMEOUT);
+	r->result = serial_cmd("M105\n", NULL, false, conn);
+	serial_set_timeout(SERIAL_CLASS_QUICK, timeout);
+	if(r->result < 0) return r->result;
+
+	// Round trips: latency of the link and the printer
+	start = serial_stats_now();
+	for(int i=0; i<BENCH_ROUNDTRIPS && r->result == 0; i++) r->result = serial_cmd("M105\n", NULL, false, conn);
+	if(r->result < 0) return r->result;
+	r->roundtrips = BENCH_ROUNDTRIPS / ((serial_stats_now() - start) / 1e9);
+
+	// Streaming: the printer buffers stay filled, so the wire is the limit
+	serial_batch_init(&batch, conn);
+	serial_stats_counters(&before, conn);
+	start = serial_stats_now();
+	for(int i=0; i<BENCH_STREAMED && r->result == 0; i++) {
+		snprintf(cmd, sizeof(cmd), "M117 Throughput test %04i: the quick brown fox jumps over the lazy dog\n", i);
+		r->result = serial_batch_add(&batch, cmd);
+	}
+	if(r->result == 0) r->result = serial_batch_send(&batch);
+	if(r->result != 0) return r->result = r->result < 0 ? r->result : -1;
+	double elapsed = (serial_stats_now() - start) / 1e9;
+	serial_stats_counters(&after, conn);
+	r->streamed = BENCH_STREAMED / elapsed;
+	r->tx_bytes = (after.tx_bytes - before.tx_bytes) / elapsed;
+
+	// Long replies: the printer sends more than it receives
+	serial_stats_counters(&before, conn);
+	start = serial_stats_now();
+	for(int i=0; i<BENCH_REPLIES && r->result == 0; i++) r->result = serial_query("M115\n", NULL, true, conn);
+	if(r->result < 0) return r->result;
+	elapsed = (serial_stats_now() - start) / 1e9;
+	serial_stats_counters(&after, conn);
+	r->rx_bytes = (after.rx_bytes - before.rx_bytes) / elapsed;
+	return 0;
+}
+
+/**
+ * Print a table of throughput measurements
+ * @param results Measurements of bench_baud()
+ * @param count Number of measurements
+ */
+void bench_baud_print(const ty_bench_baud *results, int count) {
+	printf("%10s %12s %12s %12s %12s %12s\n", "baud", "wire B/s", "round trip/s", "streamed/s", "TX B/s", "RX B/s");
+	for(int i=0; i<count; i++) {
+		const ty_bench_baud *r = &results[i];
+		if(r->result < 0) {
+			printf("%10i %12i   no reply from the printer at this rate\n", r->baud, r->baud / 10);
+			continue;
+		}
+		printf("%10i %12i %12.1f %12.1f %12.0f %12.0f\n", r->baud, r->baud / 10, r->roundtrips, r->streamed, r->tx_bytes, r->rx_bytes);
+	}
+}
+
+int bench_compare_double(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/**
+ * Measure the round trip time of the serial link: M400 and G4 P0 one after another, each sent when the
+ * previous one is acknowledged.
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_latency(ty_bench_latency *r, ty_serial_conn *conn) {
+	double times[BENCH_LATENCY];
+
+	memset(r, 0, sizeof(*r));
+	// Moves still in the planner would hold back the first M400
+	if((r->result = serial_cmd("M400\n", NULL, false, conn)) < 0) return r->result;
+
+	uint64_t start = serial_stats_now();
+	for(int i=0; i<BENCH_LATENCY; i++) {
+		uint64_t sent = serial_stats_now();
+		if((r->result = serial_cmd(i % 2 == 0 ? "M400\n" : "G4 P0\n", NULL, false, conn)) < 0) return r->result;
+		times[i] = (serial_stats_now() - sent) / 1e6;
+		r->mean += times[i];
+	}
+	r->per_second = BENCH_LATENCY / ((serial_stats_now() - start) / 1e9);
+	r->count = BENCH_LATENCY;
+	r->mean /= BENCH_LATENCY;
+
+	qsort(times, BENCH_LATENCY, sizeof(times[0]), bench_compare_double);
+	r->min = times[0];
+	r->median = times[BENCH_LATENCY / 2];
+	r->p99 = times[(BENCH_LATENCY * 99) / 100];
+	return 0;
+}
+
+/**
+ * Print round trip measurements before and after tuning the serial adapter, with the improvement
+ * @param before Measurement with the adapter as it was
+ * @param after Measurement after serial_tune_latency(), NULL when it was not tuned
+ */
+void bench_latency_print(const ty_bench_latency *before, const ty_bench_latency *after) {
+	const ty_bench_latency *rows[] = { before, after };
+	const char *names[] = { "before", "after" };
+
+	printf("%8s %10s %10s %10s %10s %12s\n", "", "mean ms", "min ms", "median ms", "p99 ms", "round trip/s");
+	for(int i=0; i<2; i++) {
+		const ty_bench_latency *r = rows[i];
+		if(r == NULL) continue;
+		if(r->result < 0) {
+			printf("%8s   no reply from the printer\n", names[i]);
+			continue;
+		}
+		printf("%8s %10.2f %10.2f %10.2f %10.2f %12.1f\n", names[i], r->mean, r->min, r->median, r->p99, r->per_second);
+	}
+	if(after != NULL && before->result == 0 && after->result == 0 && after->mean > 0) {
+		printf("Round trips are %.1fx as fast (%.2f ms saved per command)\n", before->mean / after->mean, before->mean - after->mean);
+	}
+}
+
+/**
+ * Sustained rate of short G1 moves, including the time the printer needs to finish them
+ * @param pipelined Send the moves in batches instead of waiting for each 'ok'
+ * @param per_second Filled with the moves per second
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int bench_moves(bool pipelined, double *per_second, ty_serial_conn *conn) {
+	char cmd[SERIAL_MAX_CMD_SIZE];
+	ty_serial_batch batch;
+	int res;
+
+	// Relative moves back and forth end where they started, wherever the head is
+	if((res = serial_cmd("G91\n", NULL, false, conn)) != 0) return res;
+	serial_batch_init(&batch, conn);
+	uint64_t start = serial_stats_now();
+	for(int i=0; i<BENCH_MOVES && res == 0; i++) {
+		snprintf(cmd, sizeof(cmd), BENCH_MOVE, i % 2 == 0 ? 0.1 : -0.1);
+		res = pipelined ? serial_batch_add(&batch, cmd) : serial_cmd(cmd, NULL, false, conn);
+	}
+	if(res == 0 && pipelined) res = serial_batch_send(&batch);
+	if(res == 0) res = serial_cmd("M400\n", NULL, false, conn);
+	double elapsed = (serial_stats_now() - start) / 1e9;
+	int res_abs = serial_cmd("G90\n", NULL, false, conn);
+	if(res != 0) return res < 0 ? res : -1;
+	if(res_abs != 0) return res_abs;
+	*per_second = BENCH_MOVES / elapsed;
+	return 0;
+}
+
+/**
+ * Characterise a printer: round trips, G1 moves, M421 and G29 T1
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_printer(ty_bench_printer *r, ty_serial_conn *conn) {
+	static ty_mesh mesh[SERIAL_MAX_CONNECTIONS];	// Sized by the first download, kept for the next run
+	ty_serial_counters before, after;
+	char cmd[SERIAL_MAX_CMD_SIZE];
+
+	memset(r, 0, sizeof(*r));
+	int caps = serial_conn_caps(conn);
+	if((r->result = caps) < 0) return r->result;
+	if((r->result = bench_latency(&r->ok, conn)) < 0) return r->result;
+	if((r->result = bench_moves(false, &r->moves, conn)) < 0) return r->result;
+	if((r->result = bench_moves(true, &r->moves_pipelined, conn)) < 0) return r->result;
+	if(!(caps & SERIAL_CAP_UBL)) return r->result = 0;
+	ty_mesh *m = &mesh[serial_conn_id(conn)];
+
+	// The mesh as CSV: the reply is counted as it arrives
+	serial_stats_counters(&before, conn);
+	uint64_t start = serial_stats_now();
+	if((r->result = mesh_download(-1, m, NULL, conn)) != 0) return r->result = r->result < 0 ? r->result : -1;
+	r->g29_ms = (serial_stats_now() - start) / 1e6;
+	serial_stats_counters(&after, conn);
+	r->g29_bytes = after.rx_bytes - before.rx_bytes;
+	r->g29_lines = after.rx_lines - before.rx_lines;
+
+	// Every point is written back with the value it has, so the mesh does not change
+	r->mesh_points = m->size_x * m->size_y;
+	start = serial_stats_now();
+	for(int y=0; y<m->size_y && r->result == 0; y++) {
+		for(int x=0; x<m->size_x && r->result == 0; x++) {
+			int p = mesh_index(m, x, y);
+			if(mesh_valid(m, p)) snprintf(cmd, sizeof(cmd), "M421 I%i J%i Z%.03f\n", x, y, m->z[p]);
+			else snprintf(cmd, sizeof(cmd), "M421 I%i J%i N1\n", x, y);
+			r->result = serial_cmd(cmd, NULL, false, conn);
+		}
+	}
+	if(r->result != 0) return r->result = r->result < 0 ? r->result : -1;
+	r->m421 = (serial_stats_now() - start) / 1e6 / r->mesh_points;
+
+	// All points, not only the changed ones (none)
+	mesh_forget(conn);
+	start = serial_stats_now();
+	if((r->result = mesh_upload(-1, m, NULL, conn)) != 0) return r->result = r->result < 0 ? r->result : -1;
+	r->m421_pipelined = (serial_stats_now() - start) / 1e6 / r->mesh_points;
+	return 0;
+}
+
+/**
+ * Print the measurements of bench_printer()
+ */
+void bench_printer_print(const ty_bench_printer *r, ty_serial_conn *conn) {
+	const char *port = serial_conn_port(conn);
+	if(r->result < 0) {
+		printf("%s: benchmark failed (error %i)\n", port, r->result);
+		return;
+	}
+	printf("%s: ok latency min %.2f / median %.2f / p99 %.2f ms, G1 moves %.0f/s (%.0f/s pipelined)\n", port,
+			r->ok.min, r->ok.median, r->ok.p99, r->moves, r->moves_pipelined);
+	if(r->mesh_points == 0) printf("%s: no UBL, M421 and G29 T1 not measured\n", port);
+	else printf("%s: M421 %.2f ms per point (%.2f ms pipelined), G29 T1 %lu bytes in %lu lines, %.1f ms\n", port,
+			r->m421, r->m421_pipelined, r->g29_bytes, r->g29_lines, r->g29_ms);
+}
+
+/**
+ * Write the measurements of bench_printer() as JSON, together with what is known about the printer
+ * @param path File to write
+ * @return 0 when OK or a negative error code otherwise
+ */
+int bench_printer_write_json(const char *path, const ty_bench_printer *r, ty_serial_conn *conn) {
+	char firmware[64], host[64], date[32];
+	ty_serial_adapter adapter;
+
+	FILE *fh = fopen(path, "w");
+	if(fh == NULL) {
+		fprintf(stderr, "error %d writing %s: %s\n", errno, path, strerror (errno));
+		return -1;
+	}
+	serial_stats_firmware(firmware, sizeof(firmware), conn);
+	if(gethostname(host, sizeof(host)) != 0) host[0] = 0x0;
+	host[sizeof(host) - 1] = 0x0;
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	if(serial_conn_adapter(&adapter, conn) < 0) memset(&adapter, 0, sizeof(adapter));
+	int caps = serial_conn_caps(conn);
+	if(caps < 0) caps = 0;
+
+	fprintf(fh, "{\n  \"version\": \"" VERSION "\",\n  \"host\": ");
+	serial_stats_json_string(fh, host);
+	fprintf(fh, ",\n  \"date\": \"%s\",\n  \"port\": ", date);
+	serial_stats_json_string(fh, serial_conn_port(conn));
+	fprintf(fh, ",\n  \"baud\": %i,\n  \"firmware\": ", serial_conn_baud(conn));
+	serial_stats_json_string(fh, firmware);
+	fprintf(fh, ",\n  \"caps\": { \"advanced_ok\": %s, \"autoreport_temp\": %s, \"eeprom\": %s, \"ubl\": %s },\n",
+			caps & SERIAL_CAP_ADVANCED_OK ? "true" : "false", caps & SERIAL_CAP_AUTOREPORT_TEMP ? "true" : "false",
+			caps & SERIAL_CAP_EEPROM ? "true" : "false", caps & SERIAL_CAP_UBL ? "true" : "false");
+	fprintf(fh, "  \"adapter\": { \"driver\": ");
+	serial_stats_json_string(fh, adapter.driver);
+	fprintf(fh, ", \"latency_timer\": %i },\n", adapter.driver[0] != 0x0 ? adapter.latency_timer : -1);
+	fprintf(fh, "  \"result\": %i,\n", r->result);
+	fprintf(fh, "  \"ok_latency_ms\": { \"commands\": \"M400, G4 P0\", \"count\": %i, \"min\": %.3f, \"median\": %.3f, \"p99\": %.3f, \"mean\": %.3f },\n",
+			r->ok.count, r->ok.min, r->ok.median, r->ok.p99, r->ok.mean);
+	fprintf(fh, "  \"g1_moves_per_second\": { \"sequential\": %.1f, \"pipelined\": %.1f },\n", r->moves, r->moves_pipelined);
+	if(r->mesh_points > 0) {
+		fprintf(fh, "  \"m421_ms_per_point\": { \"points\": %i, \"sequential\": %.3f, \"pipelined\": %.3f },\n",
+				r->mesh_points, r->m421, r->m421_pipelined);
+		fprintf(fh, "  \"g29_t1\": { \"bytes\": %lu, \"lines\": %lu, \"ms\": %.1f }\n}\n", r->g29_bytes, r->g29_lines, r->g29_ms);
+	} else {
+		fprintf(fh, "  \"m421_ms_per_point\": null,\n  \"g29_t1\": null\n}\n");
+	}
+	fclose(fh);
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * bench.h - Benchmarks of the serial link to a printer: how many commands and bytes per second get
+ * through at a given baud rate and how long a round trip takes, against a printer or the printer simulator.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "serial.h"
+
+/**
+ * Throughput of the serial link at one baud rate
+ */
+typedef struct {
+	int baud;				// Baud rate as set by the serial driver
+	int result;				// 0 when the printer answered at this rate, a negative error code otherwise
+	double roundtrips;		// Commands per second when waiting for each 'ok' (M105)
+	double streamed;		// Commands per second when sent in batches (M117 with a long message)
+	double tx_bytes;		// Bytes per second sent while streaming
+	double rx_bytes;		// Bytes per second received while the printer sends long replies (M115)
+} ty_bench_baud;
+
+/**
+ * Measure the throughput of the serial link at a baud rate. The port is switched to the rate first, so
+ * the printer has to run at the same rate (the simulator follows the host with -S host).
+ * @param baud Baud rate to measure
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_baud(int baud, ty_bench_baud *result, ty_serial_conn *conn = NULL);
+
+/**
+ * Print a table of throughput measurements
+ * @param results Measurements of bench_baud()
+ * @param count Number of measurements
+ */
+void bench_baud_print(const ty_bench_baud *results, int count);
+
+/**
+ * Round trip times of commands which the printer acknowledges right away
+ */
+typedef struct {
+	int result;				// 0 when OK, a negative error code otherwise
+	int count;				// Number of round trips measured
+	double mean;			// Mean round trip time in milliseconds
+	double min;				// Shortest round trip time in milliseconds
+	double median;			// Median round trip time in milliseconds
+	double p99;				// 99th percentile of the round trip time in milliseconds
+	double per_second;		// Round trips per second
+} ty_bench_latency;
+
+/**
+ * Measure the round trip time of the serial link: M400 and G4 P0 one after another, each sent when the
+ * previous one is acknowledged. With an empty planner both are acknowledged right away, so the time is
+ * spent in the link: the USB serial adapter, the driver and the wire.
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_latency(ty_bench_latency *result, ty_serial_conn *conn = NULL);
+
+/**
+ * Print round trip measurements before and after tuning the serial adapter, with the improvement
+ * @param before Measurement with the adapter as it was
+ * @param after Measurement after serial_tune_latency(), NULL when it was not tuned
+ */
+void bench_latency_print(const ty_bench_latency *before, const ty_bench_latency *after);
+
+/**
+ * What a printer and its link can do, to compare firmware builds, boards and USB hubs
+ */
+typedef struct {
+	int result;					// 0 when OK, a negative error code otherwise
+	ty_bench_latency ok;		// Round trips of commands which are acknowledged right away (M400, G4 P0)
+	double moves;				// G1 moves per second when each is sent after the previous one is acknowledged
+	double moves_pipelined;		// G1 moves per second when sent in batches
+	int mesh_points;			// Mesh points rewritten with M421, 0 when the firmware has no UBL
+	double m421;				// Milliseconds per mesh point when each M421 waits for the previous one
+	double m421_pipelined;		// Milliseconds per mesh point when sent in batches (mesh_upload())
+	unsigned long g29_bytes;	// Size of the reply to G29 T1 (the mesh as CSV)
+	unsigned long g29_lines;	// Lines in the reply to G29 T1
+	double g29_ms;				// Time the reply to G29 T1 took in milliseconds
+} ty_bench_printer;
+
+/**
+ * Characterise a printer: the round trip time of cheap commands, the sustained rate of short G1 moves
+ * with and without pipelining, the cost of M421 per mesh point and the size of the reply to G29 T1. The
+ * moves are relative and end where they started; the mesh is written back with its own values.
+ * @param result Filled with the measurements
+ * @return 0 when OK or a negative error code otherwise (also stored in result)
+ */
+int bench_printer(ty_bench_printer *result, ty_serial_conn *conn = NULL);
+
+/**
+ * Print the measurements of bench_printer()
+ */
+void bench_printer_print(const ty_bench_printer *result, ty_serial_conn *conn = NULL);
+
+/**
+ * Write the measurements of bench_printer() as JSON, together with what is known about the printer
+ * (port, baud rate, firmware, capabilities and USB serial adapter) and the host
+ * @param path File to write
+ * @return 0 when OK or a negative error code otherwise
+ */
+int bench_printer_write_json(const char *path, const ty_bench_printer *result, ty_serial_conn *conn = NULL);
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,361 @@
+/*
+ * discovery.cc - Finds the printers on the serial ports and remembers them in the printer cache.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_baud.h"
+#include "serial_adapter.h"
+#include "serial_router.h"
+#include "serial_stats.h"
+#include "line_framer.h"
+#include "discovery.h"
+
+#define DISCOVERY_MAX_PORTS 64		// Most serial ports searched at once
+#define DISCOVERY_PASSES 2			// Times the baud rates are tried on a port
+
+bool discover_use_cache = true;		// Connect with the baud rates and capabilities of the printer cache
+ty_printer_info discover_cached[SERIAL_MAX_CONNECTIONS];	// Printers of discover_cache_ports()
+
+/**
+ * Ask the printer on a port for its firmware and capabilities at one baud rate. Sent at the wrong rate,
+ * the printer does not understand the question and its answer is garbage without line endings.
+ * @return 0 when the printer answered or -1 otherwise
+ */
+static int discover_rate(int fd, int baud, ty_printer_info *info) {
+	// The empty line ends whatever garbage the printer received at the previous rate
+	static const char query[] = "\nM115\nM420 V\n";
+	const int len = sizeof(query) - 1;
+	ty_line_framer rx;
+
+	if(serial_baud_set(fd, baud) < 0) return -1;
+	tcflush(fd, TCIOFLUSH);
+	framer_reset(&rx);
+	if(write(fd, query, len) != len) return -1;
+
+	uint64_t deadline = serial_stats_now() + (uint64_t)DISCOVERY_TIMEOUT * 1000000;
+	bool firmware = false;
+	int oks = 0;
+	info->caps = 0;
+	while(1) {
+		ty_line line;
+		while(framer_next(&rx, &line)) {
+			if(serial_classify(line.str) & SERIAL_MSG_START) {
+				// The printer booted at this rate; the query got lost while it did
+				if(write(fd, query, len) != len) return -1;
+				deadline = serial_stats_now() + (uint64_t)DISCOVERY_TIMEOUT * 1000000;
+				firmware = false;
+				oks = 0;
+				info->caps = 0;
+			} else if(strncmp(line.str, "FIRMWARE_NAME:", 14) == 0) {
+				const char *end = strstr(line.str, " SOURCE_CODE_URL:");
+				int n = end != NULL ? end - line.str - 14 : (int)line.len - 14;
+				snprintf(info->firmware, sizeof(info->firmware), "%.*s", n, line.str + 14);
+				firmware = true;
+			} else if(firmware && strncasecmp(line.str, "ok", 2) == 0) {
+				// The 'ok's of M115 and M420
+				if(++oks == 2) {
+					info->baud = baud;
+					return 0;
+				}
+			} else if(firmware) {
+				info->caps |= serial_caps_line(line.str);
+			}
+		}
+
+		uint64_t now = serial_stats_now();
+		if(now >= deadline) return -1;
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int n = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		if(n == 0) continue;
+		int br = framer_fill(&rx, fd);
+		if(br < 0 && errno == EAGAIN) continue;
+		if(br <= 0) return -1;
+	}
+}
+
+/**
+ * Find the baud rate and capabilities of the printer on a single serial port.
+ * @param port Serial port to search
+ * @param info Filled with the printer
+ * @return 0 when a printer answered or a negative error code otherwise
+ */
+int discover_port(const char *port, ty_printer_info *info) {
+	static const int rates[] = { DISCOVERY_BAUD_RATES };
+
+	memset(info, 0, sizeof(*info));
+	snprintf(info->port, sizeof(info->port), "%s", port);
+	if(discover_usb_serial(port, info->key, sizeof(info->key)) < 0) snprintf(info->key, sizeof(info->key), "%s", port);
+
+	// Non-blocking, so a port waiting for carrier does not hang the search
+	int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0) return -1;
+	struct termios tty;
+	if(tcgetattr(fd, &tty) != 0) {
+		close(fd);
+		return -1;
+	}
+	// Raw 8N1, without flow control. DTR is dropped on close like after a normal connection, unless in attach
+	// mode, so the next open resets the printer as serial_connect() expects
+	cfmakeraw(&tty);
+	tty.c_cflag |= CLOCAL | CREAD;
+	tty.c_cflag &= ~(CRTSCTS | CSTOPB);
+	if(serial_get_attach()) tty.c_cflag &= ~HUPCL;
+	else tty.c_cflag |= HUPCL;
+	tcsetattr(fd, TCSANOW, &tty);
+
+	int res = -1;
+	for(int pass=0; pass<DISCOVERY_PASSES && res<0; pass++) {
+		for(unsigned int i=0; i<sizeof(rates)/sizeof(rates[0]) && res<0; i++) res = discover_rate(fd, rates[i], info);
+	}
+	close(fd);
+	return res;
+}
+
+/**
+ * USB serial number of the device behind a serial port, from sysfs
+ * @param serial Filled with the serial number
+ * @param size Size of serial
+ * @return 0 when OK or -1 when the port is not a USB device or the device has no serial number
+ */
+int discover_usb_serial(const char *port, char *serial, int size) {
+	char dir[PATH_MAX], path[PATH_MAX + 32], sys[PATH_MAX], top[PATH_MAX];
+
+	if(serial_adapter_path(port, dir, sizeof(dir)) < 0) return -1;
+	snprintf(path, sizeof(path), "%s/device", dir);
+	if(realpath(path, sys) == NULL) return -1;
+	// The walk up stops at the devices directory, which may be below a fake root as well
+	snprintf(path, sizeof(path), "%s/devices", serial_adapter_sysfs());
+	if(realpath(path, top) == NULL) return -1;
+
+	// The tty hangs below the interface of the USB device; the device has the serial number
+	char *slash;
+	while((slash = strrchr(sys, '/')) != NULL && slash - sys > (int)strlen(top)) {
+		snprintf(path, sizeof(path), "%s/serial", sys);
+		FILE *fh = fopen(path, "r");
+		if(fh != NULL) {
+			bool ok = fgets(serial, size, fh) != NULL;
+			fclose(fh);
+			if(!ok) return -1;
+			serial[strcspn(serial, "\r\n")] = 0x0;
+			// The serial number is a key in the printer cache, which is separated by spaces
+			for(char *c=serial; *c; c++) if(*c == ' ') *c = '_';
+			return serial[0] != 0x0 ? 0 : -1;
+		}
+		*slash = 0x0;
+	}
+	return -1;
+}
+
+/**
+ * Search serial ports for printers, all ports at the same time.
+ * @param ports Ports to search, NULL to search the ports matching DISCOVERY_PORTS
+ * @param nports Number of ports
+ * @param found Filled with the printers found, in the order of the ports
+ * @param max Size of found
+ * @return Number of printers found
+ */
+int discover_printers(const char **ports, int nports, ty_printer_info *found, int max) {
+	static const char *patterns[] = { DISCOVERY_PORTS };
+	char names[DISCOVERY_MAX_PORTS][SERIAL_PORT_NAME_SIZE];
+	char real[DISCOVERY_MAX_PORTS][PATH_MAX];
+	int n = 0;
+
+	if(ports == NULL) {
+		// The /dev/serial/by-id links come last and replace the name of the device they point to, as
+		// they stay the same when the printer is plugged into another port
+		for(unsigned int p=0; p<sizeof(patterns)/sizeof(patterns[0]); p++) {
+			glob_t g;
+			if(glob(patterns[p], 0, NULL, &g) != 0) continue;
+			for(size_t i=0; i<g.gl_pathc && n<DISCOVERY_MAX_PORTS; i++) {
+				char dev[PATH_MAX];
+				if(realpath(g.gl_pathv[i], dev) == NULL) continue;
+				int j = 0;
+				while(j < n && strcmp(real[j], dev) != 0) j++;
+				snprintf(names[j], sizeof(names[j]), "%s", g.gl_pathv[i]);
+				if(j == n) snprintf(real[n++], sizeof(real[0]), "%s", dev);
+			}
+			globfree(&g);
+		}
+	} else {
+		for(int i=0; i<nports && n<DISCOVERY_MAX_PORTS; i++) snprintf(names[n++], sizeof(names[0]), "%s", ports[i]);
+	}
+
+	// Most of the time goes into waiting for printers at the wrong rate; wait for all ports at once
+	ty_printer_info *infos = new ty_printer_info[n];
+	int res[DISCOVERY_MAX_PORTS];
+	std::thread threads[DISCOVERY_MAX_PORTS];
+	for(int i=0; i<n; i++) {
+		threads[i] = std::thread([&names, infos, &res, i]{ res[i] = discover_port(names[i], &infos[i]); });
+	}
+	int count = 0;
+	for(int i=0; i<n; i++) {
+		threads[i].join();
+		if(res[i] == 0 && count < max) found[count++] = infos[i];
+	}
+	delete[] infos;
+	return count;
+}
+
+/**
+ * Print a table of printers
+ */
+void discover_print(const ty_printer_info *found, int count) {
+	printf("%-40s %8s  %-11s %-8s %-9s %-4s %s\n", "Port", "Baud", "ADVANCED_OK", "AUTOTEMP", "EEPROM", "UBL", "Firmware");
+	for(int i=0; i<count; i++) {
+		const ty_printer_info *p = &found[i];
+		printf("%-40s %8i  %-11s %-8s %-9s %-4s %s\n", p->port, p->baud,
+				p->caps & SERIAL_CAP_ADVANCED_OK ? "yes" : "no", p->caps & SERIAL_CAP_AUTOREPORT_TEMP ? "yes" : "no",
+				p->caps & SERIAL_CAP_EEPROM ? "yes" : "no", p->caps & SERIAL_CAP_UBL ? "yes" : "no", p->firmware);
+	}
+}
+
+/**
+ * Path of the printer cache: PRINTER_CACHE_FILE in the home directory
+ */
+static void discover_cache_path(char *path, int size) {
+	const char *home = getenv("HOME");
+	if(home != NULL && *home != 0x0) snprintf(path, size, "%s/%s", home, PRINTER_CACHE_FILE);
+	else snprintf(path, size, "%s", PRINTER_CACHE_FILE);
+}
+
+/**
+ * Read the printer cache. Each line holds a printer: key, baud rate, capabilities, port and firmware.
+ * @param cache Filled with the printers
+ * @param max Size of cache
+ * @return Number of printers read
+ */
+static int discover_cache_load(ty_printer_info *cache, int max) {
+	char path[PATH_MAX], line[SERIAL_PORT_NAME_SIZE + DISCOVERY_KEY_SIZE + DISCOVERY_FIRMWARE_SIZE + 64];
+	discover_cache_path(path, sizeof(path));
+	FILE *fh = fopen(path, "r");
+	if(fh == NULL) return 0;
+
+	int count = 0;
+	while(count < max && fgets(line, sizeof(line), fh) != NULL) {
+		ty_printer_info *p = &cache[count];
+		memset(p, 0, sizeof(*p));
+		line[strcspn(line, "\r\n")] = 0x0;
+		int pos = 0;
+		if(sscanf(line, "%63s %i %i %63s %n", p->key, &p->baud, &p->caps, p->port, &pos) < 4 || pos == 0) continue;
+		snprintf(p->firmware, sizeof(p->firmware), "%s", line + pos);
+		count++;
+	}
+	fclose(fh);
+	return count;
+}
+
+/**
+ * Remember printers in the printer cache, next to the printers which are in it already
+ * @return 0 when OK or a negative error code otherwise
+ */
+int discover_cache_store(const ty_printer_info *found, int count) {
+	ty_printer_info cache[DISCOVERY_MAX_PORTS];
+	int n = discover_cache_load(cache, DISCOVERY_MAX_PORTS);
+	for(int i=0; i<count; i++) {
+		int j = 0;
+		while(j < n && strcmp(cache[j].key, found[i].key) != 0) j++;
+		if(j == DISCOVERY_MAX_PORTS) continue;
+		cache[j] = found[i];
+		if(j == n) n++;
+	}
+
+	char path[PATH_MAX];
+	discover_cache_path(path, sizeof(path));
+	FILE *fh = fopen(path, "w");
+	if(fh == NULL) {
+		fprintf(stderr, "error: cannot write %s: %s\n", path, strerror (errno));
+		return -1;
+	}
+	for(int i=0; i<n; i++) fprintf(fh, "%s %i %i %s %s\n", cache[i].key, cache[i].baud, cache[i].caps, cache[i].port, cache[i].firmware);
+	fclose(fh);
+	return 0;
+}
+
+/**
+ * Look up the printer on a serial port in the printer cache
+ * @param info Filled with the printer
+ * @return 0 when the printer is known or -1 otherwise
+ */
+int discover_cache_find(const char *port, ty_printer_info *info) {
+	char key[DISCOVERY_KEY_SIZE];
+	if(discover_usb_serial(port, key, sizeof(key)) < 0) snprintf(key, sizeof(key), "%s", port);
+
+	ty_printer_info cache[DISCOVERY_MAX_PORTS];
+	int n = discover_cache_load(cache, DISCOVERY_MAX_PORTS);
+	for(int i=0; i<n; i++) {
+		if(strcmp(cache[i].key, key) == 0) {
+			*info = cache[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Ports of the printers in the cache which are plugged in
+ * @param ports Filled with the ports
+ * @param max Size of ports
+ * @return Number of ports
+ */
+int discover_cache_ports(const char **ports, int max) {
+	int n = discover_cache_load(discover_cached, SERIAL_MAX_CONNECTIONS);
+	int count = 0;
+	for(int i=0; i<n && count<max; i++) {
+		if(access(discover_cached[i].port, F_OK) == 0) ports[count++] = discover_cached[i].port;
+	}
+	return count;
+}
+
+/**
+ * Use the baud rates and capabilities of the printer cache when connecting
+ */
+void discover_set_cache(bool use) {
+	discover_use_cache = use;
+}
+
+/**
+ * Connect to a printer at the baud rate and with the capabilities of the printer cache
+ * @return The connection or NULL on errors
+ */
+ty_serial_conn *discover_connect(const char *port) {
+	ty_printer_info info;
+	bool known = discover_use_cache && discover_cache_find(port, &info) == 0;
+
+	ty_serial_conn *conn = serial_connect(port, known ? info.baud : 0);
+	if(conn != NULL && known) serial_set_caps(info.caps, conn);
+	return conn;
+}
+
+/**
+ * Connect to the default printer at the baud rate and with the capabilities of the printer cache
+ * @return 0 when OK or a negative error code otherwise
+ */
+int discover_open(const char *port) {
+	ty_printer_info info;
+	bool known = discover_use_cache && discover_cache_find(port, &info) == 0;
+
+	int res = serial_open(port, known ? info.baud : 0);
+	if(res == 0 && known) serial_set_caps(info.caps);
+	return res;
+}
@@ -0,0 +1,106 @@
+/*
+ * discovery.h - Finds the printers on the serial ports: all ports are searched at the same time, each at
+ * the usual baud rates, and every printer which answers M115 is remembered with its rate and the
+ * capabilities of its firmware. The printer cache is keyed by the USB serial number, so a printer is
+ * recognised on any port and later launches connect without searching.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef DISCOVERY_H_
+#define DISCOVERY_H_
+
+#include "main.h"
+#include "serial.h"
+
+#define DISCOVERY_KEY_SIZE 64		// Longest USB serial number
+#define DISCOVERY_FIRMWARE_SIZE 64	// Longest firmware name kept
+
+/**
+ * A printer found on a serial port
+ */
+typedef struct {
+	char key[DISCOVERY_KEY_SIZE];		// USB serial number, the port for printers without one
+	char port[SERIAL_PORT_NAME_SIZE];	// Serial port, the /dev/serial/by-id name when there is one
+	int baud;							// Baud rate the printer answered at
+	int caps;							// SERIAL_CAP_* flags of the firmware
+	char firmware[DISCOVERY_FIRMWARE_SIZE];	// FIRMWARE_NAME of the reply to M115
+} ty_printer_info;
+
+/**
+ * Search serial ports for printers, all ports at the same time. Each port is tried at the baud rates of
+ * DISCOVERY_BAUD_RATES until the printer answers M115; the whole list is tried twice, as opening a port
+ * resets many printers and they only answer once they are booted.
+ * @param ports Ports to search, NULL to search the ports matching DISCOVERY_PORTS
+ * @param nports Number of ports
+ * @param found Filled with the printers found, in the order of the ports
+ * @param max Size of found
+ * @return Number of printers found
+ */
+int discover_printers(const char **ports, int nports, ty_printer_info *found, int max);
+
+/**
+ * Find the baud rate and capabilities of the printer on a single serial port.
+ * @param port Serial port to search
+ * @param info Filled with the printer
+ * @return 0 when a printer answered or a negative error code otherwise
+ */
+int discover_port(const char *port, ty_printer_info *info);
+
+/**
+ * USB serial number of the device behind a serial port, from sysfs
+ * @param serial Filled with the serial number
+ * @param size Size of serial
+ * @return 0 when OK or -1 when the port is not a USB device or the device has no serial number
+ */
+int discover_usb_serial(const char *port, char *serial, int size);
+
+/**
+ * Print a table of printers
+ */
+void discover_print(const ty_printer_info *found, int count);
+
+/**
+ * Remember printers in the printer cache, next to the printers which are in it already
+ * @return 0 when OK or a negative error code otherwise
+ */
+int discover_cache_store(const ty_printer_info *found, int count);
+
+/**
+ * Look up the printer on a serial port in the printer cache
+ * @param info Filled with the printer
+ * @return 0 when the printer is known or -1 otherwise
+ */
+int discover_cache_find(const char *port, ty_printer_info *info);
+
+/**
+ * Ports of the printers in the cache which are plugged in, so a launch without ports can skip the search.
+ * The names stay valid until the next call.
+ * @param ports Filled with the ports
+ * @param max Size of ports
+ * @return Number of ports
+ */
+int discover_cache_ports(const char **ports, int max);
+
+/**
+ * Use the baud rates and capabilities of the printer cache when connecting (the default)
+ * @param use False to connect at the rate of serial_set_baud() and ask the printers for their capabilities
+ */
+void discover_set_cache(bool use);
+
+/**
+ * Connect to a printer like serial_connect(), at the baud rate and with the capabilities of the printer
+ * cache when the printer is known.
+ * @return The connection or NULL on errors
+ */
+ty_serial_conn *discover_connect(const char *port);
+
+/**
+ * Connect to a printer like serial_open(), at the baud rate and with the capabilities of the printer
+ * cache when the printer is known.
+ * @return 0 when OK or a negative error code otherwise
+ */
+int discover_open(const char *port);
+
+#endif /* DISCOVERY_H_ */
@@ -0,0 +1,64 @@
+/*
+ * fleet.cc - Runs the same job on many printers at once.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <thread>
+
+#include "main.h"
+#include "serial.h"
+#include "fleet.h"
+#include "discovery.h"
+
+/**
+ * Open the serial ports of all printers at the same time, so the printers reset and start in parallel.
+ * @param ports Devices of the printers
+ * @param n Number of printers
+ * @param conns Filled with the connections, NULL for printers which could not be opened
+ * @return Number of printers connected
+ */
+int fleet_connect(const char **ports, int n, ty_serial_conn **conns) {
+	std::thread threads[SERIAL_MAX_CONNECTIONS];
+	int connected = 0;
+
+	if(n > SERIAL_MAX_CONNECTIONS) n = SERIAL_MAX_CONNECTIONS;
+	for(int i=0; i<n; i++) {
+		conns[i] = NULL;
+		threads[i] = std::thread([ports, conns, i]{ conns[i] = discover_connect(ports[i]); });
+	}
+	for(int i=0; i<n; i++) {
+		threads[i].join();
+		if(conns[i] != NULL) connected++;
+	}
+	return connected;
+}
+
+/**
+ * Run a job on all printers at the same time and wait until every printer has finished.
+ * @param conns Printers to run the job on; NULL entries are skipped and fail with -1
+ * @param n Number of printers
+ * @param job Function to run for each printer
+ * @param user Pointer handed to the job
+ * @param results Filled with the result of the job per printer, can be NULL
+ * @return Number of printers on which the job failed
+ */
+int fleet_run(ty_serial_conn **conns, int n, t_fleet_job job, void *user, int *results) {
+	std::thread threads[SERIAL_MAX_CONNECTIONS];
+	int res[SERIAL_MAX_CONNECTIONS];
+	int failed = 0;
+
+	if(n > SERIAL_MAX_CONNECTIONS) n = SERIAL_MAX_CONNECTIONS;
+	for(int i=0; i<n; i++) {
+		res[i] = -1;
+		if(conns[i] == NULL) continue;
+		threads[i] = std::thread([conns, job, user, &res, i]{ res[i] = job(conns[i], i, user); });
+	}
+	for(int i=0; i<n; i++) {
+		if(threads[i].joinable()) threads[i].join();
+		if(res[i] != 0) failed++;
+		if(results != NULL) results[i] = res[i];
+	}
+	return failed;
+}
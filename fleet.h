@@ -0,0 +1,44 @@
+/*
+ * fleet.h - Runs the same job on many printers at once: every printer gets its own thread, the serial
+ * traffic of all printers is handled by the shared pool of I/O threads.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef FLEET_H_
+#define FLEET_H_
+
+#include "serial.h"
+
+/**
+ * Job to run on a single printer of the fleet; called from a thread of its own so it must not use
+ * curses.
+ * @param conn Printer to drive
+ * @param index Position of the printer in the fleet
+ * @param user Pointer handed to fleet_run()
+ * @return 0 when OK or an error code otherwise
+ */
+typedef int (*t_fleet_job)(ty_serial_conn *conn, int index, void *user);
+
+/**
+ * Open the serial ports of all printers at the same time, so the printers reset and start in parallel.
+ * @param ports Devices of the printers
+ * @param n Number of printers
+ * @param conns Filled with the connections, NULL for printers which could not be opened
+ * @return Number of printers connected
+ */
+int fleet_connect(const char **ports, int n, ty_serial_conn **conns);
+
+/**
+ * Run a job on all printers at the same time and wait until every printer has finished.
+ * @param conns Printers to run the job on; NULL entries are skipped and fail with -1
+ * @param n Number of printers
+ * @param job Function to run for each printer
+ * @param user Pointer handed to the job
+ * @param results Filled with the result of the job per printer, can be NULL
+ * @return Number of printers on which the job failed
+ */
+int fleet_run(ty_serial_conn **conns, int n, t_fleet_job job, void *user, int *results);
+
+#endif /* FLEET_H_ */
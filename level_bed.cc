@@ -121,15 +121,25 @@ int level_bed_heightloop() {
 			goto stop;
 		}
 
-		// Read a keyboard press
+		// Read a keyboard press; while jogging only wait a moment so the head follows the arrow keys
+		timeout(jog_active() ? JOG_POLL : -1);
 		ch = getch();
 		// Correct the scan code for special keys like the arrow keys (consisting of 2 keystrokes)
 		if ( ch == 0 || ch == 224 )
 		ch = 256 + getch();
 
+		// Stream the jog moves; any other key ends the jog first, so the corners store where the head stopped
+		if(ch == ERR || ch == KEY_UP || ch == KEY_DOWN) {
+			ASSERT(jog_update());
+		} else {
+			ASSERT(jog_stop());
+		}
+
 		// Handle the key press
 		if(nopower == 0) {
 			switch(ch) {
+			case ERR:
+				break;
 			case 'q': // Quit the control loop
 				keepgoing = 0;
 
@@ -160,25 +170,27 @@ int level_bed_heightloop() {
 				print_status_bar(LINES-1, stepsize);
 				break;
 			case KEY_DOWN: {
-				float z = get_z();
+				// Key repeats are merged into one target, which the head follows without lagging behind
+				float z = get_z_target();
 				z -= step;
 				if(z < 0) {
 					wprintw(cmd_win,"Warning: could not lower toolhead further, switch to a smaller step size\n");
 				} else {
 					// Lower the head
 					wprintw(cmd_win,"Setting Z to %.2f\n", z+zoffset);
-					ASSERT(set_z(z,0,MAX_SPEED_Z));
+					ASSERT(jog_z(-step,MAX_SPEED_Z));
 				}}
 				break;
 			case KEY_UP: {
-				float z = get_z();
+				// Key repeats are merged into one target, which the head follows without lagging behind
+				float z = get_z_target();
 				z += step;
 				if(z > 50.0f) {
 					wprintw(cmd_win,"Warning: could not raise toolhead further, switch to a smaller step size\n");
 				} else {
 					// Raise the head
 					wprintw(cmd_win,"Setting Z to %.2f\n", z+zoffset);
-					ASSERT(set_z(z,0,MAX_SPEED_Z));
+					ASSERT(jog_z(step,MAX_SPEED_Z));
 				}}
 				break;
 			case '1':
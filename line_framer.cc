@@ -0,0 +1,138 @@
+/*
+ * line_framer.cc - Splits the byte stream from the printer into lines using a fixed-size ring buffer.
+ * Each completed line is handed out exactly once as a view into the ring; bytes are never moved
+ * around when a line is consumed.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "line_framer.h"
+
+/**
+ * Discard all buffered data, for example after flushing the serial port.
+ */
+void framer_reset(ty_line_framer *f) {
+	f->head = f->tail = f->scan = 0;
+	f->discard = false;
+}
+
+/**
+ * Number of bytes buffered in the framer which have not been handed out as a line yet.
+ */
+unsigned int framer_pending(const ty_line_framer *f) {
+	return f->tail - f->head;
+}
+
+/**
+ * When the ring is completely filled without a single line ending in it, the line can never be
+ * handed out: drop everything up to the next line ending.
+ */
+static void framer_drop_when_full(ty_line_framer *f) {
+	if(f->tail - f->head < FRAMER_RING_SIZE) return;
+	f->head = f->scan = f->tail;
+	f->discard = true;
+	f->overflows++;
+}
+
+/**
+ * Read from a file descriptor into the free space of the ring with a single read() call.
+ * @param f Framer to fill
+ * @param fd File descriptor to read from
+ * @return The number of bytes read, 0 when the stream was closed or a negative value on errors
+ * (errno is set by read())
+ */
+int framer_fill(ty_line_framer *f, int fd) {
+	framer_drop_when_full(f);
+
+	// Only read up to the end of the ring, the next fill continues at the start
+	unsigned int pos = f->tail % FRAMER_RING_SIZE;
+	unsigned int n = FRAMER_RING_SIZE - (f->tail - f->head);
+	if(pos + n > FRAMER_RING_SIZE) n = FRAMER_RING_SIZE - pos;
+
+	int br = read(fd, &f->buf[pos], n);
+	if(br > 0) f->tail += br;
+	return br;
+}
+
+/**
+ * Copy data into the ring as if it was read from the serial port.
+ * @param f Framer to fill
+ * @param data Bytes to add
+ * @param len Number of bytes to add
+ * @return The number of bytes copied, which is less than len when the ring is full
+ */
+unsigned int framer_push(ty_line_framer *f, const char *data, unsigned int len) {
+	unsigned int done = 0;
+
+	framer_drop_when_full(f);
+	while(done < len && f->tail - f->head < FRAMER_RING_SIZE) {
+		unsigned int pos = f->tail % FRAMER_RING_SIZE;
+		unsigned int n = FRAMER_RING_SIZE - (f->tail - f->head);
+		if(pos + n > FRAMER_RING_SIZE) n = FRAMER_RING_SIZE - pos;
+		if(n > len - done) n = len - done;
+
+		memcpy(&f->buf[pos], &data[done], n);
+		f->tail += n;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Hand out the next complete line in the framer.
+ * @param f Framer to take the line from
+ * @param line View to fill with the line
+ * @return True when a line was available, false when more data is needed
+ */
+bool framer_next(ty_line_framer *f, ty_line *line) {
+	// Only search the bytes which have not been searched before; at most two contiguous chunks
+	while(f->scan != f->tail) {
+		unsigned int pos = f->scan % FRAMER_RING_SIZE;
+		unsigned int n = f->tail - f->scan;
+		if(pos + n > FRAMER_RING_SIZE) n = FRAMER_RING_SIZE - pos;
+
+		char *nl = (char*)memchr(&f->buf[pos], '\n', n);
+		if(nl == NULL) {
+			f->scan += n;
+			continue;
+		}
+
+		// Found a line ending: the line runs from the head up to the line ending
+		unsigned int start = f->head;
+		unsigned int end = f->scan + (nl - &f->buf[pos]);
+		f->scan = f->head = end + 1;
+
+		if(f->discard) {
+			// Tail end of a line which was too long to keep
+			f->discard = false;
+			continue;
+		}
+
+		unsigned int spos = start % FRAMER_RING_SIZE;
+		unsigned int len = end - start;
+		char *s = &f->buf[spos];
+		if(spos + len > FRAMER_RING_SIZE) {
+			// The line wraps around the end of the ring: copy the wrapped part behind the ring
+			unsigned int wrap = spos + len - FRAMER_RING_SIZE;
+			if(wrap > FRAMER_MAX_LINE) {
+				wrap = FRAMER_MAX_LINE;
+				f->overflows++;
+			}
+			memcpy(&f->buf[FRAMER_RING_SIZE], f->buf, wrap);
+			len = FRAMER_RING_SIZE - spos + wrap;
+		}
+		// Terminate the string, this overwrites the (consumed) line ending
+		s[len] = 0x0;
+		// Strip the carriage return of a CRLF line ending
+		if(len > 0 && s[len-1] == '\r') s[--len] = 0x0;
+
+		line->str = s;
+		line->len = len;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,77 @@
+/*
+ * line_framer.h - Splits the byte stream from the printer into lines using a fixed-size ring buffer.
+ * Each completed line is handed out exactly once as a view into the ring; bytes are never moved
+ * around when a line is consumed.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef LINE_FRAMER_H_
+#define LINE_FRAMER_H_
+
+#include "main.h"
+
+// Size of the ring buffer, has to be a power of 2
+#define FRAMER_RING_SIZE 4096
+// Longest line which can wrap around the end of the ring; longer lines are truncated to the part
+// before the end of the ring. A row of the largest mesh (MESH_MAX_SIZE points in G29 T1) has to fit.
+#define FRAMER_MAX_LINE 2048
+
+/**
+ * A view on a single line in the framer: the string is null-terminated and does not include the
+ * line ending. The view stays valid until the next call to framer_fill() or framer_push().
+ */
+typedef struct {
+	const char  *str;	// Start of the line
+	unsigned int len;	// Length of the line, excluding the line ending
+} ty_line;
+
+typedef struct {
+	// The ring, followed by room to copy the start of a line that wraps around the end of the ring
+	// so each line can be handed out as a single contiguous string.
+	char buf[FRAMER_RING_SIZE + FRAMER_MAX_LINE + 1];
+	unsigned int head;			// Stream offset of the first byte not handed out yet
+	unsigned int tail;			// Stream offset of the end of the received data
+	unsigned int scan;			// Stream offset up to where the data has been searched for a line ending
+	bool discard;				// Set while dropping an overlong line up to its line ending
+	unsigned int overflows;		// Number of lines dropped because they did not fit in the ring
+} ty_line_framer;
+
+/**
+ * Discard all buffered data, for example after flushing the serial port.
+ */
+void framer_reset(ty_line_framer *f);
+
+/**
+ * Number of bytes buffered in the framer which have not been handed out as a line yet.
+ */
+unsigned int framer_pending(const ty_line_framer *f);
+
+/**
+ * Read from a file descriptor into the free space of the ring with a single read() call.
+ * @param f Framer to fill
+ * @param fd File descriptor to read from
+ * @return The number of bytes read, 0 when the stream was closed or a negative value on errors
+ * (errno is set by read())
+ */
+int framer_fill(ty_line_framer *f, int fd);
+
+/**
+ * Copy data into the ring as if it was read from the serial port.
+ * @param f Framer to fill
+ * @param data Bytes to add
+ * @param len Number of bytes to add
+ * @return The number of bytes copied, which is less than len when the ring is full
+ */
+unsigned int framer_push(ty_line_framer *f, const char *data, unsigned int len);
+
+/**
+ * Hand out the next complete line in the framer.
+ * @param f Framer to take the line from
+ * @param line View to fill with the line
+ * @return True when a line was available, false when more data is needed
+ */
+bool framer_next(ty_line_framer *f, ty_line *line);
+
+#endif /* LINE_FRAMER_H_ */
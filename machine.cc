@@ -9,18 +9,112 @@
 #include <stdio.h>
 #include <curses.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <utility>
 
 #include "main.h"
 #include "serial.h"
 #include "machine.h"
 #include "mesh_builder.h"
-
-float x = 0.0f,y = 0.0f,z = 0.0f,speed = 0.0f;
+#include "serial_stats.h"
+
+// Position of the toolhead and move settings of a printer as far as this program knows it
+typedef struct {
+	float x, y, z, speed;
+	bool pos_known;			// x, y and z match the printer; false until read back with M114
+	bool speed_known;		// speed is the feed rate of the printer; the next move sends it when false
+	unsigned int pos_session;	// serial_conn_session() when the position was read back
+	ty_mesh mesh;			// UBL mesh in the printer as of the last download or upload
+	ty_mesh mesh_next;		// The mesh being uploaded, rounded like the printer stores it
+	bool mesh_known;		// mesh is valid, mesh_upload() only sends the points which differ from it
+	unsigned int mesh_session;	// serial_conn_session() when mesh was confirmed; a reset loses the mesh
+	int mesh_sent;			// Points sent by the last mesh_upload()
+	double mesh_ms;			// Time the last mesh_upload() took, in milliseconds
+	bool stream_moves;		// Stream moves to the printer instead of waiting for each 'ok'
+	bool batch_moves;		// Collect moves in the batch, they are sent by set_batching(false)
+	ty_serial_batch batch;
+
+	// Jogging (jog_z()): the target of the keys and the end of the moves sent towards it
+	bool jog;				// A jog is running
+	float jog_target;		// Z the keys asked for
+	float jog_sent;			// Z at the end of the moves sent so far
+	float jog_speed;		// mm/min
+	int jog_presses;		// Key presses merged into this jog
+	uint64_t jog_input;		// Time of the last key press (serial_stats_now())
+	uint64_t jog_done;		// Estimated time the head reaches jog_sent
+} ty_machine_state;
+
+ty_machine_state machine_states[SERIAL_MAX_CONNECTIONS];	// Indexed by serial_conn_id()
+ty_machine_state machine_unconnected;	// Used when no printer is connected; the commands fail anyway
 extern WINDOW *serial_win;
 
 #define message(...) {if(serial_win!=NULL) wprintw(serial_win, __VA_ARGS__); \
 						else printf(__VA_ARGS__); }
 
+/**
+ * State of a printer
+ */
+static ty_machine_state *machine(ty_serial_conn *conn) {
+	int id = serial_conn_id(conn);
+	return id >= 0 ? &machine_states[id] : &machine_unconnected;
+}
+
+/**
+ * Round a coordinate the way it is sent to the printer
+ */
+static float pos_round(float v) {
+	return roundf(v * 100.0f) / 100.0f;
+}
+
+/**
+ * Read the position from the printer (M114) and take it over
+ * @param check Compare it with the position the host knows and report the difference as drift
+ * @return 0 when OK, 1 when the printer was found elsewhere or a negative error code otherwise
+ */
+static int read_pos(ty_machine_state *m, bool check, ty_serial_conn *conn) {
+	ty_serial_view reply;
+	float x, y, z;
+
+	// Taken before asking: a reconnect during the query makes the answer stale again
+	unsigned int session = serial_conn_session(conn);
+
+	// The position is on a line of its own before the 'ok'
+	int res = serial_query("M114\n", &reply, true, conn);
+	if(res != 0) return res < 0 ? res : -1;
+	if(parse_position(reply.text, &x, &y, &z) != 0) {
+		message("No position in the reply to M114\n");
+		return -1;
+	}
+
+	int drift = 0;
+	if(check && m->pos_known && (fabsf(x - m->x) > POSITION_DRIFT || fabsf(y - m->y) > POSITION_DRIFT || fabsf(z - m->z) > POSITION_DRIFT)) {
+		message("Position drift on %s: expected X%.2f Y%.2f Z%.2f, printer is at X%.2f Y%.2f Z%.2f\n",
+				serial_conn_port(conn), m->x, m->y, m->z, x, y, z);
+		drift = 1;
+	}
+	m->x = x;
+	m->y = y;
+	m->z = z;
+	m->pos_known = true;
+	m->pos_session = session;
+	return drift;
+}
+
+/**
+ * Make sure the known position is that of the printer before moves are based on it: read it back once
+ * after connecting, reconnecting or forget_pos(), not for each move
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int sync_pos(ty_machine_state *m, ty_serial_conn *conn) {
+	if(m->pos_known && m->pos_session == serial_conn_session(conn)) return 0;
+	m->speed_known = false;
+	// After a reconnect the old position is compared: the printer may have been reset meanwhile
+	int res = read_pos(m, true, conn);
+	return res < 0 ? res : 0;
+}
+
 /**
  * Position the head of the machine in 3 dimensional space and with a given speed.
  * Note that only changed parameters are sent to the printer to reduce traffic over
@@ -31,12 +125,21 @@ extern WINDOW *serial_win;
  * @param relative Marks the given coordinates as a relative move instead of an absolute one
  * @param speed for the move, always absolute
  */
-int set_position(float xval, float yval, float zval, int relative, float speedval, bool changes_only) {
+int set_position(float xval, float yval, float zval, int relative, float speedval, bool changes_only, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	float &x = m->x, &y = m->y, &z = m->z, &speed = m->speed;
 	int res = 0;
+	// Moves go from where a jog ended
+	if(m->jog && (res = jog_stop(conn)) != 0) return res;
+	if((res = sync_pos(m, conn)) != 0) return res;
+	// Coordinates are sent in hundredths; the host keeps what the printer gets
+	xval = pos_round(xval);
+	yval = pos_round(yval);
+	zval = pos_round(zval);
 	// Boundary checks
 	if(relative) { 	SAFETY_LIMIT_TEST(X, (x+xval), res); }
 	else {			SAFETY_LIMIT_TEST(X, (xval), res); }
-	if(relative) { 	SAFETY_LIMIT_TEST(Y, (y+zval), res); }
+	if(relative) { 	SAFETY_LIMIT_TEST(Y, (y+yval), res); }
 	else {			SAFETY_LIMIT_TEST(Y, (yval), res); }
 	if(relative) { 	SAFETY_LIMIT_TEST(Z, (z+zval), res); }
 	else {			SAFETY_LIMIT_TEST(Z, (zval), res); }
@@ -45,16 +148,17 @@ int set_position(float xval, float yval, float zval, int relative, float speedva
 	if(res != 0) return res;
 
 	// Calculate position for each axis, determine which axis have changed
-	int cx = 0, cy = 0, cz = 0, cs = (speedval != speed);
-	if(cs) speed = speedval;
+	int cx = 0, cy = 0, cz = 0, cs = (speedval != speed || !m->speed_known);
+	speed = speedval;
+	m->speed_known = true;
 	if(relative) {
 		// Relative move
 		cx = xval != 0.0f;
 		cy = yval != 0.0f;
 		cz = zval != 0.0f;
-		x+=xval;
-		y+=yval;
-		z+=zval;
+		x = pos_round(x + xval);
+		y = pos_round(y + yval);
+		z = pos_round(z + zval);
 	} else {
 		// Absolute move
 		cx = (xval != x);
@@ -79,125 +183,340 @@ int set_position(float xval, float yval, float zval, int relative, float speedva
 	if(cz || !changes_only) ptr += snprintf(&buf[ptr], 100-ptr,"Z%.2f ", z);
 	if(cs || !changes_only) ptr += snprintf(&buf[ptr], 100-ptr,"F%.2f ", speed);
 	ptr += snprintf(&buf[ptr], 100-ptr,"\n");
-	return serial_cmd(buf, NULL);
+	if(m->batch_moves) return serial_batch_add(&m->batch, buf);
+	if(m->stream_moves) return serial_stream_cmd(buf, conn);
+	return serial_cmd(buf, NULL, false, conn);
+}
+
+/**
+ * Enable or disable streaming of moves: when enabled, moves are queued in the printer without
+ * waiting for each 'ok' so the printer buffers stay filled. Any other command (and disabling
+ * streaming) waits for all queued moves to be acknowledged first.
+ * @param on True to stream moves, false to send them one by one
+ * @return 0 when OK or an error code otherwise
+ */
+int set_streaming(bool on, ty_serial_conn *conn) {
+	machine(conn)->stream_moves = on;
+	if(!on) return serial_stream_sync(conn);
+	return 0;
+}
+
+/**
+ * Enable or disable batching of moves: when enabled, moves are collected instead of sent. Disabling
+ * batching sends the collected moves, as many as fit within the printer buffers with a single write,
+ * and waits until all of them are acknowledged. A full batch is sent right away.
+ * @param on True to collect moves, false to send them
+ * @return 0 when OK or an error code otherwise
+ */
+int set_batching(bool on, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	if(on) {
+		if(!m->batch_moves) serial_batch_init(&m->batch, conn);
+		m->batch_moves = true;
+		return 0;
+	}
+	if(!m->batch_moves) return 0;
+	m->batch_moves = false;
+	return serial_batch_send(&m->batch);
 }
 
 // ================== Utility functions to drive one or more axis =================
 int set_x(float val) {
-	return set_position(val,y,z,0,speed);
+	return set_x(val, 0, machine(NULL)->speed);
 }
 
 int set_x(float val, int relative) {
-	if(relative) return set_position(val,0,0,1,speed);
-	else return set_position(val,y,z,0,speed);
+	return set_x(val, relative, machine(NULL)->speed);
 }
 
-int set_x(float val, int relative, float speedval) {
-	if(relative) return set_position(val,0,0,1,speedval);
-	else return set_position(val,y,z,0,speedval);
+int set_x(float val, int relative, float speedval, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	// The other axes stay where the printer has them
+	int res = m->jog ? jog_stop(conn) : 0;
+	if(res == 0) res = sync_pos(m, conn);
+	if(res != 0) return res;
+	if(relative) return set_position(val,0,0,1,speedval,true,conn);
+	else return set_position(val,m->y,m->z,0,speedval,true,conn);
 }
 
 int set_y(float val) {
-	return set_position(x,val,z,0,speed);
+	return set_y(val, 0, machine(NULL)->speed);
 }
 
 int set_y(float val, int relative) {
-	if(relative) return set_position(0,val,0,1,speed);
-	else return set_position(x,val,z,0,speed);
+	return set_y(val, relative, machine(NULL)->speed);
 }
 
-int set_y(float val, int relative, float speedval) {
-	if(relative) return set_position(0,val,0,1,speedval);
-	else return set_position(x,val,z,0,speedval);
+int set_y(float val, int relative, float speedval, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	// The other axes stay where the printer has them
+	int res = m->jog ? jog_stop(conn) : 0;
+	if(res == 0) res = sync_pos(m, conn);
+	if(res != 0) return res;
+	if(relative) return set_position(0,val,0,1,speedval,true,conn);
+	else return set_position(m->x,val,m->z,0,speedval,true,conn);
 }
 
 int set_z(float val) {
-	return set_position(x,y,val,0,speed);
+	return set_z(val, 0, machine(NULL)->speed);
 }
 
 int set_z(float val, int relative) {
-	if(relative) return set_position(0,0,val,1,speed);
-	else return set_position(x,y,val,0,speed);
+	return set_z(val, relative, machine(NULL)->speed);
 }
 
-int set_z(float val, int relative, float speedval) {
-	if(relative) return set_position(0,0,val,1,speedval);
-	else return set_position(x,y,val,0,speedval);
+int set_z(float val, int relative, float speedval, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	// The other axes stay where the printer has them
+	int res = m->jog ? jog_stop(conn) : 0;
+	if(res == 0) res = sync_pos(m, conn);
+	if(res != 0) return res;
+	if(relative) return set_position(0,0,val,1,speedval,true,conn);
+	else return set_position(m->x,m->y,val,0,speedval,true,conn);
 }
 
-int set_speed(float val) {
-	return set_position(x,y,z,0,val);
+int set_speed(float val, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	int res = m->jog ? jog_stop(conn) : 0;
+	if(res == 0) res = sync_pos(m, conn);
+	if(res != 0) return res;
+	return set_position(m->x,m->y,m->z,0,val,true,conn);
 }
 
 
 // =========================== Other positioning ======================
 
-float get_x() {
-	return x;
+float get_x(ty_serial_conn *conn) {
+	return machine(conn)->x;
 }
 
-float get_y() {
-	return y;
+float get_y(ty_serial_conn *conn) {
+	return machine(conn)->y;
 }
 
-float get_z() {
-	return z;
+float get_z(ty_serial_conn *conn) {
+	return machine(conn)->z;
 }
 
-int home_xy() {
+/**
+ * Home axes and move them to 0 afterwards, as the home can be at the end as well. Both commands leave
+ * with a single write. The position is read back afterwards: homing can move the other axes as well (Z is
+ * raised before X and Y are homed, safe homing moves X and Y to the middle of the bed before Z is homed).
+ * @param home The G28 command
+ * @param zero The move to 0
+ */
+static int home_axes(const char *home, const char *zero, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	ty_serial_batch batch;
+	int res;
+	if(m->jog && (res = jog_stop(conn)) != 0) return res;
+	serial_batch_init(&batch, conn);
+	if((res = serial_batch_add(&batch, home))) return res;
+	if((res = serial_batch_add(&batch, zero))) return res;
+	m->pos_known = false;
+	m->speed_known = false;	// The move to 0 changed the feed rate
+	if((res = serial_batch_send(&batch))) return res;
+	res = read_pos(m, false, conn);
+	return res < 0 ? res : 0;
+}
+
+int home_xy(ty_serial_conn *conn) {
 	char buf[100];
-	int res = serial_cmd("G28 X0 Y0\n", NULL);
-	if(res) return res;
 	snprintf(buf, 100, "G01 X0 Y0 F%0.1f\n", MAX_SPEED_X);
-	res = serial_cmd(buf, NULL);	// Home can be at the end as well; go to 0
-	if(res == 0) x = y = 0;
-	return res;
+	return home_axes("G28 X0 Y0\n", buf, conn);
 }
 
-int home_xyz() {
-	int res = serial_cmd("G28 X0 Y0 Z0\n", NULL);
-	if(res) return res;
-	res = serial_cmd("G01 X0 Y0 Z0\n", NULL);	// Home can be at the end as well; go to 0
-	if(res == 0) x = y = z = 0;
-	return res;
+int home_xyz(ty_serial_conn *conn) {
+	return home_axes("G28 X0 Y0 Z0\n", "G01 X0 Y0 Z0\n", conn);
 }
 
-int home_x() {
+int home_x(ty_serial_conn *conn) {
 	char buf[100];
-	int res = serial_cmd("G28 X0\n", NULL);
-	if(res) return res;
 	snprintf(buf, 100, "G01 X0 F%0.1f\n", MAX_SPEED_X);
-	res = serial_cmd(buf, NULL);	// Home can be at the end as well; go to 0
-	if(res == 0) x = 0;
-	return res;
+	return home_axes("G28 X0\n", buf, conn);
 }
 
-int home_y() {
+int home_y(ty_serial_conn *conn) {
 	char buf[100];
-	int res = serial_cmd("G28 Y0\n", NULL);
-	if(res) return res;
 	snprintf(buf, 100, "G01 Y0 F%0.1f\n", MAX_SPEED_Y);
-	res = serial_cmd(buf, NULL);	// Home can be at the end as well; go to 0
-	if(res == 0) y = 0;
-	return res;
+	return home_axes("G28 Y0\n", buf, conn);
 }
 
-int home_z() {
+int home_z(ty_serial_conn *conn) {
 	char buf[100];
-	int res = serial_cmd("G28 Z0\n", NULL);
-	if(res) return res;
 	snprintf(buf, 100, "G01 Z0 F%0.1f\n", MAX_SPEED_Z);
-	res = serial_cmd(buf, NULL);	// Home can be at the end as well; go to 0
-	if(res == 0) z = 0;
-	return res;
+	return home_axes("G28 Z0\n", buf, conn);
+}
+
+/**
+ * Ask the printer where the head is (M114) and take that over as the known position
+ * @return 0 when OK or an error code otherwise
+ */
+int get_pos(ty_serial_conn *conn) {
+	int res = read_pos(machine(conn), false, conn);
+	return res < 0 ? res : 0;
+}
+
+/**
+ * Compare the known position with that of the printer (M114); a difference is reported as drift and
+ * the position of the printer is taken over
+ * @return 0 when they match, 1 when the printer was elsewhere or a negative error code otherwise
+ */
+int check_pos(ty_serial_conn *conn) {
+	return read_pos(machine(conn), true, conn);
 }
 
 /**
- * Request the position of the toolhead from the printer
- * TODO: parse this and return the values?
+ * Forget the known position, for example after a quick stop of which the host cannot tell where the head
+ * stopped. A running jog ends without further moves. The next move reads the position back first.
  */
-int get_pos() {
-	return serial_cmd("M114\n", NULL);
+void forget_pos(ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	m->jog = false;
+	m->pos_known = false;
+}
+
+/**
+ * Parse the position from the reply to M114
+ * @param reply The reply, for example 'X:10.00 Y:20.00 Z:1.50 E:0.00 Count X:800 Y:1600 Z:600'
+ * @return 0 when all three axes were found or 1 otherwise
+ */
+int parse_position(const char *reply, float *x, float *y, float *z) {
+	// The stepper counts after 'Count' use the same letters; only the part before it is the position
+	const char *end = strstr(reply, "Count");
+	bool got_x = false, got_y = false, got_z = false;
+	for(const char *p = reply; *p != 0x0 && (end == NULL || p < end); p++) {
+		if(p[1] != ':' || (p != reply && p[-1] != ' ' && p[-1] != '\n')) continue;
+		float v = strtof(p + 2, NULL);
+		if(*p == 'X') { *x = v; got_x = true; }
+		else if(*p == 'Y') { *y = v; got_y = true; }
+		else if(*p == 'Z') { *z = v; got_z = true; }
+	}
+	return got_x && got_y && got_z ? 0 : 1;
+}
+
+// ================================= Jogging ==============================
+
+/**
+ * Jog the Z axis, for each press or repeat of a key
+ * @param delta Distance to add to the target in mm
+ * @param speed Speed of the moves in mm/min
+ * @return 0 when OK or an error code otherwise
+ */
+int jog_z(float delta, float speed, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	uint64_t now = serial_stats_now();
+	if(!m->jog) {
+		// The jog goes from the known position, without asking the printer for each key
+		int res = sync_pos(m, conn);
+		if(res != 0) return res;
+		m->jog = true;
+		m->jog_target = m->jog_sent = m->z;
+		m->jog_presses = 0;
+		m->jog_done = now;
+	}
+
+	int res = 0;
+	float target = m->jog_target + delta;
+	SAFETY_LIMIT_TEST(Z, target, res);
+	if(res != 0) return res;
+	m->jog_target = target;
+	m->jog_speed = speed;
+	m->jog_presses++;
+	m->jog_input = now;
+	return jog_update(conn);
+}
+
+/**
+ * Stream the moves of a jog which fit within JOG_LOOKAHEAD ms ahead of the head
+ * @return 0 when OK or an error code otherwise
+ */
+static int jog_stream(ty_machine_state *m, ty_serial_conn *conn) {
+	uint64_t now = serial_stats_now();
+	float segment = m->jog_speed / 60.0f * JOG_SEGMENT_TIME / 1000.0f;
+	char buf[100];
+
+	// Only keep JOG_LOOKAHEAD ms of moves ahead of the head; the rest of the target waits here, where
+	// further key presses are merged into it
+	while(fabsf(m->jog_target - m->jog_sent) >= 0.005f && m->jog_done < now + JOG_LOOKAHEAD * 1000000ull) {
+		float z = m->jog_target;
+		if(fabsf(z - m->jog_sent) > segment) z = m->jog_sent + (z > m->jog_sent ? segment : -segment);
+		// Whole hundredths, like all moves, so the target is reached exactly
+		z = roundf(z * 100.0f) / 100.0f;
+		snprintf(buf, 100, "G01 Z%.2f F%.2f\n", z, m->jog_speed);
+		int res = serial_stream_cmd(buf, conn);
+		if(res != 0) return res;
+		if(m->jog_done < now) m->jog_done = now;
+		m->jog_done += (uint64_t)(fabsf(z - m->jog_sent) / (m->jog_speed / 60.0f) * 1e9f);
+		m->jog_sent = m->z = z;
+		m->speed = m->jog_speed;
+		m->speed_known = true;
+	}
+	return 0;
+}
+
+/**
+ * Stream the next moves of a jog and end it when no key arrived for JOG_RELEASE ms
+ * @return 0 when OK or an error code otherwise
+ */
+int jog_update(ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	if(!m->jog) return 0;
+	int res = jog_stream(m, conn);
+	if(res != 0) {
+		m->jog = false;
+		return res;
+	}
+	if(serial_stats_now() - m->jog_input > JOG_RELEASE * 1000000ull) return jog_stop(conn);
+	return 0;
+}
+
+/**
+ * End a jog right away: complete a single press, stop the moves of a held key where the head is
+ * @return 0 when OK or an error code otherwise
+ */
+int jog_stop(ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	if(!m->jog) return 0;
+	m->jog = false;
+
+	// A single press goes all the way, as without jogging
+	bool held = m->jog_presses > 1;
+	while(!held && fabsf(m->jog_target - m->jog_sent) >= 0.005f) {
+		int res = jog_stream(m, conn);
+		if(res != 0) return res;
+		if(fabsf(m->jog_target - m->jog_sent) >= 0.005f) usleep(JOG_SEGMENT_TIME * 1000);
+	}
+
+	// Everything sent is in the planner after this
+	int res = serial_stream_sync(conn);
+	if(res != 0) return res;
+	// Once per jog, the moves are checked against the printer: it clamps them to its soft endstops without
+	// a word, for example
+	if(!held || m->jog_done <= serial_stats_now()) {
+		res = check_pos(conn);
+		return res < 0 ? res : 0;
+	}
+
+	// The head is still working through the moves of a released key: throw them away and see where it stopped
+	m->pos_known = false;
+	if((res = serial_cmd("M410\n", NULL, false, conn)) != 0) return res;
+	return get_pos(conn);
+}
+
+/**
+ * @return True while a jog is running, jog_update() has to be called then
+ */
+bool jog_active(ty_serial_conn *conn) {
+	return machine(conn)->jog;
+}
+
+/**
+ * Z the head is going to: the target of a running jog, otherwise get_z()
+ */
+float get_z_target(ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	return m->jog ? m->jog_target : m->z;
 }
 
 /**
@@ -206,11 +525,11 @@ int get_pos() {
  * @param timeout in microseconds (1000 is one second)
  * @return 0 when OK or an error code otherwise
  */
-int set_dwell(int timeout) {
+int set_dwell(int timeout, ty_serial_conn *conn) {
 	if(timeout < 0) timeout = 0;
 	char buf[100];
 	snprintf(buf,100,"G04 P%i\n", timeout);
-	return serial_cmd(buf, NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
 /**
@@ -222,15 +541,23 @@ int set_dwell(int timeout) {
  * @param val The value for the Z axis
  * @return 0 when OK or an error code otherwise
  */
-int override_zpos(float val) {
+int override_zpos(float val, ty_serial_conn *conn) {
 	if(val < -MAX_Z || val > MAX_Z) {
 		message("Error in override_zpos: Z axis position %f is not safe\n", val);
 		return -1;
 	}
-	z = val;	// Override position
+	ty_machine_state *m = machine(conn);
+	int res;
+	if(m->jog && (res = jog_stop(conn)) != 0) return res;
 	char buf[100];
 	snprintf(buf,100,"G92 Z%.2f\n", val);
-	return serial_cmd(buf, NULL);
+	// After the moves which are still collected, or the position would be overridden before they are sent
+	if(m->batch_moves) res = serial_batch_add(&m->batch, buf);
+	else res = serial_cmd(buf, NULL, false, conn);
+	// Override position, as the printer has it; when the command failed nobody knows
+	if(res == 0) m->z = pos_round(val);
+	else m->pos_known = false;
+	return res;
 }
 
 /**
@@ -238,8 +565,8 @@ int override_zpos(float val) {
  * to lose alignment!)
  * Firmware: Marlin, Teacup
  */
-int disable_motor_hold() {
-	return serial_cmd("M84\n", NULL);
+int disable_motor_hold(ty_serial_conn *conn) {
+	return serial_cmd("M84\n", NULL, false, conn);
 }
 
 /**
@@ -247,210 +574,146 @@ int disable_motor_hold() {
  * bounds on the machine.
  * Firmware: Marlin
  */
-int enable_soft_endstops(bool on) {
+int enable_soft_endstops(bool on, ty_serial_conn *conn) {
 	if(on)
-		return serial_cmd("M211 S1\n",NULL);
-	return serial_cmd("M211 S0\n",NULL);
+		return serial_cmd("M211 S1\n", NULL, false, conn);
+	return serial_cmd("M211 S0\n", NULL, false, conn);
 }
 
 /**
  * Disable the UBL mesh compensation; required to calibrate the mesh points (because the
  * firmware will try to compensate as well - which would be bad).
  */
-int mesh_disable() {
-	return serial_cmd("G29 D\n", NULL);
+int mesh_disable(ty_serial_conn *conn) {
+	return serial_cmd("G29 D\n", NULL, false, conn);
+}
+
+/**
+ * Forget which mesh the printer has, the next mesh_upload() sends all points
+ */
+void mesh_forget(ty_serial_conn *conn) {
+	machine(conn)->mesh_known = false;
+}
+
+/**
+ * Points sent by the last mesh_upload() and the time it took
+ * @param ms Set to the time in milliseconds, NULL when not needed
+ * @return The number of points sent
+ */
+int mesh_upload_sent(double *ms, ty_serial_conn *conn) {
+	ty_machine_state *m = machine(conn);
+	if(ms != NULL) *ms = m->mesh_ms;
+	return m->mesh_sent;
+}
+
+/**
+ * Parse a line of the reply to G29 T1; called as the line arrives (from the I/O thread when it runs)
+ */
+static void mesh_download_line(const char *line, unsigned int len, void *user) {
+	mesh_csv_line((ty_mesh_csv*)user, line);
 }
 
 /**
- * Load the UBL mesh points from a specific EEPROM save slot (or the currently loaded mesh)
+ * Load the UBL mesh points from a specific EEPROM save slot (or the currently loaded mesh). The mesh
+ * takes the size of the mesh of the printer.
  * @param slot Set to -1 to load the current mesh points and not load a mesh from EEPROM
- * @param mesh Pointer to the mesh memory to load with the mesh points from the printer
+ * @param mesh The mesh to load with the mesh points from the printer
  * @param wnd Window handle from ncurses to print debug info into (when NULL no debug info is generated)
  */
-int mesh_download(int slot, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X], WINDOW* wnd) {
-	int err = 0, row = 0, col = 0, lpos = 0, only_valid = 1;
+int mesh_download(int slot, ty_mesh *mesh, WINDOW* wnd, ty_serial_conn *conn) {
+	int err = 0;
 	char cmd_buf[100];
-	char *res_buf = NULL;
+	ty_machine_state *m = machine(conn);
+	unsigned int session = serial_conn_session(conn);
+
+	// Until the download is complete the mesh of the printer is not known (G29 L replaces it)
+	m->mesh_known = false;
 
 	// See if a slot should be loaded first
 	if(slot >= 0) {
 		snprintf(cmd_buf,100,"G29 L%i\n", slot);
-		if((err = serial_cmd(cmd_buf, NULL))) return err;
+		if((err = serial_cmd(cmd_buf, NULL, false, conn))) return err;
 		if(wnd != NULL) { wprintw(wnd,"Slot load OK\n"); wrefresh(wnd); }
 	}
 
-	// Reset and invalidate all points in the mesh
-	for(int y=0; y<MESH_SIZE_Y; y++) {
-		for(int x=0; x<MESH_SIZE_X; x++) {
-			mesh[y][x].z     = 0.0f;
-			mesh[y][x].valid = 0;
-		}
-	}
-	if(wnd != NULL) { wprintw(wnd,"Mesh reset OK\n"); wrefresh(wnd); }
-
-	// Fetch all mesh points in CSV format
-	if((err = serial_cmd("G29 T1\n", &res_buf, true))) return err;
+	// Fetch all mesh points in CSV format; the rows are parsed while the rest of the reply is on its way,
+	// the lines before them (the title of the report) are skipped
+	ty_mesh_csv csv;
+	mesh_csv_init(&csv);
+	if((err = serial_query_lines("G29 T1\n", mesh_download_line, &csv, conn))) return err;
 	if(wnd != NULL) { wprintw(wnd,"G29T OK\n"); wrefresh(wnd); }
-
-	// Scan the buffer until a line with only numbers, dots, spaces and commas - anything else indicates a comment line
-	for (int p = 0; p < SERIAL_REPLY_BUFFER_SIZE; p++) {
-		if(res_buf[p] == '\n') {
-			// Check if the previous line was valid (only comma delimited numbers and enough valid characters to be a number line)
-			if(only_valid > 6) break;
-
-			// Previous line was not a CSV list of floats, continue scanning...
-
-			// New line character - clear flag
-			only_valid = 0;
-			// Update the line start in the 'left pos' flag
-			lpos = p+1;
-		} else if((res_buf[p] >= '0' && res_buf[p] <= '9') || res_buf[p] == '.' || res_buf[p] == '-') {
-			// Numeric characters - silently swallow as these are allowed
-			if(only_valid >= 0) only_valid += 1;
-		} else if(res_buf[p] == ' ' || res_buf[p] == ',' || res_buf[p] == '\r') {
-			// Whitespace or separator characters - silently swallow as these are also allowed
-			if(only_valid >= 0) only_valid += 1;
-		} else {
-			// Unknown characters; mark line as invalid
-			only_valid = -1;
-		}
-	}
-	if(only_valid <= 6) {
-		// No valid lines found in the first 4kB of output (or a very short line of potentially valid data - also reject that)...
-		free(res_buf);
-		return 1;
+	if((err = mesh_csv_finish(&csv, mesh))) return err;
+	if(wnd != NULL) {
+		ty_mesh_stats stats;
+		mesh_stats(mesh, &stats);
+		wprintw(wnd,"Parsed a mesh of %i x %i points, %i with a value from %.3f to %.3f\n", mesh->size_x, mesh->size_y,
+				stats.valid, stats.min, stats.max);
+		wrefresh(wnd);
 	}
-	if(wnd != NULL) { wprintw(wnd,"CSV data start @ %i\n", lpos); wrefresh(wnd); }
-
-	// lpos now points to the first line of CSV data describing the mesh
-
-	// loop over the buffer to find either a comma or a newline
-	for(int pos=lpos+1; pos<SERIAL_REPLY_BUFFER_SIZE; pos++) {
-		if(res_buf[pos] == 0) {
-			// End of string - should never occur when parsing numbers...
-			free(res_buf);
-			return 1;
-		} else if(res_buf[pos] == '\r') {
-			// Carriage return is not needed, ignore it by replacing it with a space
-			res_buf[pos] = ' ';
-		} else if(res_buf[pos] == ',' || res_buf[pos] == ' ') {
-			// Parse number string between lpos and pos into float
-			// Note: change comma or space into null to 'end' the numeric string at the comma
-			res_buf[pos] = 0;
-			mesh[MESH_SIZE_Y-row-1][col].z = atof(&res_buf[lpos]);
-			mesh[MESH_SIZE_Y-row-1][col].valid = 1;
-			if(wnd != NULL) { wprintw(wnd,"Parsed CSV: (%i, %i) => %.03f\n", col, row, mesh[MESH_SIZE_Y-row-1][col].z); wrefresh(wnd); }
-			// Revert to be able to print the whole buffer if we want to
-			res_buf[pos] = ' ';
-			// Update left position; support multiple separators after each other by scanning for the first non-separator character
-			while(res_buf[pos+1] == ',' || res_buf[pos+1] == ' ') {
-				// Skip pos to the next position
-				pos++;
-				// Safety: do not run out of the buffer
-				if(pos >= SERIAL_REPLY_BUFFER_SIZE) {
-					free(res_buf);
-					return 5;
-				}
-			}
-			// If the last number in the row had a trailing space, detect that now
-			if(res_buf[pos+1] == '\n') {
-				// Update left position to the start of the next line
-				lpos = pos+2;
-				// Reset column
-				col = 0;
-				// Move row
-				row++;
-
-				// End of mesh test
-				if(row == MESH_SIZE_Y) {
-					break;
-				}
-
-				// Sanity
-				if(row >= MESH_SIZE_Y) {
-					// More mesh point rows in printer result than we allow!
-					free(res_buf);
-					return 4;
-				}
-			} else {
-				// Normal start of a new number - continue parsing the byte stream:
-				// Set the 'left position' to the start of the number (at pos+1)
-				lpos = pos+1;
-				// Move column
-				col++;
-				// Sanity
-				if(col >= MESH_SIZE_X) {
-					// More mesh point columns in printer result than we allow!
-					free(res_buf);
-					return 3;
-				}
-			}
-		} else if(res_buf[pos] == '\n') {
-			// Parse number string between lpos and pos into float
-			// Note: change comma into null to 'end' the numeric string at the comma
-			res_buf[pos] = 0;
-			mesh[MESH_SIZE_Y-row-1][col].z = atof(&res_buf[lpos]);
-			mesh[MESH_SIZE_Y-row-1][col].valid = 1;
-			if(wnd != NULL) { wprintw(wnd,"Parsed CSV: (%i, %i) => %.03f\n", col, MESH_SIZE_Y-row-1, mesh[MESH_SIZE_Y-row-1][col].z); wrefresh(wnd); }
-			// Revert to be able to print the whole buffer if we want to
-			res_buf[pos] = '\n';
-			// Update left position
-			lpos = pos+1;
-			// Reset column
-			col = 0;
-			// Move row
-			row++;
-
-			// End of mesh test
-			if(row == MESH_SIZE_Y) {
-				break;
-			}
 
-			// Sanity
-			if(row >= MESH_SIZE_Y) {
-				// More mesh point rows in printer result than we allow!
-				free(res_buf);
-				return 4;
-			}
-		}
-	}
-
-	if(wnd != NULL) { wprintw(wnd,"Done parsing mesh\n"); wrefresh(wnd); }
-
-	// Parsing done, free buffer
-	free(res_buf);
+	// This is what the printer has now, the next upload only sends the points which are changed
+	if(mesh_copy(&m->mesh, mesh) < 0) return -1;
+	mesh_round(&m->mesh, 1000.0f);
+	m->mesh_known = true;
+	m->mesh_session = session;
 
 	// Flag success
 	return 0;
 }
 
 /**
- * Upload the UBL mesh points into a specific EEPROM save slot (or the currently loaded mesh)
+ * Upload the UBL mesh points into a specific EEPROM save slot (or the currently loaded mesh). Only the
+ * points which differ from the mesh the printer has (as of the last download or upload) are sent.
  * @param slot Set to -1 to only load the mesh into the printer RAM (and not EEPROM)
- * @param mesh Pointer to the mesh memory to upload with the mesh points for the printer
+ * @param mesh The mesh to upload, of the size of the mesh of the printer
  * @param wnd Window handle from ncurses to print debug info into (when NULL no debug info is generated)
  */
-int mesh_upload(int slot, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X], WINDOW* wnd) {
+int mesh_upload(int slot, const ty_mesh *mesh, WINDOW* wnd, ty_serial_conn *conn) {
 	int err = 0;
 	char cmd_buf[100];
-
-	// Reset and invalidate all points in the mesh
-	for(int y=0; y<MESH_SIZE_Y; y++) {
-		for(int x=0; x<MESH_SIZE_X; x++) {
-			if(mesh[y][x].valid)
-				snprintf(cmd_buf, 100, "M421 I%i J%i Z%.03f\n", x, y, mesh[y][x].z);
-			else
-				snprintf(cmd_buf, 100, "M421 I%i J%i N1\n", x, y);
-			// Execute upload for this point in the mesh
-			if((err = serial_cmd(cmd_buf, NULL))) return err;
+	ty_serial_batch batch;
+	ty_machine_state *m = machine(conn);
+	uint64_t start = serial_stats_now();
+	if(mesh->z == NULL) return -1;
+	serial_batch_init(&batch, conn);
+
+	// The printer gets the Z in thousandths, that is also what it is compared in
+	if(mesh_copy(&m->mesh_next, mesh) < 0) return -1;
+	mesh_round(&m->mesh_next, 1000.0f);
+
+	// After a reconnect the printer may have been reset, which loses the mesh in RAM; then all points are sent
+	unsigned int session = serial_conn_session(conn);
+	int points = mesh_points(mesh);
+	std::vector<uint32_t> changed(mesh_words(mesh), ~0u);
+	if(m->mesh_known && m->mesh_session == session) mesh_diff(&m->mesh_next, &m->mesh, 0.0f, changed.data());
+
+	m->mesh_sent = 0;
+	for(int i = mesh_bit_next(changed.data(), points, 0); i >= 0; i = mesh_bit_next(changed.data(), points, i + 1)) {
+		int x = i % mesh->size_x, y = i / mesh->size_x;
+		if(mesh_valid(&m->mesh_next, i))
+			snprintf(cmd_buf, 100, "M421 I%i J%i Z%.03f\n", x, y, m->mesh_next.z[i]);
+		else
+			snprintf(cmd_buf, 100, "M421 I%i J%i N1\n", x, y);
+		// Queue the upload for this point in the mesh; the points are sent to the printer in batches
+		if((err = serial_batch_add(&batch, cmd_buf))) {
+			m->mesh_known = false;
+			return err;
 		}
+		m->mesh_sent++;
 	}
-	if(wnd != NULL) { wprintw(wnd,"Mesh upload OK\n"); wrefresh(wnd); }
+	// Send the points and wait for all of them to be acknowledged; when that fails it is not known which arrived
+	m->mesh_known = false;
+	if((err = serial_batch_send(&batch))) return err;
+	std::swap(m->mesh, m->mesh_next);
+	m->mesh_known = true;
+	m->mesh_session = session;
+	m->mesh_ms = (serial_stats_now() - start) / 1e6;
+	if(wnd != NULL) { wprintw(wnd,"Mesh upload OK: %i of %i points sent in %.1f ms\n", m->mesh_sent, points, m->mesh_ms); wrefresh(wnd); }
 
 	// See if a slot should be saved
 	if(slot >= 0) {
 		snprintf(cmd_buf,100,"G29 S%i\n", slot);
-		if((err = serial_cmd(cmd_buf, NULL))) return err;
+		if((err = serial_cmd(cmd_buf, NULL, false, conn))) return err;
 		if(wnd != NULL) { wprintw(wnd,"Slot save OK\n"); wrefresh(wnd); }
 	}
 
@@ -460,10 +723,10 @@ int mesh_upload(int slot, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X], WINDOW* w
 
 // ================================= Temperature stuff ====================
 
-int enable_fan(bool on) {
+int enable_fan(bool on, ty_serial_conn *conn) {
 	if(on)
-		return serial_cmd("M106 S255\n",NULL);
-	return serial_cmd("M106 S0\n",NULL);
+		return serial_cmd("M106 S255\n", NULL, false, conn);
+	return serial_cmd("M106 S0\n", NULL, false, conn);
 }
 
 /**
@@ -473,10 +736,24 @@ int enable_fan(bool on) {
  * @param hotend_temp pointer to a double to store the hotend temperature in
  * @param bed_temp pointer to a double to store the bed temperature in
  */
-int get_temperature(double *hotend_temp, double* bed_temp) {
-	char *reply = NULL;
-	if(serial_cmd("M105\n",&reply) != 0) return -1;
+int get_temperature(double *hotend_temp, double* bed_temp, ty_serial_conn *conn) {
+	// The reply is borrowed from the connection, nothing is allocated for a poll
+	ty_serial_view reply;
+	if(serial_query("M105\n", &reply, false, conn) != 0) return -1;
 
+	return parse_temperature(reply.text, hotend_temp, bed_temp);
+}
+
+/**
+ * Parse the temperatures from a temperature report of the printer (the reply to M105)
+ * Firmware: Marlin
+ *
+ * @param reply The temperature report, for example 'ok T:20.00 /0.00 B:21.00 /0.00 @:0 B@:0'
+ * @param hotend_temp pointer to a double to store the hotend temperature in
+ * @param bed_temp pointer to a double to store the bed temperature in
+ * @return 0 when both temperatures were found or 1 otherwise
+ */
+int parse_temperature(const char *reply, double *hotend_temp, double* bed_temp) {
 	// Find the location of the ':' which will be followed by the temperature
 	int pos_s = -1; // Separator position
 	int pos_e = 0; // End of temperature string
@@ -487,8 +764,7 @@ int get_temperature(double *hotend_temp, double* bed_temp) {
 		else if(pos_s != -1 && reply[pos_e] == ' ') {
 			// Get the character before the separator
 			char type = reply[pos_s-1];
-			// Convert the space into a NULL to terminate the string for atof()
-			reply[pos_e] = 0;
+			// The conversion stops at the space, the reply is not modified
 
 			// Determine where to store the temp
 			if(type == 'T') {
@@ -502,8 +778,6 @@ int get_temperature(double *hotend_temp, double* bed_temp) {
 			}
 			//else - if none of the above silently ignore it
 
-			// Restore space
-			reply[pos_e] = ' ';
 			// Reset separator index
 			pos_s = -1;
 		}
@@ -521,7 +795,7 @@ int get_temperature(double *hotend_temp, double* bed_temp) {
  * @param temp The temperature to set the printer bed to
  * @param heaterid Hotend ID to set the temperature on - if the machine only has one hotend, its usually ID 0
  */
-int set_hotend_temperature(double temp, const unsigned char heaterid) {
+int set_hotend_temperature(double temp, const unsigned char heaterid, ty_serial_conn *conn) {
 	char buf[100];
 	if(temp < 0) temp = 0;
 	if(temp > MAX_TEMP_HOTEND)
@@ -532,66 +806,66 @@ int set_hotend_temperature(double temp, const unsigned char heaterid) {
 #ifdef ENABLE_AUTOCOOL_HOTEND
 	if(temp >= AUTOCOOL_TEMP_THRESHOLD) {
 		// Hot-end enabled, enable fan as well
-		enable_fan(true);
+		enable_fan(true, conn);
 	} else {
 		// Disabling hot-end; test if the temperature is low enough to switch off the fan
 		double t_hotend = 0;
-		get_temperature(&t_hotend, NULL);
+		get_temperature(&t_hotend, NULL, conn);
 		if(t_hotend <= AUTOCOOL_TEMP_THRESHOLD) {
 			// Hotend cool enough, switch off fan as well
-			enable_fan(false);
+			enable_fan(false, conn);
 		}
 	}
 #endif
 
 	snprintf(buf,100,"M104 P%hhu S%.0f\n", heaterid, temp);
-	return serial_cmd(buf,NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
 /**
  * Set the bed temperature - this command does not wait until the target temperature is reached
  * @param temp The temperature to set the printer bed to
  */
-int set_bed_temperature(double temp) {
+int set_bed_temperature(double temp, ty_serial_conn *conn) {
 	char buf[100];
 	if(temp < 0) temp = 0;
 	if(temp > MAX_TEMP_BED)
 		temp = MAX_TEMP_BED;
 
 	snprintf(buf,100,"M140 S%.0f\n", temp);
-	return serial_cmd(buf,NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
 /**
  * Modify the proportional scaling value of the PID logic in the printer.
  * WARNING: The commands for this might differ from Teacup on other firmwares!
  */
-int set_pid_p(const double p) {
+int set_pid_p(const double p, ty_serial_conn *conn) {
 	char buf[100];
 	snprintf(buf,100,"M130 P0 S%.2f\n", p);
-	return serial_cmd(buf, NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
 /**
  * Modify the integral scaling value of the PID logic in the printer.
  * WARNING: The commands for this might differ from Teacup on other firmwares!
  */
-int set_pid_i(const int32_t i) {
+int set_pid_i(const int32_t i, ty_serial_conn *conn) {
 	char buf[100];
 	snprintf(buf,100,"M131 P0 S%i\n", i);
-	return serial_cmd(buf, NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
 /**
  * Modify the differential scaling value of the PID logic in the printer.
  * WARNING: The commands for this might differ from Teacup on other firmwares!
  */
-int set_pid_d(const int32_t d) {
+int set_pid_d(const int32_t d, ty_serial_conn *conn) {
 	char buf[100];
 	snprintf(buf,100,"M132 P0 S%i\n", d);
-	return serial_cmd(buf, NULL);
+	return serial_cmd(buf, NULL, false, conn);
 }
 
-int print_pid() {
-	return serial_cmd("M136\n", NULL);
+int print_pid(ty_serial_conn *conn) {
+	return serial_cmd("M136\n", NULL, false, conn);
 }
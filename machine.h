@@ -9,7 +9,9 @@
 #define MACHINE_H_
 
 #include "main.h"		// Also contains the machine boundaries
+#include "mesh.h"
 #include "mesh_builder.h"
+#include "serial.h"
 
 #include <ncurses.h>
 
@@ -23,6 +25,11 @@
 
 #define ASSERT(x) {int _return_code = x; if(_return_code!=0) { printf("Command assert failed in " __FILE__":%i with code %i\n", __LINE__, _return_code); return _return_code; }}
 
+// All operations take the printer to drive as the last parameter; when it is NULL (the default) the
+// default connection is used. The position and move settings are kept per printer. The position is read
+// back from the printer (M114) before the first move, after homing and after a reconnect; moves in between
+// are tracked by the host without asking the printer.
+
 /**
  * Position the head of the machine in 3 dimensional space and with a given speed.
  * Note that only changed parameters are sent to the printer to reduce traffic over
@@ -32,50 +39,146 @@
  * @param zval Z coordinate
  * @param relative Marks the given coordinates as a relative move instead of an absolute one
  * @param speed for the move, always absolute
+ * @param conn Printer to move
  * @return 0 for OK or a negative error code otherwise
  */
-int set_position(float xval, float yval, float zval, int relative, float speed, bool changes_only = true);
+int set_position(float xval, float yval, float zval, int relative, float speed, bool changes_only = true, ty_serial_conn *conn = NULL);
 
-// Wrapper functions around set_position for ease of use
-int home_x();
+// Wrapper functions around set_position for ease of use; the short forms drive the default printer
+int home_x(ty_serial_conn *conn = NULL);
 int set_x(float val);
 int set_x(float val, int relative);
-int set_x(float val, int relative, float speedval);
-float get_x();
+int set_x(float val, int relative, float speedval, ty_serial_conn *conn = NULL);
+float get_x(ty_serial_conn *conn = NULL);
 
-int home_y();
+int home_y(ty_serial_conn *conn = NULL);
 int set_y(float val);
 int set_y(float val, int relative);
-int set_y(float val, int relative, float speedval);
-float get_y();
+int set_y(float val, int relative, float speedval, ty_serial_conn *conn = NULL);
+float get_y(ty_serial_conn *conn = NULL);
 
-int home_z();
+int home_z(ty_serial_conn *conn = NULL);
 int set_z(float val);
 int set_z(float val, int relative);
-int set_z(float val, int relative, float speedval);
-float get_z();
+int set_z(float val, int relative, float speedval, ty_serial_conn *conn = NULL);
+float get_z(ty_serial_conn *conn = NULL);
+
+int home_xy(ty_serial_conn *conn = NULL);
+int home_xyz(ty_serial_conn *conn = NULL);
+
+/**
+ * Ask the printer where the head is (M114) and take that over as the known position
+ * @return 0 when OK or an error code otherwise
+ */
+int get_pos(ty_serial_conn *conn = NULL);
+
+/**
+ * Compare the known position with that of the printer (M114); a difference of more than POSITION_DRIFT
+ * is reported as drift and the position of the printer is taken over
+ * @return 0 when they match, 1 when the printer was elsewhere or a negative error code otherwise
+ */
+int check_pos(ty_serial_conn *conn = NULL);
+
+/**
+ * Forget the known position, for example after a quick stop of which the host cannot tell where the head
+ * stopped. A running jog ends without further moves. The next move reads the position back first.
+ */
+void forget_pos(ty_serial_conn *conn = NULL);
+
+/**
+ * Parse the position from the reply to M114
+ * @param reply The reply, for example 'X:10.00 Y:20.00 Z:1.50 E:0.00 Count X:800 Y:1600 Z:600'
+ * @return 0 when all three axes were found or 1 otherwise
+ */
+int parse_position(const char *reply, float *x, float *y, float *z);
 
-int home_xy();
-int home_xyz();
+/**
+ * Jog the Z axis, for each press or repeat of a key. Presses are merged into one target which the head
+ * follows with short streamed moves, never more than JOG_LOOKAHEAD ms ahead of it, so holding a key does
+ * not queue up moves the head is still working through after the key is released. The input loop calls
+ * jog_update() at least every few milliseconds while jog_active().
+ * @param delta Distance to add to the target in mm
+ * @param speed Speed of the moves in mm/min
+ * @return 0 when OK or an error code otherwise (also when the target would be out of bounds)
+ */
+int jog_z(float delta, float speed, ty_serial_conn *conn = NULL);
 
-int get_pos();
+/**
+ * Stream the next moves of a jog and end it when no key arrived for JOG_RELEASE ms
+ * @return 0 when OK or an error code otherwise
+ */
+int jog_update(ty_serial_conn *conn = NULL);
 
-int set_speed(float val);
+/**
+ * End a jog right away. A single press is completed and the position is checked against the printer
+ * (check_pos()); when a key was held, the moves the head did not reach yet are stopped with M410 and the
+ * position is read back from the printer.
+ * @return 0 when OK or an error code otherwise
+ */
+int jog_stop(ty_serial_conn *conn = NULL);
+
+/**
+ * @return True while a jog is running, jog_update() has to be called then
+ */
+bool jog_active(ty_serial_conn *conn = NULL);
 
 /**
- * Load the UBL mesh points from a specific EEPROM save slot (or the currently loaded mesh)
+ * Z the head is going to: the target of a running jog, otherwise get_z()
+ */
+float get_z_target(ty_serial_conn *conn = NULL);
+
+int set_speed(float val, ty_serial_conn *conn = NULL);
+
+/**
+ * Enable or disable streaming of moves: when enabled, moves are queued in the printer without
+ * waiting for each 'ok' so the printer buffers stay filled. Any other command (and disabling
+ * streaming) waits for all queued moves to be acknowledged first.
+ * @param on True to stream moves, false to send them one by one
+ * @return 0 when OK or an error code otherwise
+ */
+int set_streaming(bool on, ty_serial_conn *conn = NULL);
+
+/**
+ * Enable or disable batching of moves: when enabled, moves are collected instead of sent. Disabling
+ * batching sends the collected moves, as many as fit within the printer buffers with a single write,
+ * and waits until all of them are acknowledged.
+ * @param on True to collect moves, false to send them
+ * @return 0 when OK or an error code otherwise
+ */
+int set_batching(bool on, ty_serial_conn *conn = NULL);
+
+/**
+ * Load the UBL mesh points from a specific EEPROM save slot (or the currently loaded mesh). The mesh
+ * takes the size of the mesh of the printer; the reply to G29 T1 is parsed row by row as it arrives.
  * @param slot Set to -1 to load the current mesh points and not load a mesh from EEPROM
- * @param mesh Pointer to the mesh memory to load with the mesh points from the printer
+ * @param mesh The mesh to load with the mesh points from the printer, empty or of any size
+ * @return 0 when OK, 1 when the reply has no mesh, 3 when its rows have different numbers of points, 4 when
+ * the mesh is larger than MESH_MAX_SIZE or a negative error code of the serial port
  */
-int mesh_download(int slot = -1, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X] = NULL, WINDOW* wnd = NULL);
+int mesh_download(int slot, ty_mesh *mesh, WINDOW* wnd = NULL, ty_serial_conn *conn = NULL);
 
 /**
- * Upload the UBL mesh points into a specific EEPROM save slot (or the currently loaded mesh)
+ * Upload the UBL mesh points into a specific EEPROM save slot (or the currently loaded mesh). The mesh
+ * of the printer is remembered from the last download or upload; only the points which differ from it are
+ * sent, all of them with a single batch. After a reconnect or mesh_forget() all points are sent.
  * @param slot Set to -1 to only load the mesh into the printer RAM (and not EEPROM)
- * @param mesh Pointer to the mesh memory to upload with the mesh points for the printer
+ * @param mesh The mesh to upload, of the size of the mesh of the printer
  * @param wnd Window handle from ncurses to print debug info into (when NULL no debug info is generated)
  */
-int mesh_upload(int slot, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X], WINDOW* wnd);
+int mesh_upload(int slot, const ty_mesh *mesh, WINDOW* wnd, ty_serial_conn *conn = NULL);
+
+/**
+ * Points sent by the last mesh_upload() and the time it took
+ * @param ms Set to the time in milliseconds, NULL when not needed
+ * @return The number of points sent
+ */
+int mesh_upload_sent(double *ms = NULL, ty_serial_conn *conn = NULL);
+
+/**
+ * Forget which mesh the printer has, the next mesh_upload() sends all points. Needed when the mesh was
+ * changed behind the back of mesh_upload(), for example with M421 or G29 commands of its own.
+ */
+void mesh_forget(ty_serial_conn *conn = NULL);
 
 /**
  * Tell the machine to dwell for a number of microseconds. This is an unbuffered command
@@ -83,7 +186,7 @@ int mesh_upload(int slot, ty_meshpoint mesh[MESH_SIZE_Y][MESH_SIZE_X], WINDOW* w
  * @param timeout in microseconds (1000 is one second)
  * @return 0 when OK or an error code otherwise
  */
-int set_dwell(int timeout);
+int set_dwell(int timeout, ty_serial_conn *conn = NULL);
 
 /**
  * Adjust the alignment of the Z axis by overriding the position of the head. This allows us to
@@ -94,15 +197,15 @@ int set_dwell(int timeout);
  * @param val The value for the Z axis
  * @return 0 when OK or an error code otherwise
  */
-int override_zpos(float val);
+int override_zpos(float val, ty_serial_conn *conn = NULL);
 
-int disable_motor_hold();
+int disable_motor_hold(ty_serial_conn *conn = NULL);
 
-int enable_soft_endstops(bool on);
+int enable_soft_endstops(bool on, ty_serial_conn *conn = NULL);
 
-int mesh_disable();
+int mesh_disable(ty_serial_conn *conn = NULL);
 
-int enable_fan(bool on);
+int enable_fan(bool on, ty_serial_conn *conn = NULL);
 
 /**
  * Get the printer temperatures
@@ -111,7 +214,18 @@ int enable_fan(bool on);
  * @param hotend_temp pointer to a double to store the hotend temperature in
  * @param bed_temp pointer to a double to store the bed temperature in
  */
-int get_temperature(double *hotend_temp, double* bed_temp);
+int get_temperature(double *hotend_temp, double* bed_temp, ty_serial_conn *conn = NULL);
+
+/**
+ * Parse the temperatures from a temperature report of the printer (the reply to M105)
+ * Firmware: Marlin
+ *
+ * @param reply The temperature report, for example 'ok T:20.00 /0.00 B:21.00 /0.00 @:0 B@:0'
+ * @param hotend_temp pointer to a double to store the hotend temperature in
+ * @param bed_temp pointer to a double to store the bed temperature in
+ * @return 0 when both temperatures were found or 1 otherwise
+ */
+int parse_temperature(const char *reply, double *hotend_temp, double* bed_temp);
 
 /**
  * Set the hotend temperature - this command does not wait until the target temperature is reached
@@ -120,18 +234,18 @@ int get_temperature(double *hotend_temp, double* bed_temp);
  * @param temp The temperature to set the printer bed to
  * @param heaterid Hotend ID to set the temperature on - if the machine only has one hotend, its usually ID 0
  */
-int set_hotend_temperature(double temp = 0, const unsigned char heaterid = 0);
+int set_hotend_temperature(double temp = 0, const unsigned char heaterid = 0, ty_serial_conn *conn = NULL);
 
 /**
  * Set the bed temperature - this command does not wait until the target temperature is reached
  * @param temp The temperature to set the printer bed to
  */
-int set_bed_temperature(const double temp = 0);
+int set_bed_temperature(const double temp = 0, ty_serial_conn *conn = NULL);
 
-int set_pid_p(const double p);
-int set_pid_i(const int i);
-int set_pid_d(const int d);
-int print_pid();
+int set_pid_p(const double p, ty_serial_conn *conn = NULL);
+int set_pid_i(const int i, ty_serial_conn *conn = NULL);
+int set_pid_d(const int d, ty_serial_conn *conn = NULL);
+int print_pid(ty_serial_conn *conn = NULL);
 
 
 #endif /* MACHINE_H_ */
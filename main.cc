@@ -4,7 +4,12 @@
  *  Created on: Dec 5, 2012
  *      Author: cyberwizzard
  */
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -12,20 +17,264 @@
 #include <fcntl.h>
 
 #include "serial.h"
+#include "serial_thread.h"
 #include "machine.h"
 #include "level_bed.h"
 #include "mesh_builder.h"
+#include "temperature.h"
+#include "fleet.h"
+#include "serial_stats.h"
+#include "transcript.h"
+#include "bench.h"
+#include "discovery.h"
 
 #define _(x) ASSERT(x)
 
-int yaxis_break_in();
-int zaxis_break_in();
+int yaxis_break_in(ty_serial_conn *conn = NULL);
+int zaxis_break_in(ty_serial_conn *conn = NULL);
 int pid_auto_tuning();
+int fleet_main(const char **ports, int nports, const char *job);
+int printer_main(const char *port);
+int bench_main(const char *port, const char *rates);
+int latency_main(const char *port, int latency_ms);
+
+// Jobs which can be run on all printers at once with -j
+typedef struct {
+	const char *name;
+	t_fleet_job job;
+	const char *description;
+} ty_fleet_job;
+
+int fleet_mesh_download(ty_serial_conn *conn, int index, void *user);
+int fleet_mesh_upload(ty_serial_conn *conn, int index, void *user);
+int fleet_temp_sweep(ty_serial_conn *conn, int index, void *user);
+int fleet_bench(ty_serial_conn *conn, int index, void *user);
+int fleet_zaxis_break_in(ty_serial_conn *conn, int index, void *user) { return zaxis_break_in(conn); }
+int fleet_yaxis_break_in(ty_serial_conn *conn, int index, void *user) { return yaxis_break_in(conn); }
+
+const ty_fleet_job fleet_jobs[] = {
+	{ "download", fleet_mesh_download,  "download the UBL mesh of printer <n> to mesh_<n>.csv" },
+	{ "upload",   fleet_mesh_upload,    "upload mesh_<n>.csv as the UBL mesh of printer <n>" },
+	{ "temps",    fleet_temp_sweep,     "heat the hotends in steps and report the time per step" },
+	{ "zbreakin", fleet_zaxis_break_in, "break-in program for new Z axes" },
+	{ "ybreakin", fleet_yaxis_break_in, "break-in program for new Y axes" },
+	{ "bench",    fleet_bench,          "measure the latencies and command rates of printer <n> into bench_<n>.json" },
+	{ NULL, NULL, NULL }
+};
+
+void usage(const char *prog) {
+	printf("Usage: %s [-p port]... [-d] [-b baud] [-a] [-c] [-l ms] [-Y dir] [-j job | -B rates | -L] [-s file] [-t file]\n", prog);
+	printf("       [-r file | -R file]\n");
+	printf("  -p port   Serial port of the printer (default: " SERIAL_DEFAULT_PORT "); repeat it with -j\n");
+	printf("            to drive up to %i printers at the same time\n", SERIAL_MAX_CONNECTIONS);
+	printf("  -d        Search all serial ports (or the ports of -p) for printers at the usual baud rates and\n");
+	printf("            remember their rates and capabilities; launches without -p use these printers\n");
+	printf("  -b baud   Baud rate of the printers (default: %i), for example 250000 or 1000000; the\n", SERIAL_DEFAULT_BAUD);
+	printf("            rates of the printers found with -d are not used then\n");
+	printf("  -a        Attach to printers which are running already instead of resetting them, keep them\n");
+	printf("            running on exit and open their ports again when they disappear (USB glitches)\n");
+	printf("  -c        Send every command with a line number and checksum; the printer rejects corrupted\n");
+	printf("            commands and asks for them again, which makes high command rates safe on noisy cables\n");
+	printf("  -l ms     Set the latency timer of FTDI adapters to ms and ASYNC_LOW_LATENCY of the serial driver\n");
+	printf("            for shorter round trips (the default 16 ms allows about 60 commands per second)\n");
+	printf("  -Y dir    Read the USB serial adapters from a sysfs tree in dir instead of " SERIAL_SYSFS_ROOT "\n");
+	printf("  -B rates  Measure the throughput of the first printer at a comma separated list of baud rates\n");
+	printf("  -L        Measure the round trip time of the first printer, tune its USB serial adapter (-l,\n");
+	printf("            default %i ms) and measure again\n", SERIAL_LATENCY_TIMER);
+	printf("  -j job    Run a job on all printers at once instead of the interactive mesh builder:\n");
+	for(int i=0; fleet_jobs[i].name != NULL; i++) printf("              %-9s %s\n", fleet_jobs[i].name, fleet_jobs[i].description);
+	printf("  -s file   Write the traffic counters and command latencies of all printers to file (JSON)\n");
+	printf("            on exit\n");
+	printf("  -t file   Record all traffic with the printers in file\n");
+	printf("  -r file   Replay a recording instead of connecting to printers, with the original timing\n");
+	printf("  -R file   Replay a recording as fast as possible\n");
+}
+
+/**
+ * Ctrl-C gives up waiting for the printers; pressing it twice within two seconds quits as before.
+ */
+void cancel_signal(int sig) {
+	static struct timespec last;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(last.tv_sec != 0 && now.tv_sec - last.tv_sec < 2) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+	last = now;
+	serial_cancel_all();
+}
+
+ty_estop_report estop_reports[SERIAL_MAX_CONNECTIONS];
+bool use_checksum = false;		// Send all commands with line numbers and checksums (-c)
+
+/**
+ * Ctrl-\ stops all printers with M112 at any moment, also while a command is running. The time it took
+ * is printed when the program ends.
+ */
+void estop_signal(int sig) {
+	serial_emergency_all(SERIAL_ESTOP_KILL, estop_reports);
+}
+
+int main(int argc, char **argv) {
+	const char *ports[SERIAL_MAX_CONNECTIONS];
+	int nports = 0;
+	const char *job = NULL;
+	const char *stats_file = NULL;
+	const char *record_file = NULL;
+	const char *replay_file = NULL;
+	const char *bench_rates = NULL;
+	bool replay_realtime = true;
+	bool discover = false;
+	bool bench_rtt = false;
+	int latency_ms = 0;
+	static ty_printer_info found[SERIAL_MAX_CONNECTIONS];
+	int opt, res;
 
-int main(void) {
 	printf("RepRap Bed Level Tool " VERSION " by Berend Dekens\n");
-	if(serial_open() < 0) return -1;
+	while((opt = getopt(argc, argv, "p:db:acl:Y:B:Lj:s:t:r:R:h")) != -1) {
+		switch(opt) {
+		case 'p':
+			if(nports == SERIAL_MAX_CONNECTIONS) {
+				printf("At most %i printers are supported\n", SERIAL_MAX_CONNECTIONS);
+				return -1;
+			}
+			ports[nports++] = optarg;
+			break;
+		case 'b':
+			if(atoi(optarg) <= 0) {
+				printf("Invalid baud rate %s\n", optarg);
+				return -1;
+			}
+			serial_set_baud(atoi(optarg));
+			discover_set_cache(false);
+			break;
+		case 'd':
+			discover = true;
+			break;
+		case 'a':
+			serial_set_attach(true);
+			break;
+		case 'c':
+			use_checksum = true;
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			if(latency_ms < 1 || latency_ms > 255) {
+				printf("Invalid latency timer %s, it has to be 1 to 255 ms\n", optarg);
+				return -1;
+			}
+			serial_set_latency(latency_ms);
+			break;
+		case 'Y':
+			serial_adapter_set_sysfs(optarg);
+			break;
+		case 'B':
+			bench_rates = optarg;
+			break;
+		case 'L':
+			bench_rtt = true;
+			break;
+		case 'j':
+			job = optarg;
+			break;
+		case 's':
+			stats_file = optarg;
+			break;
+		case 't':
+			record_file = optarg;
+			break;
+		case 'r':
+		case 'R':
+			replay_file = optarg;
+			replay_realtime = opt == 'r';
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+	if(replay_file != NULL) {
+		if(nports > 0) {
+			printf("A replay brings its own printers, -p can not be combined with -r or -R\n");
+			return -1;
+		}
+		// The printers of the recording are played on pseudo-terminals
+		nports = transcript_replay_start(replay_file, replay_realtime, ports, SERIAL_MAX_CONNECTIONS);
+		if(nports < 0) return -1;
+		if(nports == 0) {
+			printf("No printers in %s\n", replay_file);
+			transcript_replay_stop();
+			return -1;
+		}
+	}
+	if(discover) {
+		if(replay_file != NULL) {
+			printf("A replay brings its own printers, -d can not be combined with -r or -R\n");
+			transcript_replay_stop();
+			return -1;
+		}
+		printf("Searching for printers\n");
+		nports = discover_printers(nports > 0 ? ports : NULL, nports, found, SERIAL_MAX_CONNECTIONS);
+		if(nports == 0) {
+			printf("No printers found\n");
+			return -1;
+		}
+		discover_print(found, nports);
+		discover_cache_store(found, nports);
+		for(int i=0; i<nports; i++) ports[i] = found[i].port;
+		if(nports > 1 && job == NULL && bench_rates == NULL && !bench_rtt) return 0;
+	}
+	// Without ports, the printers found by an earlier search are used; without a job only the first
+	if(nports == 0) nports = discover_cache_ports(ports, job != NULL ? SERIAL_MAX_CONNECTIONS : 1);
+	if(nports == 0) ports[nports++] = SERIAL_DEFAULT_PORT;
+	if(nports > 1 && job == NULL) {
+		printf("Multiple printers can only be driven with a job (-j)\n");
+		usage(argv[0]);
+		if(replay_file != NULL) transcript_replay_stop();
+		return -1;
+	}
+	if(record_file != NULL && transcript_record_start(record_file) < 0) {
+		if(replay_file != NULL) transcript_replay_stop();
+		return -1;
+	}
+
+	signal(SIGINT, cancel_signal);
+	signal(SIGQUIT, estop_signal);
+	if(bench_rates != NULL) res = bench_main(ports[0], bench_rates);
+	else if(bench_rtt) res = latency_main(ports[0], latency_ms > 0 ? latency_ms : SERIAL_LATENCY_TIMER);
+	else if(job != NULL) res = fleet_main(ports, nports, job);
+	else res = printer_main(ports[0]);
+
+	transcript_record_stop();
+	for(int i=0; i<SERIAL_MAX_CONNECTIONS; i++) {
+		if(estop_reports[i].requested == 0) continue;
+		char desc[128];
+		serial_emergency_describe(&estop_reports[i], desc, sizeof(desc));
+		printf("Emergency stop of printer %i: %s\n", i, desc);
+	}
+	if(replay_file != NULL && transcript_replay_stop() != 0) {
+		printf("The session did not send the same commands as the recording\n");
+		res = -1;
+	}
+	if(stats_file != NULL && serial_stats_write_json(stats_file) < 0) res = -1;
+	return res;
+}
+
+/**
+ * Run the interactive mesh builder on a single printer.
+ * @param port Serial port of the printer
+ * @return 0 when OK or a negative error code otherwise
+ */
+int printer_main(const char *port) {
+	if(discover_open(port) < 0) return -1;
 	printf("Opened serial port\n");
+	// Protect every command with a line number and checksum
+	if(use_checksum && serial_set_checksum(true) < 0) return -1;
+	// Hand the serial port to the I/O thread so commands can overlap
+	if(serial_thread_start() < 0) return -1;
+	// Let the printer report its temperatures so they never have to be polled
+	if(temp_monitor_start(TEMP_AUTOREPORT_INTERVAL) < 0) return -1;
 
 	//level_bed_heightloop();
 	mesh_builder();
@@ -35,8 +284,73 @@ int main(void) {
 
 	// Send a barrier command to the printer before shutting down
 	set_dwell(100);
-	// Close the serial port
+	temp_monitor_stop();
+	// Stop the I/O thread and close the serial port
+	serial_thread_stop();
+	serial_close();
+	return 0;
+}
+
+/**
+ * Measure the throughput of the serial link to a printer at several baud rates.
+ * @param port Serial port of the printer
+ * @param rates Comma separated list of baud rates
+ * @return 0 when the printer answered at all rates or a negative error code otherwise
+ */
+int bench_main(const char *port, const char *rates) {
+	ty_bench_baud results[16];
+	int count = 0, res = 0;
+
+	if(discover_open(port) < 0) return -1;
+	serial_verbose(false);
+	const char *p = rates;
+	while(*p != 0 && count < 16) {
+		int baud = atoi(p);
+		printf("Measuring %i baud\n", baud);
+		if(bench_baud(baud, &results[count++]) < 0) res = -1;
+		p += strcspn(p, ",");
+		if(*p == ',') p++;
+	}
+	bench_baud_print(results, count);
+	serial_close();
+	return res;
+}
+
+/**
+ * Measure the round trip time of a printer before and after tuning its USB serial adapter.
+ * @param port Serial port of the printer
+ * @param latency_ms Latency timer to set
+ * @return 0 when OK or a negative error code otherwise
+ */
+int latency_main(const char *port, int latency_ms) {
+	ty_serial_adapter adapter;
+	ty_bench_latency before, after;
+
+	// Measure the adapter as it is, so do not let the connection tune it
+	serial_set_latency(0);
+	if(discover_open(port) < 0) return -1;
+	serial_verbose(false);
+	if(serial_conn_adapter(&adapter) == 0) {
+		printf("Adapter of %s: %s, driver %s, latency timer ", port, adapter.device, adapter.driver[0] != 0x0 ? adapter.driver : "unknown");
+		if(adapter.latency_timer >= 0) printf("%i ms", adapter.latency_timer);
+		else printf("none");
+		printf(", low latency %s\n", adapter.low_latency < 0 ? "not supported" : adapter.low_latency ? "on" : "off");
+	}
+
+	printf("Measuring the round trip time\n");
+	int res = bench_latency(&before);
+	if(res == 0) {
+		printf("Setting the latency timer to %i ms and low latency mode\n", latency_ms);
+		if(serial_tune_latency(latency_ms) < 0) res = -1;
+	}
+	bool tuned = res == 0;
+	if(tuned) {
+		printf("Measuring the round trip time again\n");
+		res = bench_latency(&after);
+	}
+	bench_latency_print(&before, tuned ? &after : NULL);
 	serial_close();
+	return res;
 }
 
 int pid_auto_tuning() {
@@ -50,6 +364,8 @@ int pid_auto_tuning() {
 	double temp = 0.0, temp_err = 100.0;	// Current temp and error from target
 	int temp_ok_cnt = 0;					// Number of consecutive measurements where the temperature was ok
 	int temp_ok_max = 30;					// Target before beginning
+	ty_temperature report;					// Temperature report from the temperature monitor
+	unsigned long temp_seq = 0;				// Last temperature report used
 
 	FILE *fhp = fopen("pid_temp.plot", "w");
 	if(fhp==NULL) {
@@ -72,7 +388,8 @@ int pid_auto_tuning() {
 	sleep(4);
 
 	// Test before starting if we need to cool the printer
-	get_temperature(0, &temp);
+	if(temp_wait(&report, &temp_seq, 5000)) return -1;
+	temp = report.bed;
 	// Sanity testing
 	if(temp < 10.0 || temp > 250) {
 		printf("Unsane temperature reported: %.0f degrees\n", temp);
@@ -104,10 +421,10 @@ int pid_auto_tuning() {
 	set_hotend_temperature(test_temp);
 
 	printf("Waiting for printer to reach target temperature\n");
-	get_temperature(&temp, NULL);
+	temp = report.hotend;
 	while(temp < test_temp) {
-		usleep(1000000);		// Delay 100 ms
-		get_temperature(0, &temp);
+		if(temp_wait(&report, &temp_seq, 5000) < 0) return -1;
+		temp = report.bed;
 	}
 
 	serial_verbose(false);
@@ -125,13 +442,19 @@ int pid_auto_tuning() {
 	double temps[t_max];
 	double temp_min = test_temp, temp_max = test_temp;
 
-	int t = 1;				// Time index in 10ms steps
+	int t = 1;				// Time index in 10ms steps, taken from the arrival time of the temperature reports
+	double t_begin = report.time;
 	int t_start = -1;		// Time index of the rising flank of the wave
 	int t_crossing = -1;	// Time index of the high to low crossing of the wave through the target temperature
 
 	while(1) {
-		// Read current temperature
-		get_temperature(0, &temp);
+		// Read current temperature: wait for the next report instead of polling the printer
+		if(temp_wait(&report, &temp_seq, 5000) < 0) {
+			fclose(fh);
+			return -1;
+		}
+		temp = report.bed;
+		t = 1 + (int)((report.time - t_begin) * 100.0);
 		printf("\rT: %.2f C      ", temp);
 		// Min/max logic to detect oscillation amplitude
 		if(temp < temp_min) temp_min = temp;
@@ -175,8 +498,6 @@ int pid_auto_tuning() {
 		}
 		fprintf(fh, "%.1f	%.2f\n", (double)(t_id) / 100.0, temp);
 
-		usleep(10000);	// 10ms
-		t++;			// Forward time
 	}
 	fclose(fh);
 
@@ -191,8 +512,8 @@ int pid_auto_tuning() {
 
 	printf("Waiting for machine to cool down\n");
 	while(temp > 30.0f) {
-		sleep(1);
-		get_temperature(0, &temp);
+		if(temp_wait(&report, &temp_seq, 5000) < 0) return -1;
+		temp = report.bed;
 	}
 
 	printf("PID tuning complete\n");
@@ -200,7 +521,7 @@ int pid_auto_tuning() {
 	return 0;
 }
 
-int zaxis_break_in() {
+int zaxis_break_in(ty_serial_conn *conn) {
 	const float speed_min = 50.0;
 	const float speed_max = 200.0;
 	float speed = speed_min;
@@ -209,24 +530,27 @@ int zaxis_break_in() {
 	int cycles = 2;
 
 	// Home the Z axis to get a clean start
-	home_z();
+	home_z(conn);
 
-	printf("Running break in program for new Z axis\n");
+	printf("%s: Running break in program for new Z axis\n", serial_conn_port(conn));
 
 	for(int i=0;i<speed_cycles;i++) {
 		speed = speed_min;
 		cycles = 2;
 		while(speed < speed_max) {
 			// Home Z axis to make sure in case of missed steps we start anew
-			printf("Home Z\n");
-			home_z();
+			printf("%s: Home Z\n", serial_conn_port(conn));
+			home_z(conn);
 
-			// Run the carriage a couple of times up and down
+			// Run the carriage a couple of times up and down; the moves are sent in batches so the
+			// printer planner stays filled and the carriage does not stop between moves
+			set_batching(true, conn);
 			for(int j=0;j<cycles;j++) {
-				printf("Running up and down (%i/%i)\n",j,cycles);
-				set_z(30.0f, 0, speed);
-				set_z(0.0f, 0, speed);
+				printf("%s: Running up and down (%i/%i)\n", serial_conn_port(conn), j, cycles);
+				set_z(30.0f, 0, speed, conn);
+				set_z(0.0f, 0, speed, conn);
 			}
+			set_batching(false, conn);
 
 			// Increase speed for next run
 			speed *= 2.0f;
@@ -237,12 +561,12 @@ int zaxis_break_in() {
 		}
 	}
 
-	printf("Done\n");
+	printf("%s: Done\n", serial_conn_port(conn));
 
 	return 0;
 }
 
-int yaxis_break_in() {
+int yaxis_break_in(ty_serial_conn *conn) {
 	const float speed_min = 100.0;
 	const float speed_max = 4000.0;
 	float speed = 100.0;
@@ -253,22 +577,25 @@ int yaxis_break_in() {
 	// Home the Y axis to get a clean start
 	//home_y();
 
-	printf("Running break in program for new axis\n");
+	printf("%s: Running break in program for new axis\n", serial_conn_port(conn));
 
 	for(int i=0;i<speed_cycles;i++) {
 		speed = speed_min;
 		cycles = 2;
 		while(speed < speed_max) {
 			// Home Y axis to make sure in case of missed steps we start anew
-			printf("Home Y\n");
-			home_y();
+			printf("%s: Home Y\n", serial_conn_port(conn));
+			home_y(conn);
 
-			// Run the carriage a couple of times up and down
+			// Run the carriage a couple of times up and down; the moves are sent in batches so the
+			// printer planner stays filled and the carriage does not stop between moves
+			set_batching(true, conn);
 			for(int j=0;j<cycles;j++) {
-				printf("Running up and down (%i/%i)\n",j,cycles);
-				set_y(180.0f, 0, speed);
-				set_y(0.0f, 0, speed);
+				printf("%s: Running up and down (%i/%i)\n", serial_conn_port(conn), j, cycles);
+				set_y(180.0f, 0, speed, conn);
+				set_y(0.0f, 0, speed, conn);
 			}
+			set_batching(false, conn);
 
 			// Increase speed for next run
 			speed *= 2.0f;
@@ -279,8 +606,175 @@ int yaxis_break_in() {
 		}
 	}
 
-	printf("Done\n");
+	printf("%s: Done\n", serial_conn_port(conn));
 
 	return 0;
 }
 
+
+/**
+ * Connect to all printers and run a job on all of them at the same time.
+ * @param ports Serial ports of the printers
+ * @param nports Number of printers
+ * @param job Name of the job (see fleet_jobs)
+ * @return 0 when the job succeeded on all printers or -1 otherwise
+ */
+int fleet_main(const char **ports, int nports, const char *job) {
+	const ty_fleet_job *j = fleet_jobs;
+	while(j->name != NULL && strcmp(j->name, job) != 0) j++;
+	if(j->name == NULL) {
+		printf("Unknown job '%s'\n", job);
+		return -1;
+	}
+
+	ty_serial_conn *conns[SERIAL_MAX_CONNECTIONS];
+	int results[SERIAL_MAX_CONNECTIONS];
+	if(fleet_connect(ports, nports, conns) == 0) return -1;
+	for(int i=0; i<nports; i++) {
+		if(conns[i] == NULL) continue;
+		if(use_checksum && serial_set_checksum(true, conns[i]) < 0) { serial_close(conns[i]); conns[i] = NULL; continue; }
+		// All printers share the pool of I/O threads
+		if(serial_thread_start(conns[i]) < 0 || temp_monitor_start(TEMP_AUTOREPORT_INTERVAL, conns[i]) < 0) {
+			serial_close(conns[i]);
+			conns[i] = NULL;
+		}
+	}
+
+	// The traffic of many printers at once is unreadable; only the results are printed
+	serial_verbose(false);
+	printf("Running '%s' on %i printers\n", j->name, nports);
+	int failed = fleet_run(conns, nports, j->job, NULL, results);
+
+	for(int i=0; i<nports; i++) {
+		printf("%-20s %s", ports[i], conns[i] == NULL ? "not connected" : (results[i] == 0 ? "OK" : "FAILED"));
+		if(conns[i] != NULL && results[i] != 0) printf(" (%i)", results[i]);
+		printf("\n");
+		if(conns[i] == NULL) continue;
+		set_dwell(100, conns[i]);
+		temp_monitor_stop(conns[i]);
+		serial_close(conns[i]);
+	}
+	serial_verbose(true);
+	return failed == 0 ? 0 : -1;
+}
+
+/**
+ * Fleet job: download the current UBL mesh of a printer into mesh_<index>.csv; the first line is the
+ * back row of the bed, points without a value are written as nan.
+ */
+int fleet_mesh_download(ty_serial_conn *conn, int index, void *user) {
+	ty_mesh mesh = MESH_EMPTY;
+	char name[32];
+
+	if(mesh_download(-1, &mesh, NULL, conn) != 0) {
+		mesh_free(&mesh);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "mesh_%i.csv", index);
+	FILE *fh = fopen(name, "w");
+	if(fh == NULL) {
+		printf("%s: could not open %s\n", serial_conn_port(conn), name);
+		mesh_free(&mesh);
+		return -1;
+	}
+	for(int y=mesh.size_y-1; y>=0; y--) {
+		for(int x=0; x<mesh.size_x; x++) {
+			int p = mesh_index(&mesh, x, y);
+			if(mesh_valid(&mesh, p)) fprintf(fh, "%s%.3f", x ? "," : "", mesh.z[p]);
+			else fprintf(fh, "%snan", x ? "," : "");
+		}
+		fprintf(fh, "\n");
+	}
+	fclose(fh);
+	ty_mesh_stats stats;
+	mesh_stats(&mesh, &stats);
+	printf("%s: %ix%i mesh saved in %s, %i points with a value from %.3f to %.3f (mean %.3f)\n", serial_conn_port(conn),
+			mesh.size_x, mesh.size_y, name, stats.valid, stats.min, stats.max, stats.mean);
+	mesh_free(&mesh);
+	return 0;
+}
+
+/**
+ * Fleet job: upload mesh_<index>.csv (as written by fleet_mesh_download) as the UBL mesh of a printer.
+ * The file has to have the size of the mesh of the printer.
+ */
+int fleet_mesh_upload(ty_serial_conn *conn, int index, void *user) {
+	ty_mesh mesh = MESH_EMPTY;
+	ty_mesh_csv csv;
+	char name[32];
+	char *line = NULL;
+	size_t len = 0;
+
+	snprintf(name, sizeof(name), "mesh_%i.csv", index);
+	FILE *fh = fopen(name, "r");
+	if(fh == NULL) {
+		printf("%s: could not open %s\n", serial_conn_port(conn), name);
+		return -1;
+	}
+	mesh_csv_init(&csv);
+	while(getline(&line, &len, fh) >= 0) mesh_csv_line(&csv, line);
+	free(line);
+	fclose(fh);
+
+	int res = mesh_csv_finish(&csv, &mesh);
+	if(res != 0) {
+		if(res == 1) printf("%s: %s has no rows of numbers\n", serial_conn_port(conn), name);
+		else if(res == 3) printf("%s: the rows in %s have different numbers of points\n", serial_conn_port(conn), name);
+		else printf("%s: %s has more than %i rows or columns\n", serial_conn_port(conn), name, MESH_MAX_SIZE);
+		return -1;
+	}
+
+	res = mesh_upload(-1, &mesh, NULL, conn);
+	if(res == 0) {
+		double ms;
+		int sent = mesh_upload_sent(&ms, conn);
+		printf("%s: mesh loaded from %s, %i of %i points sent in %.1f ms\n", serial_conn_port(conn), name, sent, mesh.size_x * mesh.size_y, ms);
+	}
+	mesh_free(&mesh);
+	return res == 0 ? 0 : -1;
+}
+
+/**
+ * Fleet job: heat the hotend in steps, report how long each step took and switch it off again.
+ */
+int fleet_temp_sweep(ty_serial_conn *conn, int index, void *user) {
+	const double steps[] = { 50.0, 100.0, 150.0 };
+	const double tolerance = 2.0;		// Degrees around the target which count as reached
+	const double step_timeout = 300.0;	// Seconds before giving up on a step
+	ty_temperature report;
+	unsigned long temp_seq = 0;
+
+	for(unsigned int s=0; s<sizeof(steps)/sizeof(steps[0]); s++) {
+		ASSERT(set_hotend_temperature(steps[s], 0, conn));
+		if(temp_wait(&report, &temp_seq, 5000, conn) != 0) {
+			set_hotend_temperature(0, 0, conn);
+			return -1;
+		}
+		double t_begin = report.time;
+		while(fabs(report.hotend - steps[s]) > tolerance) {
+			if(temp_wait(&report, &temp_seq, 5000, conn) != 0 || report.time - t_begin > step_timeout) {
+				printf("%s: %.0f C not reached (%.1f C)\n", serial_conn_port(conn), steps[s], report.hotend);
+				set_hotend_temperature(0, 0, conn);
+				return -1;
+			}
+		}
+		printf("%s: %.0f C reached in %.1f s\n", serial_conn_port(conn), steps[s], report.time - t_begin);
+	}
+	return set_hotend_temperature(0, 0, conn);
+}
+
+/**
+ * Fleet job: measure what printer <index> and its link can do and write the report to bench_<index>.json,
+ * to compare firmware builds, boards and USB hubs.
+ */
+int fleet_bench(ty_serial_conn *conn, int index, void *user) {
+	ty_bench_printer result;
+	char name[32];
+
+	int res = bench_printer(&result, conn);
+	bench_printer_print(&result, conn);
+	snprintf(name, sizeof(name), "bench_%i.json", index);
+	if(bench_printer_write_json(name, &result, conn) < 0) return -1;
+	return res;
+}
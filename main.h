@@ -10,9 +10,34 @@
 
 #define VERSION "0.5"		// Version number for the program
 
-#define DEMO_MODE 0  		// As testing UI features without a printer is hard, provide a dummy mode
-							// WARNING: With this enabled, the serial port and machine driver will pretend
-							// to drive the printer.
+// Serial port of the printer, can be changed with the -p option. To test without a printer, point the
+// program to the pty of the printer simulator (tools/marlin_sim.cc).
+#define SERIAL_DEFAULT_PORT "/dev/ttyUSB0"
+// Baud rate of the printers unless selected with -b; any rate the serial driver supports can be used
+#define SERIAL_DEFAULT_BAUD 115200
+// Attach mode (-a): time a running printer gets to answer the probe (M110 and M115) before it is reset after
+// all, in milliseconds, and how long a lost serial port (USB glitch) is tried to be opened again, in seconds
+#define SERIAL_ATTACH_TIMEOUT 500
+#define SERIAL_RECONNECT_TIME 10
+// Time an emergency stop (M112, M410) waits for room in the output buffer of a port, in milliseconds; a full
+// buffer of 4 KiB takes about 350 ms at 115200 baud
+#define SERIAL_ESTOP_WRITE_TIMEOUT 1000
+// Discovery (-d): serial ports searched for printers and the baud rates tried on each of them, in this order;
+// a printer gets DISCOVERY_TIMEOUT milliseconds to answer at a rate. The printers found are remembered in
+// PRINTER_CACHE_FILE in the home directory, so later launches use the right rate and features right away.
+#define DISCOVERY_PORTS "/dev/ttyUSB*", "/dev/ttyACM*", "/dev/serial/by-id/*"
+#define DISCOVERY_BAUD_RATES 115200, 250000, 500000, 1000000, 230400, 57600
+#define DISCOVERY_TIMEOUT 500
+#define PRINTER_CACHE_FILE ".reputils_printers"
+// USB serial adapters: root of the sysfs tree the adapter type and latency timer are read from (-Y points it
+// to a fake tree to test with) and the latency timer set with -L, in milliseconds. FTDI adapters default
+// to 16 ms, which limits a printer to about 60 round trips per second.
+#define SERIAL_SYSFS_ROOT "/sys"
+#define SERIAL_LATENCY_TIMER 1
+// Maximum number of printers driven at the same time (-p can be given multiple times)
+#define SERIAL_MAX_CONNECTIONS 16
+// Number of I/O threads which serve all connected printers
+#define SERIAL_THREAD_POOL_SIZE 2
 
 // Safety features: define some limits to prevent sending insane commands to the printer
 // Temperature
@@ -47,19 +72,60 @@
 #define MAX_SPEED_Y 5000.0f
 #define MAX_SPEED_Z 150.0f
 
+// Jogging with the arrow keys: key repeats are merged into one target which the head follows with short moves
+// of JOG_SEGMENT_TIME ms, streamed at most JOG_LOOKAHEAD ms ahead of the head. When no key arrived for
+// JOG_RELEASE ms the key counts as released and the moves still queued are stopped with M410.
+#define JOG_SEGMENT_TIME 50
+#define JOG_LOOKAHEAD 100
+#define JOG_RELEASE 150
+#define JOG_POLL 10			// Keys are read at least this often while jogging, in ms
+
+// Position of the head: kept by the host and read back from the printer (M114) after homing, a quick stop or
+// a reconnect. A difference of more than POSITION_DRIFT mm between the two is reported as drift.
+#define POSITION_DRIFT 0.015f
+
 // Mesh generation: define properties of the mesh
 #define MESH_MIN_X    1.0f
 #define MESH_MAX_X  179.0f
 #define MESH_MIN_Y    1.0f
 #define MESH_MAX_Y  179.0f
-#define MESH_SIZE_X     5
+#define MESH_SIZE_X     5		// Size of a new mesh; a mesh downloaded from the printer has the size of the printer's mesh
 #define MESH_SIZE_Y     5
+#define MESH_MAX_SIZE 255		// Most points per row or column accepted from a printer
 
 // Size of the serial buffer allocated to parse command responses; has to be large enough for the biggest reply but too large means
 // high memory consumption in the program for no reason.
 // Default: 1024 bytes
 #define SERIAL_REPLY_BUFFER_SIZE 2048
 
+// Command streaming: instead of waiting for an 'ok' after every command, multiple commands can be in flight.
+// The host keeps track of how much of the receive buffer and command queue of the printer is in use and only
+// sends a new command when it fits. Marlin defaults to a 128 byte RX buffer and a command queue of 4 (BUFSIZE).
+// When the printer reports ADVANCED_OK (ok N.. P.. B..), the free command slots are taken from the reply instead.
+#define SERIAL_RX_BUFFER_SIZE 127
+#define SERIAL_STREAM_MAX_INFLIGHT 4
+// Maximum length of a single command (Marlin: MAX_CMD_SIZE), longer commands are refused
+#define SERIAL_MAX_CMD_SIZE 96
+// Bytes of commands a batch (serial_batch_add()) collects before it sends them; all commands of a batch which
+// fit within the printer buffers at the same time are sent with a single write()
+#define SERIAL_BATCH_SIZE 4096
+
+// Number of sent lines remembered to answer resend requests; has to cover all commands which can be in flight
+#define SERIAL_RESEND_HISTORY 64
+
+// Time the printer gets to acknowledge a command before the wait is given up, in milliseconds, per class of
+// command (see serial_cmd_class()). The time starts when the printer can start working on the command: when it
+// is sent, or when the command before it was acknowledged. Can be changed at runtime with serial_set_timeout().
+#define SERIAL_TIMEOUT_QUICK      5000	// Queries which are answered right away: M105, M114, M115, ...
+#define SERIAL_TIMEOUT_DEFAULT   60000	// Moves and settings; a move is only acknowledged when the planner has room
+#define SERIAL_TIMEOUT_LONG     300000	// Homing, probing and waiting for moves: G28, G29, M400, ...
+#define SERIAL_TIMEOUT_HEATING 1200000	// Waiting for a temperature: M109, M190, M303
+
+// Temperature monitoring: printers which support it report their temperatures by themselves every
+// TEMP_AUTOREPORT_INTERVAL seconds (M155), others are asked with M105. The last TEMP_HISTORY_SIZE reports are kept.
+#define TEMP_AUTOREPORT_INTERVAL 1
+#define TEMP_HISTORY_SIZE 600
+
 
 
 #endif /* MAIN_H_ */
@@ -0,0 +1,270 @@
+/*
+ * mesh.cc - Meshes of bed heights of any size.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "mesh.h"
+
+// Four floats which the compiler keeps in one vector register (SSE on x86, NEON on ARM). A plain loop
+// with a running minimum is not vectorised, as that could change the result when a value is NaN.
+typedef float ty_mesh_lanes __attribute__((vector_size(16)));
+
+/**
+ * Give a mesh another size. All points are invalid afterwards, the grid is spread evenly over the bed
+ * (MESH_MIN_X to MESH_MAX_X and MESH_MIN_Y to MESH_MAX_Y).
+ * @param mesh Mesh to size, empty or sized before
+ * @param size_x Points per row, 1 to MESH_MAX_SIZE
+ * @param size_y Rows, 1 to MESH_MAX_SIZE
+ * @return 0 when OK or -1 when the size is not supported
+ */
+int mesh_resize(ty_mesh *mesh, int size_x, int size_y) {
+	if(size_x < 1 || size_y < 1 || size_x > MESH_MAX_SIZE || size_y > MESH_MAX_SIZE) return -1;
+
+	// The points are only allocated again when the number changes
+	int words = (size_x * size_y + 31) / 32;
+	if(mesh->z == NULL || size_x * size_y != mesh_points(mesh)) {
+		delete[] mesh->z;
+		delete[] mesh->valid;
+		mesh->z = new float[size_x * size_y];
+		mesh->valid = new uint32_t[words];
+	}
+	mesh->size_x = size_x;
+	mesh->size_y = size_y;
+	mesh->min_x = MESH_MIN_X;
+	mesh->min_y = MESH_MIN_Y;
+	mesh->step_x = size_x > 1 ? (MESH_MAX_X - MESH_MIN_X) / (size_x - 1) : 0.0f;
+	mesh->step_y = size_y > 1 ? (MESH_MAX_Y - MESH_MIN_Y) / (size_y - 1) : 0.0f;
+
+	memset(mesh->z, 0, sizeof(float) * size_x * size_y);
+	memset(mesh->valid, 0, sizeof(uint32_t) * words);
+	return 0;
+}
+
+/**
+ * Copy a mesh, including its size
+ * @return 0 when OK or -1 on errors
+ */
+int mesh_copy(ty_mesh *dst, const ty_mesh *src) {
+	if(dst == src) return 0;
+	if(src->z == NULL) {
+		mesh_free(dst);
+		return 0;
+	}
+	if(mesh_resize(dst, src->size_x, src->size_y) < 0) return -1;
+	dst->min_x = src->min_x;
+	dst->min_y = src->min_y;
+	dst->step_x = src->step_x;
+	dst->step_y = src->step_y;
+	memcpy(dst->z, src->z, sizeof(float) * mesh_points(src));
+	memcpy(dst->valid, src->valid, sizeof(uint32_t) * mesh_words(src));
+	return 0;
+}
+
+/**
+ * Release the points of a mesh; the mesh is empty afterwards
+ */
+void mesh_free(ty_mesh *mesh) {
+	delete[] mesh->z;
+	delete[] mesh->valid;
+	mesh->z = NULL;
+	mesh->valid = NULL;
+	mesh->size_x = mesh->size_y = 0;
+}
+
+/**
+ * Find the next set bit in a bitset with a bit per point, to iterate over the points of a mesh:
+ * for(int i = mesh_bit_next(bits, n, 0); i >= 0; i = mesh_bit_next(bits, n, i + 1))
+ * @param bits The bitset, 32 points per word
+ * @param count Number of points
+ * @param from First point to look at
+ * @return The index of the point or -1 when there are no more
+ */
+int mesh_bit_next(const uint32_t *bits, int count, int from) {
+	if(from >= count) return -1;
+	// Skip the bits before from in its word, then whole words at a time
+	uint32_t word = bits[from / 32] & (~0u << (from % 32));
+	for(int w = from / 32; ; ) {
+		if(word != 0) {
+			int i = w * 32 + __builtin_ctz(word);
+			return i < count ? i : -1;
+		}
+		if(++w * 32 >= count) return -1;
+		word = bits[w];
+	}
+}
+
+/**
+ * Count the points of a mesh which have a value
+ */
+int mesh_count_valid(const ty_mesh *mesh) {
+	int count = 0;
+	for(int w=0; w<mesh_words(mesh); w++) count += __builtin_popcount(mesh->valid[w]);
+	return count;
+}
+
+/**
+ * Lowest, highest and average point of a mesh, of the points which have a value
+ * @param stats Filled with the result
+ */
+void mesh_stats(const ty_mesh *mesh, ty_mesh_stats *stats) {
+	// The running minimum, maximum and sum are kept in vectors of 4 lanes which are combined at the end
+	ty_mesh_lanes lo = { INFINITY, INFINITY, INFINITY, INFINITY };
+	ty_mesh_lanes hi = { -INFINITY, -INFINITY, -INFINITY, -INFINITY };
+	ty_mesh_lanes sum = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+	int valid = 0;
+	for(int w=0; w<mesh_words(mesh); w++) {
+		uint32_t bits = mesh->valid[w];
+		const float *z = &mesh->z[w * 32];
+		if(bits == ~0u) {
+			// All 32 points have a value (bits past the end of the mesh are never set)
+			for(int k=0; k<32; k+=4) {
+				ty_mesh_lanes v;
+				memcpy(&v, &z[k], sizeof(v));
+				lo = v < lo ? v : lo;
+				hi = v > hi ? v : hi;
+				sum += v;
+			}
+			valid += 32;
+		} else {
+			for(; bits != 0; bits &= bits - 1) {
+				float v = z[__builtin_ctz(bits)];
+				lo[0] = v < lo[0] ? v : lo[0];
+				hi[0] = v > hi[0] ? v : hi[0];
+				sum[0] += v;
+				valid++;
+			}
+		}
+	}
+
+	stats->valid = valid;
+	stats->min = stats->max = stats->mean = 0.0f;
+	if(valid == 0) return;
+	double total = 0.0;
+	stats->min = lo[0];
+	stats->max = hi[0];
+	for(int l=0; l<4; l++) {
+		if(lo[l] < stats->min) stats->min = lo[l];
+		if(hi[l] > stats->max) stats->max = hi[l];
+		total += sum[l];
+	}
+	stats->mean = total / valid;
+}
+
+/**
+ * Find the points in which two meshes of the same size differ: one has a value and the other does not,
+ * or both have a value and they are more than tolerance apart
+ * @param changed Bitset of mesh_words() words, filled with a bit per point which differs; NULL when not needed
+ * @return The number of points which differ or -1 when the meshes differ in size
+ */
+int mesh_diff(const ty_mesh *a, const ty_mesh *b, float tolerance, uint32_t *changed) {
+	if(a->size_x != b->size_x || a->size_y != b->size_y) return -1;
+
+	int points = mesh_points(a), count = 0;
+	for(int w=0; w<mesh_words(a); w++) {
+		const float *za = &a->z[w * 32], *zb = &b->z[w * 32];
+		int n = points - w * 32 < 32 ? points - w * 32 : 32;
+		// Compare the heights of all points of the word without branches, then mask with the valid bits
+		uint32_t apart = 0;
+		for(int k=0; k<n; k++) apart |= (uint32_t)(fabsf(za[k] - zb[k]) > tolerance) << k;
+		uint32_t diff = (a->valid[w] ^ b->valid[w]) | (a->valid[w] & b->valid[w] & apart);
+		if(changed != NULL) changed[w] = diff;
+		count += __builtin_popcount(diff);
+	}
+	return count;
+}
+
+/**
+ * Round all points of a mesh to a fraction of a millimetre, for example to what the printer stores
+ * @param scale Steps per millimetre, 1000 rounds to thousandths
+ */
+void mesh_round(ty_mesh *mesh, float scale) {
+	int points = mesh_points(mesh);
+	for(int i=0; i<points; i++) mesh->z[i] = roundf(mesh->z[i] * scale) / scale;
+}
+
+/**
+ * Start parsing a mesh in CSV
+ */
+void mesh_csv_init(ty_mesh_csv *csv) {
+	csv->z.clear();
+	csv->size_x = 0;
+	csv->rows = 0;
+	csv->error = 0;
+}
+
+/**
+ * Test for a separator between the points of a row
+ */
+static bool mesh_csv_separator(char c) {
+	return c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Parse a line of a mesh in CSV. Lines which are not a row of numbers (the title of the report, empty
+ * lines) are skipped.
+ * @param line The line, null-terminated; a line ending is allowed
+ */
+void mesh_csv_line(ty_mesh_csv *csv, const char *line) {
+	float row[MESH_MAX_SIZE];
+	int n = 0;
+
+	if(csv->error) return;
+	for(const char *p = line; *p != 0x0; ) {
+		if(mesh_csv_separator(*p)) {
+			p++;
+			continue;
+		}
+		// Anything but a number (nan included) means this is not a row of the mesh
+		char *end;
+		float z = strtof(p, &end);
+		if(end == p || (*end != 0x0 && !mesh_csv_separator(*end))) return;
+		if(n == MESH_MAX_SIZE) {
+			csv->error = 4;
+			return;
+		}
+		row[n++] = z;
+		p = end;
+	}
+	// A single number is not a row, UBL meshes have at least 2 points per row
+	if(n < 2) return;
+
+	if(csv->size_x == 0) csv->size_x = n;
+	if(n != csv->size_x) {
+		csv->error = 3;
+		return;
+	}
+	if(csv->rows == MESH_MAX_SIZE) {
+		csv->error = 4;
+		return;
+	}
+	csv->z.insert(csv->z.end(), row, row + n);
+	csv->rows++;
+}
+
+/**
+ * Size a mesh to the rows parsed and fill it
+ * @return 0 when OK, 1 when no rows were found, 3 when the rows have different numbers of points or 4
+ * when the mesh has more than MESH_MAX_SIZE rows or columns
+ */
+int mesh_csv_finish(ty_mesh_csv *csv, ty_mesh *mesh) {
+	if(csv->error) return csv->error;
+	if(csv->rows == 0) return 1;
+	if(mesh_resize(mesh, csv->size_x, csv->rows) < 0) return 4;
+
+	// The first row is the back of the bed
+	for(int row=0; row<csv->rows; row++) {
+		for(int x=0; x<csv->size_x; x++) {
+			float z = csv->z[row * csv->size_x + x];
+			if(!isnan(z)) mesh_set(mesh, mesh_index(mesh, x, csv->rows - row - 1), z);
+		}
+	}
+	return 0;
+}
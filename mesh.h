@@ -0,0 +1,190 @@
+/*
+ * mesh.h - Meshes of bed heights of any size. The size of a UBL mesh is set when the firmware of the
+ * printer is built (GRID_MAX_POINTS_X/Y), so it is not known until a mesh is downloaded from the printer;
+ * the points are allocated for the size of the mesh at hand.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef MESH_H_
+#define MESH_H_
+
+#include <stdint.h>
+#include <vector>
+
+// A mesh is kept as a structure of arrays: the X and Y of the points follow from the grid, the heights are
+// one contiguous array and which points have a value is a bitset, 32 points per word. Loops over all points
+// only touch the data they need and the compiler can vectorise them; a point takes 4 bytes and a bit.
+typedef struct {
+	int size_x;				// Points per row (I)
+	int size_y;				// Rows (J)
+	float min_x, min_y;		// Location of the first point (I=0, J=0) on the bed
+	float step_x, step_y;	// Distance between two points in a row and between two rows
+	float *z;				// size_x * size_y offsets from the Z home point, row by row from the front of the bed (J=0)
+	uint32_t *valid;		// Bit i is set when point i has a value; the z of the other points means nothing
+} ty_mesh;
+
+// An empty mesh, to initialise a ty_mesh with before it is sized
+#define MESH_EMPTY { 0, 0, 0.0f, 0.0f, 0.0f, 0.0f, NULL, NULL }
+
+// Summary of the points of a mesh which have a value
+typedef struct {
+	int valid;				// Points with a value; the others are 0 when there are none
+	float min, max;			// Lowest and highest point
+	float mean;				// Average of the points
+} ty_mesh_stats;
+
+// Rows of a mesh in CSV, as G29 T1 reports them: the back row of the bed first, the points separated by
+// commas, spaces or tabs and nan for the points without a value. The rows are parsed one line at a time
+// as they arrive and only the numbers are kept, so the text of the whole mesh is never needed at once.
+typedef struct {
+	std::vector<float> z;	// Points of the rows parsed so far, in the order of the lines
+	int size_x;				// Points per row, 0 until the first row
+	int rows;				// Rows parsed so far
+	int error;				// 0, 3 when a row has another number of points than the first or 4 when the mesh is too big
+} ty_mesh_csv;
+
+/**
+ * Number of points of a mesh
+ */
+static inline int mesh_points(const ty_mesh *mesh) {
+	return mesh->size_x * mesh->size_y;
+}
+
+/**
+ * Number of words in a bitset with a bit per point of a mesh, such as mesh->valid
+ */
+static inline int mesh_words(const ty_mesh *mesh) {
+	return (mesh_points(mesh) + 31) / 32;
+}
+
+/**
+ * Index of a point in a mesh
+ * @param x Column (I), 0 is the left of the bed
+ * @param y Row (J), 0 is the front of the bed
+ */
+static inline int mesh_index(const ty_mesh *mesh, int x, int y) {
+	return y * mesh->size_x + x;
+}
+
+/**
+ * X location of point i of a mesh
+ */
+static inline float mesh_x(const ty_mesh *mesh, int i) {
+	return mesh->min_x + (i % mesh->size_x) * mesh->step_x;
+}
+
+/**
+ * Y location of point i of a mesh
+ */
+static inline float mesh_y(const ty_mesh *mesh, int i) {
+	return mesh->min_y + (i / mesh->size_x) * mesh->step_y;
+}
+
+/**
+ * Test if point i of a mesh has a value
+ */
+static inline bool mesh_valid(const ty_mesh *mesh, int i) {
+	return (mesh->valid[i / 32] >> (i % 32)) & 1;
+}
+
+/**
+ * Mark point i of a mesh as having a value or not; its Z is left alone
+ */
+static inline void mesh_set_valid(ty_mesh *mesh, int i, bool valid) {
+	if(valid) mesh->valid[i / 32] |= 1u << (i % 32);
+	else      mesh->valid[i / 32] &= ~(1u << (i % 32));
+}
+
+/**
+ * Give point i of a mesh a value
+ */
+static inline void mesh_set(ty_mesh *mesh, int i, float z) {
+	mesh->z[i] = z;
+	mesh_set_valid(mesh, i, true);
+}
+
+/**
+ * Find the next set bit in a bitset with a bit per point, to iterate over the points of a mesh:
+ * for(int i = mesh_bit_next(bits, n, 0); i >= 0; i = mesh_bit_next(bits, n, i + 1))
+ * @param bits The bitset, 32 points per word
+ * @param count Number of points
+ * @param from First point to look at
+ * @return The index of the point or -1 when there are no more
+ */
+int mesh_bit_next(const uint32_t *bits, int count, int from);
+
+/**
+ * Find the next point of a mesh which has a value, see mesh_bit_next()
+ */
+static inline int mesh_next_valid(const ty_mesh *mesh, int from) {
+	return mesh_bit_next(mesh->valid, mesh_points(mesh), from);
+}
+
+/**
+ * Give a mesh another size. All points are invalid afterwards, the grid is spread evenly over the bed
+ * (MESH_MIN_X to MESH_MAX_X and MESH_MIN_Y to MESH_MAX_Y).
+ * @param mesh Mesh to size, empty or sized before
+ * @param size_x Points per row, 1 to MESH_MAX_SIZE
+ * @param size_y Rows, 1 to MESH_MAX_SIZE
+ * @return 0 when OK or -1 when the size is not supported
+ */
+int mesh_resize(ty_mesh *mesh, int size_x, int size_y);
+
+/**
+ * Copy a mesh, including its size
+ * @return 0 when OK or -1 on errors
+ */
+int mesh_copy(ty_mesh *dst, const ty_mesh *src);
+
+/**
+ * Count the points of a mesh which have a value
+ */
+int mesh_count_valid(const ty_mesh *mesh);
+
+/**
+ * Lowest, highest and average point of a mesh, of the points which have a value
+ * @param stats Filled with the result
+ */
+void mesh_stats(const ty_mesh *mesh, ty_mesh_stats *stats);
+
+/**
+ * Find the points in which two meshes of the same size differ: one has a value and the other does not,
+ * or both have a value and they are more than tolerance apart
+ * @param changed Bitset of mesh_words() words, filled with a bit per point which differs; NULL when not needed
+ * @return The number of points which differ or -1 when the meshes differ in size
+ */
+int mesh_diff(const ty_mesh *a, const ty_mesh *b, float tolerance, uint32_t *changed);
+
+/**
+ * Round all points of a mesh to a fraction of a millimetre, for example to what the printer stores
+ * @param scale Steps per millimetre, 1000 rounds to thousandths
+ */
+void mesh_round(ty_mesh *mesh, float scale);
+
+/**
+ * Release the points of a mesh; the mesh is empty afterwards
+ */
+void mesh_free(ty_mesh *mesh);
+
+/**
+ * Start parsing a mesh in CSV
+ */
+void mesh_csv_init(ty_mesh_csv *csv);
+
+/**
+ * Parse a line of a mesh in CSV. Lines which are not a row of numbers (the title of the report, empty
+ * lines) are skipped.
+ * @param line The line, null-terminated; a line ending is allowed
+ */
+void mesh_csv_line(ty_mesh_csv *csv, const char *line);
+
+/**
+ * Size a mesh to the rows parsed and fill it
+ * @return 0 when OK, 1 when no rows were found, 3 when the rows have different numbers of points or 4
+ * when the mesh has more than MESH_MAX_SIZE rows or columns
+ */
+int mesh_csv_finish(ty_mesh_csv *csv, ty_mesh *mesh);
+
+#endif /* MESH_H_ */
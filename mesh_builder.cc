@@ -14,9 +14,12 @@
 #include "machine.h"
 #include "utility.h"
 #include "tui.h"
+#include "serial_thread.h"
+#include "temperature.h"
+#include "serial_stats.h"
 
-// Mesh points
-ty_meshpoint mesh [MESH_SIZE_Y][MESH_SIZE_X];
+// Mesh points; the mesh takes the size of the printer's mesh when it is downloaded
+ty_mesh mesh = MESH_EMPTY;
 
 int mesh_builder_stepsize = 0;			// Step size for lowering or raising the head
 
@@ -47,7 +50,7 @@ void mesh_builder_destroy_win(WINDOW *local_win)
 
 void mesh_builder_print_status_bar(int row, int stepsize) {
 	//const char *banner = "[AWSD] Move mesh point [F2] Fill Row [F3] Fill Column [F4] Fill All [Up/Down] Raise/lower head [Left/Right] Change step size: %s";
-	const char *banner = "[F5] Download mesh [F6] Upload mesh [F10] Quit [AWSD] Move mesh point [Up/Down] Raise/lower head [Left/Right] Change step size: %s";
+	const char *banner = "[F5] Download mesh [F6] Upload mesh [F7] Serial stats [F8] Quick stop [F10] Quit [AWSD] Move mesh point [Up/Down] Raise/lower head [Left/Right] Change step size: %s";
 	const char *step0 = "[1mm] 0.1mm 0.01mm";
 	const char *step1 = "1mm [0.1mm] 0.01mm";
 	const char *step2 = "1mm 0.1mm [0.01mm]";
@@ -67,23 +70,17 @@ int mesh_builder() {
 	float zraise = 0.0f;		// How far should the head be raised during moves from corner to corner?
 	float z_offset = 7.0f;		// The offset of the Z axis using G92, this allows us to get below the optoflag
 
-	double t_hotend = 0;		// Temperature of the hotend, periodically polled and printed in mesh overview
-	double t_bed = 0;			// Temperature of the bed, periodically polled and printed in mesh overview
+	double t_hotend = 0;		// Temperature of the hotend, taken from the temperature monitor and printed in mesh overview
+	double t_bed = 0;			// Temperature of the bed, taken from the temperature monitor and printed in mesh overview
+	unsigned long temp_seq = 0;	// Last temperature report shown
+	ty_temperature temp_report;
 
 	// Input loop variables
 	mesh_builder_stepsize = 1;	// 0 = 1mm, 1 = 0.1mm, 2 = 0.01mm
 	float step = 0.1f;
 
 	// Inititialize the mesh array so the X and Y coordinates of each mesh point are known
-	for (int y=0; y<MESH_SIZE_Y; y++) {
-		for (int x=0; x<MESH_SIZE_X; x++) {
-			mesh[y][x].valid = 0;
-
-			mesh[y][x].x = MESH_MIN_X + ((float)x * (MESH_MAX_X - MESH_MIN_X)) / (MESH_SIZE_X - 1);
-			mesh[y][x].y = MESH_MIN_Y + ((float)y * (MESH_MAX_Y - MESH_MIN_Y)) / (MESH_SIZE_Y - 1);
-			mesh[y][x].z = 0.0f;
-		}
-	}
+	if(mesh_resize(&mesh, MESH_SIZE_X, MESH_SIZE_Y) < 0) return -1;
 
 	// Start curses and all windows
 	tui_init(1, &mesh_builder_print_status_bar);
@@ -146,19 +143,28 @@ int mesh_builder() {
 	// Move Z up to whatever the movement height is
 	ASSERT(set_z(zraise+z_offset));
 	// Move to point (0,0) in the mesh
-	ASSERT(set_position(mesh[0][0].x,mesh[0][0].y,get_z(),0,xyspeed));
+	ASSERT(set_position(mesh_x(&mesh, 0),mesh_y(&mesh, 0),get_z(),0,xyspeed));
 
 	// Input loop
 	// Print the status bar
 	mesh_builder_print_status_bar(LINES-1, mesh_builder_stepsize);
 	wrefresh(overview_win);
 
-	// Set the timeout for getch() so the temperature gets updated every now and then
-	timeout(2000);
-
 	while(keepgoing) {
 		int update = 0; // Flag to trigger the mesh Z height to be updated and the mesh overview refreshed
 
+		// Set the timeout for getch() so the temperature gets updated every now and then, and the head
+		// follows the arrow keys while jogging
+		timeout(jog_active() ? JOG_POLL : TEMP_AUTOREPORT_INTERVAL * 1000);
+
+		// Show the latest temperature report once it has arrived
+		if(temp_latest(&temp_report, &temp_seq)) {
+			serial_thread_flush_log();
+			t_hotend = temp_report.hotend;
+			t_bed = temp_report.bed;
+			update = 1;
+		}
+
 		if(mesh_builder_stepsize < 0 || mesh_builder_stepsize > 2) {
 			wprintw(cmd_win,"Invalid step size detected: %i\n", mesh_builder_stepsize);
 			goto stop;
@@ -174,9 +180,14 @@ int mesh_builder() {
 
 		switch(ch) {
 		case ERR:
-			// Timeout on input loop, update temperature
-			ASSERT(get_temperature(&t_hotend, &t_bed));
-			update = 1;
+			// Timeout on input loop; the temperature monitor is updated by the printer itself. When the printer
+			// does not report by itself, ask for a report (in the background when the I/O thread is running).
+			if(jog_active() || temp_autoreport_active()) break;
+			if(serial_thread_active()) {
+				if(serial_thread_pending() == 0) serial_submit("M105\n", NULL, NULL, false);
+			} else {
+				ASSERT(get_temperature(&t_hotend, &t_bed));
+			}
 			break;
 		case 'q': // Quit the control loop
 			wprintw(cmd_win,"Hint: to quit, press F10 (instead of Q)\n");
@@ -212,31 +223,33 @@ int mesh_builder() {
 			mesh_builder_print_status_bar(LINES-1, mesh_builder_stepsize);
 			break;
 		case KEY_DOWN: {
-			float z = get_z();
+			// Key repeats are merged into one target, which the head follows without lagging behind
+			float z = get_z_target();
 			z -= step;
 			if(z < 0) {
 				wprintw(cmd_win,"Warning: could not lower toolhead further, switch to a smaller step size\n");
 			} else {
 				// Lower the head
 				wprintw(cmd_win,"Setting Z to %.2f\n", z-z_offset);
-				ASSERT(set_z(z,0,MAX_SPEED_Z));
+				ASSERT(jog_z(-step,MAX_SPEED_Z));
 			}}
 			// Toolhead moved, mark this point now as valid
-			if(!mesh[y_pos][x_pos].valid) mesh[y_pos][x_pos].valid = 1;
+			mesh_set_valid(&mesh, mesh_index(&mesh, x_pos, y_pos), true);
 			update = 1; // Update the mesh state
 			break;
 		case KEY_UP: {
-			float z = get_z();
+			// Key repeats are merged into one target, which the head follows without lagging behind
+			float z = get_z_target();
 			z += step;
 			if(z > 50.0f) {
 				wprintw(cmd_win,"Warning: could not raise toolhead further, switch to a smaller step size\n");
 			} else {
 				// Raise the head
 				wprintw(cmd_win,"Setting Z to %.2f\n", z-z_offset);
-				ASSERT(set_z(z,0,MAX_SPEED_Z));
+				ASSERT(jog_z(step,MAX_SPEED_Z));
 			}}
 			// Toolhead moved, mark this point now as valid
-			if(!mesh[y_pos][x_pos].valid) mesh[y_pos][x_pos].valid = 1;
+			mesh_set_valid(&mesh, mesh_index(&mesh, x_pos, y_pos), true);
 			update = 1; // Update the mesh state
 			break;
 		case 'a':
@@ -248,14 +261,14 @@ int mesh_builder() {
 			break;
 		case 'd':
 			// Move 'right' on the mesh selection
-			if(x_sel < MESH_SIZE_X-1) {
+			if(x_sel < mesh.size_x-1) {
 				x_sel++;
 				update = 1; // Update the mesh state
 			}
 			break;
 		case 'w':
 			// Move 'up' on the mesh selection
-			if(y_sel < MESH_SIZE_Y-1) {
+			if(y_sel < mesh.size_y-1) {
 				y_sel++;
 				update = 1; // Update the mesh state
 			}
@@ -271,16 +284,18 @@ int mesh_builder() {
 			// Enter key - switch selection
 			if(x_sel != x_pos || y_sel != y_pos) {
 				// Selection changed - get the current Z and store it (relatively to the Z end-stop, which was shifted up by z_offset)
-				mesh[y_pos][x_pos].z = get_z() - z_offset;
+				ASSERT(jog_stop());
+				mesh.z[mesh_index(&mesh, x_pos, y_pos)] = get_z() - z_offset;
 
 				// Update position to selection
 				x_pos = x_sel;
 				y_pos = y_sel;
-				wprintw(cmd_win, "Moving to mesh point (%i,%i) @ (%.1f,%.1f)\n", x_pos, y_pos, mesh[y_pos][x_pos].x, mesh[y_pos][x_pos].y);
+				int p = mesh_index(&mesh, x_pos, y_pos);
+				wprintw(cmd_win, "Moving to mesh point (%i,%i) @ (%.1f,%.1f)\n", x_pos, y_pos, mesh_x(&mesh, p), mesh_y(&mesh, p));
 				// Raise Z and move to new position
 				set_z(zraise+z_offset);
-				set_position(mesh[y_pos][x_pos].x,mesh[y_pos][x_pos].y,get_z(),0,xyspeed);
-				set_z(mesh[y_pos][x_pos].z+z_offset);
+				set_position(mesh_x(&mesh, p),mesh_y(&mesh, p),get_z(),0,xyspeed);
+				set_z(mesh.z[p]+z_offset);
 
 				// Update the overview
 				mesh_builder_print_mesh_status(overview_win, y_pos, x_pos, y_sel, x_sel, t_hotend, t_bed);
@@ -296,18 +311,24 @@ int mesh_builder() {
 				if(!utility_ask_int(cmd_win, "Which mesh should be loaded from printer EEPROM? Use -1 to use the currently active mesh instead.", &zoi, -1, -1, 20, 1)) goto stop;
 
 				// Download mesh from printer
-				if((errcode = mesh_download(zoi, mesh, cmd_win))) {
+				if((errcode = mesh_download(zoi, &mesh, cmd_win))) {
 					if(errcode == 1) {
-						wprintw(cmd_win, "ERROR: No valid CSV line found in first 4kB of mesh response!\n");
+						wprintw(cmd_win, "ERROR: No valid CSV line found in the mesh response!\n");
 					} else if(errcode == 3) {
-						wprintw(cmd_win, "ERROR: Incorrect number of columns (X points) found! Expected: %i\n", MESH_SIZE_X);
-					} if(errcode == 4) {
-						wprintw(cmd_win, "ERROR: Incorrect number of rows (Y points) found! Expected: %i\n", MESH_SIZE_Y);
+						wprintw(cmd_win, "ERROR: The rows of the mesh have different numbers of points!\n");
+					} else if(errcode == 4) {
+						wprintw(cmd_win, "ERROR: The mesh has more than %i rows or columns!\n", MESH_MAX_SIZE);
 					} else {
 						wprintw(cmd_win, "ERROR: Unknown error during download: %i\n", errcode);
 					}
 				} else {
 					wprintw(cmd_win, "Downloaded mesh successfully\n");
+					// The mesh has the size of the printer's mesh now
+					if(x_pos >= mesh.size_x) x_pos = mesh.size_x - 1;
+					if(y_pos >= mesh.size_y) y_pos = mesh.size_y - 1;
+					if(x_sel >= mesh.size_x) x_sel = mesh.size_x - 1;
+					if(y_sel >= mesh.size_y) y_sel = mesh.size_y - 1;
+					tui_set_overview_lines(mesh.size_y);
 				}
 
 				// Redraw the mesh overview
@@ -318,8 +339,8 @@ int mesh_builder() {
 				if(!utility_ask_bool(cmd_win, "Mesh loaded; move toolhead to loaded Z position?", &ans, false)) goto stop;
 				if(ans) {
 					// Move to current Z height in mesh
-					wprintw(cmd_win,"Setting Z to %.2f\n", mesh[y_pos][x_pos].z);
-					ASSERT(set_z(mesh[y_pos][x_pos].z+z_offset));
+					wprintw(cmd_win,"Setting Z to %.2f\n", mesh.z[mesh_index(&mesh, x_pos, y_pos)]);
+					ASSERT(set_z(mesh.z[mesh_index(&mesh, x_pos, y_pos)]+z_offset));
 				} else {
 					wprintw(cmd_win,"Not moving current Z height; downloaded mesh point updated\n");
 				}
@@ -336,13 +357,31 @@ int mesh_builder() {
 				if(!utility_ask_int(cmd_win, "Which mesh slot should the mesh be saved into printer EEPROM? Use -1 to only upload.", &zoi, -1, -1, 20, 1)) goto stop;
 
 				// Upload mesh from printer
-				if((errcode = mesh_upload(zoi, mesh, cmd_win))) {
+				if((errcode = mesh_upload(zoi, &mesh, cmd_win))) {
 					wprintw(cmd_win, "ERROR: Unknown error during download: %i\n", errcode);
 				} else {
 					wprintw(cmd_win, "Uploaded mesh successfully\n");
 				}
 			}
 			break;
+		case KEY_F7:
+			// Show the traffic counters and the command latencies so far
+			serial_stats_print(cmd_win);
+			break;
+		case KEY_F8:
+			{
+				// Abort all moves right away; Ctrl-\ does the same with M112 while a command is running
+				ty_estop_report r;
+				char desc[128];
+				if(serial_emergency(SERIAL_ESTOP_QUICK, &r) == 0) {
+					serial_emergency_describe(&r, desc, sizeof(desc));
+					wprintw(cmd_win, "Quick stop: %s\n", desc);
+					// M410 leaves the printer with the position where the steppers stopped, read it back
+					forget_pos();
+					if(get_pos() == 0) update = 1;
+				}
+			}
+			break;
 		case 410:
 			// Resize event
 			tui_resize();
@@ -351,10 +390,16 @@ int mesh_builder() {
 			wprintw(cmd_win,"Invalid key: %i\n", ch);
 		}
 
+		// Stream the jog moves; once the jog has ended the mesh point takes the Z where the head stopped
+		if(jog_active()) {
+			ASSERT(jog_update());
+			if(!jog_active()) update = 1;
+		}
+
 		// Update the mesh if requested
 		if (update) {
 			// Get the current Z and store it in the mesh (so the view will update)
-			mesh[y_pos][x_pos].z = get_z() - z_offset;
+			mesh.z[mesh_index(&mesh, x_pos, y_pos)] = get_z() - z_offset;
 			// Re-print the overview
 			mesh_builder_print_mesh_status(overview_win, y_pos, x_pos, y_sel, x_sel, t_hotend, t_bed);
 		}
@@ -389,17 +434,18 @@ stop:
  */
 void mesh_builder_print_mesh_status(WINDOW *wnd, int y, int x, int y_sel, int x_sel, double t_hotend, double t_bed) {
 	wprintw(wnd, "\nMesh size (X*Y): %i x %i - Bounds (mm): (%0.2f, %0.2f) x (%0.2f, %0.2f) - Hotend: %.02f °C - Bed: %.02f °C\n",
-			MESH_SIZE_X, MESH_SIZE_Y, MESH_MIN_X, MESH_MIN_Y, MESH_MAX_X, MESH_MAX_Y, t_hotend, t_bed);
+			mesh.size_x, mesh.size_y, MESH_MIN_X, MESH_MIN_Y, MESH_MAX_X, MESH_MAX_Y, t_hotend, t_bed);
 
-	for (int yy = MESH_SIZE_Y - 1; yy >= 0; yy--) {
-		for (int xx = 0; xx < MESH_SIZE_X; xx++) {
-			if(mesh[yy][xx].valid) {
+	for (int yy = mesh.size_y - 1; yy >= 0; yy--) {
+		for (int xx = 0; xx < mesh.size_x; xx++) {
+			int p = mesh_index(&mesh, xx, yy);
+			if(mesh_valid(&mesh, p)) {
 				if(x == xx && y == yy)
-					wprintw(wnd, "[%6.2f] ", mesh[yy][xx].z);
+					wprintw(wnd, "[%6.2f] ", mesh.z[p]);
 				else if(x_sel == xx && y_sel == yy)
-					wprintw(wnd, "<%6.2f> ", mesh[yy][xx].z);
+					wprintw(wnd, "<%6.2f> ", mesh.z[p]);
 				else
-					wprintw(wnd, " %6.2f  ", mesh[yy][xx].z);
+					wprintw(wnd, " %6.2f  ", mesh.z[p]);
 			} else {
 				if(x == xx && y == yy)
 					wprintw(wnd, "  [ * ]  ");
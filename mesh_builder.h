@@ -8,6 +8,8 @@
 #ifndef MESH_BUILDER_H_
 #define MESH_BUILDER_H_
 
+#include "mesh.h"
+
 
 //#define KEY_DOWN 258
 //#define KEY_UP 259
@@ -26,14 +28,6 @@
 #define KEY_F11 275
 #define KEY_F12 276
 
-typedef struct {
-	float x;	  // X location of the mesh point
-	float y;	  // Y location of the mesh point
-
-	float z;	  // Offset from the Z home point, always negative if the bed is below the home point
-
-	int   valid;  // Mark which points have been filled as valid
-} ty_meshpoint;
 
 
 int mesh_builder();
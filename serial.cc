@@ -13,9 +13,21 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <ctype.h>
+#include <atomic>
 #include "main.h"
 #include "serial.h"
+#include "line_framer.h"
+#include "serial_thread.h"
+#include "serial_router.h"
+#include "serial_conn.h"
+#include "serial_stats.h"
+#include "serial_baud.h"
+#include "transcript.h"
 
 #include <curses.h>
 extern WINDOW *serial_win;
@@ -27,17 +39,103 @@ bool serial_ena_output = true;		// Utility switch to silence serial I/O
 #define message(...) { if(serial_ena_output) { if(serial_win==NULL) printf(__VA_ARGS__); \
 						else { wprintw(serial_win, __VA_ARGS__); wrefresh(serial_win); }}}
 
-int serial_fd = 0;
+ty_serial_conn *serial_conns[SERIAL_MAX_CONNECTIONS];	// All connected printers
+ty_serial_conn *serial_default = NULL;	// Connection used when a function is called without one
+std::mutex serial_conns_mutex;			// Protects the connection table
+int serial_baud_rate = SERIAL_DEFAULT_BAUD;	// Baud rate for the printers opened from now on
+bool serial_attach_mode = false;		// Attach to running printers instead of resetting them
+int serial_latency_ms = 0;				// Latency timer for the USB serial adapters opened from now on, 0 to leave them alone
+std::atomic<unsigned int> serial_sessions(0);	// Source of the session numbers of the connections
+
+// Time the printer gets to acknowledge a command per class, in milliseconds
+std::atomic<int> serial_timeouts[SERIAL_CLASSES] = { SERIAL_TIMEOUT_QUICK, SERIAL_TIMEOUT_DEFAULT, SERIAL_TIMEOUT_LONG, SERIAL_TIMEOUT_HEATING };
+
+/**
+ * Resolve a connection handle: NULL stands for the default connection.
+ * @return The connection or NULL (after printing an error) when no port is open
+ */
+ty_serial_conn *serial_conn_get(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	if(conn == NULL || conn->fd <= 0) {
+		error_message("error: serial port not open\n");
+		return NULL;
+	}
+	return conn;
+}
+
+/**
+ * Read from the serial port into the line framer of a connection with a single read() call and add the
+ * bytes to the transcript when recording.
+ * @return The number of bytes read, 0 when the stream was closed or a negative value on errors
+ * (errno is set by read())
+ */
+int serial_fill(ty_serial_conn *conn) {
+	int br = framer_fill(&conn->rx, conn->fd);
+	// A single read never wraps around the end of the ring
+	if(br > 0) transcript_rx(conn, &conn->rx.buf[(conn->rx.tail - br) % FRAMER_RING_SIZE], br);
+	return br;
+}
+
+/**
+ * Read the next line from the printer, blocking until a complete line has been received. While the
+ * port is opened again (serial_reconnect(), also run for the I/O threads) nothing is printed and
+ * serial_cancel() is left to the commands: it does not abort the reconnect.
+ * @param line View to fill with the line, valid until the next read from the printer
+ * @param deadline Time to give up (serial_stats_now())
+ * @return 0 when OK, SERIAL_ERR_TIMEOUT, SERIAL_ERR_CANCELLED or a negative error code otherwise
+ */
+int serial_readline(ty_serial_conn *conn, ty_line *line, uint64_t deadline) {
+	while(!framer_next(&conn->rx, line)) {
+		// Wait for data, the deadline or serial_cancel()
+		uint64_t now = serial_stats_now();
+		if(now >= deadline) return SERIAL_ERR_TIMEOUT;
+		struct timespec left;
+		left.tv_sec = (deadline - now) / 1000000000ull;
+		left.tv_nsec = (deadline - now) % 1000000000ull;
+
+		struct pollfd fds[2];
+		fds[0].fd = conn->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = conn->cancel_fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		int n = ppoll(fds, conn->reconnecting ? 1 : 2, &left, NULL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) {
+			if(!conn->reconnecting) error_message("error: poll failed: %s (%i)\n", strerror (errno), errno);
+			return -1;
+		}
+		if(n == 0) return SERIAL_ERR_TIMEOUT;
+		if(fds[1].revents & POLLIN) {
+			uint64_t v;
+			read(conn->cancel_fd, &v, sizeof(v));
+			return SERIAL_ERR_CANCELLED;
+		}
+
+		int br = serial_fill(conn);
+		if(br <= 0) {
+			// The port was lost again while it is opened again; the reconnect reports it
+			if(conn->reconnecting) return -1;
+			if(br == 0) {
+				error_message("error: stream closed during read\n");
+			} else {
+				error_message("error while reading from port: %s (%i)\n", strerror (errno), errno);
+			}
+			// The port of a USB printer disappears for a moment on a glitch; the printer keeps its state
+			if(serial_reconnect(conn) == 0) {
+				message("Reconnected to %s\n", conn->port);
+				return SERIAL_ERR_RECONNECTED;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
 
 // http://stackoverflow.com/questions/6947413/how-to-open-read-and-write-from-serial-port-in-c
 // http://www.easysw.com/~mike/serial/serial.html#3_1_1
 // https://support.dce.felk.cvut.cz/pos/cv5/doc/serial.html
 int set_interface_attribs(int fd, int speed, int parity) {
-	if(DEMO_MODE) {
-		// Demo mode - pretend we set attributes
-		return 0;
-	}
-
 	struct termios tty;
 	memset(&tty, 0, sizeof tty);
 
@@ -87,40 +185,31 @@ int set_interface_attribs(int fd, int speed, int parity) {
 /**
  * Set DTR (Data Transfer Ready) to low and high again - this simulates a modem
  * hangup and should power cycle the printer on the other end.
- * Note: when the demo mode is enabled, this call does nothing
  */
-void set_reset_dtr() {
+void set_reset_dtr(ty_serial_conn *conn) {
 	int status = 0;
 
-	if(DEMO_MODE) {
-		// Demo mode - pretend we do a reset
-		return;
-	}
+	if((conn = serial_conn_get(conn)) == NULL) return;
 
 	// Fetch the status from the file descriptor
-    ioctl(serial_fd, TIOCMGET, &status);
+    ioctl(conn->fd, TIOCMGET, &status);
     // Mask the DTR bit so DTR will get low
     status &= ~TIOCM_DTR;
-    ioctl(serial_fd, TIOCMSET, &status);
+    ioctl(conn->fd, TIOCMSET, &status);
 
     // Wait...
     usleep(10000);
 
     // Set the DTR bit high again
     status |= TIOCM_DTR;
-    ioctl(serial_fd, TIOCMSET, &status);
+    ioctl(conn->fd, TIOCMSET, &status);
 }
 
 /**
  * When enabling blocking, a read() on the serial port (terminal) will block until
  * data is available.
- * Note: when the demo mode is enabled, this call does nothing
  */
 void set_blocking(int fd, int should_block) {
-	if(DEMO_MODE) {
-		// Demo mode - pretend we set attributes
-		return;
-	}
 	struct termios tty;
 	memset(&tty, 0, sizeof tty);
 	// Get terminal attributes
@@ -139,197 +228,764 @@ void set_blocking(int fd, int should_block) {
 }
 
 /**
- * Open the serial port to the printer
- * Note: when the demo mode is enabled, this call does nothing
+ * When enabled, DTR is dropped when the port is closed (HUPCL), which resets most printers. Disabled, the
+ * printer keeps running after the program exits and can be attached to on the next launch.
  */
-int serial_open() {
-	if(DEMO_MODE) {
-		// Demo mode - pretend we opened a port
-		return 0;
+void set_hangup(int fd, int hangup) {
+	struct termios tty;
+	memset(&tty, 0, sizeof tty);
+	if (tcgetattr(fd, &tty) != 0) {
+		error_message("error %d from tcgetattr\n", errno);
+		return;
+	}
+
+	if(hangup) tty.c_cflag |= HUPCL;
+	else tty.c_cflag &= ~HUPCL;
+
+	if (tcsetattr(fd, TCSANOW, &tty) != 0)
+		error_message("error %d setting term attributes\n", errno);
+}
+
+/**
+ * Test if the printer on a connection is running, without resetting it: M110 N0 restarts the line numbers
+ * and M115 has to be answered, both are sent with a single write. Whatever the printer sent before is
+ * discarded, as are 'ok's of commands sent before the probe. The lines of the reply go to the subscribers
+ * of the message router.
+ * @param timeout Time the printer gets to send its first line, in milliseconds; a printer which sends
+ * anything is running and gets the time of a query from each line it sends
+ * @return 0 when the printer answered or started, or a negative error code otherwise
+ */
+static int serial_probe(ty_serial_conn *conn, int timeout) {
+	static const char probe[] = "M110 N0\nM115\n";
+	const int len = sizeof(probe) - 1;
+
+	tcflush(conn->fd, TCIFLUSH);
+	framer_reset(&conn->rx);
+	uint64_t deadline = serial_stats_now() + (uint64_t)timeout * 1000000;
+	if(write(conn->fd, probe, len) != len) return -1;
+	serial_stats_tx(conn, len);
+	transcript_tx(conn, probe, len);
+
+	// The 'ok' after the firmware line of M115 is the last line of the probe
+	bool firmware = false;
+	while(1) {
+		ty_line line;
+		int res = serial_readline(conn, &line, deadline);
+		if(res < 0) return res;
+		// Opening the port reset the printer after all; the probe was lost while it booted
+		if(serial_route(conn, line.str) & SERIAL_MSG_START) break;
+		if(strncmp(line.str, "FIRMWARE_NAME", 13) == 0) firmware = true;
+		else if(firmware && strncasecmp(line.str, "ok", 2) == 0) break;
+		// A printer busy with a long command answers once it is done
+		deadline = serial_stats_now() + (uint64_t)serial_cmd_timeout("M115\n") * 1000000;
 	}
 
-	const char *portname = "/dev/ttyUSB0";
+	// The printer expects line 1 next and has no resend pending; when it missed M110 N0 it asks for a
+	// line which was not sent yet, which is answered with a numbered M110 (see transport_line())
+	conn->tx_line = 0;
+	conn->resend_line = -1;
+	conn->resend_ignore = 0;
+	conn->resend_error = 0;
+	conn->ok_swallow = 0;
+	conn->ok_late = 0;
+	conn->resync = true;
+	return 0;
+}
 
-	serial_fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-	if (serial_fd < 0) {
+/**
+ * Open the serial port to a printer, reset the printer and wait for it to start. In attach mode a
+ * printer which is running already is used as it is.
+ * @param portname Device of the printer, for example /dev/ttyUSB0 or the pty of the simulator
+ * @param baud Baud rate of the printer, 0 for the rate selected with serial_set_baud()
+ * @return The connection or NULL on errors
+ */
+ty_serial_conn *serial_connect(const char *portname, int baud) {
+	ty_serial_conn *conn = new ty_serial_conn();
+	conn->id = -1;
+	conn->caps = -1;
+	conn->session = ++serial_sessions;
+	conn->resend_line = -1;
+	conn->stream_window = SERIAL_STREAM_MAX_INFLIGHT;
+	conn->wake_fd = -1;
+	conn->timer_fd = -1;
+	conn->cancel_fd = -1;
+	snprintf(conn->port, sizeof(conn->port), "%s", portname);
+
+	// Claim a slot in the connection table
+	{
+		std::lock_guard<std::mutex> lock(serial_conns_mutex);
+		for(int i=0; i<SERIAL_MAX_CONNECTIONS && conn->id < 0; i++) {
+			if(serial_conns[i] == NULL) {
+				conn->id = i;
+				serial_conns[i] = conn;
+			}
+		}
+	}
+	if(conn->id < 0) {
+		error_message("error: more than %i printers connected\n", SERIAL_MAX_CONNECTIONS);
+		delete conn;
+		return NULL;
+	}
+
+	serial_stats_open(conn);
+
+	conn->fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
+	if (conn->fd < 0) {
 		error_message("error %d opening %s: %s\n", errno, portname, strerror (errno));
-		return -1;
+		conn->fd = 0;
+		serial_close(conn);
+		return NULL;
+	}
+
+	set_interface_attribs(conn->fd, B115200, 0);	// set speed to 115,200 bps, 8n1 (no parity)
+	set_blocking(conn->fd, 1);               		// set blocking
+	set_hangup(conn->fd, !serial_attach_mode);		// keep DTR up after closing when attaching
+	// termios stops at 115200 on most systems; the selected rate is set with termios2
+	if(serial_change_baud(baud > 0 ? baud : serial_baud_rate, conn) < 0) {
+		serial_close(conn);
+		return NULL;
+	}
+	// Not fatal: the printer works, only the round trips take longer
+	if(serial_latency_ms > 0) serial_tune_latency(serial_latency_ms, conn);
+	conn->cancel_fd = eventfd(0, EFD_NONBLOCK);
+	if(conn->cancel_fd < 0) {
+		error_message("error %d creating eventfd: %s\n", errno, strerror (errno));
+		serial_close(conn);
+		return NULL;
 	}
+	transcript_open(conn);
 
-	set_interface_attribs(serial_fd, B115200, 0);	// set speed to 115,200 bps, 8n1 (no parity)
-	set_blocking(serial_fd, 1);               		// set blocking
+	if(serial_attach_mode) {
+		uint64_t start = serial_stats_now();
+		if(serial_probe(conn, SERIAL_ATTACH_TIMEOUT) == 0) {
+			message("Serial port %s opened - attached to the running printer in %.0f ms\n", portname, (serial_stats_now() - start) / 1e6);
+			return conn;
+		}
+		message("Serial port %s opened - no answer from the printer, resetting it\n", portname);
+	}
 
 	// toggle the DTR line to trigger a reset at the printer (most hardware supports this)
-	set_reset_dtr();
+	set_reset_dtr(conn);
 
-	message("Serial port opened - waiting for printer to start\n");
-	serial_waitforok(false, 30); // Edit - ignore return code for printers not using 'OK' during restart
+	message("Serial port %s opened - waiting for printer to start\n", portname);
+	serial_waitforok(false, 30, conn); // Edit - ignore return code for printers not using 'OK' during restart
+	// A reset printer does not answer the commands sent before
+	conn->ok_late = 0;
+	return conn;
+}
+
+/**
+ * Open the serial port to the printer and use it as the default connection
+ * @param portname Device of the printer, for example /dev/ttyUSB0 or the pty of the simulator
+ * @param baud Baud rate of the printer, 0 for the rate selected with serial_set_baud()
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_open(const char *portname, int baud) {
+	ty_serial_conn *conn = serial_connect(portname, baud);
+	if(conn == NULL) return -1;
+	serial_default = conn;
 	return 0;
 }
 
-void serial_close() {
-	if(serial_fd > 0) {
-		close(serial_fd);
-		serial_fd = 0;
+/**
+ * Close the serial port of a printer and release the connection
+ */
+void serial_close(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	if(conn == NULL) return;
+
+	// Take the connection back from the I/O threads first
+	serial_thread_stop(conn);
+	if(conn->fd > 0) {
+		close(conn->fd);
+		conn->fd = 0;
+	}
+	if(conn->cancel_fd >= 0) close(conn->cancel_fd);
+
+	std::lock_guard<std::mutex> lock(serial_conns_mutex);
+	if(conn->id >= 0) serial_conns[conn->id] = NULL;
+	if(serial_default == conn) serial_default = NULL;
+	delete conn;
+}
+
+/**
+ * The default connection, NULL when no printer is connected
+ */
+ty_serial_conn *serial_default_conn() {
+	return serial_default;
+}
+
+/**
+ * Number of a connection (0 to SERIAL_MAX_CONNECTIONS-1), for example to keep state per printer
+ * @return The number or -1 when no printer is connected
+ */
+int serial_conn_id(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	return conn != NULL ? conn->id : -1;
+}
+
+/**
+ * Select the baud rate for the printers opened from now on
+ * @param baud Baud rate, any rate the serial driver supports
+ */
+void serial_set_baud(int baud) {
+	serial_baud_rate = baud;
+}
+
+/**
+ * Attach to the printers opened from now on instead of resetting them
+ * @param attach True to attach, false to reset the printers
+ */
+void serial_set_attach(bool attach) {
+	serial_attach_mode = attach;
+}
+
+bool serial_get_attach() {
+	return serial_attach_mode;
+}
+
+/**
+ * Tune the USB serial adapters of the printers opened from now on for short round trips
+ * @param latency_ms Latency timer in milliseconds, 0 to leave the adapters as they are
+ */
+void serial_set_latency(int latency_ms) {
+	serial_latency_ms = latency_ms;
+}
+
+/**
+ * Make the USB serial adapter of a printer send the replies to the host sooner
+ * @param latency_ms Latency timer in milliseconds (1 to 255)
+ * @return 0 when OK or -1 when the adapter refused a setting
+ */
+int serial_tune_latency(int latency_ms, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(serial_adapter_tune(conn->fd, conn->port, latency_ms) < 0) {
+		error_message("warning: could not tune the serial adapter of %s: %s\n", conn->port, strerror (errno));
+		return -1;
 	}
+	return 0;
+}
+
+/**
+ * Type and settings of the USB serial adapter of a printer
+ * @return 0 when OK or -1 otherwise
+ */
+int serial_conn_adapter(ty_serial_adapter *info, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	return serial_adapter_info(conn->fd, conn->port, info);
+}
+
+/**
+ * Open the serial port of a connection again after it was lost, without resetting the printer. Also
+ * run for the I/O threads, so it does not print anything (neither does the probe, see serial_readline());
+ * the callers report the outcome. Takes up to SERIAL_RECONNECT_TIME plus the time of a query.
+ * @return 0 when the printer answers again or a negative error code otherwise
+ */
+int serial_reconnect(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	if(conn == NULL || conn->fd <= 0 || !serial_attach_mode || conn->reconnecting) return -1;
+
+	// The device comes back once the USB device is enumerated again
+	uint64_t give_up = serial_stats_now() + (uint64_t)SERIAL_RECONNECT_TIME * 1000000000ull;
+	int fd;
+	while((fd = open(conn->port, O_RDWR | O_NOCTTY | O_SYNC)) < 0) {
+		if(serial_stats_now() >= give_up) return -1;
+		usleep(100000);
+	}
+	set_interface_attribs(fd, B115200, 0);
+	set_blocking(fd, 1);
+	set_hangup(fd, 0);
+	if(serial_baud_set(fd, conn->baud) < 0) {
+		close(fd);
+		return -1;
+	}
+	// A device which was enumerated again starts with the default latency timer
+	if(serial_latency_ms > 0) serial_adapter_tune(fd, conn->port, serial_latency_ms);
+
+	// Keep the number of the file descriptor: the I/O threads and the poll loops know the port by it
+	dup2(fd, conn->fd);
+	close(fd);
+	framer_reset(&conn->rx);
+
+	// The printer may be in the middle of a command, it gets the time of a query
+	conn->reconnecting = true;
+	int res = serial_probe(conn, serial_cmd_timeout("M115\n"));
+	conn->reconnecting = false;
+
+	// The printer may have moved (or restarted) while it was away
+	conn->session = ++serial_sessions;
+	return res;
+}
+
+/**
+ * Change the baud rate of an open serial port, for example to find the rate of a printer. Commands
+ * still in flight are acknowledged first; whatever arrives before the change completes is discarded.
+ * @param baud Baud rate, any rate the serial driver supports
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_change_baud(int baud, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(serial_thread_active(conn)) {
+		error_message("error: the baud rate can not be changed while the I/O threads own the port\n");
+		return -1;
+	}
+	if(serial_stream_inflight(conn) > 0 && serial_stream_sync(conn) < 0) return -1;
+
+	tcdrain(conn->fd);
+	if(serial_baud_set(conn->fd, baud) < 0) {
+		error_message("error: %s does not support %i baud: %s\n", conn->port, baud, strerror (errno));
+		return -1;
+	}
+	// Drivers round the rate to what the hardware can do
+	int actual = serial_baud_get(conn->fd);
+	if(actual > 0 && actual != baud) message("Baud rate of %s is %i instead of %i\n", conn->port, actual, baud);
+	conn->baud = actual > 0 ? actual : baud;
+	// Replies which were late at the old rate will not arrive anymore
+	tcflush(conn->fd, TCIFLUSH);
+	framer_reset(&conn->rx);
+	conn->ok_late = 0;
+	return 0;
+}
+
+/**
+ * Baud rate of a connection
+ */
+int serial_conn_baud(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	return conn != NULL ? conn->baud : 0;
+}
+
+/**
+ * Session of a connection: a number which is unique to the connection and changes whenever it is
+ * reconnected. State kept about the printer (such as its position) is stale when the session changed.
+ */
+unsigned int serial_conn_session(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	return conn != NULL ? conn->session.load() : 0;
+}
+
+/**
+ * Name of the serial port of a connection
+ */
+const char *serial_conn_port(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	return conn != NULL ? conn->port : "";
+}
+
+/**
+ * Capabilities a line of the replies to M115 or M420 V stands for
+ * @return The SERIAL_CAP_* flag of the line or 0
+ */
+int serial_caps_line(const char *line) {
+	static const struct { const char *name; int cap; } caps[] = {
+		{ "Cap:ADVANCED_OK:1", SERIAL_CAP_ADVANCED_OK },
+		{ "Cap:AUTOREPORT_TEMP:1", SERIAL_CAP_AUTOREPORT_TEMP },
+		{ "Cap:EEPROM:1", SERIAL_CAP_EEPROM },
+	};
+	for(unsigned int i=0; i<sizeof(caps)/sizeof(caps[0]); i++) {
+		if(strncmp(line, caps[i].name, strlen(caps[i].name)) == 0) return caps[i].cap;
+	}
+	// M115 has no capability for the type of bed leveling; M420 V names it
+	if(strstr(line, "Unified Bed Leveling") != NULL) return SERIAL_CAP_UBL;
+	return 0;
+}
+
+/**
+ * Capabilities of the firmware of a printer, asked for once
+ * @return Combination of SERIAL_CAP_* flags or a negative error code
+ */
+int serial_conn_caps(ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(conn->caps >= 0) return conn->caps;
+
+	static const char *queries[] = { "M115\n", "M420 V\n" };
+	int caps = 0;
+	for(int i=0; i<2; i++) {
+		ty_serial_view reply;
+		int res = serial_query(queries[i], &reply, true, conn);
+		if(res < 0) return res;
+		unsigned int pos = 0;
+		const char *line;
+		while(serial_reply_next(&reply, &pos, &line) >= 0) caps |= serial_caps_line(line);
+	}
+	conn->caps = caps;
+	return caps;
+}
+
+/**
+ * Set the capabilities of the firmware of a printer, so they do not have to be asked for
+ * @param caps Combination of SERIAL_CAP_* flags, -1 to ask the printer again
+ */
+void serial_set_caps(int caps, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return;
+	conn->caps = caps;
+}
+
+/**
+ * Class of a command, which decides how long the printer gets to acknowledge it
+ * @param cmd Command as it is sent, without line number
+ * @return One of the SERIAL_CLASS_* values
+ */
+int serial_cmd_class(const char *cmd) {
+	while(*cmd == ' ') cmd++;
+	char letter = toupper(*cmd);
+	int code = atoi(cmd + 1);
+
+	if(letter == 'G') {
+		switch(code) {
+		case 4: case 28: case 29: case 30: case 33: case 34: case 35:
+			return SERIAL_CLASS_LONG;
+		}
+	} else if(letter == 'M') {
+		switch(code) {
+		case 105: case 110: case 111: case 114: case 115: case 119: case 155:
+			return SERIAL_CLASS_QUICK;
+		case 48: case 400:
+			return SERIAL_CLASS_LONG;
+		case 109: case 190: case 191: case 303:
+			return SERIAL_CLASS_HEATING;
+		}
+	}
+	return SERIAL_CLASS_DEFAULT;
+}
+
+/**
+ * Change the time the printer gets to acknowledge the commands of a class
+ * @param cls One of the SERIAL_CLASS_* values
+ * @param ms Time in milliseconds
+ */
+void serial_set_timeout(int cls, int ms) {
+	if(cls >= 0 && cls < SERIAL_CLASSES) serial_timeouts[cls] = ms;
+}
+
+/**
+ * Time the printer gets to acknowledge a command, in milliseconds
+ */
+int serial_cmd_timeout(const char *cmd) {
+	return serial_timeouts[serial_cmd_class(cmd)].load(std::memory_order_relaxed);
+}
+
+/**
+ * Set the function called for each keepalive of a printer; every keepalive also restarts the time the
+ * printer gets to acknowledge the command.
+ * @param cb Function to call, NULL to stop calling it
+ * @param user Pointer handed to the function
+ */
+void serial_set_progress(t_serial_progress cb, void *user, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return;
+	conn->progress_cb = cb;
+	conn->progress_user = user;
+}
+
+/**
+ * Test if a line is a keepalive of the printer while it works on a command and report it to the progress
+ * callback. The caller restarts the deadline of the command.
+ * @param type Classes of the line (SERIAL_MSG_*)
+ * @param cmd The command the printer works on
+ * @param sent Time the command was sent (serial_stats_now())
+ * @return True when the line is a keepalive
+ */
+bool serial_keepalive(ty_serial_conn *conn, int type, const char *cmd, uint64_t sent, const char *line) {
+	// While waiting for a heater, Marlin reports the temperatures instead of being busy
+	bool heating = (type & SERIAL_MSG_TEMPERATURE) && !(type & SERIAL_MSG_REPLY) && serial_cmd_class(cmd) == SERIAL_CLASS_HEATING;
+	if(!(type & SERIAL_MSG_BUSY) && !heating) return false;
+
+	if(conn->progress_cb != NULL) conn->progress_cb(conn, cmd, line, (serial_stats_now() - sent) / 1e9, conn->progress_user);
+	return true;
+}
+
+/**
+ * Cancel the commands a printer has not acknowledged yet: whoever waits for them gets SERIAL_ERR_CANCELLED
+ * right away, from any thread. The printer is not stopped, its late 'ok's are ignored.
+ */
+void serial_cancel(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	if(conn == NULL || conn->cancel_fd < 0) return;
+	uint64_t v = 1;
+	write(conn->cancel_fd, &v, sizeof(v));
+}
+
+/**
+ * Cancel the unacknowledged commands of all printers. Only writes to an eventfd per printer, so it can be
+ * used from a signal handler.
+ */
+void serial_cancel_all() {
+	// No lock: a signal might arrive while the table is locked
+	for(int i=0; i<SERIAL_MAX_CONNECTIONS; i++) {
+		ty_serial_conn *conn = serial_conns[i];
+		if(conn != NULL) serial_cancel(conn);
+	}
+}
+
+/**
+ * Send an emergency command to the printer right away, ahead of everything waiting to be sent and while
+ * other threads wait for replies. After M112 all waits are cancelled and the connection refuses further
+ * commands. Only uses system calls which are safe in a signal handler; the command is not recorded in
+ * the transcript.
+ * @param kind SERIAL_ESTOP_KILL or SERIAL_ESTOP_QUICK
+ * @param report Filled with the time it took to get the command out, can be NULL
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_emergency(int kind, ty_estop_report *report, ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default;
+	if(conn == NULL || conn->fd <= 0) return -1;
+
+	ty_estop_report r;
+	r.kind = kind;
+	r.requested = serial_stats_now();
+	r.written = r.drained = 0;
+
+	// This can run in a signal handler, so it cannot take a lock against the I/O thread: the tty may
+	// already hold part of a command, or get the rest of it after this write. The leading newline ends
+	// such a line so the emergency command always starts a line of its own; Marlin ignores empty lines
+	// and rejects the cut off parts like any corrupted command. After a kill nothing else has to reach
+	// the printer, so what is not sent yet is dropped as well.
+	const char *cmd = "\nM410\n";
+	if(kind == SERIAL_ESTOP_KILL) {
+		conn->halted = true;
+		tcflush(conn->fd, TCOFLUSH);
+		cmd = "\nM112\n";
+	}
+	int len = strlen(cmd), done = 0;
+	while(done < len) {
+		int n = write(conn->fd, cmd + done, len - done);
+		if(n > 0) done += n;
+		else if(n < 0 && errno == EINTR) continue;
+		else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// The port is non-blocking while the I/O threads own it; wait for room in its output buffer
+			// (poll() is safe in a signal handler) instead of spinning until the UART drains
+			struct pollfd pfd;
+			pfd.fd = conn->fd;
+			pfd.events = POLLOUT;
+			if(poll(&pfd, 1, SERIAL_ESTOP_WRITE_TIMEOUT) == 0) return -1;
+		} else return -1;
+	}
+	r.written = serial_stats_now();
+
+	if(kind == SERIAL_ESTOP_KILL) {
+		// A killed printer acknowledges nothing anymore
+		serial_cancel(conn);
+	} else {
+		// M410 is acknowledged like any other command, but nobody waits for it
+		conn->ok_late++;
+	}
+	tcdrain(conn->fd);
+	r.drained = serial_stats_now();
+	serial_stats_tx(conn, len);
+
+	if(report != NULL) *report = r;
+	return 0;
+}
+
+/**
+ * Send an emergency command to all printers; like serial_emergency() it can be used from a signal handler.
+ * @param kind SERIAL_ESTOP_KILL or SERIAL_ESTOP_QUICK
+ * @param reports Array of SERIAL_MAX_CONNECTIONS reports indexed by serial_conn_id(), can be NULL
+ * @return Number of printers the command was sent to
+ */
+int serial_emergency_all(int kind, ty_estop_report *reports) {
+	int sent = 0;
+	// No lock: a signal might arrive while the table is locked
+	for(int i=0; i<SERIAL_MAX_CONNECTIONS; i++) {
+		ty_serial_conn *conn = serial_conns[i];
+		if(conn != NULL && serial_emergency(kind, reports != NULL ? &reports[i] : NULL, conn) == 0) sent++;
+	}
+	return sent;
+}
+
+/**
+ * Describe an emergency stop report, for example 'M112 written after 0.021 ms, sent after 0.540 ms'
+ * @param buf Buffer to fill
+ * @param size Size of the buffer
+ */
+void serial_emergency_describe(const ty_estop_report *r, char *buf, int size) {
+	snprintf(buf, size, "%s written after %.3f ms, sent after %.3f ms", r->kind == SERIAL_ESTOP_KILL ? "M112" : "M410",
+			(r->written - r->requested) / 1e6, (r->drained - r->requested) / 1e6);
+}
+
+/**
+ * Report a wait which was given up; the 'ok's of the commands may still arrive and are ignored then.
+ * @param cmd The oldest command waited for
+ * @param count Number of commands given up
+ */
+static void serial_give_up(ty_serial_conn *conn, const char *cmd, int res, int count) {
+	if(res == SERIAL_ERR_TIMEOUT) {
+		error_message("error: no reply to '%.*s' within %i ms\n", (int)strcspn(cmd, "\n"), cmd, serial_cmd_timeout(cmd));
+	} else if(res == SERIAL_ERR_CANCELLED) {
+		error_message("error: wait for '%.*s' cancelled\n", (int)strcspn(cmd, "\n"), cmd);
+	} else if(res == SERIAL_ERR_RECONNECTED) {
+		error_message("error: port lost while waiting for '%.*s', it may not have been executed\n", (int)strcspn(cmd, "\n"), cmd);
+	}
+	if(res == SERIAL_ERR_TIMEOUT || res == SERIAL_ERR_CANCELLED) conn->ok_late += count;
 }
 
 /**
  * Send a command over the serial port to the printer.
  * @param cmd Character buffer to send out
- * @param reply Pointer to a character buffer to fill the reply in (for commands that need to parse the response)
+ * @param reply Pointer to a character buffer to fill the reply in (for commands that need to parse the response); the
+ * caller has to free() it
  * @param keepall When false, discard serial lines not starting with 'ok'; when true, keep all serial data up to and including the first line starting with 'ok'
+ * (except unsolicited messages like temperature reports and busy keepalives, these go to the subscribers of the message router)
  */
-int serial_cmd(const char *cmd, char **reply, bool keepall) {
-	if(DEMO_MODE) {
-		// Demo mode - pretend we send the command
-		message("> %s", cmd);
-
-		// Special handling of mesh loading command; fake response to test parser
-		if(strcmp(cmd, "G29 T1\n") == 0) {
-			// Mesh load request - return canned reply
-			message("DEMO MODE: command ok - returning fake mesh data\n");
-
-			if(reply != NULL) {
-				//*reply = strdup("\n"
-				//			"Bed Topography Report for CSV:\n"
-				//			"\n"
-				//			"0.086,-0.091,-0.281,-0.369,-0.514,-0.610,-0.619,-0.719\n"
-				//			"-0.018,-0.176,-0.307,-0.423,-0.528,-0.569,-0.633,-0.662\n"
-				//			"-0.081,-0.261,-0.340,-0.432,-0.558,-0.612,-0.670,-0.607\n"
-				//			"-0.107,-0.244,-0.383,-0.457,-0.568,-0.594,-0.705,-0.683\n"
-				//			"-0.128,-0.289,-0.417,-0.522,-0.613,-0.702,-0.738,-0.821\n"
-				//			"-0.120,-0.274,-0.453,-0.550,-0.649,-0.743,-0.804,-0.892\n"
-				//			"-0.217,-0.383,-0.596,-0.661,-0.806,-0.877,-0.935,-0.992\n"
-				//			"-0.318   -0.461   -0.621   -0.710 , -0.750     ,   -0.837,   -0.836,  -0.961  \n"
-				//			"ok\n");
-
-				*reply = strdup("\n"
-							"Bed Topography Report for CSV:\n"
-							"\n"
-							"0.086,-0.091,-0.281,-0.369,-0.514\n"
-							"-0.018,-0.176,-0.307,-0.423,-0.528\n"
-							"-0.081,-0.261,-0.340,-0.432,-0.558\n"
-							"-0.107,-0.244,-0.383,-0.457,-0.568\n"
-							"-0.710 , -0.750     ,   -0.837,   -0.836,  -0.961  \n"
-							"ok\n");
-			}
-		} else if(strcmp(cmd, "M105\n") == 0) {
-			// Temperature request - return canned reply
-			message("DEMO MODE: command ok - returning fake temperature\n");
+int serial_cmd(const char *cmd, char **reply, bool keepall, ty_serial_conn *conn) {
+	ty_serial_view view;
+	int res = serial_query(cmd, reply != NULL ? &view : NULL, keepall, conn);
+	if(res == 0 && reply != NULL) *reply = strdup(view.text);
+	return res;
+}
 
-			if(reply != NULL)
-				*reply = strdup("ok T:16.78 /20.00 B:23.45 /30.00 @:0 B@:0\n");
-			//message("DEMO MODE: temp string @ %p %s\n", reply, *reply);
-		} else {
-			message("DEMO MODE: command ok\n");
-			if(reply != NULL)
-				*reply = strdup("ok\n");
-		}
-		return 0;
+/**
+ * Send a command and wait for the 'ok', see serial_query() and serial_query_lines()
+ * @param line_cb Called for each line before the 'ok' instead of keeping it in the reply, can be NULL
+ */
+static int query(const char *cmd, ty_serial_view *reply, bool keepall, t_serial_line line_cb, void *line_user, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(conn->halted) {
+		error_message("error: printer halted by M112, reconnect to reset it\n");
+		return -1;
+	}
+
+	// When the I/O threads own the serial port, hand the command to them and wait for the reply
+	if(serial_thread_active(conn)) {
+		serial_thread_flush_log(conn);
+		int res = serial_thread_query(conn, cmd, keepall, reply, line_cb, line_user);
+		serial_thread_flush_log(conn);
+		return res;
 	}
 
-	const unsigned int buflen = SERIAL_REPLY_BUFFER_SIZE;	// Size of the serial buffer to fill while searching for the 'ok'; if keepall = true, all serial data up to the line starting with the OK needs to fit within this many bytes
-	char buf [buflen+1];			// Ugly hack (+1) to make sure the buffer is always null-terminated
+	const unsigned int buflen = SERIAL_REPLY_BUFFER_SIZE;	// Size of the buffer to collect the reply in; if keepall = true, all lines up to the line starting with the OK need to fit within this many bytes
+	char *buf = conn->reply_buf;	// Lines received before the 'ok' (only when keepall = true), followed by the 'ok'
 	unsigned int bp = 0;			// Buffer pointer, points to the end of the data in the buffer
-	unsigned int lle = 0;			// Last line ending; points to the end of the last line parsed for the 'ok' - only used when keepall = true, otherwise this is always 0
 
-	if(serial_fd <= 0) {
-		error_message("error: serial port not open\n");
-		return -1;
-	}
+	// The next 'ok' has to belong to this command; collect the streamed commands still waiting for theirs first
+	if(serial_stream_inflight(conn) > 0 && serial_stream_sync(conn) < 0) return -1;
 
-	// As data might be in the serial buffer (for example because of debug output or
-	// start of the printer), flush (clear) the buffer.
-	tcflush(serial_fd, TCIFLUSH);
+	// Data might be in the serial buffer (for example because of debug output or temperature reports);
+	// hand it to the subscribers so it does not end up in the reply.
+	if(serial_poll(conn) < 0) return -1;
+
+	// Only cancel this command when serial_cancel() is called from now on
+	uint64_t v;
+	read(conn->cancel_fd, &v, sizeof(v));
+
+	// Add the line number and checksum when enabled
+	char wire[SERIAL_WIRE_SIZE];
+	int wire_len = serial_frame(cmd, wire, conn);
+	if(wire_len < 0) {
+		error_message("error: command too long: %s", cmd);
+		return -2;
+	}
 
 	// Show what command we will send (no need for a \n)
-	message("> %s", cmd);
+	message("> %s", wire);
 	// Send command
-	write(serial_fd, cmd, strlen(cmd));
+	uint64_t sent = serial_stats_now();
+	uint64_t deadline = sent + (uint64_t)serial_cmd_timeout(cmd) * 1000000;
+	write(conn->fd, wire, wire_len);
+	serial_stats_tx(conn, wire_len);
+	transcript_tx(conn, wire, wire_len);
 	// Now loop until we read an 'ok' in the stream - this signals that
 	// the command was accepted.
-	while(bp < buflen) {
-		char *sbuf = NULL; // Sub-buffer pointer, points to the byte after the last line ending that was parsed and rejected in the serial buffer
-
-		int br=read(serial_fd, &buf[bp], buflen-bp);
-		// Debug: show whats in the buffer between reads
-		//message("debug (buf): %s\n", buf);
-		//for(unsigned int i=0;i<buflen;i++) {
-		//	if(buf[i] == 0x0) break;
-		//	message("%02X ", buf[i]);
-		//}
-		//message("\n");
-		if(br==0) {
-			error_message("error: stream closed during read\n");
-			return -1;
+	while(1) {
+		ty_line line;
+		int res = serial_readline(conn, &line, deadline);
+		if(res < 0) {
+			serial_give_up(conn, cmd, res, 1);
+			return res;
 		}
-		if(br < 0) {
-			error_message("error while reading from port: %s (%i)\n", strerror (errno), errno);
-			return -1;
+
+		// Resend requests and their 'ok's are handled by the transport
+		int tr = serial_transport_line(line.str, conn);
+		if(tr != SERIAL_LINE_NORMAL) {
+			serial_log_transport(conn, tr, line.str);
+			if(tr == SERIAL_LINE_RESEND_FAILED) return -1;
+			continue;
 		}
-		bp+=br;
-		buf[bp] = 0x0;	// Always make sure its \0 terminated to make a valid string
-
-		// Set the last-line-ending position to the buffer
-		sbuf = &buf[lle];
-
-		// Scan the buffer contents if there is at least space for 'ok' (computed from the last-line-ending (lle) - only 
-		// non-zero when keepall = true) and it has a line ending (starting after the last-line-ending).
-		// Without a line ending, the reply of the printer is incomplete.
-		while ((bp-lle) > 2 && strchr(sbuf, '\n') != NULL){
-			// It should start with ok; if not, we discard the line.
-			if(strcasestr(sbuf,"ok") != sbuf) {
-				// This line does not start with 'ok': search for a newline.
-				int lineend = -1;
-				for(unsigned int i=lle;i<bp;i++) {
-					// Scan up to the end of the data in the buffer, or \0 (which should not happen)
-					if(buf[i]==0x0) break;
-					if(buf[i]=='\n') {
-						lineend = i;
-						break;
-					}
-				}
 
-				// Test if a line ending was found
-				if(lineend >= 0) {
-					// Print the discarded data
-					message("* %.*s\n", lineend-lle, sbuf);
-
-					// When keepall=false, discard bytes from ignored lines
-					if(!keepall) {
-						// Now move all bytes after the lineend in the buffer
-						for(unsigned int i=lineend+1;i<bp;i++) {
-							buf[i-lineend-1] = buf[i];
-						}
-
-						unsigned int old_bp = bp;
-						bp = bp - lineend - 1;
-
-						// Erase the end of the buffer
-						for(unsigned int i=bp;i<=old_bp;i++) buf[i] = 0x0;
-					} else {
-						// Keeping all data, just move the last-line-ending positions
-						lle = lineend + 1;
-						// Update sbuf to point to the new last-line-ending
-						sbuf = &buf[lle];
-					}
-				}
-			} else {
-				// Print the reply
-				message("< %s\n", sbuf);
+		// It should start with ok; if not, we discard the line (or keep it when keepall = true). Unsolicited
+		// messages like temperature reports never belong to the reply.
+		int type = serial_route(conn, line.str);
+		if(strncasecmp(line.str, "ok", 2) != 0) {
+			// The printer is still working on the command, it gets its full time again
+			if(serial_keepalive(conn, type, cmd, sent, line.str)) {
+				message("~ %s (%.0f s)\n", line.str, (serial_stats_now() - sent) / 1e9);
+				deadline = serial_stats_now() + (uint64_t)serial_cmd_timeout(cmd) * 1000000;
+				continue;
+			}
+
+			// Print the discarded data
+			message("* %s\n", line.str);
 
-				// Buffer starts with 'ok' and has a line ending, return the buffer.
-				if(reply != NULL) {
-					*reply = strdup(buf);
+			if(keepall && !(type & SERIAL_MSG_UNSOLICITED)) {
+				if(line_cb != NULL) {
+					line_cb(line.str, line.len, line_user);
+					continue;
 				}
-				return 0;
+				if(bp + line.len + 1 > buflen) {
+					error_message("error: reply buffer overflow\n");
+					return -1;
+				}
+				memcpy(&buf[bp], line.str, line.len);
+				bp += line.len;
+				buf[bp++] = '\n';
 			}
+			continue;
+		}
+
+		// Print the reply
+		message("< %s\n", line.str);
+		serial_stats_cmd(conn, cmd, sent);
+
+		// Line starts with 'ok', return the reply (including the kept lines before it); no line is longer
+		// than the ring of the line framer, so the 'ok' always fits behind the kept lines
+		if(reply != NULL) {
+			memcpy(&buf[bp], line.str, line.len);
+			bp += line.len;
+			buf[bp++] = '\n';
+			buf[bp] = 0x0;
+			reply->text = buf;
+			reply->len = bp;
 		}
+		return 0;
 	}
+}
+
+/**
+ * Send a command over the serial port to the printer; the reply is collected in the reply buffer of the
+ * connection (or in the reused request of the I/O threads) instead of allocating memory for it.
+ * @param cmd Character buffer to send out
+ * @param reply Set to the reply, valid until the next command to the printer; can be NULL
+ * @param keepall When false, discard serial lines not starting with 'ok'; when true, keep all serial data up to and including the first line starting with 'ok'
+ * (except unsolicited messages like temperature reports and busy keepalives, these go to the subscribers of the message router)
+ */
+int serial_query(const char *cmd, ty_serial_view *reply, bool keepall, ty_serial_conn *conn) {
+	return query(cmd, reply, keepall, NULL, NULL, conn);
+}
 
-	error_message("error: reply buffer overflow\n");
-	return -1;
+/**
+ * Send a command to the printer and hand each line of the reply before the 'ok' to a function as it
+ * arrives, instead of collecting the reply
+ * @param cb Function to call for each line
+ * @param user Pointer handed to the function
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_query_lines(const char *cmd, t_serial_line cb, void *user, ty_serial_conn *conn) {
+	return query(cmd, NULL, true, cb, user, conn);
+}
+
+/**
+ * Walk over the lines of a reply.
+ * @param pos Offset in the reply, start with 0
+ * @param line Set to the start of the next line; the line ends with a newline instead of a null
+ * @return Length of the line without the newline or -1 after the last line
+ */
+int serial_reply_next(const ty_serial_view *reply, unsigned int *pos, const char **line) {
+	if(*pos >= reply->len) return -1;
+	*line = &reply->text[*pos];
+	const char *end = (const char*)memchr(*line, '\n', reply->len - *pos);
+	int len = end != NULL ? end - *line : reply->len - *pos;
+	*pos += len + 1;
+	return len;
 }
 
 /**
@@ -339,12 +995,10 @@ int serial_cmd(const char *cmd, char **reply, bool keepall) {
  * @param flush Flush the current serial buffer before waiting for 'ok'
  * @param timeout Timeout in seconds before canceling the wait
  */
-int serial_waitforok(bool flush, int timeout) {
+int serial_waitforok(bool flush, int timeout, ty_serial_conn *conn) {
 	// Alternative: use an ioctl to see if theres data:
 	// ioctl(serial_file_descriptor, FIONREAD, &bytes_available);
 	fd_set fds;			// Used for the select() to wait for data on the serial port
-	FD_ZERO(&fds);		// Clear the struct
-	FD_SET(serial_fd, &fds);
 
 	if(timeout < 0) timeout = 0;
 	else if(timeout > 30) timeout = 30;
@@ -352,30 +1006,35 @@ int serial_waitforok(bool flush, int timeout) {
 	timer.tv_usec = 0;
 	timer.tv_sec = timeout;
 
-	if(DEMO_MODE) {
-		// Demo mode
-		message("DEMO MODE: startup ok\n");
-		return 0;
-	}
-
-	const unsigned int buflen = 1000; // Buffer needs to be big enough to buffer the printer start blurp
-	char buf [buflen+1]; 		// Ugly hack (+1) to make sure the buffer is always null-terminated
-	unsigned int bp = 0;		// Buffer pointer, tracks the number of bytes used in the buffer
-
-	if(serial_fd <= 0) {
-		error_message("error: serial port not open\n");
-		return -1;
-	}
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
 
 	// As data might be in the serial buffer (for example because of debug output or
 	// start of the printer), flush (clear) the buffer.
-	if(flush) tcflush(serial_fd, TCIFLUSH);
+	if(flush) {
+		tcflush(conn->fd, TCIFLUSH);
+		framer_reset(&conn->rx);
+	}
+
+	// Now loop until we read the start banner in the stream
+	while(1) {
+		ty_line line;
+
+		// Scan the complete lines received so far; without a line ending, the reply of the printer is incomplete.
+		while(framer_next(&conn->rx, &line)) {
+			// Starting line should say 'start'; if not, we discard the line.
+			if(serial_route(conn, line.str) & SERIAL_MSG_START) {
+				// Print the reply
+				message("< '%s'\n", line.str);
+				return 0;
+			}
+			// Print the discarded data
+			message("* %s\n", line.str);
+		}
 
-	// Now loop until we read an 'ok' in the stream - this signals that
-	// the command was accepted.
-	while(bp < buflen) {
 		// Wait for data to arrive in the serial buffer
-		int n = select(serial_fd+1, &fds, NULL, NULL, &timer);
+		FD_ZERO(&fds);
+		FD_SET(conn->fd, &fds);
+		int n = select(conn->fd+1, &fds, NULL, NULL, &timer);
 		if (n < 0) {
 			error_message("error: select failed - wait aborted\n");
 			sleep(5);
@@ -387,7 +1046,7 @@ int serial_waitforok(bool flush, int timeout) {
 		}
 
 		// Read from the serial descriptor
-		int br=read(serial_fd, &buf[bp], buflen-bp);
+		int br = serial_fill(conn);
 		if(br==0) {
 			error_message("error: stream closed during read\n");
 			return -1;
@@ -396,53 +1055,566 @@ int serial_waitforok(bool flush, int timeout) {
 			error_message("error while reading from port: %s (%i)\n", strerror (errno), errno);
 			return -1;
 		}
-		bp+=br;			// Move the buffer pointer
-		buf[bp] = 0x0;	// Always make sure its \0 terminated to make a valid string
+	}
+}
 
-		// Scan the buffer contents if there is at least space for 'ok' and it has a line ending.
-		// Without a line ending, the reply of the printer is incomplete.
-		while (bp > 2 && strchr(buf, '\n') != NULL){
-			// Starting line should say 'start'; if not, we discard the line.
-			if(strcasestr(buf,"start") != buf) {
-				// This line does not start with 'ok': search for a newline.
-				int lineend = -1;
-				for(unsigned int i=0;i<bp;i++) {
-					// Scan up to the end of the data in the buffer, or \0 (which should not happen)
-					if(buf[i]==0x0) break;
-					if(buf[i]=='\n') {
-						lineend = i;
-						break;
-					}
-				}
+/**
+ * Read all lines the printer sent so far without waiting for more and hand them to the subscribers of
+ * the message router. With the I/O thread running, this happens as soon as the lines arrive.
+ * @return Number of lines handled or a negative error code
+ */
+int serial_poll(ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(serial_thread_active(conn)) {
+		serial_thread_flush_log(conn);
+		return 0;
+	}
+	// The 'ok's of streamed commands are collected by the stream
+	if(conn->stream_count > 0) return 0;
 
-				// Test if a line ending was found
-				if(lineend >= 0) {
-					// Print the discarded data
-					message("* %.*s", lineend, buf);
-
-					// Now move all bytes after the lineend in the buffer to
-					// the beginning of the byte buffer.
-					for(unsigned int i=lineend+1;i<bp;i++) {
-						buf[i-lineend-1] = buf[i];
-					}
-					// Adjust pointer and ending
-					unsigned int old_bp = bp;
-					bp = bp - lineend - 1;
-
-					// Erase the end of the buffer
-					for(unsigned int i=bp;i<=old_bp;i++)
-						buf[i] = 0x0;
-				}
+	int lines = 0;
+	while(1) {
+		ty_line line;
+		while(framer_next(&conn->rx, &line)) {
+			int tr = serial_transport_line(line.str, conn);
+			if(tr != SERIAL_LINE_NORMAL) {
+				serial_log_transport(conn, tr, line.str);
+				continue;
+			}
+			serial_route(conn, line.str);
+			// Late or unsolicited - nothing to pair it with
+			message("* %s\n", line.str);
+			lines++;
+		}
+
+		// Only read when data is waiting, this function never blocks
+		struct pollfd fds;
+		fds.fd = conn->fd;
+		fds.events = POLLIN;
+		if(poll(&fds, 1, 0) <= 0 || !(fds.revents & (POLLIN | POLLHUP | POLLERR))) return lines;
+
+		int br = serial_fill(conn);
+		if(br <= 0) {
+			if(br == 0) {
+				error_message("error: stream closed during read\n");
 			} else {
-				// Print the reply
-				message("< '%s'", buf);
-				return 0;
+				error_message("error while reading from port: %s (%i)\n", strerror (errno), errno);
+			}
+			// Nothing is in flight, so the port can be replaced without losing a command
+			if(serial_reconnect(conn) < 0) return -1;
+			message("Reconnected to %s\n", conn->port);
+		}
+	}
+}
+
+// ================================ Command streaming =================================
+
+/**
+ * Read lines from the printer until one 'ok' has been received and pair it with the oldest
+ * unacknowledged command.
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int serial_stream_collect_ok(ty_serial_conn *conn) {
+	while(1) {
+		ty_line l;
+		const char *first = conn->stream_cmd[conn->stream_head];
+		int res = serial_readline(conn, &l, conn->stream_since + (uint64_t)serial_cmd_timeout(first) * 1000000);
+		if(res < 0) {
+			// None of the commands in flight gets its 'ok' paired anymore
+			serial_give_up(conn, first, res, conn->stream_count);
+			conn->stream_count = conn->stream_bytes = 0;
+			return res;
+		}
+		const char *line = l.str;
+
+		// Resend requests and their 'ok's are handled by the transport
+		int tr = serial_transport_line(line, conn);
+		if(tr != SERIAL_LINE_NORMAL) {
+			serial_log_transport(conn, tr, line);
+			if(tr == SERIAL_LINE_RESEND_FAILED) return -1;
+			continue;
+		}
+
+		const char *oldest = conn->stream_count > 0 ? conn->stream_cmd[conn->stream_head] : "";
+		int type = serial_route(conn, line);
+		if(strncasecmp(line, "ok", 2) == 0) {
+			if(conn->stream_count == 0) {
+				// Late or unsolicited 'ok' - nothing to pair it with
+				message("* %s\n", line);
+				continue;
 			}
+			message("< %s (%.*s)\n", line, (int)strcspn(oldest, "\n"), oldest);
+			serial_stats_cmd(conn, oldest, conn->stream_sent[conn->stream_head]);
+
+			// Release the slot of the acknowledged command
+			conn->stream_bytes -= conn->stream_cmd_len[conn->stream_head];
+			conn->stream_head = (conn->stream_head + 1) % STREAM_SLOTS;
+			conn->stream_count--;
+			conn->stream_since = serial_stats_now();
+
+			// ADVANCED_OK: use the free command slots as the window. Commands still in transit are
+			// counted as well, so this is conservative.
+			int free_slots = serial_advanced_ok_free(line);
+			if(free_slots >= 0) {
+				conn->stream_window = free_slots < 1 ? 1 : (free_slots > STREAM_SLOTS ? STREAM_SLOTS : free_slots);
+			}
+			return 0;
+		} else if(conn->stream_count > 0 && serial_keepalive(conn, type, oldest, conn->stream_sent[conn->stream_head], line)) {
+			message("~ %s (%.*s)\n", line, (int)strcspn(oldest, "\n"), oldest);
+			conn->stream_since = serial_stats_now();
+		} else if(type & SERIAL_MSG_ERROR) {
+			// Marlin follows an error with an 'ok' for the same command; remember it failed
+			error_message("error: printer reported '%s' for '%.*s'\n", line, (int)strcspn(oldest, "\n"), oldest);
+			conn->stream_errors++;
+		} else {
+			message("* %s\n", line);
 		}
 	}
+}
+
+/**
+ * Room a command takes in the receive buffer of the printer: the command, its line ending and the line
+ * number and checksum when enabled. The command is only framed right before sending, as answering a
+ * resend request while waiting sends all framed lines.
+ * @return The number of bytes or -2 when the command is too long
+ */
+static int serial_stream_room(ty_serial_conn *conn, const char *cmd) {
+	unsigned int len = strcspn(cmd, "\r\n");
+	if(len > SERIAL_MAX_CMD_SIZE) return -2;
+	return len + (conn->checksum ? SERIAL_WIRE_SIZE - SERIAL_MAX_CMD_SIZE : 1);
+}
+
+/**
+ * Test if a command of the given size fits within the printer buffers next to the commands in flight
+ */
+static bool serial_stream_fits(ty_serial_conn *conn, unsigned int len) {
+	return conn->stream_count == 0 || ((int)conn->stream_count < conn->stream_window &&
+			conn->stream_bytes + len <= SERIAL_RX_BUFFER_SIZE && conn->stream_count < STREAM_SLOTS);
+}
+
+/**
+ * Prepare the next streamed command for the wire and remember it to pair it with its 'ok' later; the
+ * caller writes it to the serial port.
+ * @param wire Buffer to receive the command as it is sent, at least SERIAL_WIRE_SIZE bytes
+ * @return Length of the command in the buffer
+ */
+static unsigned int serial_stream_push(ty_serial_conn *conn, const char *cmd, char *wire) {
+	// Add the line number and checksum when enabled
+	unsigned int len = serial_frame(cmd, wire, conn);
+
+	unsigned int slot = (conn->stream_head + conn->stream_count) % STREAM_SLOTS;
+	snprintf(conn->stream_cmd[slot], sizeof(conn->stream_cmd[slot]), "%s", cmd);
+	conn->stream_cmd_len[slot] = len;
+	conn->stream_count++;
+	conn->stream_bytes += len;
+
+	message("> %.*s", (int)len, wire);
+	conn->stream_sent[slot] = serial_stats_now();
+	if(conn->stream_count == 1) conn->stream_since = conn->stream_sent[slot];
+	return len;
+}
 
-	error_message("error: reply buffer overflow\n");
-	return -1;
+/**
+ * Start streaming: when nothing is in flight, data received since the last command is handed to the
+ * subscribers and serial_cancel() only cancels the commands from now on
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int serial_stream_begin(ty_serial_conn *conn) {
+	if(conn->stream_count > 0) return 0;
+	if(serial_poll(conn) < 0) return -1;
+	uint64_t v;
+	read(conn->cancel_fd, &v, sizeof(v));
+	return 0;
+}
+
+/**
+ * Queue a command in streaming mode: the command is sent as soon as it fits within the receive
+ * buffer and command queue of the printer, without waiting for the 'ok' of the previous commands.
+ * Each 'ok' that comes back is paired with the oldest unacknowledged command.
+ * @param cmd Command to send, including the trailing newline
+ * @return 0 when the command was sent or a negative error code otherwise
+ */
+int serial_stream_cmd(const char *cmd, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(conn->halted) {
+		error_message("error: printer halted by M112, reconnect to reset it\n");
+		return -1;
+	}
+
+	// The I/O threads stream all commands by themselves
+	if(serial_thread_active(conn)) {
+		serial_thread_flush_log(conn);
+		return serial_submit(cmd, NULL, NULL, false, conn);
+	}
+
+	int len = serial_stream_room(conn, cmd);
+	if(len < 0) {
+		error_message("error: command too long for streaming: %s", cmd);
+		return -2;
+	}
+	if(serial_stream_begin(conn) < 0) return -1;
+
+	// Wait for acknowledgements until the command fits within the printer buffers
+	while(!serial_stream_fits(conn, len)) {
+		int res = serial_stream_collect_ok(conn);
+		if(res < 0) return res;
+	}
+
+	char wire[SERIAL_WIRE_SIZE];
+	len = serial_stream_push(conn, cmd, wire);
+	if(write(conn->fd, wire, len) != len) {
+		error_message("error while writing to port: %s (%i)\n", strerror (errno), errno);
+		return -1;
+	}
+	serial_stats_tx(conn, len);
+	transcript_tx(conn, wire, len);
+	return 0;
+}
+
+/**
+ * Start an empty batch of commands. A batch is sent like streamed commands, but all commands which fit
+ * within the printer buffers at the same time leave with a single write() instead of one per command.
+ */
+void serial_batch_init(ty_serial_batch *batch, ty_serial_conn *conn) {
+	batch->conn = conn;
+	batch->len = 0;
+	batch->count = 0;
+}
+
+/**
+ * Send the commands of a batch without waiting for the acknowledgements of the last ones; the batch is
+ * empty afterwards. Between the writes, the acknowledgements are collected until the next command fits.
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int serial_batch_write(ty_serial_batch *batch) {
+	ty_serial_conn *conn = serial_conn_get(batch->conn);
+	const char *cmd = batch->buf, *end = batch->buf + batch->len;
+	int res = 0;
+	batch->len = batch->count = 0;
+
+	if(conn == NULL) return -1;
+	if(conn->halted) {
+		error_message("error: printer halted by M112, reconnect to reset it\n");
+		return -1;
+	}
+
+	// The I/O threads append all queued commands which fit within the printer buffers to the output buffer
+	// of the connection and write it with a single write(); what the port does not take is written on EPOLLOUT
+	if(serial_thread_active(conn)) {
+		for(; cmd < end && res == 0; cmd += strlen(cmd) + 1) res = serial_submit(cmd, NULL, NULL, false, conn);
+		serial_thread_flush_log(conn);
+		return res;
+	}
+
+	if(serial_stream_begin(conn) < 0) return -1;
+	// Commands in flight use at most SERIAL_RX_BUFFER_SIZE bytes, except for a single longer one
+	char wire[SERIAL_RX_BUFFER_SIZE + SERIAL_WIRE_SIZE];
+	while(cmd < end) {
+		// Wait for acknowledgements until the next command fits within the printer buffers
+		while(!serial_stream_fits(conn, serial_stream_room(conn, cmd))) {
+			if((res = serial_stream_collect_ok(conn)) < 0) return res;
+		}
+
+		// Frame all commands which fit now and send them together
+		unsigned int len = 0, count = 0;
+		while(cmd < end && len + SERIAL_WIRE_SIZE <= sizeof(wire) && serial_stream_fits(conn, serial_stream_room(conn, cmd))) {
+			len += serial_stream_push(conn, cmd, &wire[len]);
+			cmd += strlen(cmd) + 1;
+			count++;
+		}
+		if(write(conn->fd, wire, len) != (int)len) {
+			error_message("error while writing to port: %s (%i)\n", strerror (errno), errno);
+			return -1;
+		}
+		for(unsigned int i=0; i<count; i++) {
+			unsigned int slot = (conn->stream_head + conn->stream_count - count + i) % STREAM_SLOTS;
+			serial_stats_tx(conn, conn->stream_cmd_len[slot]);
+		}
+		transcript_tx(conn, wire, len);
+	}
+	return 0;
+}
+
+/**
+ * Add a command to a batch. When the batch is full, the commands collected so far are sent first without
+ * waiting for their acknowledgements.
+ * @param cmd Command to send, including the trailing newline
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_batch_add(ty_serial_batch *batch, const char *cmd) {
+	unsigned int len = strlen(cmd);
+	if(strcspn(cmd, "\r\n") > SERIAL_MAX_CMD_SIZE) {
+		error_message("error: command too long: %s", cmd);
+		return -2;
+	}
+	if(batch->len + len + 1 > sizeof(batch->buf)) {
+		int res = serial_batch_write(batch);
+		if(res < 0) return res;
+	}
+	memcpy(&batch->buf[batch->len], cmd, len + 1);
+	batch->len += len + 1;
+	batch->count++;
+	return 0;
+}
+
+/**
+ * Send the commands of a batch and wait until the printer acknowledged all of them; the batch is empty
+ * afterwards.
+ * @return 0 when OK, a negative error code on I/O errors or a positive number of commands that were
+ * answered with an error by the printer
+ */
+int serial_batch_send(ty_serial_batch *batch) {
+	int res = serial_batch_write(batch);
+	if(res < 0) return res;
+	return serial_stream_sync(batch->conn);
+}
+
+/**
+ * Wait until all streamed commands have been acknowledged by the printer.
+ * @return 0 when OK, a negative error code on I/O errors or a positive number of commands that were
+ * answered with an error by the printer since the last sync
+ */
+int serial_stream_sync(ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(serial_thread_active(conn)) {
+		int errors = serial_thread_sync(conn);
+		serial_thread_flush_log(conn);
+		return errors;
+	}
+
+	while(conn->stream_count > 0) {
+		int res = serial_stream_collect_ok(conn);
+		if(res < 0) {
+			// The pairing is lost; start over with an empty stream
+			conn->stream_count = conn->stream_bytes = 0;
+			return res;
+		}
+	}
+	int errors = conn->stream_errors;
+	conn->stream_errors = 0;
+	return errors;
+}
+
+/**
+ * Number of streamed commands which are sent but not acknowledged yet.
+ */
+int serial_stream_inflight(ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return 0;
+	if(serial_thread_active(conn)) return serial_thread_pending(conn);
+	return conn->stream_count;
+}
+
+/**
+ * Parse the free command buffer slots from an ADVANCED_OK reply ('ok N<line> P<planner> B<buffer>').
+ * @param line Reply line starting with 'ok'
+ * @return The number of free slots or -1 when the reply does not carry this information
+ */
+int serial_advanced_ok_free(const char *line) {
+	const char *b = strstr(line, " B");
+	if(b == NULL || b[2] < '0' || b[2] > '9') return -1;
+	return atoi(b+2);
+}
+
+// ========================= Line numbers, checksums and resends ==========================
+
+/**
+ * Enable or disable line numbers and checksums on all commands sent to the printer. When enabling,
+ * the line number in the printer is reset with M110.
+ * @param on True to send all commands as 'N<line> <command>*<checksum>'
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_set_checksum(bool on, ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+
+	// Make sure no command is in flight while switching
+	if(serial_stream_inflight(conn) > 0 && serial_stream_sync(conn) < 0) return -1;
+	if(!on) {
+		conn->checksum = false;
+		return 0;
+	}
+
+	// The next line the printer expects is 1
+	conn->checksum = false;
+	int res = serial_cmd("M110 N0\n", NULL, false, conn);
+	if(res) return res;
+	conn->tx_line = 0;
+	conn->resend_line = -1;
+	conn->resend_ignore = 0;
+	conn->resend_error = 0;
+	conn->ok_swallow = 0;
+	conn->resync = true;
+	conn->checksum = true;
+	return 0;
+}
+
+/**
+ * Prepare a command for the wire: when checksums are enabled, the command is given the next line
+ * number and a checksum and it is remembered in the history to answer resend requests.
+ * @param cmd Command to send, including the trailing newline
+ * @param out Buffer to receive the command as it is sent, at least SERIAL_WIRE_SIZE bytes
+ * @return Length of the command in the buffer or a negative value when it does not fit
+ */
+int serial_frame(const char *cmd, char *out, ty_serial_conn *conn) {
+	int len = strcspn(cmd, "\r\n");
+	if(len > SERIAL_MAX_CMD_SIZE) return -1;
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+
+	if(!conn->checksum) {
+		memcpy(out, cmd, len);
+		out[len++] = '\n';
+		out[len] = 0x0;
+		return len;
+	}
+
+	// Checksum: XOR of all bytes up to the '*'
+	long line = conn->tx_line + 1;
+	len = snprintf(out, SERIAL_WIRE_SIZE, "N%li %.*s", line, len, cmd);
+	unsigned char cs = 0;
+	for(int i=0; i<len; i++) cs ^= (unsigned char)out[i];
+	len += snprintf(&out[len], SERIAL_WIRE_SIZE - len, "*%u\n", cs);
+
+	conn->tx_line = line;
+	memcpy(conn->tx_history[line % SERIAL_RESEND_HISTORY], out, len + 1);
+	conn->tx_history_len[line % SERIAL_RESEND_HISTORY] = len;
+	return len;
+}
+
+/**
+ * Send a line of the transport (resends); the I/O threads write it after the rest of their output
+ * @return False when the line could not be written
+ */
+static bool transport_write(ty_serial_conn *conn, const char *data, int len) {
+	if(conn->attached) conn->io_out.append(data, len);
+	else if(write(conn->fd, data, len) != len) return false;
+	serial_stats_tx(conn, len);
+	transcript_tx(conn, data, len);
+	return true;
+}
+
+/**
+ * Let the transport inspect a line received from the printer. Resend requests are answered by
+ * sending the requested lines from the history again.
+ * @param line Line received from the printer
+ * @param conn Connection the line was received on, the lines are sent again on it
+ * @return One of the SERIAL_LINE_* codes
+ */
+static int transport_line(const char *line, ty_serial_conn *conn) {
+
+	if(strncasecmp(line, "ok", 2) == 0) {
+		if(conn->ok_swallow > 0) {
+			conn->ok_swallow--;
+			return SERIAL_LINE_SWALLOWED;
+		}
+		// A numbered command was accepted, the printer counts the lines from the last M110
+		conn->resync = false;
+		return SERIAL_LINE_NORMAL;
+	}
+
+	// Marlin reports corrupted lines as 'Error:checksum mismatch, Last Line: 41' before requesting a resend.
+	// Lines which were already on the way when a line was rejected are reported as out of sequence.
+	if(strncasecmp(line, "error", 5) == 0 && strstr(line, "Last Line") != NULL) {
+		conn->resend_error = strstr(line, "Line Number") != NULL ? 1 : 2;
+		return SERIAL_LINE_TRANSPORT_ERROR;
+	}
+
+	// Resend request: 'Resend: 42' (Marlin, Repetier) or 'rs 42' / 'rs N42' (Teacup)
+	const char *p = NULL;
+	if(strncasecmp(line, "resend:", 7) == 0) p = &line[7];
+	else if(strncmp(line, "rs ", 3) == 0) p = &line[3];
+	if(p == NULL) return SERIAL_LINE_NORMAL;
+	while(*p == ' ' || *p == 'N') p++;
+	long n = strtol(p, NULL, 10);
+
+	// The printer follows every resend request with an 'ok' which does not acknowledge a command
+	conn->ok_swallow++;
+
+	// When a line is rejected, the printer also rejects every line sent after it which was already on the
+	// way; each of those causes another request for the same line. Only the first one is answered.
+	// Marlin tells these apart from a corrupted resend by the out-of-sequence error; without an error
+	// message, at most one request per line that was on the way is ignored.
+	int error = conn->resend_error;
+	conn->resend_error = 0;
+	if(n == conn->resend_line && conn->resend_ignore > 0 && error != 2) {
+		conn->resend_ignore--;
+		return SERIAL_LINE_RESEND_IGNORED;
+	}
+
+	// A printer which missed the M110 N0 of a probe or reconnect still counts the lines from before and asks
+	// for a line which was not sent yet: its count is started again with a numbered M110, after which all
+	// lines are sent again from line 1
+	long from = n;
+	if(n > conn->tx_line && conn->resync) from = 1;
+	if(from < 1 || from > conn->tx_line || conn->tx_line - from >= SERIAL_RESEND_HISTORY) return SERIAL_LINE_RESEND_FAILED;
+
+	conn->resend_line = n;
+	long sent = conn->tx_line;
+	if(conn->attached) {
+		// The I/O thread writes the port: the lines go out after the rest of the line it is writing, and
+		// the lines it did not start on yet are part of the resend anyway
+		size_t end = conn->io_out_pos;
+		if(end > 0 && conn->io_out[end-1] != '\n') end = conn->io_out.find('\n', end) + 1;
+		for(size_t p = end; (p = conn->io_out.find('\n', p)) != std::string::npos; p++) sent--;
+		conn->io_out.resize(end);
+	}
+	conn->resend_ignore = sent > from ? sent - from : 0;
+	if(from != n) {
+		// Checksum of 'N0 M110'
+		char m110[16];
+		int len = snprintf(m110, sizeof(m110), "N0 M110*%u\n", 'N' ^ '0' ^ ' ' ^ 'M' ^ '1' ^ '1' ^ '0');
+		if(!transport_write(conn, m110, len)) return SERIAL_LINE_RESEND_FAILED;
+		conn->resync = false;
+	}
+	for(long l=from; l<=conn->tx_line; l++) {
+		int i = l % SERIAL_RESEND_HISTORY;
+		if(!transport_write(conn, conn->tx_history[i], conn->tx_history_len[i])) return SERIAL_LINE_RESEND_FAILED;
+	}
+	return SERIAL_LINE_RESEND;
+}
+
+/**
+ * Let the transport inspect a line received from the printer. Resend requests are answered by
+ * sending the requested lines from the history again.
+ * @param line Line received from the printer
+ * @param conn Connection the line was received on, the lines are sent again on it
+ * @return One of the SERIAL_LINE_* codes
+ */
+int serial_transport_line(const char *line, ty_serial_conn *conn) {
+	int res;
+	if(conn->ok_late > 0 && strncasecmp(line, "ok", 2) == 0) {
+		// Nobody waits for the commands which timed out or were cancelled anymore
+		conn->ok_late--;
+		res = SERIAL_LINE_SWALLOWED;
+	} else if(!conn->checksum) {
+		return SERIAL_LINE_NORMAL;
+	} else {
+		res = transport_line(line, conn);
+	}
+
+	// Lines of the transport do not pass the message router; count them here
+	if(res != SERIAL_LINE_NORMAL) serial_stats_rx(conn, serial_classify(line), line, strlen(line));
+	if(res == SERIAL_LINE_RESEND) serial_stats_resend(conn);
+	return res;
+}
+
+/**
+ * Log the handling of a transport line
+ */
+void serial_log_transport(ty_serial_conn *conn, int res, const char *line) {
+	switch(res) {
+	case SERIAL_LINE_SWALLOWED:
+	case SERIAL_LINE_TRANSPORT_ERROR:
+		message("* %s\n", line);
+		break;
+	case SERIAL_LINE_RESEND:
+		message("* %s - resending from line %li\n", line, conn->resend_line);
+		break;
+	case SERIAL_LINE_RESEND_IGNORED:
+		message("* %s - already resent\n", line);
+		break;
+	case SERIAL_LINE_RESEND_FAILED:
+		error_message("error: cannot answer '%s', line not in history (last line %li)\n", line, conn->tx_line);
+		break;
+	}
 }
 
 int serial_cmd(const char *cmd) {
@@ -8,11 +8,333 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
-int serial_open();
-void serial_close();
-int serial_cmd(const char *cmd, char **reply, bool keepall = false);
+#include <stdint.h>
+
+#include "main.h"
+#include "serial_adapter.h"
+
+// Size of a command on the wire: the command plus line number and checksum
+#define SERIAL_WIRE_SIZE (SERIAL_MAX_CMD_SIZE + 20)
+// Longest name of a serial port
+#define SERIAL_PORT_NAME_SIZE 64
+
+// Result of serial_transport_line()
+#define SERIAL_LINE_NORMAL          0	// Not a transport line, handle as usual
+#define SERIAL_LINE_SWALLOWED       1	// 'ok' belonging to a line the printer rejected, ignore it
+#define SERIAL_LINE_TRANSPORT_ERROR 2	// Error about a corrupted line; a resend request follows
+#define SERIAL_LINE_RESEND          3	// Resend request, the requested lines have been sent again
+#define SERIAL_LINE_RESEND_IGNORED  4	// Repeated resend request caused by lines sent before the resend
+#define SERIAL_LINE_RESEND_FAILED  -1	// Resend request for a line which is not in the history anymore
+
+// Error codes of serial_cmd() and the stream functions, next to -1 for I/O errors and -2 for commands which
+// are too long
+#define SERIAL_ERR_TIMEOUT   -3	// The printer did not acknowledge the command within the time of its class
+#define SERIAL_ERR_CANCELLED -4	// The wait was cancelled with serial_cancel()
+#define SERIAL_ERR_RECONNECTED -5	// The serial port was lost and opened again (attach mode); the command may or may not have been executed
+
+// Classes of commands, each with its own time to acknowledge a command
+#define SERIAL_CLASS_QUICK   0	// Queries which are answered right away: M105, M114, M115, ...
+#define SERIAL_CLASS_DEFAULT 1	// Moves and settings
+#define SERIAL_CLASS_LONG    2	// Homing, probing and waiting for moves: G28, G29, M400, ...
+#define SERIAL_CLASS_HEATING 3	// Waiting for a temperature: M109, M190, M303
+#define SERIAL_CLASSES       4
+
+// Capabilities of the firmware of a printer (serial_conn_caps()): the Cap: lines of M115 and, for UBL, M420 V
+#define SERIAL_CAP_ADVANCED_OK     0x01	// The 'ok's carry the free room in the buffers of the printer
+#define SERIAL_CAP_AUTOREPORT_TEMP 0x02	// The printer reports its temperatures by itself (M155)
+#define SERIAL_CAP_EEPROM          0x04	// Settings and meshes can be stored (M500, G29 S)
+#define SERIAL_CAP_UBL             0x08	// Unified bed leveling (G29 T, M421)
+
+// Emergency commands of serial_emergency(), handled by Marlin as soon as they are received (EMERGENCY_PARSER)
+#define SERIAL_ESTOP_KILL  0	// M112: stop everything, the printer has to be reset afterwards
+#define SERIAL_ESTOP_QUICK 1	// M410: abort all moves; the printer stays usable but the position is lost
+
+/**
+ * How fast an emergency command got out, all times from serial_stats_now()
+ */
+typedef struct {
+	int kind;				// SERIAL_ESTOP_*
+	uint64_t requested;		// serial_emergency() was called, 0 when no emergency command was sent
+	uint64_t written;		// write() returned: the command is in the kernel
+	uint64_t drained;		// tcdrain() returned: the command left the serial port
+} ty_estop_report;
+
+/**
+ * Reply of the printer to serial_query(), borrowed from the connection: nothing is copied or allocated
+ * for it. The text stays valid until the next command to the same printer.
+ */
+typedef struct {
+	const char *text;		// The lines of the reply, each ending with a newline; null-terminated
+	unsigned int len;		// Length of the text
+} ty_serial_view;
+
+/**
+ * Connection to a single printer. All functions taking a connection use the default connection (the
+ * first printer opened) when the connection is NULL.
+ */
+typedef struct serial_conn ty_serial_conn;
+
+/**
+ * Function called for each keepalive of a printer while it works on a long command (busy messages, and
+ * the temperature reports while it waits for a heater). It is called from the thread reading the serial
+ * port (the I/O thread when it is running) so it should be short and must not use curses.
+ * @param conn Printer which sent the keepalive
+ * @param cmd The command the printer works on
+ * @param line The keepalive, for example 'echo:busy: processing'
+ * @param elapsed Seconds since the command was sent
+ * @param user Pointer handed to serial_set_progress()
+ */
+typedef void (*t_serial_progress)(ty_serial_conn *conn, const char *cmd, const char *line, double elapsed, void *user);
+
+/**
+ * Function called for each line of a reply as it arrives, see serial_query_lines(). It is called from the
+ * thread reading the serial port (the I/O thread when it is running) while the caller waits for the 'ok', so
+ * it must not use curses.
+ * @param line The line, null-terminated and without the line ending
+ * @param len Length of the line
+ * @param user Pointer handed to serial_query_lines()
+ */
+typedef void (*t_serial_line)(const char *line, unsigned int len, void *user);
+
+/**
+ * Commands collected to be sent together, see serial_batch_add()
+ */
+typedef struct {
+	ty_serial_conn *conn;			// Printer to send the commands to, NULL for the default connection
+	char buf[SERIAL_BATCH_SIZE];	// The commands, each including its newline and followed by a null
+	unsigned int len;				// Bytes used in buf
+	unsigned int count;				// Number of commands in buf
+} ty_serial_batch;
+
+/**
+ * Open the serial port to a printer, reset the printer and wait for it to start. In attach mode (see
+ * serial_set_attach()) a printer which is running already is used as it is.
+ * @param portname Device of the printer, for example /dev/ttyUSB0 or the pty of the simulator
+ * @param baud Baud rate of the printer, 0 for the rate selected with serial_set_baud()
+ * @return The connection or NULL on errors
+ */
+ty_serial_conn *serial_connect(const char *portname, int baud = 0);
+
+/**
+ * Open the serial port to the printer and use it as the default connection
+ * @param portname Device of the printer, for example /dev/ttyUSB0 or the pty of the simulator
+ * @param baud Baud rate of the printer, 0 for the rate selected with serial_set_baud()
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_open(const char *portname = SERIAL_DEFAULT_PORT, int baud = 0);
+
+/**
+ * Close the serial port of a printer and release the connection
+ */
+void serial_close(ty_serial_conn *conn = NULL);
+
+/**
+ * The default connection, NULL when no printer is connected
+ */
+ty_serial_conn *serial_default_conn();
+
+/**
+ * Number of a connection (0 to SERIAL_MAX_CONNECTIONS-1), for example to keep state per printer
+ * @return The number or -1 when no printer is connected
+ */
+int serial_conn_id(ty_serial_conn *conn = NULL);
+
+/**
+ * Name of the serial port of a connection
+ */
+const char *serial_conn_port(ty_serial_conn *conn = NULL);
+
+/**
+ * Select the baud rate for the printers opened from now on (default SERIAL_DEFAULT_BAUD)
+ * @param baud Baud rate, any rate the serial driver supports (for example 250000 or 1000000)
+ */
+void serial_set_baud(int baud);
+
+/**
+ * Attach to the printers opened from now on without resetting them, instead of resetting them and waiting
+ * for the start banner. A printer which answers M115 right away is ready in a fraction of a second; one
+ * which does not is reset as usual. In attach mode DTR stays up when the port is closed (no HUPCL) so the
+ * next launch does not reset the printer either, and a port which disappears (a USB glitch) is opened again
+ * by serial_reconnect().
+ * @param attach True to attach, false to reset the printers (the default)
+ */
+void serial_set_attach(bool attach);
+
+/**
+ * @return True in attach mode, see serial_set_attach()
+ */
+bool serial_get_attach();
+
+/**
+ * Tune the USB serial adapters of the printers opened from now on for short round trips, see
+ * serial_tune_latency()
+ * @param latency_ms Latency timer in milliseconds, 0 to leave the adapters as they are (the default)
+ */
+void serial_set_latency(int latency_ms);
+
+/**
+ * Make the USB serial adapter of a printer send the replies to the host sooner: set the latency timer of an
+ * FTDI adapter and ASYNC_LOW_LATENCY of the driver. Adapters without these settings are left alone.
+ * @param latency_ms Latency timer in milliseconds (1 to 255)
+ * @return 0 when OK or -1 when the adapter refused a setting (writing sysfs needs root or a udev rule)
+ */
+int serial_tune_latency(int latency_ms, ty_serial_conn *conn = NULL);
+
+/**
+ * Type and settings of the USB serial adapter of a printer, see serial_adapter_info()
+ * @return 0 when OK or -1 otherwise
+ */
+int serial_conn_adapter(ty_serial_adapter *info, ty_serial_conn *conn = NULL);
+
+/**
+ * Open the serial port of a connection again after it was lost, without resetting the printer. The
+ * connection stays the same, so everything kept per printer survives; the commands which were in flight
+ * fail with SERIAL_ERR_RECONNECTED. Called by the serial code when a read fails in attach mode.
+ * @return 0 when the printer answers again or a negative error code otherwise
+ */
+int serial_reconnect(ty_serial_conn *conn = NULL);
+
+/**
+ * Change the baud rate of an open serial port, for example to find the rate of a printer. Commands
+ * still in flight are acknowledged first; whatever arrives before the change completes is discarded.
+ * Not possible while the I/O threads own the port.
+ * @param baud Baud rate, any rate the serial driver supports
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_change_baud(int baud, ty_serial_conn *conn = NULL);
+
+/**
+ * Baud rate of a connection, as set by the serial driver
+ */
+int serial_conn_baud(ty_serial_conn *conn = NULL);
+
+/**
+ * Session of a connection: a number which is unique to the connection and changes whenever it is
+ * reconnected. State kept about the printer (such as its position) is stale when the session changed.
+ */
+unsigned int serial_conn_session(ty_serial_conn *conn = NULL);
+
+/**
+ * Capabilities of the firmware of a printer. They are asked for once (M115 and M420 V) unless they were
+ * set with serial_set_caps(), for example from the printer cache of the discovery.
+ * @return Combination of SERIAL_CAP_* flags or a negative error code
+ */
+int serial_conn_caps(ty_serial_conn *conn = NULL);
+
+/**
+ * Set the capabilities of the firmware of a printer, so they do not have to be asked for
+ * @param caps Combination of SERIAL_CAP_* flags, -1 to ask the printer again
+ */
+void serial_set_caps(int caps, ty_serial_conn *conn = NULL);
+
+/**
+ * Capabilities a line of the replies to M115 or M420 V stands for
+ * @return The SERIAL_CAP_* flag of the line or 0
+ */
+int serial_caps_line(const char *line);
+
+/**
+ * Send a command to the printer and wait for the 'ok'.
+ * @param reply Set to a copy of the reply which the caller has to free(), can be NULL; serial_query()
+ * returns the reply without a copy
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_cmd(const char *cmd, char **reply, bool keepall = false, ty_serial_conn *conn = NULL);
 //int serial_cmd(const char *cmd);
 
+/**
+ * Send a command to the printer and wait for the 'ok'. The reply is borrowed from the connection, so
+ * a printer which is polled all day does not allocate memory for it.
+ * @param reply Set to the reply, valid until the next command to the printer; can be NULL
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_query(const char *cmd, ty_serial_view *reply, bool keepall = false, ty_serial_conn *conn = NULL);
+
+/**
+ * Send a command to the printer and hand each line of the reply before the 'ok' to a function as it
+ * arrives, instead of collecting the reply: the reply can be of any size and is processed while the rest
+ * of it is still on its way. Unsolicited messages go to the message router as usual.
+ * @param cb Function to call for each line
+ * @param user Pointer handed to the function
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_query_lines(const char *cmd, t_serial_line cb, void *user, ty_serial_conn *conn = NULL);
+
+/**
+ * Walk over the lines of a reply.
+ * @param pos Offset in the reply, start with 0
+ * @param line Set to the start of the next line; the line ends with a newline instead of a null
+ * @return Length of the line without the newline or -1 after the last line
+ */
+int serial_reply_next(const ty_serial_view *reply, unsigned int *pos, const char **line);
+
+/**
+ * Class of a command, which decides how long the printer gets to acknowledge it
+ * @param cmd Command as it is sent, without line number
+ * @return One of the SERIAL_CLASS_* values
+ */
+int serial_cmd_class(const char *cmd);
+
+/**
+ * Change the time the printer gets to acknowledge the commands of a class
+ * @param cls One of the SERIAL_CLASS_* values
+ * @param ms Time in milliseconds
+ */
+void serial_set_timeout(int cls, int ms);
+
+/**
+ * Time the printer gets to acknowledge a command, in milliseconds
+ */
+int serial_cmd_timeout(const char *cmd);
+
+/**
+ * Set the function called for each keepalive of a printer; every keepalive also restarts the time the
+ * printer gets to acknowledge the command.
+ * @param cb Function to call, NULL to stop calling it
+ * @param user Pointer handed to the function
+ */
+void serial_set_progress(t_serial_progress cb, void *user, ty_serial_conn *conn = NULL);
+
+/**
+ * Cancel the commands a printer has not acknowledged yet: whoever waits for them gets SERIAL_ERR_CANCELLED
+ * right away, from any thread. The printer is not stopped, its late 'ok's are ignored.
+ */
+void serial_cancel(ty_serial_conn *conn = NULL);
+
+/**
+ * Cancel the unacknowledged commands of all printers. Only writes to an eventfd per printer, so it can be
+ * used from a signal handler.
+ */
+void serial_cancel_all();
+
+/**
+ * Send an emergency command to the printer right away, ahead of everything waiting to be sent and while
+ * other threads wait for replies. After M112 all waits are cancelled and the connection refuses further
+ * commands. Only uses system calls which are safe in a signal handler; the command is not recorded in
+ * the transcript.
+ * @param kind SERIAL_ESTOP_KILL or SERIAL_ESTOP_QUICK
+ * @param report Filled with the time it took to get the command out, can be NULL
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_emergency(int kind, ty_estop_report *report = NULL, ty_serial_conn *conn = NULL);
+
+/**
+ * Send an emergency command to all printers; like serial_emergency() it can be used from a signal handler.
+ * @param kind SERIAL_ESTOP_KILL or SERIAL_ESTOP_QUICK
+ * @param reports Array of SERIAL_MAX_CONNECTIONS reports indexed by serial_conn_id(), can be NULL
+ * @return Number of printers the command was sent to
+ */
+int serial_emergency_all(int kind, ty_estop_report *reports = NULL);
+
+/**
+ * Describe an emergency stop report, for example 'M112 written after 0.021 ms, sent after 0.540 ms'
+ * @param buf Buffer to fill
+ * @param size Size of the buffer
+ */
+void serial_emergency_describe(const ty_estop_report *r, char *buf, int size);
+
 /**
  * When the printer reboots (when the serial port is opened and reset), it will send a
  * starting banner. For example Teacup starts with "start" followed by "ok".
@@ -20,15 +342,98 @@ int serial_cmd(const char *cmd, char **reply, bool keepall = false);
  * @param flush Flush the current serial buffer before waiting for 'ok'
  * @param timeout Timeout in seconds before canceling the wait
  */
-int serial_waitforok(bool flush, int timeout);
+int serial_waitforok(bool flush, int timeout, ty_serial_conn *conn = NULL);
 
 /**
  * Set DTR (Data Transfer Ready) to low and high again - this simulates a modem
  * hangup and should power cycle the printer on the other end.
  */
-void set_reset_dtr();
+void set_reset_dtr(ty_serial_conn *conn = NULL);
 
 void serial_verbose(bool b);
 
+/**
+ * Read all lines the printer sent so far without waiting for more and hand them to the subscribers of
+ * the message router. With the I/O thread running, this happens as soon as the lines arrive.
+ * @return Number of lines handled or a negative error code
+ */
+int serial_poll(ty_serial_conn *conn = NULL);
+
+/**
+ * Queue a command in streaming mode: the command is sent as soon as it fits within the receive
+ * buffer and command queue of the printer, without waiting for the 'ok' of the previous commands.
+ * Each 'ok' that comes back is paired with the oldest unacknowledged command.
+ * @param cmd Command to send, including the trailing newline
+ * @return 0 when the command was sent or a negative error code otherwise
+ */
+int serial_stream_cmd(const char *cmd, ty_serial_conn *conn = NULL);
+
+/**
+ * Wait until all streamed commands have been acknowledged by the printer.
+ * @return 0 when OK, a negative error code on I/O errors or a positive number of commands that were
+ * answered with an error by the printer since the last sync
+ */
+int serial_stream_sync(ty_serial_conn *conn = NULL);
+
+/**
+ * Number of streamed commands which are sent but not acknowledged yet.
+ */
+int serial_stream_inflight(ty_serial_conn *conn = NULL);
+
+/**
+ * Start an empty batch of commands. A batch is sent like streamed commands, but all commands which fit
+ * within the printer buffers at the same time leave with a single write() instead of one per command.
+ */
+void serial_batch_init(ty_serial_batch *batch, ty_serial_conn *conn = NULL);
+
+/**
+ * Add a command to a batch. When the batch is full, the commands collected so far are sent first without
+ * waiting for their acknowledgements.
+ * @param cmd Command to send, including the trailing newline
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_batch_add(ty_serial_batch *batch, const char *cmd);
+
+/**
+ * Send the commands of a batch and wait until the printer acknowledged all of them; the batch is empty
+ * afterwards.
+ * @return 0 when OK, a negative error code on I/O errors or a positive number of commands that were
+ * answered with an error by the printer
+ */
+int serial_batch_send(ty_serial_batch *batch);
+
+/**
+ * Parse the free command buffer slots from an ADVANCED_OK reply ('ok N<line> P<planner> B<buffer>').
+ * @param line Reply line starting with 'ok'
+ * @return The number of free slots or -1 when the reply does not carry this information
+ */
+int serial_advanced_ok_free(const char *line);
+
+/**
+ * Enable or disable line numbers and checksums on all commands sent to the printer. When enabling,
+ * the line number in the printer is reset with M110.
+ * @param on True to send all commands as 'N<line> <command>*<checksum>'
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_set_checksum(bool on, ty_serial_conn *conn = NULL);
+
+/**
+ * Prepare a command for the wire: when checksums are enabled, the command is given the next line
+ * number and a checksum and it is remembered in the history to answer resend requests.
+ * @param cmd Command to send, including the trailing newline
+ * @param out Buffer to receive the command as it is sent, at least SERIAL_WIRE_SIZE bytes
+ * @return Length of the command in the buffer or a negative value when it does not fit
+ */
+int serial_frame(const char *cmd, char *out, ty_serial_conn *conn = NULL);
+
+/**
+ * Let the transport inspect a line received from the printer. Resend requests are answered by
+ * sending the requested lines from the history again.
+ * @param line Line received from the printer
+ * @param conn Connection the line was received on, the lines are sent again on it
+ * @return One of the SERIAL_LINE_* codes
+ */
+int serial_transport_line(const char *line, ty_serial_conn *conn);
+
 
 #endif /* SERIAL_H_ */
@@ -0,0 +1,127 @@
+/*
+ * serial_adapter.cc - USB serial adapters behind the serial ports: the adapter type and latency timer from
+ * sysfs and ASYNC_LOW_LATENCY of the driver.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "main.h"
+#include "serial_adapter.h"
+
+char serial_sysfs_root[PATH_MAX] = SERIAL_SYSFS_ROOT;
+
+/**
+ * Read sysfs below another root than /sys, for example a fake tree to test with
+ * @param root Directory which takes the place of /sys
+ */
+void serial_adapter_set_sysfs(const char *root) {
+	snprintf(serial_sysfs_root, sizeof(serial_sysfs_root), "%s", root);
+}
+
+/**
+ * Root of the sysfs tree, /sys unless changed with serial_adapter_set_sysfs()
+ */
+const char *serial_adapter_sysfs() {
+	return serial_sysfs_root;
+}
+
+/**
+ * Directory of a serial port in sysfs: <root>/class/tty/<device>
+ * @param port Serial port, symlinks such as /dev/serial/by-id/... are followed
+ * @param path Filled with the directory
+ * @param size Size of path
+ * @return 0 when OK or -1 when the port does not exist
+ */
+int serial_adapter_path(const char *port, char *path, int size) {
+	char dev[PATH_MAX];
+	if(realpath(port, dev) == NULL) return -1;
+	int len = snprintf(path, size, "%s/class/tty/%s", serial_sysfs_root, strrchr(dev, '/') + 1);
+	return len < size ? 0 : -1;
+}
+
+/**
+ * Find out which adapter is behind a serial port and how it is set
+ * @param fd Open file descriptor of the port to read ASYNC_LOW_LATENCY, -1 to skip it
+ * @param port Serial port
+ * @param info Filled with what is known about the adapter
+ * @return 0 when OK or -1 when the port does not exist
+ */
+int serial_adapter_info(int fd, const char *port, ty_serial_adapter *info) {
+	char dir[PATH_MAX], path[PATH_MAX + 32], link[PATH_MAX];
+
+	memset(info, 0, sizeof(*info));
+	info->latency_timer = info->low_latency = -1;
+	if(serial_adapter_path(port, dir, sizeof(dir)) < 0) return -1;
+	snprintf(info->device, sizeof(info->device), "%s", strrchr(dir, '/') + 1);
+
+	// The driver is a symlink to the driver directory, its name is the type of the adapter
+	snprintf(path, sizeof(path), "%s/device/driver", dir);
+	int len = readlink(path, link, sizeof(link) - 1);
+	if(len > 0) {
+		link[len] = 0x0;
+		const char *name = strrchr(link, '/');
+		if(snprintf(info->driver, sizeof(info->driver), "%s", name != NULL ? name + 1 : link) >= (int)sizeof(info->driver)) info->driver[0] = 0x0;
+	}
+
+	// Only adapters with a latency timer (FTDI) have the file
+	snprintf(path, sizeof(path), "%s/device/latency_timer", dir);
+	FILE *fh = fopen(path, "r");
+	if(fh != NULL) {
+		if(fscanf(fh, "%d", &info->latency_timer) != 1) info->latency_timer = -1;
+		fclose(fh);
+	}
+
+	struct serial_struct ss;
+	if(fd >= 0 && ioctl(fd, TIOCGSERIAL, &ss) == 0) info->low_latency = (ss.flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+	return 0;
+}
+
+/**
+ * Make an adapter send the received bytes to the host sooner: set its latency timer (when it has one) and
+ * ASYNC_LOW_LATENCY (when the driver supports it).
+ * @param fd Open file descriptor of the port, -1 to leave ASYNC_LOW_LATENCY alone
+ * @param port Serial port
+ * @param latency_ms Latency timer in milliseconds (1 to 255)
+ * @return 0 when OK (also when the adapter has nothing to set) or -1 when a setting was refused (errno is set)
+ */
+int serial_adapter_tune(int fd, const char *port, int latency_ms) {
+	char dir[PATH_MAX], path[PATH_MAX + 32];
+	int res = 0, err = 0;
+
+	if(serial_adapter_path(port, dir, sizeof(dir)) < 0) return -1;
+	snprintf(path, sizeof(path), "%s/device/latency_timer", dir);
+	if(access(path, F_OK) == 0) {
+		FILE *fh = fopen(path, "w");
+		if(fh == NULL || fprintf(fh, "%d\n", latency_ms) < 0) {
+			res = -1;
+			err = errno;
+		}
+		// sysfs reports a refused value when the file is closed
+		if(fh != NULL && fclose(fh) != 0 && res == 0) {
+			res = -1;
+			err = errno;
+		}
+	}
+
+	// Drivers without the flag (ptys, most USB CDC drivers) refuse TIOCGSERIAL; nothing to do for them
+	struct serial_struct ss;
+	if(fd >= 0 && ioctl(fd, TIOCGSERIAL, &ss) == 0 && !(ss.flags & ASYNC_LOW_LATENCY)) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if(ioctl(fd, TIOCSSERIAL, &ss) < 0 && res == 0) {
+			res = -1;
+			err = errno;
+		}
+	}
+	if(res < 0) errno = err;
+	return res;
+}
@@ -0,0 +1,64 @@
+/*
+ * serial_adapter.h - USB serial adapters behind the serial ports. FTDI adapters hold back received bytes
+ * for up to their latency timer (16 ms by default) before they send them to the host, which limits a
+ * printer to about 60 commands per second whatever the baud rate. The adapter type and the timer are read
+ * from sysfs; the timer and ASYNC_LOW_LATENCY of the driver can be set to get the replies sooner.
+ *
+ * The sysfs tree is read below a root which can be moved (serial_adapter_set_sysfs()), so all of this can
+ * be tried against a fake tree without an adapter.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_ADAPTER_H_
+#define SERIAL_ADAPTER_H_
+
+typedef struct {
+	char device[32];		// Name of the tty, for example ttyUSB0
+	char driver[32];		// Kernel driver of the adapter, for example ftdi_sio, cdc_acm or ch341-uart; empty when unknown
+	int latency_timer;		// Latency timer in milliseconds, -1 when the adapter has none
+	int low_latency;		// ASYNC_LOW_LATENCY of the driver: 1 set, 0 cleared or -1 when not supported
+} ty_serial_adapter;
+
+/**
+ * Read sysfs below another root than /sys, for example a fake tree to test with
+ * @param root Directory which takes the place of /sys
+ */
+void serial_adapter_set_sysfs(const char *root);
+
+/**
+ * Root of the sysfs tree, /sys unless changed with serial_adapter_set_sysfs()
+ */
+const char *serial_adapter_sysfs();
+
+/**
+ * Directory of a serial port in sysfs: <root>/class/tty/<device>
+ * @param port Serial port, symlinks such as /dev/serial/by-id/... are followed
+ * @param path Filled with the directory
+ * @param size Size of path
+ * @return 0 when OK or -1 when the port does not exist
+ */
+int serial_adapter_path(const char *port, char *path, int size);
+
+/**
+ * Find out which adapter is behind a serial port and how it is set
+ * @param fd Open file descriptor of the port to read ASYNC_LOW_LATENCY, -1 to skip it
+ * @param port Serial port
+ * @param info Filled with what is known about the adapter
+ * @return 0 when OK or -1 when the port does not exist
+ */
+int serial_adapter_info(int fd, const char *port, ty_serial_adapter *info);
+
+/**
+ * Make an adapter send the received bytes to the host sooner: set its latency timer (when it has one) and
+ * ASYNC_LOW_LATENCY (when the driver supports it). Writing the latency timer needs write access to sysfs,
+ * usually root or a udev rule.
+ * @param fd Open file descriptor of the port, -1 to leave ASYNC_LOW_LATENCY alone
+ * @param port Serial port
+ * @param latency_ms Latency timer in milliseconds (1 to 255)
+ * @return 0 when OK (also when the adapter has nothing to set) or -1 when a setting was refused (errno is set)
+ */
+int serial_adapter_tune(int fd, const char *port, int latency_ms);
+
+#endif /* SERIAL_ADAPTER_H_ */
@@ -0,0 +1,43 @@
+/*
+ * serial_baud.cc - Baud rates of the serial port beyond the B* constants of termios. Many printer boards
+ * run at 250000 baud or faster, which termios cannot express; Linux sets any rate with termios2 and
+ * BOTHER. Kept apart from serial.cc as <asm/termbits.h> cannot be included together with <termios.h>.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "serial_baud.h"
+
+/**
+ * Set the input and output baud rate of a serial port; all other settings are left alone.
+ * @param fd File descriptor of the serial port
+ * @param baud Baud rate, any rate the driver supports (for example 115200, 250000 or 1000000)
+ * @return 0 when OK or -1 when the driver refused the rate (errno is set)
+ */
+int serial_baud_set(int fd, int baud) {
+	struct termios2 tio;
+	if(ioctl(fd, TCGETS2, &tio) < 0) return -1;
+
+	// BOTHER takes the rate from c_ospeed; the same for input (no separate IBSHIFT rate)
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+/**
+ * Output baud rate of a serial port. Both sides of a pseudo-terminal report the rate set on the slave,
+ * so the printer simulator can see the rate the host selected.
+ * @return The baud rate or -1 on errors (errno is set)
+ */
+int serial_baud_get(int fd) {
+	struct termios2 tio;
+	if(ioctl(fd, TCGETS2, &tio) < 0) return -1;
+	return tio.c_ospeed;
+}
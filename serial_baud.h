@@ -0,0 +1,28 @@
+/*
+ * serial_baud.h - Baud rates of the serial port beyond the B* constants of termios. Many printer boards
+ * run at 250000 baud or faster, which termios cannot express; Linux sets any rate with termios2 and
+ * BOTHER. Kept apart from serial.cc as <asm/termbits.h> cannot be included together with <termios.h>.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_BAUD_H_
+#define SERIAL_BAUD_H_
+
+/**
+ * Set the input and output baud rate of a serial port; all other settings are left alone.
+ * @param fd File descriptor of the serial port
+ * @param baud Baud rate, any rate the driver supports (for example 115200, 250000 or 1000000)
+ * @return 0 when OK or -1 when the driver refused the rate (errno is set)
+ */
+int serial_baud_set(int fd, int baud);
+
+/**
+ * Output baud rate of a serial port. Both sides of a pseudo-terminal report the rate set on the slave,
+ * so the printer simulator can see the rate the host selected.
+ * @return The baud rate or -1 on errors (errno is set)
+ */
+int serial_baud_get(int fd);
+
+#endif /* SERIAL_BAUD_H_ */
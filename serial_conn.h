@@ -0,0 +1,147 @@
+/*
+ * serial_conn.h - State of a connection to a printer: the serial port, the transport and the command
+ * queues. Only used by the serial code (serial.cc and serial_thread.cc); everybody else only passes
+ * the handle around.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_CONN_H_
+#define SERIAL_CONN_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stdint.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_thread.h"
+#include "line_framer.h"
+
+#define STREAM_SLOTS 32		// Size of the host-side history of unacknowledged streamed commands (power of 2)
+#define INFLIGHT_SLOTS 32	// Maximum number of commands in flight on the I/O threads (power of 2)
+
+typedef struct serial_request ty_serial_request;	// Command submitted to the I/O threads (serial_thread.cc)
+
+// Cell of the bounded multi-producer single-consumer queue of the I/O threads
+typedef struct {
+	std::atomic<unsigned int> seq;
+	ty_serial_request *req;
+} ty_queue_cell;
+
+struct serial_conn {
+	int id;								// Index in the connection table
+	int fd;								// File descriptor of the serial port
+	char port[SERIAL_PORT_NAME_SIZE];	// Name of the serial port
+	int baud;							// Baud rate of the serial port
+	int caps;							// SERIAL_CAP_* flags of the firmware, -1 until known
+	ty_line_framer rx;					// Splits the data received from the printer into lines
+	int cancel_fd;						// eventfd written by serial_cancel()
+	std::atomic<int> ok_late;			// 'ok's still to come for commands which timed out, were cancelled or stopped
+	std::atomic<bool> halted;			// M112 was sent, the printer has to be reset
+	bool reconnecting;					// serial_reconnect() is opening the port again
+	std::atomic<unsigned int> session;	// Changes on every (re)connect, see serial_conn_session()
+	t_serial_progress progress_cb;		// Called for each keepalive during a long command
+	void *progress_user;
+	char reply_buf[SERIAL_REPLY_BUFFER_SIZE + FRAMER_RING_SIZE + 2];	// Reply of the last serial_query(): kept lines and the 'ok'
+
+	// Line numbers, checksums and resends
+	bool checksum;						// Send all commands with line numbers and checksums
+	long tx_line;						// Line number of the last command sent
+	char tx_history[SERIAL_RESEND_HISTORY][SERIAL_WIRE_SIZE];	// Last sent lines, indexed by line number
+	int tx_history_len[SERIAL_RESEND_HISTORY];
+	long resend_line;					// Line number of the last resend request which was answered
+	long resend_ignore;					// Repeated requests for resend_line which are still expected
+	int resend_error;					// Error before the resend request: 0 none, 1 out-of-sequence line, 2 other
+	int ok_swallow;						// Number of 'ok's following a resend request (not an acknowledgement)
+	bool resync;						// The printer may have missed the last unnumbered M110 (probe, reconnect)
+
+	// Command streaming without the I/O threads: commands sent but not yet acknowledged, oldest first
+	char stream_cmd[STREAM_SLOTS][SERIAL_MAX_CMD_SIZE+1];
+	int stream_cmd_len[STREAM_SLOTS];
+	uint64_t stream_sent[STREAM_SLOTS];	// Time each command was sent (serial_stats_now())
+	unsigned int stream_head;			// Index of the oldest unacknowledged command
+	uint64_t stream_since;				// Time the oldest command could start: sent or the previous one acknowledged
+	unsigned int stream_count;			// Number of unacknowledged commands
+	unsigned int stream_bytes;			// Number of bytes of the unacknowledged commands (printer RX buffer use)
+	int stream_window;					// Commands allowed in flight, updated by ADVANCED_OK replies
+	int stream_errors;					// Commands answered with an error since the last sync
+
+	// I/O threads (serial_thread.cc)
+	std::atomic<bool> attached;			// The connection is handled by the I/O threads
+	ty_queue_cell queue[SERIAL_THREAD_QUEUE_SIZE];
+	std::atomic<unsigned int> queue_enq;
+	unsigned int queue_deq;				// Only used by the I/O thread handling the connection
+	int wake_fd;						// eventfd to wake the I/O threads after a submit
+	int timer_fd;						// timerfd which expires at the deadline of the oldest command in flight
+	int fd_flags;						// File status flags of the serial port before it was attached
+	std::atomic<int> pending;			// Submitted but not yet completed commands
+	std::atomic<int> errors;			// Streamed commands answered with an error by the printer since the last sync
+	std::atomic<int> failed;			// Result of the first streamed command which failed since the last sync, 0 when none
+	std::mutex idle_mutex;
+	std::condition_variable idle;		// Signalled when the last pending command completes
+	std::mutex log_mutex;
+	std::string log_buf;				// Traffic log of the I/O threads, printed by serial_thread_flush_log()
+	ty_serial_request *inflight[INFLIGHT_SLOTS];	// Sent commands waiting for their 'ok', oldest first
+	unsigned int io_head, io_count;
+	uint64_t io_since;					// Time the oldest command could start: sent or the previous one acknowledged
+	uint64_t io_deadline;				// Time the timer is set to, 0 when it is not running
+	unsigned int io_bytes;				// Bytes of the commands in flight (printer RX buffer use)
+	int io_window;						// Commands allowed in flight, updated by ADVANCED_OK replies
+	ty_serial_request *io_next;			// Next command to send, waiting for room in the printer
+	std::string io_out;					// Bytes sent to the port which did not fit in its output buffer yet
+	unsigned int io_out_pos;			// Bytes of io_out already written
+	bool io_out_armed;					// The serial port waits for EPOLLOUT to write io_out
+	ty_serial_request *query_req;		// Request reused by serial_query(), so it allocates nothing
+	std::mutex query_mutex;				// Held during a serial_query(), one query at a time uses the request
+	std::mutex query_wait_mutex;
+	std::condition_variable query_done;	// Signalled when the reply to the reused request is complete
+	bool query_busy;
+	bool io_broken;						// Set when the serial port failed; all commands fail from then on
+	bool io_reconnecting;				// The port is opened again by io_reconnect, nothing is sent meanwhile
+	std::thread io_reconnect;			// Runs serial_reconnect() for the I/O threads
+};
+
+/**
+ * Resolve a connection handle: NULL stands for the default connection.
+ * @return The connection or NULL (after printing an error) when no port is open
+ */
+ty_serial_conn *serial_conn_get(ty_serial_conn *conn);
+
+/**
+ * Read from the serial port into the line framer of a connection with a single read() call and add the
+ * bytes to the transcript when recording.
+ * @return The number of bytes read, 0 when the stream was closed or a negative value on errors
+ * (errno is set by read())
+ */
+int serial_fill(ty_serial_conn *conn);
+
+/**
+ * Test if a line is a keepalive of the printer while it works on a command and report it to the progress
+ * callback. The caller restarts the deadline of the command.
+ * @param type Classes of the line (SERIAL_MSG_*)
+ * @param cmd The command the printer works on
+ * @param sent Time the command was sent (serial_stats_now())
+ * @return True when the line is a keepalive
+ */
+bool serial_keepalive(ty_serial_conn *conn, int type, const char *cmd, uint64_t sent, const char *line);
+
+/**
+ * Send a command through the I/O threads and wait for the reply, reusing the same request every time.
+ * @param reply Set to the reply, which lives in the request until the next serial_thread_query(); can be NULL
+ * @param line_cb Called from the I/O thread for each line before the 'ok' instead of keeping it, can be NULL
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_thread_query(ty_serial_conn *conn, const char *cmd, bool keepall, ty_serial_view *reply, t_serial_line line_cb = NULL, void *line_user = NULL);
+
+/**
+ * Log the handling of a transport line
+ */
+void serial_log_transport(ty_serial_conn *conn, int res, const char *line);
+
+#endif /* SERIAL_CONN_H_ */
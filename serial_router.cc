@@ -0,0 +1,100 @@
+/*
+ * serial_router.cc - Classifies every line received from the printer and hands it to the subscribers
+ * of its class.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <mutex>
+
+#include <string.h>
+#include <strings.h>
+
+#include "serial_router.h"
+#include "serial_stats.h"
+
+typedef struct {
+	int mask;				// Classes the subscriber wants, 0 when the slot is free
+	t_serial_subscriber cb;
+	void *user;
+} ty_subscriber;
+
+ty_subscriber subscribers[SERIAL_ROUTER_MAX_SUBSCRIBERS];
+std::mutex router_mutex;		// Protects the subscribers; held while dispatching
+
+/**
+ * Test if a line is a temperature report: 'T:' (optionally after 'ok' and spaces) followed by a number
+ */
+static bool is_temperature(const char *line) {
+	if(strncasecmp(line, "ok", 2) == 0) line += 2;
+	while(*line == ' ') line++;
+	return (line[0] == 'T' && line[1] == ':' && (line[2] == '-' || (line[2] >= '0' && line[2] <= '9')));
+}
+
+/**
+ * Determine the classes of a line received from the printer.
+ * @param line Line without line ending
+ * @return Combination of SERIAL_MSG_* flags
+ */
+int serial_classify(const char *line) {
+	if(strncasecmp(line, "ok", 2) == 0)
+		return is_temperature(line) ? SERIAL_MSG_REPLY | SERIAL_MSG_TEMPERATURE : SERIAL_MSG_REPLY;
+	if(is_temperature(line)) return SERIAL_MSG_TEMPERATURE;
+	if(strncmp(line, "echo:busy:", 10) == 0 || strncmp(line, "busy:", 5) == 0) return SERIAL_MSG_BUSY;
+	if(strncasecmp(line, "error", 5) == 0 || strncmp(line, "!!", 2) == 0) return SERIAL_MSG_ERROR;
+	if(strncmp(line, "echo:", 5) == 0 || strncmp(line, "//", 2) == 0) return SERIAL_MSG_ECHO;
+	if(strncasecmp(line, "start", 5) == 0) return SERIAL_MSG_START;
+	// Anything else is data of a reply, for example the mesh of G29 T1 or the position of M114
+	return SERIAL_MSG_REPLY;
+}
+
+/**
+ * Classify a line received from the printer and hand it to all subscribers of its classes.
+ * @param conn Connection the line was received on
+ * @param line Line without line ending
+ * @return Combination of SERIAL_MSG_* flags
+ */
+int serial_route(ty_serial_conn *conn, const char *line) {
+	int type = serial_classify(line);
+	serial_stats_rx(conn, type, line, strlen(line));
+
+	std::lock_guard<std::mutex> lock(router_mutex);
+	for(int i=0; i<SERIAL_ROUTER_MAX_SUBSCRIBERS; i++) {
+		if(subscribers[i].mask & type) subscribers[i].cb(conn, type, line, subscribers[i].user);
+	}
+	return type;
+}
+
+/**
+ * Register a function which is called for every received line of the given classes.
+ * @param mask Combination of SERIAL_MSG_* flags
+ * @param cb Function to call
+ * @param user Pointer handed to the function
+ * @return Subscription id for serial_unsubscribe() or a negative error code when all slots are in use
+ */
+int serial_subscribe(int mask, t_serial_subscriber cb, void *user) {
+	if(mask == 0 || cb == NULL) return -2;
+
+	std::lock_guard<std::mutex> lock(router_mutex);
+	for(int i=0; i<SERIAL_ROUTER_MAX_SUBSCRIBERS; i++) {
+		if(subscribers[i].mask == 0) {
+			subscribers[i].cb = cb;
+			subscribers[i].user = user;
+			subscribers[i].mask = mask;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Remove a subscription; when this function returns, the function is not called anymore.
+ * @param id Subscription id returned by serial_subscribe()
+ */
+void serial_unsubscribe(int id) {
+	if(id < 0 || id >= SERIAL_ROUTER_MAX_SUBSCRIBERS) return;
+
+	std::lock_guard<std::mutex> lock(router_mutex);
+	subscribers[id].mask = 0;
+}
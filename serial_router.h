@@ -0,0 +1,72 @@
+/*
+ * serial_router.h - Classifies every line received from the printer and hands it to the subscribers
+ * of its class. Unsolicited messages (temperature reports, busy keepalives, echo and error messages)
+ * are delivered instead of being flushed from the serial buffer before each command.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_ROUTER_H_
+#define SERIAL_ROUTER_H_
+
+#include "serial.h"
+
+// Classes of lines received from the printer; a line can belong to more than one class, for example
+// the reply to M105 ('ok T:20.00 /0.00 B:21.00 /0.00') is both a reply and a temperature report.
+#define SERIAL_MSG_REPLY       0x01		// 'ok' and the lines belonging to the reply of a command
+#define SERIAL_MSG_TEMPERATURE 0x02		// Temperature report: ' T:20.00 /0.00 B:21.00 /0.00 @:0 B@:0'
+#define SERIAL_MSG_BUSY        0x04		// Keepalive during long commands: 'echo:busy: processing'
+#define SERIAL_MSG_ERROR       0x08		// 'Error:...' or '!!'
+#define SERIAL_MSG_ECHO        0x10		// 'echo:...' and host action messages ('//action:...')
+#define SERIAL_MSG_START       0x20		// Start banner of the printer after a reset
+#define SERIAL_MSG_ALL         0xff
+
+// Classes which are never part of the reply to a command
+#define SERIAL_MSG_UNSOLICITED (SERIAL_MSG_TEMPERATURE | SERIAL_MSG_BUSY | SERIAL_MSG_START)
+
+// Maximum number of subscribers at the same time
+#define SERIAL_ROUTER_MAX_SUBSCRIBERS 16
+
+/**
+ * Function called for each line of a subscribed class. It is called from the thread reading the serial
+ * port (the I/O thread when it is running) so it should be short, must not use curses and must not
+ * subscribe or unsubscribe.
+ * @param conn Connection the line was received on
+ * @param type Classes of the line (SERIAL_MSG_*)
+ * @param line The line without line ending, only valid during the call
+ * @param user Pointer handed to serial_subscribe()
+ */
+typedef void (*t_serial_subscriber)(ty_serial_conn *conn, int type, const char *line, void *user);
+
+/**
+ * Determine the classes of a line received from the printer.
+ * @param line Line without line ending
+ * @return Combination of SERIAL_MSG_* flags
+ */
+int serial_classify(const char *line);
+
+/**
+ * Classify a line received from the printer and hand it to all subscribers of its classes.
+ * @param conn Connection the line was received on
+ * @param line Line without line ending
+ * @return Combination of SERIAL_MSG_* flags
+ */
+int serial_route(ty_serial_conn *conn, const char *line);
+
+/**
+ * Register a function which is called for every received line of the given classes.
+ * @param mask Combination of SERIAL_MSG_* flags
+ * @param cb Function to call
+ * @param user Pointer handed to the function
+ * @return Subscription id for serial_unsubscribe() or a negative error code when all slots are in use
+ */
+int serial_subscribe(int mask, t_serial_subscriber cb, void *user);
+
+/**
+ * Remove a subscription; when this function returns, the function is not called anymore.
+ * @param id Subscription id returned by serial_subscribe()
+ */
+void serial_unsubscribe(int id);
+
+#endif /* SERIAL_ROUTER_H_ */
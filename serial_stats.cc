@@ -0,0 +1,398 @@
+/*
+ * serial_stats.cc - Always-on instrumentation of the serial traffic: latency histograms per G-code
+ * verb and traffic counters per printer.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <atomic>
+#include <mutex>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_conn.h"
+#include "serial_router.h"
+#include "serial_stats.h"
+
+#define FIRMWARE_NAME_SIZE 64
+
+// Histogram of the latencies of one verb. Every field is only changed by the thread handling the
+// printer, the atomics allow reading the statistics from any thread.
+typedef struct {
+	std::atomic<uint64_t> key;		// The verb packed into an integer, 0 when the slot is unused
+	std::atomic<unsigned long> count;
+	std::atomic<uint64_t> sum;		// Sum of all latencies, for the mean
+	std::atomic<uint32_t> max;
+	std::atomic<uint32_t> buckets[STATS_BUCKETS];
+} ty_verb_hist;
+
+typedef struct {
+	char port[SERIAL_PORT_NAME_SIZE];
+	char firmware[FIRMWARE_NAME_SIZE];	// From the reply to M115
+	std::mutex names_mutex;				// Protects port and firmware
+	std::atomic<unsigned long> tx_bytes, tx_lines, rx_bytes, rx_lines, errors, resends, busy;
+	std::atomic<int> nverbs;
+	ty_verb_hist verbs[STATS_MAX_VERBS + 1];	// The last slot collects all verbs which did not fit
+} ty_conn_stats;
+
+// Statistics per connection slot; they stay around after the printer is disconnected so they can be
+// written when the program ends.
+ty_conn_stats *stats_slots[SERIAL_MAX_CONNECTIONS];
+std::mutex stats_mutex;		// Protects the allocation of the slots
+
+/**
+ * Current time in nanoseconds (CLOCK_MONOTONIC), the start of a latency measurement.
+ */
+uint64_t serial_stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Bucket of a latency: values below 2*STATS_SUB_COUNT have a bucket of their own, above that every
+ * power of 2 is split into STATS_SUB_COUNT buckets.
+ */
+static int stats_bucket(uint32_t us) {
+	if(us < 2 * STATS_SUB_COUNT) return us;
+	int shift = (31 - __builtin_clz(us)) - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB_COUNT + (us >> shift) - STATS_SUB_COUNT;
+}
+
+/**
+ * Lowest latency which ends up in a bucket
+ */
+static uint64_t stats_bucket_low(int b) {
+	if(b < 2 * STATS_SUB_COUNT) return b;
+	int shift = b / STATS_SUB_COUNT - 1;
+	return (uint64_t)(b % STATS_SUB_COUNT + STATS_SUB_COUNT) << shift;
+}
+
+/**
+ * Highest latency which ends up in a bucket
+ */
+static uint32_t stats_bucket_high(int b) {
+	uint64_t high = stats_bucket_low(b + 1) - 1;
+	return high > UINT32_MAX ? UINT32_MAX : high;
+}
+
+/**
+ * The verb of a command packed into an integer: the first word, for example 'G01' or 'M421'
+ */
+static uint64_t stats_verb_key(const char *cmd) {
+	uint64_t key = 0;
+	while(*cmd == ' ') cmd++;
+	for(int i=0; i<STATS_VERB_SIZE && cmd[i] > ' ' && cmd[i] != '*' && cmd[i] != ';'; i++) {
+		char c = cmd[i];
+		if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+		key |= (uint64_t)(unsigned char)c << (8 * i);
+	}
+	return key;
+}
+
+static void stats_verb_name(uint64_t key, char *out) {
+	int i;
+	for(i=0; i<STATS_VERB_SIZE && (key >> (8 * i)) & 0xff; i++) out[i] = (key >> (8 * i)) & 0xff;
+	out[i] = 0;
+}
+
+static ty_conn_stats *stats_get(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	if(conn == NULL || conn->id < 0) return NULL;
+	return stats_slots[conn->id];
+}
+
+/**
+ * Start collecting the statistics of a newly connected printer; the statistics of the connection
+ * which used the slot before are dropped. Called by serial_connect().
+ */
+void serial_stats_open(ty_serial_conn *conn) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	ty_conn_stats *s = stats_slots[conn->id];
+	if(s != NULL) delete s;
+	s = new ty_conn_stats();
+	snprintf(s->port, sizeof(s->port), "%s", conn->port);
+	stats_slots[conn->id] = s;
+}
+
+/**
+ * Record the acknowledgement of a command.
+ * @param conn Printer which acknowledged the command
+ * @param cmd The command as it was submitted (without line number)
+ * @param sent Time the command was sent, from serial_stats_now()
+ */
+void serial_stats_cmd(ty_serial_conn *conn, const char *cmd, uint64_t sent) {
+	ty_conn_stats *s = stats_slots[conn->id];
+	if(s == NULL) return;
+
+	uint64_t us = (serial_stats_now() - sent) / 1000;
+	uint32_t v = us > UINT32_MAX ? UINT32_MAX : us;
+	uint64_t key = stats_verb_key(cmd);
+
+	// Verbs are only added by the thread handling the printer, so a verb is never added twice
+	int n = s->nverbs.load(std::memory_order_acquire);
+	ty_verb_hist *h = NULL;
+	for(int i=0; i<n; i++) {
+		if(s->verbs[i].key.load(std::memory_order_relaxed) == key) {
+			h = &s->verbs[i];
+			break;
+		}
+	}
+	if(h == NULL) {
+		if(n < STATS_MAX_VERBS) {
+			h = &s->verbs[n];
+			h->key.store(key, std::memory_order_relaxed);
+			s->nverbs.store(n + 1, std::memory_order_release);
+		} else {
+			h = &s->verbs[STATS_MAX_VERBS];
+			h->key.store('*', std::memory_order_relaxed);
+		}
+	}
+
+	h->buckets[stats_bucket(v)].fetch_add(1, std::memory_order_relaxed);
+	h->sum.fetch_add(v, std::memory_order_relaxed);
+	if(v > h->max.load(std::memory_order_relaxed)) h->max.store(v, std::memory_order_relaxed);
+	h->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Count bytes sent to the printer.
+ */
+void serial_stats_tx(ty_serial_conn *conn, unsigned int bytes) {
+	ty_conn_stats *s = stats_slots[conn->id];
+	if(s == NULL) return;
+	s->tx_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	s->tx_lines.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Count a line received from the printer.
+ * @param type Classes of the line (SERIAL_MSG_*), 0 for lines of the transport (resend requests)
+ * @param line The line without line ending
+ * @param len Length of the line
+ */
+void serial_stats_rx(ty_serial_conn *conn, int type, const char *line, unsigned int len) {
+	ty_conn_stats *s = stats_slots[conn->id];
+	if(s == NULL) return;
+	s->rx_bytes.fetch_add(len + 1, std::memory_order_relaxed);
+	s->rx_lines.fetch_add(1, std::memory_order_relaxed);
+	if(type & SERIAL_MSG_ERROR) s->errors.fetch_add(1, std::memory_order_relaxed);
+	if(type & SERIAL_MSG_BUSY) s->busy.fetch_add(1, std::memory_order_relaxed);
+
+	// Remember the firmware to tell the statistics of different firmwares apart
+	if(strncmp(line, "FIRMWARE_NAME:", 14) == 0) {
+		const char *end = strstr(line, " SOURCE_CODE_URL:");
+		int n = end != NULL ? end - line - 14 : (int)len - 14;
+		std::lock_guard<std::mutex> lock(s->names_mutex);
+		snprintf(s->firmware, sizeof(s->firmware), "%.*s", n, line + 14);
+	}
+}
+
+/**
+ * Count an answered resend request.
+ */
+void serial_stats_resend(ty_serial_conn *conn) {
+	ty_conn_stats *s = stats_slots[conn->id];
+	if(s != NULL) s->resends.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void stats_counters(ty_conn_stats *s, ty_serial_counters *out) {
+	out->tx_bytes = s->tx_bytes;
+	out->tx_lines = s->tx_lines;
+	out->rx_bytes = s->rx_bytes;
+	out->rx_lines = s->rx_lines;
+	out->errors = s->errors;
+	out->resends = s->resends;
+	out->busy = s->busy;
+}
+
+/**
+ * Get the traffic counters of a printer.
+ */
+void serial_stats_counters(ty_serial_counters *out, ty_serial_conn *conn) {
+	memset(out, 0, sizeof(*out));
+	ty_conn_stats *s = stats_get(conn);
+	if(s != NULL) stats_counters(s, out);
+}
+
+/**
+ * Firmware of a printer as it reported itself in the reply to M115, empty when it was not asked yet.
+ * @param out Filled with the firmware name
+ * @param size Size of out
+ */
+void serial_stats_firmware(char *out, int size, ty_serial_conn *conn) {
+	if(size > 0) out[0] = 0x0;
+	ty_conn_stats *s = stats_get(conn);
+	if(s == NULL) return;
+	std::lock_guard<std::mutex> lock(s->names_mutex);
+	snprintf(out, size, "%s", s->firmware);
+}
+
+/**
+ * Summarize a histogram; the buckets are copied first as they may change while reading.
+ */
+static void stats_summary(ty_verb_hist *h, ty_verb_stats *out, uint32_t *buckets) {
+	unsigned long count = 0;
+	for(int b=0; b<STATS_BUCKETS; b++) {
+		buckets[b] = h->buckets[b].load(std::memory_order_relaxed);
+		count += buckets[b];
+	}
+
+	stats_verb_name(h->key, out->verb);
+	out->count = count;
+	out->max = h->max;
+	out->mean = count > 0 ? (double)h->sum / count : 0.0;
+
+	// Percentiles: the highest latency of the bucket holding the requested rank
+	const double pct[3] = { 0.50, 0.90, 0.99 };
+	uint32_t *res[3] = { &out->p50, &out->p90, &out->p99 };
+	for(int p=0; p<3; p++) {
+		unsigned long rank = (unsigned long)(pct[p] * count + 0.999999), seen = 0;
+		*res[p] = 0;
+		if(count == 0) continue;
+		if(rank < 1) rank = 1;
+		for(int b=0; b<STATS_BUCKETS; b++) {
+			seen += buckets[b];
+			if(seen >= rank) {
+				*res[p] = stats_bucket_high(b) < out->max ? stats_bucket_high(b) : out->max;
+				break;
+			}
+		}
+	}
+}
+
+static int stats_verbs(ty_conn_stats *s, ty_verb_stats *out, int max) {
+	static uint32_t buckets[STATS_BUCKETS];
+	static std::mutex buckets_mutex;
+	std::lock_guard<std::mutex> lock(buckets_mutex);
+
+	int n = s->nverbs.load(std::memory_order_acquire), filled = 0;
+	for(int i=0; i<=n && filled<max; i++) {
+		// The overflow slot comes last and is only reported when used
+		ty_verb_hist *h = i < n ? &s->verbs[i] : &s->verbs[STATS_MAX_VERBS];
+		if(h->count == 0) continue;
+		stats_summary(h, &out[filled++], buckets);
+	}
+	return filled;
+}
+
+/**
+ * Get the latency summary of each verb sent to a printer.
+ * @param out Array to fill
+ * @param max Size of the array
+ * @return Number of verbs filled in
+ */
+int serial_stats_verbs(ty_verb_stats *out, int max, ty_serial_conn *conn) {
+	ty_conn_stats *s = stats_get(conn);
+	return s != NULL ? stats_verbs(s, out, max) : 0;
+}
+
+/**
+ * Print the counters and latencies of a printer as a table.
+ * @param wnd Window to print in, stdout when NULL
+ */
+void serial_stats_print(WINDOW *wnd, ty_serial_conn *conn) {
+	ty_serial_counters c;
+	ty_verb_stats v[STATS_MAX_VERBS + 1];
+	char line[160];
+
+	serial_stats_counters(&c, conn);
+	int n = serial_stats_verbs(v, STATS_MAX_VERBS + 1, conn);
+
+#define STATS_MS(us) ((us) < 9999999999.0 ? (us) / 1000.0 : 9999999.99)
+#define STATS_OUT(...) { snprintf(line, sizeof(line), __VA_ARGS__); if(wnd != NULL) wprintw(wnd, "%s", line); else fputs(line, stdout); }
+	STATS_OUT("Serial statistics of %s\n", serial_conn_port(conn));
+	STATS_OUT("  sent %lu lines / %lu bytes, received %lu lines / %lu bytes\n", c.tx_lines, c.tx_bytes, c.rx_lines, c.rx_bytes);
+	STATS_OUT("  %lu errors, %lu resends, %lu busy\n", c.errors, c.resends, c.busy);
+	STATS_OUT("  %-8s %8s %10s %10s %10s %10s %10s\n", "verb", "count", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for(int i=0; i<n; i++) {
+		// Verbs are at most STATS_VERB_SIZE long; latencies are capped so every column keeps its width
+		STATS_OUT("  %-8.8s %8lu %10.2f %10.2f %10.2f %10.2f %10.2f\n", v[i].verb, v[i].count, STATS_MS(v[i].mean),
+				STATS_MS(v[i].p50), STATS_MS(v[i].p90), STATS_MS(v[i].p99), STATS_MS(v[i].max));
+	}
+#undef STATS_OUT
+#undef STATS_MS
+	if(wnd != NULL) wrefresh(wnd);
+}
+
+/**
+ * Write a string as a JSON string, with quotes and escapes
+ */
+void serial_stats_json_string(FILE *fh, const char *s) {
+	fputc('"', fh);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') fprintf(fh, "\\%c", *s);
+		else if((unsigned char)*s < 0x20) fprintf(fh, "\\u%04x", *s);
+		else fputc(*s, fh);
+	}
+	fputc('"', fh);
+}
+
+/**
+ * Write the statistics of all printers connected since the start of the program as JSON, including
+ * the non-empty histogram buckets so runs can be merged later.
+ * @param path File to write
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_stats_write_json(const char *path) {
+	static uint32_t buckets[STATS_BUCKETS];
+	FILE *fh = fopen(path, "w");
+	if(fh == NULL) {
+		fprintf(stderr, "error %d writing %s: %s\n", errno, path, strerror (errno));
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	fprintf(fh, "{\n  \"latency_unit\": \"us\",\n  \"printers\": [");
+	bool first = true;
+	for(int i=0; i<SERIAL_MAX_CONNECTIONS; i++) {
+		ty_conn_stats *s = stats_slots[i];
+		if(s == NULL) continue;
+
+		ty_serial_counters c;
+		stats_counters(s, &c);
+		fprintf(fh, "%s\n    {\n      \"port\": ", first ? "" : ",");
+		first = false;
+		{
+			std::lock_guard<std::mutex> names_lock(s->names_mutex);
+			serial_stats_json_string(fh, s->port);
+			fprintf(fh, ",\n      \"firmware\": ");
+			serial_stats_json_string(fh, s->firmware);
+		}
+		fprintf(fh, ",\n      \"tx_bytes\": %lu, \"tx_lines\": %lu, \"rx_bytes\": %lu, \"rx_lines\": %lu,\n", c.tx_bytes, c.tx_lines, c.rx_bytes, c.rx_lines);
+		fprintf(fh, "      \"errors\": %lu, \"resends\": %lu, \"busy\": %lu,\n      \"commands\": {", c.errors, c.resends, c.busy);
+
+		int n = s->nverbs.load(std::memory_order_acquire);
+		bool first_verb = true;
+		for(int j=0; j<=n; j++) {
+			ty_verb_hist *h = j < n ? &s->verbs[j] : &s->verbs[STATS_MAX_VERBS];
+			if(h->count == 0) continue;
+			ty_verb_stats v;
+			stats_summary(h, &v, buckets);
+			fprintf(fh, "%s\n        ", first_verb ? "" : ",");
+			first_verb = false;
+			serial_stats_json_string(fh, v.verb);
+			fprintf(fh, ": { \"count\": %lu, \"mean\": %.1f, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u,\n",
+					v.count, v.mean, v.p50, v.p90, v.p99, v.max);
+			// Buckets as [lowest latency, count] pairs
+			fprintf(fh, "          \"buckets\": [");
+			bool first_bucket = true;
+			for(int b=0; b<STATS_BUCKETS; b++) {
+				if(buckets[b] == 0) continue;
+				fprintf(fh, "%s[%llu, %u]", first_bucket ? "" : ", ", (unsigned long long)stats_bucket_low(b), buckets[b]);
+				first_bucket = false;
+			}
+			fprintf(fh, "] }");
+		}
+		fprintf(fh, "%s}\n    }", first_verb ? "" : "\n      ");
+	}
+	fprintf(fh, "\n  ]\n}\n");
+	fclose(fh);
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * serial_stats.h - Always-on instrumentation of the serial traffic: the time from sending a command
+ * to its 'ok' is recorded per G-code verb (G01, G28, M421, ...) in log-linear histograms, and bytes,
+ * lines, errors and resends are counted per printer.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_STATS_H_
+#define SERIAL_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <curses.h>
+
+#include "serial.h"
+
+// Maximum number of different verbs per printer; later verbs are counted together as '*'
+#define STATS_MAX_VERBS 32
+// Longest verb which is told apart from others (longer verbs are cut off)
+#define STATS_VERB_SIZE 8
+// The histograms have 2^STATS_SUB_BITS buckets per power of 2, so a recorded latency is off by at most
+// 1/2^STATS_SUB_BITS (about 3%) of its value; latencies are recorded in microseconds up to 2^32.
+#define STATS_SUB_BITS 5
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((32 - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+/**
+ * Summary of the latencies of one verb, all times in microseconds
+ */
+typedef struct {
+	char verb[STATS_VERB_SIZE+1];
+	unsigned long count;		// Number of acknowledged commands
+	double mean;
+	uint32_t p50, p90, p99;		// Percentiles, accurate to the bucket size
+	uint32_t max;
+} ty_verb_stats;
+
+/**
+ * Traffic counters of a printer
+ */
+typedef struct {
+	unsigned long tx_bytes, tx_lines;	// Sent to the printer, including resent lines
+	unsigned long rx_bytes, rx_lines;	// Received from the printer
+	unsigned long errors;				// Error messages of the printer
+	unsigned long resends;				// Resend requests answered
+	unsigned long busy;					// Busy keepalives
+} ty_serial_counters;
+
+/**
+ * Current time in nanoseconds (CLOCK_MONOTONIC), the start of a latency measurement.
+ */
+uint64_t serial_stats_now();
+
+/**
+ * Start collecting the statistics of a newly connected printer; the statistics of the connection
+ * which used the slot before are dropped. Called by serial_connect().
+ */
+void serial_stats_open(ty_serial_conn *conn);
+
+/**
+ * Record the acknowledgement of a command.
+ * @param conn Printer which acknowledged the command
+ * @param cmd The command as it was submitted (without line number)
+ * @param sent Time the command was sent, from serial_stats_now()
+ */
+void serial_stats_cmd(ty_serial_conn *conn, const char *cmd, uint64_t sent);
+
+/**
+ * Count bytes sent to the printer.
+ */
+void serial_stats_tx(ty_serial_conn *conn, unsigned int bytes);
+
+/**
+ * Count a line received from the printer.
+ * @param type Classes of the line (SERIAL_MSG_*), 0 for lines of the transport (resend requests)
+ * @param line The line without line ending
+ * @param len Length of the line
+ */
+void serial_stats_rx(ty_serial_conn *conn, int type, const char *line, unsigned int len);
+
+/**
+ * Count an answered resend request.
+ */
+void serial_stats_resend(ty_serial_conn *conn);
+
+/**
+ * Get the traffic counters of a printer.
+ */
+void serial_stats_counters(ty_serial_counters *out, ty_serial_conn *conn = NULL);
+
+/**
+ * Get the latency summary of each verb sent to a printer.
+ * @param out Array to fill
+ * @param max Size of the array
+ * @return Number of verbs filled in
+ */
+int serial_stats_verbs(ty_verb_stats *out, int max, ty_serial_conn *conn = NULL);
+
+/**
+ * Firmware of a printer as it reported itself in the reply to M115, empty when it was not asked yet.
+ * @param out Filled with the firmware name
+ * @param size Size of out
+ */
+void serial_stats_firmware(char *out, int size, ty_serial_conn *conn = NULL);
+
+/**
+ * Print the counters and latencies of a printer as a table.
+ * @param wnd Window to print in, stdout when NULL
+ */
+void serial_stats_print(WINDOW *wnd, ty_serial_conn *conn = NULL);
+
+/**
+ * Write the statistics of all printers connected since the start of the program as JSON, including
+ * the non-empty histogram buckets so runs can be merged later.
+ * @param path File to write
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_stats_write_json(const char *path);
+
+/**
+ * Write a string as a JSON string, with quotes and escapes
+ */
+void serial_stats_json_string(FILE *fh, const char *s);
+
+#endif /* SERIAL_STATS_H_ */
@@ -0,0 +1,780 @@
+/*
+ * serial_thread.cc - Pool of I/O threads which owns the serial ports. Commands are submitted to a
+ * lock-free queue per printer from any thread; the I/O threads wait on all serial ports at once with
+ * epoll, send the commands as soon as they fit within the buffers of the printer and hand the reply
+ * back through a future or a callback.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_conn.h"
+#include "serial_thread.h"
+#include "serial_router.h"
+#include "serial_stats.h"
+#include "transcript.h"
+#include "line_framer.h"
+
+#include <curses.h>
+extern WINDOW *serial_win;
+extern bool serial_ena_output;
+
+#define message(...) { if(serial_ena_output) { if(serial_win==NULL) printf(__VA_ARGS__); \
+						else { wprintw(serial_win, __VA_ARGS__); wrefresh(serial_win); }}}
+
+#define LOG_LIMIT 65536		// Maximum size of the traffic log between two flushes
+#define EPOLL_EVENTS 16		// Events handled per epoll_wait() call
+
+// Value of the epoll events: the connection slot times four plus the kind of file descriptor
+#define EV_SERIAL 0		// Serial port
+#define EV_WAKE   1		// Wakeup eventfd, written after a submit
+#define EV_CANCEL 2		// Cancel eventfd, written by serial_cancel()
+#define EV_TIMER  3		// Deadline of the oldest command in flight
+#define EV_VALUE(id, kind) ((uint64_t)(id) * 4 + (kind))
+#define EV_STOP   UINT64_MAX
+
+struct serial_request {
+	char cmd[SERIAL_MAX_CMD_SIZE+2];		// The command with a single '\n'
+	unsigned int len;						// Length of cmd, including the '\n'
+	char wire[SERIAL_WIRE_SIZE];			// The command as sent, with line number and checksum when enabled
+	unsigned int wire_len;
+	uint64_t sent;							// Time the command was sent (serial_stats_now())
+	bool keepall;
+	t_serial_line line_cb;					// Called for each line of the reply instead of keeping it (keepall)
+	void *line_user;
+	std::promise<ty_serial_reply> *promise;	// Set when the caller waits on a future
+	t_serial_callback cb;					// Set when the caller wants a callback
+	void *user;
+	bool reused;							// Owned by the connection (serial_thread_query()), not released
+	ty_serial_reply reply;
+};
+
+// A connection slot of the I/O threads. The slots outlive the connections so an event which was
+// already picked up by one thread while the connection is detached by another can be ignored safely.
+typedef struct {
+	std::mutex lock;			// Held while a thread handles the connection
+	ty_serial_conn *conn;		// Attached connection, NULL when the slot is free
+} ty_io_slot;
+
+ty_io_slot io_slots[SERIAL_MAX_CONNECTIONS];
+
+std::mutex io_pool_mutex;					// Protects the pool while connections attach and detach
+std::thread io_threads[SERIAL_THREAD_POOL_SIZE];
+int io_epoll_fd = -1;						// Waits on the serial ports and wakeup eventfds of all connections
+int io_stop_fd = -1;						// eventfd which stops all I/O threads (never re-armed)
+int io_attached = 0;						// Number of attached connections
+
+/**
+ * Add a line to the traffic log of a connection; called from the I/O threads.
+ */
+static void thread_log(ty_serial_conn *conn, const char *fmt, ...) {
+	char buf[SERIAL_REPLY_BUFFER_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	std::lock_guard<std::mutex> lock(conn->log_mutex);
+	if(conn->log_buf.size() < LOG_LIMIT) conn->log_buf += buf;
+}
+
+// Bounded multi-producer single-consumer queue (D. Vyukov): each cell carries a sequence number
+// which tells producers and the consumer whether the cell is free or filled for their lap.
+static bool queue_push(ty_serial_conn *conn, ty_serial_request *req) {
+	unsigned int pos = conn->queue_enq.load(std::memory_order_relaxed);
+	while(1) {
+		ty_queue_cell *cell = &conn->queue[pos % SERIAL_THREAD_QUEUE_SIZE];
+		int diff = (int)(cell->seq.load(std::memory_order_acquire) - pos);
+		if(diff == 0) {
+			// Cell is free for this lap; claim it
+			if(conn->queue_enq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell->req = req;
+				cell->seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(diff < 0) {
+			// Queue is full
+			return false;
+		} else {
+			// Another producer claimed the cell first
+			pos = conn->queue_enq.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+static ty_serial_request *queue_pop(ty_serial_conn *conn) {
+	ty_queue_cell *cell = &conn->queue[conn->queue_deq % SERIAL_THREAD_QUEUE_SIZE];
+	if((int)(cell->seq.load(std::memory_order_acquire) - (conn->queue_deq + 1)) < 0) return NULL;
+	ty_serial_request *req = cell->req;
+	cell->seq.store(conn->queue_deq + SERIAL_THREAD_QUEUE_SIZE, std::memory_order_release);
+	conn->queue_deq++;
+	return req;
+}
+
+/**
+ * Hand the reply to the caller and release the request; called from the I/O threads.
+ */
+static void complete(ty_serial_conn *conn, ty_serial_request *req) {
+	// A streamed command has nobody waiting for its result, the next sync reports that it failed; the
+	// callers of the other commands get the result themselves
+	bool streamed = req->promise == NULL && req->cb == NULL && !req->reused;
+	int none = 0;
+	if(streamed && req->reply.result > 0) conn->errors++;
+	if(streamed && req->reply.result < 0) conn->failed.compare_exchange_strong(none, req->reply.result);
+	if(req->promise != NULL) {
+		req->promise->set_value(req->reply);
+		delete req->promise;
+	}
+	// The owner of a reused request may send the next command as soon as the callback returns
+	bool reused = req->reused;
+	if(req->cb != NULL) req->cb(&req->reply, req->user);
+	if(!reused) delete req;
+
+	if(--conn->pending == 0) {
+		std::lock_guard<std::mutex> lock(conn->idle_mutex);
+		conn->idle.notify_all();
+	}
+}
+
+/**
+ * Fail all commands in flight
+ * @param result Result handed to the callers
+ */
+static void conn_fail_inflight(ty_serial_conn *conn, int result) {
+	for(; conn->io_count > 0; conn->io_count--, conn->io_head = (conn->io_head + 1) % INFLIGHT_SLOTS) {
+		conn->inflight[conn->io_head]->reply.result = result;
+		complete(conn, conn->inflight[conn->io_head]);
+	}
+	conn->io_bytes = 0;
+}
+
+/**
+ * Fail all commands in flight after the serial port broke; new commands fail right away.
+ */
+static void conn_break(ty_serial_conn *conn) {
+	conn->io_broken = true;
+	conn_fail_inflight(conn, -1);
+}
+
+/**
+ * Give up on all commands in flight and all queued commands; the 'ok's the printer still sends for the
+ * commands in flight are ignored.
+ * @param result SERIAL_ERR_TIMEOUT or SERIAL_ERR_CANCELLED
+ */
+static void conn_give_up(ty_serial_conn *conn, int result) {
+	// The commands in flight while the port is opened again are lost, their 'ok's never arrive
+	if(!conn->io_reconnecting) conn->ok_late += conn->io_count;
+	conn_fail_inflight(conn, result);
+
+	ty_serial_request *req = conn->io_next;
+	conn->io_next = NULL;
+	if(req == NULL) req = queue_pop(conn);
+	for(; req != NULL; req = queue_pop(conn)) {
+		req->reply.result = result;
+		complete(conn, req);
+	}
+}
+
+/**
+ * Time the oldest command in flight has to be acknowledged by, 0 when nothing is in flight
+ */
+static uint64_t conn_deadline(ty_serial_conn *conn) {
+	if(conn->io_count == 0) return 0;
+	return conn->io_since + (uint64_t)serial_cmd_timeout(conn->inflight[conn->io_head]->cmd) * 1000000;
+}
+
+/**
+ * Set the timer of a connection to the deadline of the oldest command in flight
+ */
+static void conn_set_timer(ty_serial_conn *conn) {
+	uint64_t deadline = conn_deadline(conn);
+	if(deadline == conn->io_deadline) return;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000ull;
+	its.it_value.tv_nsec = deadline % 1000000000ull;
+	timerfd_settime(conn->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	conn->io_deadline = deadline;
+}
+
+/**
+ * The timer expired: give up when the oldest command is not acknowledged in time.
+ */
+static void conn_check_deadline(ty_serial_conn *conn) {
+	// The commands in flight fail once the port is back or given up
+	if(conn->io_reconnecting) return;
+	uint64_t deadline = conn_deadline(conn);
+	conn->io_deadline = 0;
+	if(deadline == 0 || serial_stats_now() < deadline) return;
+
+	const char *cmd = conn->inflight[conn->io_head]->cmd;
+	thread_log(conn, "error: no reply to '%.*s' within %i ms\n", (int)strcspn(cmd, "\n"), cmd, serial_cmd_timeout(cmd));
+	conn_give_up(conn, SERIAL_ERR_TIMEOUT);
+}
+
+/**
+ * Write as much of the output of a connection as the port takes; the port is non-blocking, so the rest
+ * is written when the port reports EPOLLOUT.
+ */
+static void conn_flush(ty_serial_conn *conn) {
+	// After a kill nothing else has to reach the printer
+	if(conn->halted) conn->io_out.clear();
+	while(conn->io_out_pos < conn->io_out.size()) {
+		ssize_t n = write(conn->fd, conn->io_out.data() + conn->io_out_pos, conn->io_out.size() - conn->io_out_pos);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if(n <= 0) {
+			thread_log(conn, "error while writing to port: %s (%i)\n", strerror (errno), errno);
+			conn_fail_inflight(conn, -1);
+			break;
+		}
+		conn->io_out_pos += n;
+	}
+	conn->io_out.clear();
+	conn->io_out_pos = 0;
+}
+
+/**
+ * Send all queued commands of a connection which fit within the printer buffers, together with a single
+ * write() call. The commands are in flight from then on, also when the port takes only part of them.
+ */
+static void conn_send(ty_serial_conn *conn) {
+	// The queued commands wait for the port to come back
+	if(conn->io_reconnecting) return;
+	uint64_t sent = serial_stats_now();
+	while(1) {
+		if(conn->io_next == NULL) conn->io_next = queue_pop(conn);
+		ty_serial_request *next = conn->io_next;
+		if(next == NULL) break;
+		if(conn->io_broken || conn->halted) {
+			next->reply.result = -1;
+			complete(conn, next);
+			conn->io_next = NULL;
+			continue;
+		}
+		// Reserve room for the line number and checksum; the command is only framed right before
+		// sending, as answering a resend request sends all framed lines.
+		unsigned int len = next->len + (conn->checksum ? SERIAL_WIRE_SIZE - SERIAL_MAX_CMD_SIZE : 0);
+		if(conn->io_count > 0 && ((int)conn->io_count >= conn->io_window ||
+				conn->io_bytes + len > SERIAL_RX_BUFFER_SIZE || conn->io_count == INFLIGHT_SLOTS)) break;
+
+		next->wire_len = serial_frame(next->cmd, next->wire, conn);
+		thread_log(conn, "> %s", next->wire);
+		conn->io_next = NULL;
+		next->sent = sent;
+		if(conn->io_count == 0) conn->io_since = sent;
+		conn->inflight[(conn->io_head + conn->io_count) % INFLIGHT_SLOTS] = next;
+		conn->io_count++;
+		conn->io_bytes += next->wire_len;
+		conn->io_out.append(next->wire, next->wire_len);
+		serial_stats_tx(conn, next->wire_len);
+		transcript_tx(conn, next->wire, next->wire_len);
+	}
+	conn_flush(conn);
+}
+
+/**
+ * Handle a line received from the printer: pair 'ok's and errors with the oldest command in flight.
+ * @return False when the stream is lost
+ */
+static bool conn_line(ty_serial_conn *conn, ty_line *line) {
+	ty_serial_request *oldest = conn->io_count > 0 ? conn->inflight[conn->io_head] : NULL;
+
+	// Resend requests and their 'ok's are handled by the transport
+	int tr = serial_transport_line(line->str, conn);
+	if(tr == SERIAL_LINE_RESEND_FAILED) {
+		// The printer wants a line which is not in the history anymore; the stream is lost
+		thread_log(conn, "error: cannot answer '%s', line not in history\n", line->str);
+		return false;
+	} else if(tr != SERIAL_LINE_NORMAL) {
+		thread_log(conn, "* %s\n", line->str);
+		return true;
+	}
+
+	// Every line goes to the subscribers of the message router, including unsolicited ones
+	int type = serial_route(conn, line->str);
+	if(strncasecmp(line->str, "ok", 2) == 0) {
+		if(oldest == NULL) {
+			// Late or unsolicited 'ok' - nothing to pair it with
+			thread_log(conn, "* %s\n", line->str);
+			return true;
+		}
+		thread_log(conn, "< %s\n", line->str);
+		serial_stats_cmd(conn, oldest->cmd, oldest->sent);
+		oldest->reply.text.append(line->str, line->len);
+		oldest->reply.text += '\n';
+
+		conn->io_head = (conn->io_head + 1) % INFLIGHT_SLOTS;
+		conn->io_count--;
+		conn->io_bytes -= oldest->wire_len;
+		conn->io_since = serial_stats_now();
+
+		int free_slots = serial_advanced_ok_free(line->str);
+		if(free_slots >= 0) conn->io_window = free_slots < 1 ? 1 : (free_slots > INFLIGHT_SLOTS ? INFLIGHT_SLOTS : free_slots);
+
+		complete(conn, oldest);
+	} else if(oldest != NULL && serial_keepalive(conn, type, oldest->cmd, oldest->sent, line->str)) {
+		// The printer is still working on the command, it gets its full time again
+		thread_log(conn, "~ %s (%.*s)\n", line->str, (int)strcspn(oldest->cmd, "\n"), oldest->cmd);
+		conn->io_since = serial_stats_now();
+	} else {
+		if(oldest != NULL && (type & SERIAL_MSG_ERROR)) {
+			// Marlin follows an error with an 'ok' for the same command
+			thread_log(conn, "error: printer reported '%s' for '%.*s'\n", line->str, (int)strcspn(oldest->cmd, "\n"), oldest->cmd);
+			oldest->reply.result = 1;
+		} else {
+			thread_log(conn, "* %s\n", line->str);
+		}
+		if(oldest != NULL && oldest->keepall && !(type & SERIAL_MSG_UNSOLICITED)) {
+			if(oldest->line_cb != NULL) {
+				oldest->line_cb(line->str, line->len, oldest->line_user);
+			} else {
+				oldest->reply.text.append(line->str, line->len);
+				oldest->reply.text += '\n';
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * File descriptor of a kind of event of a connection
+ */
+static int conn_event_fd(ty_serial_conn *conn, int kind) {
+	switch(kind) {
+	case EV_WAKE:   return conn->wake_fd;
+	case EV_CANCEL: return conn->cancel_fd;
+	case EV_TIMER:  return conn->timer_fd;
+	default:        return conn->fd;
+	}
+}
+
+/**
+ * Add or arm an event of a connection again; the events are one-shot so only one thread handles a
+ * connection at a time.
+ */
+static void conn_arm(ty_serial_conn *conn, int kind, int op = EPOLL_CTL_MOD) {
+	struct epoll_event e;
+	e.events = EPOLLIN | EPOLLONESHOT;
+	if(kind == EV_SERIAL) {
+		// Wait for room in the output buffer of the port as well when output is left over
+		conn->io_out_armed = !conn->io_out.empty();
+		if(conn->io_out_armed) e.events |= EPOLLOUT;
+	}
+	e.data.u64 = EV_VALUE(conn->id, kind);
+	epoll_ctl(io_epoll_fd, op, conn_event_fd(conn, kind), &e);
+}
+
+/**
+ * Open the serial port of a connection again after a read failed. Runs in a thread of its own, as it can
+ * take seconds and the pool threads serve the other printers meanwhile; the serial port is not armed
+ * until it is done.
+ */
+static void conn_reconnect(ty_serial_conn *conn) {
+	int res = serial_reconnect(conn);
+
+	std::lock_guard<std::mutex> lock(io_slots[conn->id].lock);
+	conn->io_reconnecting = false;
+	if(res == 0) {
+		thread_log(conn, "Reconnected to %s\n", conn->port);
+		// What was not written yet belongs to the commands which are lost
+		conn->io_out.clear();
+		conn->io_out_pos = 0;
+		conn_fail_inflight(conn, SERIAL_ERR_RECONNECTED);
+		fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+		conn_send(conn);
+		// Closing the old port removed it from epoll
+		conn_arm(conn, EV_SERIAL, EPOLL_CTL_ADD);
+	} else {
+		thread_log(conn, "error: could not reconnect to %s (%i)\n", conn->port, res);
+		conn_break(conn);
+		conn_send(conn);
+	}
+	conn_set_timer(conn);
+}
+
+/**
+ * Read everything the printer sent (the serial port is non-blocking while attached) and handle it.
+ */
+static void conn_receive(ty_serial_conn *conn) {
+	while(!conn->io_broken) {
+		int br = serial_fill(conn);
+		if(br < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+		if(br <= 0) {
+			if(br == 0) thread_log(conn, "error: stream closed during read\n");
+			else thread_log(conn, "error while reading from port: %s (%i)\n", strerror (errno), errno);
+			// The port of a USB printer disappears for a moment on a glitch; the printer keeps its state
+			// but the commands in flight are lost. A thread of its own waits for the port to come back.
+			conn->io_reconnecting = true;
+			if(conn->io_reconnect.joinable()) conn->io_reconnect.join();
+			conn->io_reconnect = std::thread(conn_reconnect, conn);
+			return;
+		}
+
+		ty_line line;
+		while(framer_next(&conn->rx, &line)) {
+			if(!conn_line(conn, &line)) {
+				conn_break(conn);
+				return;
+			}
+		}
+	}
+}
+
+static void io_thread_main() {
+	struct epoll_event events[EPOLL_EVENTS];
+
+	while(1) {
+		int n = epoll_wait(io_epoll_fd, events, EPOLL_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "error: epoll_wait failed: %s (%i)\n", strerror (errno), errno);
+			return;
+		}
+
+		for(int i=0; i<n; i++) {
+			if(events[i].data.u64 == EV_STOP) return;
+
+			int id = events[i].data.u64 / 4;
+			int kind = events[i].data.u64 % 4;
+			ty_io_slot *slot = &io_slots[id];
+			std::lock_guard<std::mutex> lock(slot->lock);
+			ty_serial_conn *conn = slot->conn;
+			if(conn == NULL) continue;	// Detached in the meantime
+
+			uint64_t v;
+			switch(kind) {
+			case EV_SERIAL:
+				conn_receive(conn);
+				break;
+			case EV_CANCEL:
+				read(conn->cancel_fd, &v, sizeof(v));
+				if(conn->pending > 0) thread_log(conn, "error: %i commands cancelled\n", (int)conn->pending);
+				conn_give_up(conn, SERIAL_ERR_CANCELLED);
+				break;
+			case EV_TIMER:
+				read(conn->timer_fd, &v, sizeof(v));
+				conn_check_deadline(conn);
+				break;
+			default:
+				read(conn->wake_fd, &v, sizeof(v));
+				break;
+			}
+			conn_send(conn);
+			conn_set_timer(conn);
+
+			// The serial port of a broken connection is not armed anymore, while reconnecting it is armed
+			// again by conn_reconnect()
+			bool port_ok = !conn->io_broken && !conn->io_reconnecting;
+			if(kind != EV_SERIAL || port_ok) conn_arm(conn, kind);
+			// Output left over from another event waits for the serial port to take it
+			if(kind != EV_SERIAL && port_ok && !conn->io_out.empty() && !conn->io_out_armed) conn_arm(conn, EV_SERIAL);
+		}
+	}
+}
+
+/**
+ * Start the I/O threads for a printer; from now on all serial commands to it are handled by the
+ * threads. The thread pool is started with the first printer.
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_thread_start(ty_serial_conn *conn) {
+	if((conn = serial_conn_get(conn)) == NULL) return -1;
+	if(conn->attached) return 0;
+
+	// Commands which were streamed before the threads took over are collected first
+	if(serial_stream_sync(conn) < 0) return -1;
+
+	std::lock_guard<std::mutex> pool_lock(io_pool_mutex);
+	if(io_attached == 0) {
+		io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		io_stop_fd = eventfd(0, EFD_NONBLOCK);
+		if(io_epoll_fd < 0 || io_stop_fd < 0) {
+			fprintf(stderr, "error %d creating the I/O thread pool: %s\n", errno, strerror (errno));
+			if(io_epoll_fd >= 0) close(io_epoll_fd);
+			if(io_stop_fd >= 0) close(io_stop_fd);
+			io_epoll_fd = io_stop_fd = -1;
+			return -1;
+		}
+		// Level-triggered and never read, so every thread sees it
+		struct epoll_event e;
+		e.events = EPOLLIN;
+		e.data.u64 = EV_STOP;
+		epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, io_stop_fd, &e);
+		for(int i=0; i<SERIAL_THREAD_POOL_SIZE; i++) io_threads[i] = std::thread(io_thread_main);
+	}
+
+	for(unsigned int i=0; i<SERIAL_THREAD_QUEUE_SIZE; i++) conn->queue[i].seq.store(i, std::memory_order_relaxed);
+	conn->queue_enq = 0;
+	conn->queue_deq = 0;
+	conn->pending = 0;
+	conn->errors = 0;
+	conn->failed = 0;
+	conn->io_head = conn->io_count = conn->io_bytes = 0;
+	conn->io_window = SERIAL_STREAM_MAX_INFLIGHT;
+	conn->io_next = NULL;
+	conn->io_out.clear();
+	conn->io_out_pos = 0;
+	conn->io_out_armed = false;
+	conn->io_broken = false;
+	conn->io_reconnecting = false;
+	conn->io_deadline = 0;
+	conn->query_req = new ty_serial_request();
+	conn->query_req->promise = NULL;
+	conn->query_req->reused = true;
+
+	conn->wake_fd = eventfd(0, EFD_NONBLOCK);
+	conn->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(conn->wake_fd < 0 || conn->timer_fd < 0) {
+		fprintf(stderr, "error %d creating eventfd: %s\n", errno, strerror (errno));
+		if(conn->wake_fd >= 0) close(conn->wake_fd);
+		if(conn->timer_fd >= 0) close(conn->timer_fd);
+		conn->wake_fd = conn->timer_fd = -1;
+		return -1;
+	}
+	// A cancel before the threads took over is not for the commands to come
+	uint64_t v;
+	read(conn->cancel_fd, &v, sizeof(v));
+	conn->fd_flags = fcntl(conn->fd, F_GETFL);
+	fcntl(conn->fd, F_SETFL, conn->fd_flags | O_NONBLOCK);
+
+	{
+		std::lock_guard<std::mutex> lock(io_slots[conn->id].lock);
+		io_slots[conn->id].conn = conn;
+	}
+	conn->attached = true;
+	io_attached++;
+
+	for(int kind=EV_SERIAL; kind<=EV_TIMER; kind++) conn_arm(conn, kind, EPOLL_CTL_ADD);
+	return 0;
+}
+
+/**
+ * Stop the I/O threads for a printer after all submitted commands have been acknowledged; the
+ * thread pool is stopped with the last printer.
+ */
+void serial_thread_stop(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	if(conn == NULL || !conn->attached) return;
+
+	serial_thread_sync(conn);
+	if(conn->io_reconnect.joinable()) conn->io_reconnect.join();
+
+	std::lock_guard<std::mutex> pool_lock(io_pool_mutex);
+	{
+		std::lock_guard<std::mutex> lock(io_slots[conn->id].lock);
+		io_slots[conn->id].conn = NULL;
+		conn->attached = false;
+		for(int kind=EV_SERIAL; kind<=EV_TIMER; kind++) epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, conn_event_fd(conn, kind), NULL);
+	}
+	close(conn->wake_fd);
+	close(conn->timer_fd);
+	conn->wake_fd = conn->timer_fd = -1;
+	fcntl(conn->fd, F_SETFL, conn->fd_flags);
+	// Commands which were given up on are still owed to the printer, their 'ok's are expected (ok_late)
+	if(conn->io_out_pos < conn->io_out.size() && !conn->halted) {
+		write(conn->fd, conn->io_out.data() + conn->io_out_pos, conn->io_out.size() - conn->io_out_pos);
+	}
+	conn->io_out.clear();
+	conn->io_out_pos = 0;
+	delete conn->query_req;
+	conn->query_req = NULL;
+
+	if(--io_attached == 0) {
+		uint64_t v = 1;
+		write(io_stop_fd, &v, sizeof(v));
+		for(int i=0; i<SERIAL_THREAD_POOL_SIZE; i++) io_threads[i].join();
+		close(io_stop_fd);
+		close(io_epoll_fd);
+		io_stop_fd = io_epoll_fd = -1;
+	}
+	serial_thread_flush_log(conn);
+}
+
+/**
+ * Test if a printer is handled by the I/O threads.
+ */
+bool serial_thread_active(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	return conn != NULL && conn->attached;
+}
+
+/**
+ * Queue a request and wake the I/O threads
+ */
+static int submit(ty_serial_conn *conn, ty_serial_request *req, const char *cmd, bool keepall) {
+	// Measured without the line ending, like serial_frame() and the streaming without the I/O threads do
+	unsigned int len = strcspn(cmd, "\r\n");
+	if(len > SERIAL_MAX_CMD_SIZE) {
+		thread_log(conn, "error: command too long: %.*s\n", (int)len, cmd);
+		return -2;
+	}
+	memcpy(req->cmd, cmd, len);
+	req->cmd[len] = '\n';
+	req->cmd[len + 1] = 0x0;
+	req->len = len + 1;
+	req->keepall = keepall;
+	req->reply.result = 0;
+	req->reply.text.clear();
+
+	conn->pending++;
+	// When the queue is full, wait for the I/O threads to make room
+	while(!queue_push(conn, req)) usleep(100);
+
+	uint64_t v = 1;
+	write(conn->wake_fd, &v, sizeof(v));
+	return 0;
+}
+
+/**
+ * Submit a command to the I/O threads.
+ * @param cmd Command to send, including the trailing newline
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @param conn Printer to send the command to
+ * @return A future which holds the reply once the printer acknowledged the command
+ */
+std::future<ty_serial_reply> serial_submit(const char *cmd, bool keepall, ty_serial_conn *conn) {
+	ty_serial_request *req = new ty_serial_request();
+	req->promise = new std::promise<ty_serial_reply>();
+	req->cb = NULL;
+	req->user = NULL;
+	req->reused = false;
+	std::future<ty_serial_reply> f = req->promise->get_future();
+
+	if(conn == NULL) conn = serial_default_conn();
+	if(!serial_thread_active(conn) || submit(conn, req, cmd, keepall) < 0) {
+		ty_serial_reply reply;
+		reply.result = -1;
+		req->promise->set_value(reply);
+		delete req->promise;
+		delete req;
+	}
+	return f;
+}
+
+/**
+ * Submit a command to the I/O threads and call a function when the reply is complete.
+ * @param cmd Command to send, including the trailing newline
+ * @param cb Function to call from the I/O thread with the reply, can be NULL
+ * @param user Pointer handed to the callback
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @param conn Printer to send the command to
+ * @return 0 when the command was queued or a negative error code otherwise
+ */
+int serial_submit(const char *cmd, t_serial_callback cb, void *user, bool keepall, ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	if(!serial_thread_active(conn)) return -1;
+
+	ty_serial_request *req = new ty_serial_request();
+	req->promise = NULL;
+	req->cb = cb;
+	req->user = user;
+	req->reused = false;
+
+	int res = submit(conn, req, cmd, keepall);
+	if(res < 0) delete req;
+	return res;
+}
+
+/**
+ * Wake up serial_thread_query(); called from the I/O thread.
+ */
+static void query_complete(const ty_serial_reply *reply, void *user) {
+	ty_serial_conn *conn = (ty_serial_conn*)user;
+	std::lock_guard<std::mutex> lock(conn->query_wait_mutex);
+	conn->query_busy = false;
+	conn->query_done.notify_all();
+}
+
+/**
+ * Send a command through the I/O threads and wait for the reply, reusing the same request every time.
+ * The text of the reply keeps its memory between commands, so the steady state allocates nothing.
+ * @param reply Set to the reply, which lives in the request until the next serial_thread_query(); can be NULL
+ * @param line_cb Called from the I/O thread for each line before the 'ok' instead of keeping it, can be NULL
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_thread_query(ty_serial_conn *conn, const char *cmd, bool keepall, ty_serial_view *reply, t_serial_line line_cb, void *line_user) {
+	std::lock_guard<std::mutex> query_lock(conn->query_mutex);
+
+	ty_serial_request *req = conn->query_req;
+	req->cb = query_complete;
+	req->user = conn;
+	req->line_cb = line_cb;
+	req->line_user = line_user;
+	conn->query_busy = true;
+	int res = submit(conn, req, cmd, keepall || line_cb != NULL);
+	if(res < 0) return res;
+	{
+		std::unique_lock<std::mutex> lock(conn->query_wait_mutex);
+		conn->query_done.wait(lock, [conn]{ return !conn->query_busy; });
+	}
+
+	if(req->reply.result < 0) return req->reply.result;
+	if(reply != NULL) {
+		reply->text = req->reply.text.c_str();
+		reply->len = req->reply.text.size();
+	}
+	return 0;
+}
+
+/**
+ * Number of commands submitted to the I/O threads for a printer which are not acknowledged yet.
+ */
+int serial_thread_pending(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	return conn != NULL ? (int)conn->pending : 0;
+}
+
+/**
+ * Wait until all commands submitted to the I/O threads for a printer have been acknowledged.
+ * @return 0 when OK, the negative error code of the first streamed command which was not acknowledged
+ * (timeout, cancel, I/O error) or the number of streamed commands answered with an error since the last sync
+ */
+int serial_thread_sync(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	if(conn == NULL) return 0;
+
+	std::unique_lock<std::mutex> lock(conn->idle_mutex);
+	conn->idle.wait(lock, [conn]{ return conn->pending == 0; });
+	int failed = conn->failed.exchange(0);
+	int errors = conn->errors.exchange(0);
+	return failed < 0 ? failed : errors;
+}
+
+/**
+ * Print the serial traffic logged by the I/O threads for a printer; curses is not thread-safe so the
+ * output of the threads is collected and printed from the thread using the serial functions.
+ */
+void serial_thread_flush_log(ty_serial_conn *conn) {
+	if(conn == NULL) conn = serial_default_conn();
+	if(conn == NULL) return;
+
+	// Swap the buffers instead of moving the log out, so both keep their memory
+	static thread_local std::string out;
+	{
+		std::lock_guard<std::mutex> lock(conn->log_mutex);
+		out.swap(conn->log_buf);
+	}
+	if(!out.empty()) message("%s", out.c_str());
+	out.clear();
+}
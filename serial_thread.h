@@ -0,0 +1,94 @@
+/*
+ * serial_thread.h - Pool of I/O threads which owns the serial ports. Commands are submitted to a
+ * lock-free queue per printer from any thread; the I/O threads wait on all serial ports at once with
+ * epoll, send the commands as soon as they fit within the buffers of the printer and hand the reply
+ * back through a future or a callback.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef SERIAL_THREAD_H_
+#define SERIAL_THREAD_H_
+
+#include <future>
+#include <string>
+
+#include "serial.h"
+
+// Number of commands which can be queued per printer for the I/O threads (power of 2)
+#define SERIAL_THREAD_QUEUE_SIZE 64
+
+/**
+ * Reply of the printer to a submitted command
+ */
+typedef struct {
+	int result;			// 0 when the printer acknowledged the command, a negative error code on I/O errors
+						// or 1 when the printer answered with an error
+	std::string text;	// The 'ok' line, preceded by the other lines received for the command when keepall was set
+						// (unsolicited messages like temperature reports are left out)
+} ty_serial_reply;
+
+/**
+ * Callback for a completed command; called from the I/O thread so it should be short and must not
+ * use curses.
+ */
+typedef void (*t_serial_callback)(const ty_serial_reply *reply, void *user);
+
+/**
+ * Start the I/O threads for a printer; from now on all serial commands to it are handled by the
+ * threads. The thread pool is started with the first printer.
+ * @return 0 when OK or a negative error code otherwise
+ */
+int serial_thread_start(ty_serial_conn *conn = NULL);
+
+/**
+ * Stop the I/O threads for a printer after all submitted commands have been acknowledged; the
+ * thread pool is stopped with the last printer.
+ */
+void serial_thread_stop(ty_serial_conn *conn = NULL);
+
+/**
+ * Test if a printer is handled by the I/O threads.
+ */
+bool serial_thread_active(ty_serial_conn *conn = NULL);
+
+/**
+ * Submit a command to the I/O threads.
+ * @param cmd Command to send, including the trailing newline
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @param conn Printer to send the command to
+ * @return A future which holds the reply once the printer acknowledged the command
+ */
+std::future<ty_serial_reply> serial_submit(const char *cmd, bool keepall = false, ty_serial_conn *conn = NULL);
+
+/**
+ * Submit a command to the I/O threads and call a function when the reply is complete.
+ * @param cmd Command to send, including the trailing newline
+ * @param cb Function to call from the I/O thread with the reply, can be NULL
+ * @param user Pointer handed to the callback
+ * @param keepall When true, the reply contains all lines received before the 'ok'
+ * @param conn Printer to send the command to
+ * @return 0 when the command was queued or a negative error code otherwise
+ */
+int serial_submit(const char *cmd, t_serial_callback cb, void *user, bool keepall = false, ty_serial_conn *conn = NULL);
+
+/**
+ * Number of commands submitted to the I/O threads for a printer which are not acknowledged yet.
+ */
+int serial_thread_pending(ty_serial_conn *conn = NULL);
+
+/**
+ * Wait until all commands submitted to the I/O threads for a printer have been acknowledged.
+ * @return 0 when OK, the negative error code of the first streamed command which was not acknowledged
+ * (timeout, cancel, I/O error) or the number of streamed commands answered with an error since the last sync
+ */
+int serial_thread_sync(ty_serial_conn *conn = NULL);
+
+/**
+ * Print the serial traffic logged by the I/O threads for a printer; curses is not thread-safe so the
+ * output of the threads is collected and printed from the thread using the serial functions.
+ */
+void serial_thread_flush_log(ty_serial_conn *conn = NULL);
+
+#endif /* SERIAL_THREAD_H_ */
@@ -0,0 +1,269 @@
+/*
+ * temperature.cc - Temperature monitor: every temperature report of the printer is parsed on arrival
+ * into the latest value and a history.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "serial.h"
+#include "serial_router.h"
+#include "serial_thread.h"
+#include "temperature.h"
+
+#include <curses.h>
+extern WINDOW *serial_win;
+
+#define error_message(...) { if(serial_win==NULL) fprintf(stderr, __VA_ARGS__); \
+							  else { wprintw(serial_win, __VA_ARGS__); wrefresh(serial_win); }}
+
+// Temperature monitor of a single printer
+typedef struct {
+	ty_temperature hist[TEMP_HISTORY_SIZE];	// Last reports, count % TEMP_HISTORY_SIZE is the next slot
+	unsigned long count;					// Number of reports received
+	bool started;							// temp_monitor_start() was called for the printer
+	bool autoreport;						// The printer sends the reports by itself (M155)
+} ty_temp_monitor;
+
+ty_temp_monitor temp_monitors[SERIAL_MAX_CONNECTIONS];	// Indexed by serial_conn_id()
+std::mutex temp_mutex;
+std::condition_variable temp_cond;		// Signalled on every new report
+
+std::mutex temp_sub_mutex;				// Protects the subscription; never held while temp_mutex is held
+int temp_sub_id = -1;					// Subscription at the message router, shared by all printers
+int temp_started = 0;					// Number of printers with a started monitor
+
+/**
+ * Monitor of a printer, NULL when no printer is connected
+ */
+static ty_temp_monitor *temp_monitor(ty_serial_conn *conn) {
+	int id = serial_conn_id(conn);
+	return id >= 0 ? &temp_monitors[id] : NULL;
+}
+
+static double temp_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Parse the value following a 'T:' or 'B:' label: the temperature and optionally ' /target'
+ */
+static const char *temp_parse_value(const char *p, double *temp, double *target) {
+	char *end;
+	*temp = strtod(p, &end);
+	p = end;
+	while(*p == ' ') p++;
+	if(*p == '/') {
+		*target = strtod(p + 1, &end);
+		p = end;
+	}
+	return p;
+}
+
+/**
+ * Parse a temperature report, for example ' T:20.00 /0.00 B:21.00 /0.00 @:0 B@:0' or the same report
+ * following the 'ok' of M105.
+ * @param line Line received from the printer
+ * @param t Filled with the temperatures; the time is not set
+ * @return 0 when at least the hotend temperature was found or 1 otherwise
+ */
+int temp_parse(const char *line, ty_temperature *t) {
+	bool got_hotend = false;
+
+	memset(t, 0, sizeof(*t));
+	for(const char *p = line; *p; ) {
+		// Labels start after a space or at the start of the line; 'T0:', '@:' and 'B@:' are skipped
+		if((p == line || p[-1] == ' ') && p[1] == ':') {
+			if(p[0] == 'T') {
+				p = temp_parse_value(p + 2, &t->hotend, &t->hotend_target);
+				got_hotend = true;
+				continue;
+			} else if(p[0] == 'B') {
+				p = temp_parse_value(p + 2, &t->bed, &t->bed_target);
+				continue;
+			}
+		}
+		p++;
+	}
+	return got_hotend ? 0 : 1;
+}
+
+/**
+ * Subscriber of the message router: store each temperature report
+ */
+static void temp_report(ty_serial_conn *conn, int type, const char *line, void *user) {
+	ty_temperature t;
+	if(temp_parse(line, &t) != 0) return;
+	t.time = temp_now();
+
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL) return;
+	{
+		std::lock_guard<std::mutex> lock(temp_mutex);
+		m->hist[m->count % TEMP_HISTORY_SIZE] = t;
+		m->count++;
+	}
+	temp_cond.notify_all();
+}
+
+/**
+ * Start collecting the temperature reports of the printer. When the printer supports it, it is asked to
+ * report the temperatures by itself (M155) so no polling is needed.
+ * @param interval Seconds between automatic reports, 0 to only collect the replies to M105
+ * @return 0 when OK or a negative error code otherwise
+ */
+int temp_monitor_start(int interval, ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL) {
+		error_message("error: serial port not open\n");
+		return -1;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(temp_sub_mutex);
+		if(!m->started) {
+			if(temp_sub_id < 0) {
+				temp_sub_id = serial_subscribe(SERIAL_MSG_TEMPERATURE, temp_report, NULL);
+				if(temp_sub_id < 0) {
+					error_message("error: no room to subscribe to temperature reports\n");
+					return -1;
+				}
+			}
+			// The slot may have been used by a printer which is disconnected
+			{
+				std::lock_guard<std::mutex> hist_lock(temp_mutex);
+				m->count = 0;
+			}
+			m->autoreport = false;
+			m->started = true;
+			temp_started++;
+		}
+	}
+	if(interval <= 0) return 0;
+
+	// Only printers which list the capability know M155
+	int caps = serial_conn_caps(conn);
+	if(caps < 0) return -1;
+	if(!(caps & SERIAL_CAP_AUTOREPORT_TEMP)) return 0;
+
+	char cmd[32];
+	snprintf(cmd, sizeof(cmd), "M155 S%i\n", interval);
+	if(serial_cmd(cmd, NULL, false, conn) < 0) return -1;
+	m->autoreport = true;
+	return 0;
+}
+
+/**
+ * Stop the automatic reports of the printer and stop collecting temperature reports.
+ */
+void temp_monitor_stop(ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL || !m->started) return;
+
+	if(m->autoreport) {
+		serial_cmd("M155 S0\n", NULL, false, conn);
+		m->autoreport = false;
+	}
+
+	std::lock_guard<std::mutex> lock(temp_sub_mutex);
+	m->started = false;
+	if(--temp_started == 0) {
+		serial_unsubscribe(temp_sub_id);
+		temp_sub_id = -1;
+	}
+}
+
+/**
+ * Test if the printer reports the temperatures by itself.
+ */
+bool temp_autoreport_active(ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	return m != NULL && m->autoreport;
+}
+
+/**
+ * Get the latest temperature report without waiting.
+ * @param t Filled with the latest report
+ * @param seq Number of the last report the caller has seen, updated to the number of the returned report;
+ * NULL to get the latest report even when it was seen before
+ * @return True when a (new) report was returned
+ */
+bool temp_latest(ty_temperature *t, unsigned long *seq, ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL) return false;
+
+	// Without the I/O threads nobody reads the reports which arrived in the meantime
+	if(!serial_thread_active(conn)) serial_poll(conn);
+
+	std::lock_guard<std::mutex> lock(temp_mutex);
+	if(m->count == 0 || (seq != NULL && *seq == m->count)) return false;
+	*t = m->hist[(m->count - 1) % TEMP_HISTORY_SIZE];
+	if(seq != NULL) *seq = m->count;
+	return true;
+}
+
+/**
+ * Wait for the next temperature report. Without automatic reports, a report is requested with M105.
+ * @param t Filled with the report
+ * @param seq Number of the last report the caller has seen, updated to the number of the returned report
+ * @param timeout_ms Maximum time to wait in milliseconds
+ * @return 0 when OK, 1 on a timeout or a negative error code otherwise
+ */
+int temp_wait(ty_temperature *t, unsigned long *seq, int timeout_ms, ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL) {
+		error_message("error: serial port not open\n");
+		return -1;
+	}
+
+	// The reply to M105 passes the message router before serial_cmd() returns
+	if(!m->autoreport && serial_cmd("M105\n", NULL, false, conn) < 0) return -1;
+
+	if(serial_thread_active(conn)) {
+		std::unique_lock<std::mutex> lock(temp_mutex);
+		if(!temp_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [m, seq]{ return m->count != *seq; })) return 1;
+		*t = m->hist[(m->count - 1) % TEMP_HISTORY_SIZE];
+		*seq = m->count;
+		return 0;
+	}
+
+	// Without the I/O threads, read the serial port until a report arrives
+	double deadline = temp_now() + timeout_ms / 1000.0;
+	while(!temp_latest(t, seq, conn)) {
+		if(temp_now() >= deadline) return 1;
+		usleep(10000);
+	}
+	return 0;
+}
+
+/**
+ * Copy the most recent temperature reports.
+ * @param out Array to fill, oldest report first
+ * @param max Maximum number of reports to copy
+ * @return Number of reports copied
+ */
+int temp_history(ty_temperature *out, int max, ty_serial_conn *conn) {
+	ty_temp_monitor *m = temp_monitor(conn);
+	if(m == NULL) return 0;
+
+	std::lock_guard<std::mutex> lock(temp_mutex);
+	unsigned long n = m->count < TEMP_HISTORY_SIZE ? m->count : TEMP_HISTORY_SIZE;
+	if(max < 0) max = 0;
+	if(n > (unsigned long)max) n = max;
+	for(unsigned long i=0; i<n; i++) out[i] = m->hist[(m->count - n + i) % TEMP_HISTORY_SIZE];
+	return n;
+}
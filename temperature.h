@@ -0,0 +1,81 @@
+/*
+ * temperature.h - Temperature monitor: every temperature report of the printer (the automatic reports
+ * enabled with M155 as well as replies to M105) is parsed on arrival into the latest value and a
+ * history per printer, which can be read without sending anything to the printer. All functions take
+ * the printer as an optional last parameter (the default connection when NULL).
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef TEMPERATURE_H_
+#define TEMPERATURE_H_
+
+#include "main.h"
+#include "serial.h"
+
+/**
+ * A single temperature report of the printer
+ */
+typedef struct {
+	double time;			// Time of arrival in seconds (CLOCK_MONOTONIC)
+	double hotend;			// Hotend temperature
+	double hotend_target;	// Hotend target temperature, 0 when off
+	double bed;				// Bed temperature, 0 when the printer did not report a bed
+	double bed_target;		// Bed target temperature, 0 when off
+} ty_temperature;
+
+/**
+ * Parse a temperature report, for example ' T:20.00 /0.00 B:21.00 /0.00 @:0 B@:0' or the same report
+ * following the 'ok' of M105.
+ * @param line Line received from the printer
+ * @param t Filled with the temperatures; the time is not set
+ * @return 0 when at least the hotend temperature was found or 1 otherwise
+ */
+int temp_parse(const char *line, ty_temperature *t);
+
+/**
+ * Start collecting the temperature reports of the printer. When the printer supports it, it is asked to
+ * report the temperatures by itself (M155) so no polling is needed.
+ * @param interval Seconds between automatic reports, 0 to only collect the replies to M105
+ * @return 0 when OK or a negative error code otherwise
+ */
+int temp_monitor_start(int interval, ty_serial_conn *conn = NULL);
+
+/**
+ * Stop the automatic reports of the printer and stop collecting temperature reports.
+ */
+void temp_monitor_stop(ty_serial_conn *conn = NULL);
+
+/**
+ * Test if the printer reports the temperatures by itself.
+ */
+bool temp_autoreport_active(ty_serial_conn *conn = NULL);
+
+/**
+ * Get the latest temperature report without waiting.
+ * @param t Filled with the latest report
+ * @param seq Number of the last report the caller has seen, updated to the number of the returned report;
+ * NULL to get the latest report even when it was seen before
+ * @return True when a (new) report was returned
+ */
+bool temp_latest(ty_temperature *t, unsigned long *seq, ty_serial_conn *conn = NULL);
+
+/**
+ * Wait for the next temperature report. Without automatic reports, a report is requested with M105.
+ * @param t Filled with the report
+ * @param seq Number of the last report the caller has seen, updated to the number of the returned report
+ * @param timeout_ms Maximum time to wait in milliseconds
+ * @return 0 when OK, 1 on a timeout or a negative error code otherwise
+ */
+int temp_wait(ty_temperature *t, unsigned long *seq, int timeout_ms, ty_serial_conn *conn = NULL);
+
+/**
+ * Copy the most recent temperature reports.
+ * @param out Array to fill, oldest report first
+ * @param max Maximum number of reports to copy
+ * @return Number of reports copied
+ */
+int temp_history(ty_temperature *out, int max, ty_serial_conn *conn = NULL);
+
+#endif /* TEMPERATURE_H_ */
@@ -0,0 +1,145 @@
+/*
+ * framer_bench.cc - Microbenchmark for the line framer: replays recorded reply streams from the
+ * printer through the framer in read()-sized chunks and compares it with the old way of scanning
+ * the reply buffer (strchr and shifting the remaining bytes after every line).
+ *
+ * Compile from the root of the repository:
+ * g++ -O3 -I. -o framer_bench tools/framer_bench.cc line_framer.cc
+ *
+ * Usage: framer_bench [recorded stream files...] (defaults to the streams in tools/data)
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "line_framer.h"
+
+#define LEGACY_BUFFER_SIZE 2048		// SERIAL_REPLY_BUFFER_SIZE of the old reply scanner
+#define TARGET_BYTES (64 * 1024 * 1024)	// Amount of data to push through each parser per measurement
+
+const char *default_streams[] = { "tools/data/g29_t1_15x15.txt", "tools/data/m503.txt", "tools/data/busy_probe_session.txt" };
+// Sizes of the chunks handed out by read(): single bytes (slow printer), USB packets and bulk reads
+const unsigned int chunk_sizes[] = { 1, 32, 64, 512, 4096 };
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Load a recorded stream from disk
+ * @return Buffer with the stream (to be freed by the caller) or NULL on errors
+ */
+char *load_stream(const char *path, unsigned int *len) {
+	FILE *fh = fopen(path, "rb");
+	if(fh == NULL) return NULL;
+	fseek(fh, 0, SEEK_END);
+	long size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	char *buf = (char*)malloc(size > 0 ? size : 1);
+	*len = fread(buf, 1, size, fh);
+	fclose(fh);
+	return buf;
+}
+
+/**
+ * Replay a stream through the ring buffer framer
+ * @return Number of lines handed out
+ */
+unsigned long run_framer(const char *data, unsigned int len, unsigned int chunk, unsigned int rounds, unsigned long *bytes) {
+	static ty_line_framer f;
+	unsigned long lines = 0;
+	ty_line line;
+
+	framer_reset(&f);
+	for(unsigned int r=0; r<rounds; r++) {
+		for(unsigned int p=0; p<len; ) {
+			unsigned int n = (len - p < chunk) ? len - p : chunk;
+			p += framer_push(&f, &data[p], n);
+			while(framer_next(&f, &line)) {
+				lines++;
+				*bytes += line.len;
+			}
+		}
+	}
+	return lines;
+}
+
+/**
+ * Replay a stream through a copy of the old reply scanner of serial_cmd(): search the buffer with
+ * strchr() after every read and shift the remaining bytes down after every line.
+ * @return Number of lines handed out
+ */
+unsigned long run_legacy(const char *data, unsigned int len, unsigned int chunk, unsigned int rounds, unsigned long *bytes) {
+	static char buf[LEGACY_BUFFER_SIZE+1];
+	unsigned int bp = 0;
+	unsigned long lines = 0;
+
+	for(unsigned int r=0; r<rounds; r++) {
+		for(unsigned int p=0; p<len; ) {
+			// Like read(), never hand out more than the free space in the buffer
+			unsigned int n = (len - p < chunk) ? len - p : chunk;
+			if(n > LEGACY_BUFFER_SIZE - bp) n = LEGACY_BUFFER_SIZE - bp;
+			memcpy(&buf[bp], &data[p], n);
+			bp += n;
+			p += n;
+			buf[bp] = 0x0;
+
+			char *nl;
+			while(bp > 2 && (nl = strchr(buf, '\n')) != NULL) {
+				unsigned int lineend = nl - buf;
+				lines++;
+				*bytes += lineend;
+				for(unsigned int i=lineend+1;i<bp;i++) buf[i-lineend-1] = buf[i];
+				unsigned int old_bp = bp;
+				bp = bp - lineend - 1;
+				for(unsigned int i=bp;i<=old_bp;i++) buf[i] = 0x0;
+			}
+			// A full buffer without a line ending is dropped
+			if(bp == LEGACY_BUFFER_SIZE) bp = 0;
+		}
+	}
+	return lines;
+}
+
+int main(int argc, char **argv) {
+	int nstreams = argc > 1 ? argc - 1 : (int)(sizeof(default_streams) / sizeof(default_streams[0]));
+
+	printf("%-36s %6s %12s %12s %10s %10s %8s\n", "stream", "chunk", "framer MB/s", "legacy MB/s", "framer ns", "legacy ns", "speedup");
+	for(int s=0; s<nstreams; s++) {
+		const char *path = argc > 1 ? argv[s+1] : default_streams[s];
+		unsigned int len = 0;
+		char *data = load_stream(path, &len);
+		if(data == NULL || len == 0) {
+			fprintf(stderr, "Could not load recorded stream %s\n", path);
+			free(data);
+			return -1;
+		}
+
+		unsigned int rounds = TARGET_BYTES / len + 1;
+		for(unsigned int c=0; c<sizeof(chunk_sizes)/sizeof(chunk_sizes[0]); c++) {
+			unsigned long fbytes = 0, lbytes = 0;
+
+			double t0 = now();
+			unsigned long flines = run_framer(data, len, chunk_sizes[c], rounds, &fbytes);
+			double t1 = now();
+			unsigned long llines = run_legacy(data, len, chunk_sizes[c], rounds, &lbytes);
+			double t2 = now();
+
+			if(flines != llines) fprintf(stderr, "Warning: line count differs for %s: %lu vs %lu\n", path, flines, llines);
+
+			double mb = (double)len * rounds / (1024.0 * 1024.0);
+			printf("%-36s %6u %12.1f %12.1f %10.1f %10.1f %7.1fx\n", path, chunk_sizes[c],
+					mb / (t1 - t0), mb / (t2 - t1),
+					(t1 - t0) * 1e9 / flines, (t2 - t1) * 1e9 / llines, (t2 - t1) / (t1 - t0));
+		}
+		free(data);
+	}
+	return 0;
+}
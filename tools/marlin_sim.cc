@@ -0,0 +1,972 @@
+/*
+ * marlin_sim.cc - Printer simulator: opens a pseudo-terminal and answers on it like a printer running
+ * Marlin. RepUtils can be pointed at the pty (reputils -p <pty>) to test and benchmark the program end
+ * to end without hardware.
+ *
+ * The simulator emulates:
+ * - the serial receive buffer and the command queue (BUFSIZE) of the printer, bytes which do not fit
+ *   in the receive buffer are lost like on a real printer
+ * - line numbers, checksums and resend requests
+ * - 'ok' timing with a configurable latency per command and ADVANCED_OK replies
+ * - a planner buffer with moves that take time to execute (G0/G1, M400, G4); M410 stops the head where it is
+ * - homing of the given axes (G28), optionally raising Z before X and Y are homed, and moves clamped to the
+ *   soft endstops (M211); both move the head elsewhere than the host asked without a word
+ * - 'busy:' keepalive messages during long commands (G28, G29 probing, waiting for the planner)
+ * - a thermal model for the hotend and the bed (M104, M105, M109, M140, M190)
+ * - UBL mesh storage (G29 A/D/L/S/T, M420, M421)
+ * - line noise: bits flipped in the received bytes
+ * - the baud rate: the time bytes take on the wire, and garbage when the host selected another rate
+ * - the latency timer of an FTDI adapter: replies are held back until the next tick of the timer, which is
+ *   read from a file, the latency_timer of a fake sysfs tree (reputils -Y) so the host can change it
+ * Opening the pty counts as a reset of the printer (like the DTR reset of a USB printer) unless the host
+ * cleared HUPCL before it closed the pty the last time, as DTR then stayed up; the start banner is sent
+ * once the boot time has passed. SIGUSR1 unplugs the printer for a moment like a USB glitch: the pty is
+ * replaced by a new one (the link follows) and the printer keeps running.
+ *
+ * Compile from the root of the repository:
+ * g++ -O2 -I. -o marlin_sim tools/marlin_sim.cc serial_baud.cc
+ *
+ * Usage: marlin_sim [options], see usage() below
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "serial_baud.h"
+
+#define SIM_MAX_CMD_SIZE 96			// MAX_CMD_SIZE: longer lines are truncated
+#define SIM_AMBIENT_TEMP 21.0
+
+#define log_message(...) { if(cfg.verbose) { fprintf(stderr, "%10.3f ", now() - t_start); fprintf(stderr, __VA_ARGS__); }}
+
+/**
+ * Settings of the simulated printer
+ */
+typedef struct {
+	const char *link;			// Symlink to create to the pty, NULL for none
+	double latency;				// Time to process a command in seconds
+	std::map<std::string, double> cmd_latency;	// Latency per command (for example G28), overrides the default
+	unsigned int planner_size;	// Number of moves in the planner buffer (BLOCK_BUFFER_SIZE)
+	unsigned int queue_size;	// Number of commands in the command queue (BUFSIZE)
+	unsigned int rx_size;		// Size of the serial receive buffer (RX_BUFFER_SIZE)
+	double keepalive;			// Interval between busy messages in seconds, 0 to disable
+	double boot_time;			// Time between opening the port and the start banner
+	bool advanced_ok;			// Reply with 'ok N<line> P<planner> B<queue>'
+	int mesh_x, mesh_y;			// Size of the UBL mesh
+	double noise;				// Probability of a corrupted byte
+	unsigned int seed;			// Seed for the noise
+	int baud;					// Baud rate of the printer, 0 for an unlimited line speed or -1 to follow the host
+	const char *latency_timer;	// File with the latency timer of the emulated USB serial adapter in ms, NULL for none
+	double homing_raise;		// Z is raised to at least this height before X or Y are homed (Z_HOMING_HEIGHT)
+	double soft_endstops;		// Clamp moves to the soft endstops at 0 and this position until M211 S0, 0 for none
+	bool verbose;				// Log all traffic to stderr
+} ty_sim_config;
+
+/**
+ * Model of a heater: first order system which is driven by a proportional controller
+ */
+typedef struct {
+	double temp;		// Current temperature
+	double target;		// Target temperature, 0 when off
+	double gain;		// Temperature above ambient at full power
+	double tau;			// Time constant in seconds
+	double power;		// Heater power (0-1)
+} ty_heater;
+
+/**
+ * Command which is being executed
+ */
+typedef struct {
+	std::string cmd;	// Command without line number and checksum
+	char letter;		// G or M
+	int code;			// Command number
+	int stage;			// 0: waiting for the planner, 1: executing, 2: waiting for a heater
+	double start;		// Time the command was taken from the queue
+	double done;		// Time the command is finished
+	double next_msg;	// Time for the next busy or temperature message
+} ty_active_cmd;
+
+ty_sim_config cfg;
+double t_start;
+volatile sig_atomic_t sim_stop = 0;
+volatile sig_atomic_t sim_unplug = 0;
+
+int master_fd = -1;
+bool connected = false;			// Host has the pty open
+bool reset_on_open = true;		// Opening the pty resets the printer: first open or HUPCL set by the host
+bool booted = false;			// Start banner has been sent
+bool killed = false;			// M112 received, the printer stops responding
+double t_connect = 0.0;
+
+std::string rx;					// Serial receive buffer of the printer
+std::string ep_line;			// Line seen so far by the emergency parser
+std::deque<std::string> queue;	// Command queue
+bool cmd_active = false;
+ty_active_cmd active;
+long last_line = 0;				// Last line number accepted
+
+/**
+ * Move in the planner buffer
+ */
+typedef struct {
+	double start, end;			// Time the move starts and ends
+	double from[3], to[3];		// Position of the head before and after the move
+} ty_planned_move;
+
+std::deque<ty_planned_move> planner;	// Moves in the planner, oldest first
+double pos[4] = { 0.0, 0.0, 0.0, 0.0 };
+double feedrate = 1500.0;		// mm/min
+bool relative = false;
+bool endstops_on = true;		// M211
+
+ty_heater hotend = { SIM_AMBIENT_TEMP, 0.0, 280.0, 40.0, 0.0 };
+ty_heater bed    = { SIM_AMBIENT_TEMP, 0.0, 110.0, 200.0, 0.0 };
+double t_thermal = 0.0;
+unsigned int autoreport = 0;
+
+std::vector<float> mesh;		// UBL mesh, row major with J=0 first
+std::map<int, std::vector<float> > mesh_slots;
+bool mesh_active = false;
+
+unsigned long stat_lines = 0, stat_checksum = 0, stat_overflow = 0, stat_corrupted = 0, stat_baud = 0;
+unsigned long rng_state;
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Pseudo random number (xorshift) so noise can be reproduced with the same seed
+ */
+double sim_random() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Baud rate of the wire: the rate of the printer or, when following the host, the rate the host selected
+ * @return The rate, 0 when the line speed is not limited or -1 when the host selected another rate than
+ * the printer uses
+ */
+int wire_baud() {
+	if(cfg.baud == 0) return 0;
+	int host = serial_baud_get(master_fd);
+	if(cfg.baud < 0) return host > 0 ? host : 0;
+	return host == cfg.baud ? cfg.baud : -1;
+}
+
+/**
+ * Spend the time bytes take on the wire: 10 bits per byte (8N1)
+ */
+void wire_delay(int baud, int bytes) {
+	if(baud > 0) usleep((useconds_t)(bytes * 10.0e6 / baud));
+}
+
+/**
+ * Hold back a reply like the latency timer of an FTDI adapter: the adapter sends what it received when
+ * its timer expires, so a short reply waits for the next tick. Lines sent right after a tick go with it.
+ */
+void adapter_delay() {
+	static double released = -1.0;
+	if(cfg.latency_timer == NULL || now() - released < 0.001) return;
+	FILE *fh = fopen(cfg.latency_timer, "r");
+	if(fh == NULL) return;
+	int ms = 0;
+	if(fscanf(fh, "%d", &ms) != 1) ms = 0;
+	fclose(fh);
+	if(ms <= 0) return;
+	double tick = ms / 1000.0;
+	usleep((useconds_t)((tick - fmod(now() - t_start, tick)) * 1e6));
+	released = now();
+}
+
+void send_line(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Send a line to the host
+ */
+void send_line(const char *fmt, ...) {
+	char buf[4096];		// Rows of G29 T1 of big meshes are long
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if(len < 0) return;
+	if(len > (int)sizeof(buf) - 2) len = sizeof(buf) - 2;
+	log_message("> %s\n", buf);
+	buf[len++] = '\n';
+	int baud = wire_baud();
+	if(baud < 0) {
+		// The host reads at another rate: every byte turns into garbage without line endings
+		for(int i=0; i<len; i++) buf[i] = 0x80 | (buf[i] ^ 0x2a);
+		stat_baud += len;
+	}
+	wire_delay(baud, len);
+	adapter_delay();
+	for(int p=0; p<len; ) {
+		int bw = write(master_fd, &buf[p], len - p);
+		if(bw < 0) {
+			if(errno == EINTR) continue;
+			return;
+		}
+		p += bw;
+	}
+}
+
+/**
+ * Create a mesh which looks like a real bed: tilted with a bump in the middle
+ */
+void mesh_init() {
+	mesh.assign(cfg.mesh_x * cfg.mesh_y, 0.0f);
+	for(int j=0; j<cfg.mesh_y; j++) {
+		for(int i=0; i<cfg.mesh_x; i++) {
+			double fx = cfg.mesh_x > 1 ? (double)i / (cfg.mesh_x - 1) : 0.0;
+			double fy = cfg.mesh_y > 1 ? (double)j / (cfg.mesh_y - 1) : 0.0;
+			mesh[j * cfg.mesh_x + i] = 0.08 - 0.45 * fx - 0.35 * fy + 0.06 * sin(fx * M_PI) * sin(fy * M_PI);
+		}
+	}
+}
+
+/**
+ * Print the mesh like G29 T does; rows are printed from the back (highest J) to the front
+ * @param csv True for the CSV format of G29 T1, which Marlin separates with tabs
+ */
+void mesh_print(bool csv) {
+	char buf[4096];
+	send_line("%s", "");
+	send_line(csv ? "Bed Topography Report for CSV:" : "Bed Topography Report:");
+	send_line("%s", "");
+	for(int j=cfg.mesh_y-1; j>=0; j--) {
+		int p = 0;
+		for(int i=0; i<cfg.mesh_x && p < (int)sizeof(buf) - 16; i++) {
+			float z = mesh[j * cfg.mesh_x + i];
+			if(csv) {
+				if(i > 0) buf[p++] = '\t';
+				if(isnan(z)) p += sprintf(&buf[p], "NAN");
+				else         p += sprintf(&buf[p], "%.3f", z);
+			} else {
+				if(isnan(z)) p += sprintf(&buf[p], "   .   ");
+				else         p += sprintf(&buf[p], " %+.3f ", z);
+			}
+		}
+		buf[p] = 0x0;
+		send_line("%s", buf);
+	}
+}
+
+/**
+ * Find a parameter in a command
+ * @param cmd Command without line number and checksum
+ * @param letter Parameter to look for
+ * @param val Filled with the value of the parameter
+ * @return True when the parameter is present
+ */
+bool cmd_param(const char *cmd, char letter, double *val) {
+	// Skip the command itself
+	const char *p = cmd;
+	while(*p && *p != ' ') p++;
+	for(; *p; p++) {
+		if(*p == letter && (p[-1] == ' ')) {
+			char *end;
+			double v = strtod(p + 1, &end);
+			if(val != NULL) *val = (end == p + 1) ? 0.0 : v;
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned int planner_free() {
+	return cfg.planner_size - planner.size();
+}
+
+/**
+ * Send the 'ok' for the current command
+ */
+void send_ok() {
+	if(cfg.advanced_ok)
+		send_line("ok N%ld P%u B%u", last_line, planner_free(), (unsigned int)(cfg.queue_size - queue.size()));
+	else
+		send_line("ok");
+}
+
+/**
+ * Request a resend of the line after the last accepted line
+ */
+void request_resend(const char *error) {
+	stat_checksum++;
+	send_line("Error:%s, Last Line: %ld", error, last_line);
+	send_line("Resend: %ld", last_line + 1);
+	send_line("ok");
+}
+
+void sim_reset() {
+	rx.clear();
+	queue.clear();
+	planner.clear();
+	cmd_active = false;
+	last_line = 0;
+	killed = false;
+	booted = false;
+	relative = false;
+	autoreport = 0;
+	hotend.target = bed.target = 0.0;
+	for(int i=0; i<4; i++) pos[i] = 0.0;
+	endstops_on = true;
+	// The mesh in RAM is lost, the stored slots survive like the EEPROM
+	mesh_init();
+	mesh_active = false;
+}
+
+/**
+ * Position of the head at a time: in the move which is executing or where the planned moves end
+ */
+void head_position(double t, double *out) {
+	for(unsigned int i=0; i<planner.size(); i++) {
+		const ty_planned_move &m = planner[i];
+		if(t >= m.end) continue;
+		double f = t <= m.start ? 0.0 : (t - m.start) / (m.end - m.start);
+		for(int a=0; a<3; a++) out[a] = m.from[a] + (m.to[a] - m.from[a]) * f;
+		return;
+	}
+	for(int a=0; a<3; a++) out[a] = pos[a];
+}
+
+/**
+ * Commands which are handled immediately when they are received, before the command queue
+ * (Marlin: EMERGENCY_PARSER)
+ */
+void emergency_parse(const char *cmd) {
+	if(strncmp(cmd, "M112", 4) == 0 && (cmd[4] == 0 || cmd[4] == ' ')) {
+		send_line("Error:Printer halted. kill() called!");
+		killed = true;
+		hotend.target = bed.target = 0.0;
+		fprintf(stderr, "Printer killed by M112\n");
+	} else if(strncmp(cmd, "M410", 4) == 0 && (cmd[4] == 0 || cmd[4] == ' ')) {
+		// Quickstop: throw away all moves in the planner; the head stays where it is in the current move
+		head_position(now(), pos);
+		planner.clear();
+	} else if(strncmp(cmd, "M108", 4) == 0 && (cmd[4] == 0 || cmd[4] == ' ')) {
+		// Stop waiting for heaters
+		if(cmd_active && active.stage == 2) active.stage = 1;
+	}
+}
+
+/**
+ * Handle a line received from the host: check the line number and checksum and put the command
+ * in the queue
+ */
+void receive_line(char *line) {
+	char *cmd = line;
+	stat_lines++;
+
+	// Strip comments and trailing whitespace
+	char *c = strchr(line, ';');
+	if(c != NULL) *c = 0x0;
+	int len = strlen(line);
+	while(len > 0 && (line[len-1] == ' ' || line[len-1] == '\r')) line[--len] = 0x0;
+	while(*cmd == ' ') cmd++;
+	if(*cmd == 0x0) return;
+
+	if(*cmd == 'N') {
+		long n = strtol(cmd + 1, &c, 10);
+		char *star = strchr(cmd, '*');
+		while(*c == ' ') c++;
+		bool m110 = strncmp(c, "M110", 4) == 0;
+
+		if(n != last_line + 1 && !m110) {
+			request_resend("Line Number is not Last Line Number+1");
+			return;
+		}
+		if(star == NULL) {
+			request_resend("No Checksum with line number");
+			return;
+		}
+		unsigned char sum = 0;
+		for(char *p=cmd; p<star; p++) sum ^= *p;
+		if(sum != (unsigned char)atoi(star + 1)) {
+			request_resend("checksum mismatch");
+			return;
+		}
+		*star = 0x0;
+		while(star > c && star[-1] == ' ') *--star = 0x0;
+		last_line = n;
+		cmd = c;
+	} else if(strchr(cmd, '*') != NULL) {
+		request_resend("No Line Number with checksum");
+		return;
+	}
+
+	if(strlen(cmd) > SIM_MAX_CMD_SIZE - 1) cmd[SIM_MAX_CMD_SIZE - 1] = 0x0;
+	queue.push_back(cmd);
+}
+
+/**
+ * Move bytes from the receive buffer into the command queue while there is room
+ */
+void parse_rx() {
+	size_t nl;
+	while(!killed && queue.size() < cfg.queue_size && (nl = rx.find('\n')) != std::string::npos) {
+		std::string line = rx.substr(0, nl);
+		rx.erase(0, nl + 1);
+		receive_line(&line[0]);
+	}
+}
+
+/**
+ * Read all bytes the host sent; bytes which do not fit in the receive buffer are lost
+ */
+void read_host() {
+	char buf[4097];
+	int br = read(master_fd, buf, sizeof(buf) - 1);
+	if(br <= 0) return;
+	int baud = wire_baud();
+	wire_delay(baud, br);
+	if(baud < 0) {
+		// Sent at another rate: the printer does not receive anything it can use
+		stat_baud += br;
+		return;
+	}
+
+	for(int i=0; i<br; i++) {
+		char ch = buf[i];
+		if(cfg.noise > 0.0 && sim_random() < cfg.noise) {
+			ch ^= 1 << (int)(sim_random() * 7);
+			stat_corrupted++;
+		}
+		if(ch == '\r') ch = '\n';
+		// Like Marlin, emergency commands are picked out of the byte stream as it arrives, even when the
+		// receive buffer or the command queue is full
+		if(ch == '\n') {
+			const char *cmd = ep_line.c_str();
+			if(*cmd == 'N') cmd = strchr(cmd, ' ') != NULL ? strchr(cmd, ' ') + 1 : "";
+			emergency_parse(cmd);
+			ep_line.clear();
+		} else if(ep_line.size() < SIM_MAX_CMD_SIZE) {
+			ep_line.push_back(ch);
+		}
+		if(rx.size() >= cfg.rx_size) {
+			stat_overflow++;
+			continue;
+		}
+		rx.push_back(ch);
+	}
+	if(cfg.verbose) {
+		buf[br] = 0x0;
+		for(char *l=strtok(buf, "\r\n"); l!=NULL; l=strtok(NULL, "\r\n")) log_message("< %s\n", l);
+	}
+}
+
+/**
+ * Update the temperatures of the heaters
+ */
+void thermal_update(double t) {
+	double dt = t - t_thermal;
+	t_thermal = t;
+	ty_heater *heaters[2] = { &hotend, &bed };
+	for(int h=0; h<2; h++) {
+		ty_heater *ht = heaters[h];
+		if(ht->target > 0.0) {
+			// Feed forward to hold the target plus a proportional term for the error
+			ht->power = (ht->target - SIM_AMBIENT_TEMP) / ht->gain + (ht->target - ht->temp) / 5.0;
+			if(ht->power < 0.0) ht->power = 0.0;
+			if(ht->power > 1.0) ht->power = 1.0;
+		} else {
+			ht->power = 0.0;
+		}
+		double t_inf = SIM_AMBIENT_TEMP + ht->power * ht->gain;
+		ht->temp = t_inf + (ht->temp - t_inf) * exp(-dt / ht->tau);
+	}
+}
+
+void print_temperatures(bool ok) {
+	send_line("%sT:%.2f /%.2f B:%.2f /%.2f @:%d B@:%d", ok ? "ok " : " ",
+			hotend.temp, hotend.target, bed.temp, bed.target, (int)(hotend.power * 127), (int)(bed.power * 127));
+}
+
+/**
+ * Time to process a command, from the -c options or the default latency
+ */
+double cmd_latency(const ty_active_cmd *a) {
+	char key[8];
+	snprintf(key, sizeof(key), "%c%d", a->letter, a->code);
+	std::map<std::string, double>::iterator it = cfg.cmd_latency.find(key);
+	if(it != cfg.cmd_latency.end()) return it->second;
+	if(a->letter == 'G' && a->code == 28) return 2.0;	// Homing takes a while
+	return cfg.latency;
+}
+
+/**
+ * Does the command wait for the planner before it starts? Returns false when it can start.
+ */
+bool planner_wait(const ty_active_cmd *a) {
+	if(a->letter == 'G' && (a->code == 0 || a->code == 1)) return planner_free() == 0;
+	if(a->letter == 'G' && (a->code == 4 || a->code == 28 || a->code == 29)) return !planner.empty();
+	if(a->letter == 'M' && (a->code == 400 || a->code == 109 || a->code == 190 || a->code == 421)) return !planner.empty();
+	return false;
+}
+
+/**
+ * Queue a linear move in the planner
+ */
+void plan_move(const char *cmd, double t) {
+	const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+	double v, dist = 0.0;
+	ty_planned_move move;
+	for(int a=0; a<3; a++) move.from[a] = pos[a];
+	if(cmd_param(cmd, 'F', &v) && v > 0.0) feedrate = v;
+	for(int a=0; a<4; a++) {
+		if(!cmd_param(cmd, axes[a], &v)) continue;
+		double target = relative ? pos[a] + v : v;
+		if(a < 3 && cfg.soft_endstops > 0.0 && endstops_on) target = target < 0.0 ? 0.0 : (target > cfg.soft_endstops ? cfg.soft_endstops : target);
+		if(a < 3) dist += (target - pos[a]) * (target - pos[a]);
+		pos[a] = target;
+	}
+	double start = planner.empty() ? t : planner.back().end;
+	if(start < t) start = t;
+	move.start = start;
+	move.end = start + sqrt(dist) / (feedrate / 60.0) + 0.001;
+	for(int a=0; a<3; a++) move.to[a] = pos[a];
+	planner.push_back(move);
+}
+
+/**
+ * Start a command: apply its effect and calculate when it is done
+ */
+void cmd_start(double t) {
+	ty_active_cmd *a = &active;
+	const char *cmd = a->cmd.c_str();
+	double v;
+
+	a->stage = 1;
+	a->done = t + cmd_latency(a);
+	if(a->letter == 'G') {
+		switch(a->code) {
+		case 0: case 1:
+			plan_move(cmd, t);
+			break;
+		case 4:
+			if(cmd_param(cmd, 'P', &v)) a->done += v / 1000.0;
+			if(cmd_param(cmd, 'S', &v)) a->done += v;
+			break;
+		case 28: {
+			// Without axes all of them are homed
+			bool hx = cmd_param(cmd, 'X', NULL), hy = cmd_param(cmd, 'Y', NULL), hz = cmd_param(cmd, 'Z', NULL);
+			if(!hx && !hy && !hz) hx = hy = hz = true;
+			if((hx || hy) && pos[2] < cfg.homing_raise) pos[2] = cfg.homing_raise;
+			if(hx) pos[0] = 0.0;
+			if(hy) pos[1] = 0.0;
+			if(hz) pos[2] = 0.0;
+			break;
+		}
+		case 29:
+			if(cmd_param(cmd, 'P', &v) && v == 1) {
+				// Probing: takes a while for every point
+				a->done += 0.3 * cfg.mesh_x * cfg.mesh_y;
+				mesh_init();
+				mesh_active = true;
+			}
+			break;
+		case 90: relative = false; break;
+		case 91: relative = true; break;
+		case 92: {
+			const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+			for(int i=0; i<4; i++) if(cmd_param(cmd, axes[i], &v)) pos[i] = v;
+			break;
+		}
+		}
+	} else if(a->letter == 'M') {
+		switch(a->code) {
+		case 104: case 109:
+			if(cmd_param(cmd, 'S', &v) || cmd_param(cmd, 'R', &v)) hotend.target = v;
+			if(a->code == 109 && hotend.target > 0.0) a->stage = 2;
+			break;
+		case 140: case 190:
+			if(cmd_param(cmd, 'S', &v) || cmd_param(cmd, 'R', &v)) bed.target = v;
+			if(a->code == 190 && bed.target > 0.0) a->stage = 2;
+			break;
+		case 110:
+			// Set the line number, also without a line number of its own (queue.set_current_line_number)
+			if(cmd_param(cmd, 'N', &v)) last_line = (long)v;
+			break;
+		case 155:
+			if(cmd_param(cmd, 'S', &v)) autoreport = (unsigned int)v;
+			break;
+		}
+	}
+}
+
+/**
+ * Finish a command: send its reply and the 'ok'
+ */
+void cmd_finish() {
+	ty_active_cmd *a = &active;
+	const char *cmd = a->cmd.c_str();
+	double v, iv, jv;
+
+	if(a->letter == 'G' && a->code == 29) {
+		if(cmd_param(cmd, 'T', &v)) {
+			mesh_print(v == 1);
+		} else if(cmd_param(cmd, 'L', &v)) {
+			std::map<int, std::vector<float> >::iterator it = mesh_slots.find((int)v);
+			if(it == mesh_slots.end()) send_line("?Invalid slot.");
+			else {
+				mesh = it->second;
+				send_line("Mesh loaded from slot %d", (int)v);
+			}
+		} else if(cmd_param(cmd, 'S', &v)) {
+			mesh_slots[(int)v] = mesh;
+			send_line("Mesh saved in slot %d", (int)v);
+		} else if(cmd_param(cmd, 'A', NULL)) {
+			mesh_active = true;
+			send_line("Unified Bed Leveling System activated.");
+		} else if(cmd_param(cmd, 'D', NULL)) {
+			mesh_active = false;
+			send_line("Unified Bed Leveling System deactivated.");
+		}
+	} else if(a->letter == 'G' && (a->code == 0 || a->code == 1 || a->code == 4 || a->code == 28 || a->code == 90 || a->code == 91 || a->code == 92)) {
+		// Nothing to report
+	} else if(a->letter == 'M') {
+		switch(a->code) {
+		case 105:
+			print_temperatures(true);
+			return;
+		case 114:
+			send_line("X:%.2f Y:%.2f Z:%.2f E:%.2f Count X:%d Y:%d Z:%d", pos[0], pos[1], pos[2], pos[3],
+					(int)(pos[0] * 80), (int)(pos[1] * 80), (int)(pos[2] * 400));
+			break;
+		case 115:
+			send_line("FIRMWARE_NAME:Marlin 2.1.2 (simulator) SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin "
+					"PROTOCOL_VERSION:1.0 MACHINE_TYPE:RepUtils simulator EXTRUDER_COUNT:1 UUID:00000000-0000-0000-0000-000000000000");
+			send_line("Cap:SERIAL_XON_XOFF:0");
+			send_line("Cap:EEPROM:1");
+			send_line("Cap:AUTOREPORT_TEMP:1");
+			send_line("Cap:AUTOREPORT_POS:0");
+			send_line("Cap:ADVANCED_OK:%d", cfg.advanced_ok ? 1 : 0);
+			send_line("Cap:EMERGENCY_PARSER:1");
+			send_line("Cap:HOST_ACTION_COMMANDS:0");
+			break;
+		case 420:
+			if(cmd_param(cmd, 'S', &v)) mesh_active = v != 0.0;
+			if(cmd_param(cmd, 'V', NULL)) send_line("Unified Bed Leveling System v1.01 %sactive", mesh_active ? "" : "in");
+			send_line("echo:Bed Leveling %s", mesh_active ? "ON" : "OFF");
+			break;
+		case 421:
+			if(!cmd_param(cmd, 'I', &iv) || !cmd_param(cmd, 'J', &jv) || iv < 0 || jv < 0 || iv >= cfg.mesh_x || jv >= cfg.mesh_y) {
+				send_line("?(I,J) out of bounds.");
+			} else if(cmd_param(cmd, 'N', NULL)) {
+				mesh[(int)jv * cfg.mesh_x + (int)iv] = NAN;
+			} else if(cmd_param(cmd, 'Z', &v)) {
+				mesh[(int)jv * cfg.mesh_x + (int)iv] = v;
+			} else if(cmd_param(cmd, 'Q', &v)) {
+				mesh[(int)jv * cfg.mesh_x + (int)iv] += v;
+			} else {
+				send_line("?Z or Q or N needed.");
+			}
+			break;
+		case 82: case 83: case 84: case 104: case 106: case 107: case 108: case 109: case 110: case 117: case 140:
+		case 211:
+			if(cmd_param(cmd, 'S', &v)) endstops_on = v != 0.0;
+			break;
+		case 155: case 190: case 400: case 410: case 500: case 501: case 503:
+			break;
+		default:
+			send_line("echo:Unknown command: \"%s\"", cmd);
+		}
+	} else {
+		send_line("echo:Unknown command: \"%s\"", cmd);
+	}
+	send_ok();
+}
+
+/**
+ * Run the printer: execute the command queue and send messages
+ * @return Time until something needs to happen again
+ */
+double sim_step(double t) {
+	double next = t + 0.1;
+
+	thermal_update(t);
+	while(!planner.empty() && planner.front().end <= t) planner.pop_front();
+	if(!planner.empty() && planner.front().end < next) next = planner.front().end;
+
+	if(autoreport > 0) {
+		static double t_report = 0.0;
+		if(t >= t_report) {
+			print_temperatures(false);
+			t_report = t + autoreport;
+		}
+		if(t_report < next) next = t_report;
+	}
+
+	while(true) {
+		parse_rx();
+		if(!cmd_active) {
+			if(queue.empty()) break;
+			active.cmd = queue.front();
+			queue.pop_front();
+			active.letter = active.cmd[0];
+			active.code = atoi(&active.cmd.c_str()[1]);
+			active.stage = 0;
+			active.start = t;
+			active.next_msg = t + cfg.keepalive;
+			cmd_active = true;
+		}
+
+		ty_active_cmd *a = &active;
+		if(a->stage == 0) {
+			if(planner_wait(a)) break;
+			cmd_start(t);
+		}
+		if(a->stage == 2) {
+			// M109 / M190: wait for the heater, report the temperatures every second
+			ty_heater *ht = a->code == 109 ? &hotend : &bed;
+			if(fabs(ht->temp - ht->target) > 1.0) {
+				if(t >= a->next_msg) {
+					print_temperatures(false);
+					a->next_msg = t + 1.0;
+				}
+				if(a->next_msg < next) next = a->next_msg;
+				break;
+			}
+			a->stage = 1;
+		}
+		if(t < a->done) {
+			if(a->done < next) next = a->done;
+			break;
+		}
+		cmd_finish();
+		cmd_active = false;
+	}
+
+	// Long running command: let the host know the printer is still alive
+	if(cmd_active && active.stage != 2 && cfg.keepalive > 0.0) {
+		if(t >= active.next_msg) {
+			send_line("echo:busy: processing");
+			active.next_msg = t + cfg.keepalive;
+		}
+		if(active.next_msg < next) next = active.next_msg;
+	}
+	return next - t;
+}
+
+void sim_signal(int sig) {
+	if(sig == SIGUSR1) sim_unplug = 1;
+	else sim_stop = 1;
+}
+
+/**
+ * Open a new pseudo-terminal as the serial port of the printer and point the link to it
+ * @return 0 when OK or -1 otherwise
+ */
+int open_pty() {
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+		fprintf(stderr, "Could not open a pseudo-terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	// Start in raw mode so the start banner is not echoed back before the host configures the port
+	struct termios tty;
+	if(tcgetattr(master_fd, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(master_fd, TCSANOW, &tty);
+	}
+	const char *slave = ptsname(master_fd);
+	if(cfg.link != NULL) {
+		unlink(cfg.link);
+		if(symlink(slave, cfg.link) < 0) {
+			fprintf(stderr, "Could not create link %s: %s\n", cfg.link, strerror(errno));
+			return -1;
+		}
+	}
+	printf("%s\n", slave);
+	fflush(stdout);
+	return 0;
+}
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -L link    Create a symlink to the pty, for example /tmp/printer\n");
+	fprintf(stderr, "  -d ms      Time to process a command (default 1)\n");
+	fprintf(stderr, "  -c CMD=ms  Time to process a specific command, for example -c G28=3000 (repeatable)\n");
+	fprintf(stderr, "  -b n       Moves in the planner buffer (default 16)\n");
+	fprintf(stderr, "  -q n       Commands in the command queue (default 4)\n");
+	fprintf(stderr, "  -r n       Size of the receive buffer in bytes (default 128)\n");
+	fprintf(stderr, "  -k s       Seconds between busy messages, 0 to disable (default 2)\n");
+	fprintf(stderr, "  -B ms      Boot time after opening the port (default 500)\n");
+	fprintf(stderr, "  -a         Reply with ADVANCED_OK\n");
+	fprintf(stderr, "  -m XxY     Size of the UBL mesh (default 5x5)\n");
+	fprintf(stderr, "  -n p       Probability that a received byte is corrupted (default 0)\n");
+	fprintf(stderr, "  -s seed    Seed for the line noise (default 1)\n");
+	fprintf(stderr, "  -S baud    Baud rate of the printer: bytes take their time on the wire and the host has to\n");
+	fprintf(stderr, "             select the same rate; 'host' uses the rate the host selects (default: unlimited)\n");
+	fprintf(stderr, "  -U file    Hold back replies like the latency timer of an FTDI adapter, in ms read from file\n");
+	fprintf(stderr, "             (the latency_timer of a fake sysfs tree, see reputils -Y)\n");
+	fprintf(stderr, "  -Z mm      Raise Z to at least this height before homing X or Y (default 0)\n");
+	fprintf(stderr, "  -E mm      Clamp moves to soft endstops at 0 and mm on all axes, unless disabled with M211 S0\n");
+	fprintf(stderr, "  -v         Log all traffic to stderr\n");
+}
+
+int main(int argc, char **argv) {
+	int opt;
+
+	cfg.link = NULL;
+	cfg.latency = 0.001;
+	cfg.planner_size = 16;
+	cfg.queue_size = 4;
+	cfg.rx_size = 128;
+	cfg.keepalive = 2.0;
+	cfg.boot_time = 0.5;
+	cfg.advanced_ok = false;
+	cfg.mesh_x = cfg.mesh_y = 5;
+	cfg.noise = 0.0;
+	cfg.seed = 1;
+	cfg.baud = 0;
+	cfg.latency_timer = NULL;
+	cfg.homing_raise = 0.0;
+	cfg.soft_endstops = 0.0;
+	cfg.verbose = false;
+
+	while((opt = getopt(argc, argv, "L:d:c:b:q:r:k:B:am:n:s:S:U:Z:E:vh")) != -1) {
+		switch(opt) {
+		case 'L': cfg.link = optarg; break;
+		case 'd': cfg.latency = atof(optarg) / 1000.0; break;
+		case 'c': {
+			char *eq = strchr(optarg, '=');
+			if(eq == NULL) { usage(argv[0]); return -1; }
+			cfg.cmd_latency[std::string(optarg, eq - optarg)] = atof(eq + 1) / 1000.0;
+			break;
+		}
+		case 'b': cfg.planner_size = atoi(optarg); break;
+		case 'q': cfg.queue_size = atoi(optarg); break;
+		case 'r': cfg.rx_size = atoi(optarg); break;
+		case 'k': cfg.keepalive = atof(optarg); break;
+		case 'B': cfg.boot_time = atof(optarg) / 1000.0; break;
+		case 'a': cfg.advanced_ok = true; break;
+		case 'm':
+			if(sscanf(optarg, "%dx%d", &cfg.mesh_x, &cfg.mesh_y) == 1) cfg.mesh_y = cfg.mesh_x;
+			break;
+		case 'n': cfg.noise = atof(optarg); break;
+		case 's': cfg.seed = atoi(optarg); break;
+		case 'S': cfg.baud = strcmp(optarg, "host") == 0 ? -1 : atoi(optarg); break;
+		case 'U': cfg.latency_timer = optarg; break;
+		case 'Z': cfg.homing_raise = atof(optarg); break;
+		case 'E': cfg.soft_endstops = atof(optarg); break;
+		case 'v': cfg.verbose = true; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+	if(cfg.planner_size < 1 || cfg.queue_size < 1 || cfg.rx_size < 2 || cfg.mesh_x < 2 || cfg.mesh_y < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+	rng_state = cfg.seed * 2654435761UL + 1;
+
+	if(open_pty() < 0) return -1;
+
+	signal(SIGINT, sim_signal);
+	signal(SIGTERM, sim_signal);
+	signal(SIGUSR1, sim_signal);
+	t_start = t_thermal = now();
+	mesh_init();
+
+	while(!sim_stop) {
+		if(sim_unplug) {
+			// The USB device disappears and comes back; the printer itself keeps running
+			sim_unplug = 0;
+			log_message("unplugged\n");
+			close(master_fd);
+			if(open_pty() < 0) break;
+			connected = false;
+			reset_on_open = false;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = master_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		double t = now();
+		double wait = 0.1;
+		if(connected && booted && !killed) wait = sim_step(t);
+		else if(connected && !booted) wait = t_connect + cfg.boot_time - t;
+		if(wait < 0.0) wait = 0.0;
+
+		int res = poll(&pfd, 1, (int)ceil(wait * 1000.0));
+		if(res < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		// Without the other side of the pty opened, the master reports a hang up
+		if(pfd.revents & POLLHUP) {
+			if(connected) {
+				// The pty keeps the settings of the host: with HUPCL the host dropped DTR when it closed
+				struct termios tty;
+				reset_on_open = tcgetattr(master_fd, &tty) != 0 || (tty.c_cflag & HUPCL);
+				log_message("host disconnected%s\n", reset_on_open ? "" : ", DTR stays up");
+				connected = false;
+			}
+			usleep(10000);
+			continue;
+		}
+		t = now();
+		if(!connected) {
+			// Opening the port resets the printer, unless DTR stayed up
+			if(reset_on_open) {
+				log_message("host connected\n");
+				sim_reset();
+				t_connect = t;
+			} else {
+				log_message("host connected, no reset\n");
+			}
+			connected = true;
+		}
+		if(!booted && t >= t_connect + cfg.boot_time) {
+			booted = true;
+			send_line("start");
+			send_line("echo:Marlin 2.1.2 (simulator)");
+			send_line("echo: Last Updated: 2026-10-17 | Author: (RepUtils)");
+			send_line("echo:Free Memory: 4096  PlannerBufferBytes: 1264");
+		}
+		if(pfd.revents & POLLIN) {
+			if(booted && !killed) read_host();
+			else {
+				// Bytes sent while the printer boots or after a kill are lost
+				char buf[256];
+				if(read(master_fd, buf, sizeof(buf)) < 0 && errno != EAGAIN) break;
+			}
+		}
+	}
+
+	fprintf(stderr, "Lines: %lu, line errors: %lu, corrupted bytes: %lu, receive buffer overflows: %lu bytes, "
+			"bytes at the wrong baud rate: %lu\n", stat_lines, stat_checksum, stat_corrupted, stat_overflow, stat_baud);
+	if(cfg.link != NULL) unlink(cfg.link);
+	close(master_fd);
+	return 0;
+}
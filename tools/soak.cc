@@ -0,0 +1,120 @@
+/*
+ * soak.cc - Soak test for the serial code: plays a long printer session (a day of temperature polls by
+ * default, with moves and mesh downloads in between) as fast as the printer answers and checks that the
+ * memory use of the process stays flat. Run it against the printer simulator.
+ *
+ * Compile from the root of the repository:
+ * g++ -O2 -I. -o soak tools/soak.cc $(ls *.cc | grep -v main.cc) -lcurses -lpthread
+ *
+ * Usage: soak -p /tmp/printer [-H hours] [-i interval] [-l limit] [-j]
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "machine.h"
+#include "serial.h"
+#include "serial_thread.h"
+#include "serial_stats.h"
+
+#define MOVE_EVERY 60		// Simulated seconds between two moves
+#define MESH_EVERY 600		// Simulated seconds between two mesh downloads
+#define REPORTS 10			// Number of progress reports during the session
+
+/**
+ * Resident set size of the process in kB
+ */
+long rss_kb() {
+	long size = 0, resident = 0;
+	FILE *fh = fopen("/proc/self/statm", "r");
+	if(fh == NULL) return -1;
+	if(fscanf(fh, "%ld %ld", &size, &resident) != 2) resident = -1;
+	fclose(fh);
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void usage() {
+	fprintf(stderr, "Usage: soak -p port [options]\n");
+	fprintf(stderr, "  -p port    Serial port of the printer or simulator\n");
+	fprintf(stderr, "  -H hours   Length of the simulated session (default 24)\n");
+	fprintf(stderr, "  -i s       Simulated seconds between two temperature polls (default 1)\n");
+	fprintf(stderr, "  -l kB      Allowed growth of the resident memory after the first pass (default 64)\n");
+	fprintf(stderr, "  -j         Send the commands through the I/O threads\n");
+}
+
+int main(int argc, char **argv) {
+	const char *port = NULL;
+	double hours = 24, interval = 1;
+	long limit = 64;
+	bool threads = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "p:H:i:l:jh")) != -1) {
+		switch(opt) {
+		case 'p': port = optarg; break;
+		case 'H': hours = atof(optarg); break;
+		case 'i': interval = atof(optarg); break;
+		case 'l': limit = atol(optarg); break;
+		case 'j': threads = true; break;
+		default: usage(); return 2;
+		}
+	}
+	if(port == NULL || hours <= 0 || interval <= 0) {
+		usage();
+		return 2;
+	}
+
+	serial_verbose(false);
+	if(serial_open(port) != 0) return 1;
+	if(threads && serial_thread_start() != 0) return 1;
+
+	long polls = (long)(hours * 3600 / interval);
+	long move_every = (long)(MOVE_EVERY / interval) > 0 ? (long)(MOVE_EVERY / interval) : 1;
+	long mesh_every = (long)(MESH_EVERY / interval) > 0 ? (long)(MESH_EVERY / interval) : 1;
+	long report_every = polls / REPORTS > 0 ? polls / REPORTS : 1;
+	ty_mesh mesh = MESH_EMPTY;
+	char cmd[SERIAL_MAX_CMD_SIZE];
+	long base = -1, peak = 0, errors = 0;
+	uint64_t start = serial_stats_now();
+
+	printf("Soak: %.1f h simulated, %ld temperature polls, %s\n", hours, polls, threads ? "I/O threads" : "synchronous");
+	for(long n=0; n<polls; n++) {
+		double hotend = 0, bed = 0;
+		if(get_temperature(&hotend, &bed) != 0) errors++;
+		if(n % move_every == 0) {
+			snprintf(cmd, sizeof(cmd), "G1 X%ld Y%ld F3000\n", 10 + n % 100, 10 + n % 50);
+			if(serial_cmd(cmd, NULL) != 0) errors++;
+		}
+		if(n % mesh_every == 0 && mesh_download(-1, &mesh) != 0) errors++;
+
+		// Every buffer has been used once after the first mesh download; from then on nothing may grow
+		long rss = rss_kb();
+		if(base < 0 && n >= mesh_every) base = rss;
+		if(base >= 0 && rss > peak) peak = rss;
+		if((n + 1) % report_every == 0) {
+			printf("%5.1f h: RSS %ld kB, %ld errors, %.1f s\n", (n + 1) * interval / 3600, rss, errors,
+					(serial_stats_now() - start) / 1e9);
+			fflush(stdout);
+		}
+	}
+	if(base < 0) base = peak = rss_kb();
+	mesh_free(&mesh);
+
+	if(threads) serial_thread_stop();
+	serial_close();
+
+	long growth = peak - base;
+	printf("RSS after the first pass %ld kB, peak %ld kB, growth %ld kB (limit %ld kB), %ld errors\n", base, peak, growth, limit, errors);
+	if(growth > limit || errors > 0) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * transcript.cc - Recorder and replayer of the serial traffic.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "serial.h"
+#include "transcript.h"
+
+#include <curses.h>
+extern WINDOW *serial_win;
+
+#define error_message(...) { if(serial_win==NULL) fprintf(stderr, __VA_ARGS__); \
+							  else { wprintw(serial_win, __VA_ARGS__); wrefresh(serial_win); }}
+
+// Recorder
+std::atomic<bool> rec_active(false);	// Tested without the lock so not recording costs nothing
+std::mutex rec_mutex;					// Protects the file and keeps the records in time order
+FILE *rec_file = NULL;
+uint64_t rec_start;
+
+// A recorded event of a printer in the replayer
+typedef struct {
+	uint64_t time;
+	int type;					// TRANSCRIPT_TX or TRANSCRIPT_RX
+	std::string data;
+	size_t tx_end;				// TX: number of bytes the host sent up to and including this event
+} ty_replay_event;
+
+// A printer of the replayer
+typedef struct {
+	char port[SERIAL_PORT_NAME_SIZE];	// Port in the recording
+	char pty[SERIAL_PORT_NAME_SIZE];	// Port to connect to
+	int master_fd;
+	std::vector<ty_replay_event> events;
+	std::string tx;						// All bytes the host sent in the recording
+	uint64_t open_time;					// Time of the open record
+	int state;							// 0 waiting for the host, 1 playing, 2 the host closed the port
+	size_t next;						// Next event to play
+	size_t written;						// Bytes of the next RX event written so far
+	size_t host_bytes;					// Bytes the host sent so far
+	long first_diff;					// Offset of the first byte which differs from the recording, -1 when none
+	uint64_t anchor_rec, anchor_real;	// Recorded and real time of the last event the host caused
+} ty_replay_printer;
+
+std::vector<ty_replay_printer *> replay_printers;
+std::thread replay_thread;
+std::atomic<bool> replay_stop;
+bool replay_realtime;
+
+static uint64_t transcript_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Append a record to the recording
+ */
+static void transcript_write(int type, ty_serial_conn *conn, const char *data, unsigned int len) {
+	std::lock_guard<std::mutex> lock(rec_mutex);
+	if(rec_file == NULL) return;
+
+	ty_transcript_record r;
+	memset(&r, 0, sizeof(r));
+	r.time = transcript_now() - rec_start;
+	r.len = len;
+	r.type = type;
+	r.conn = serial_conn_id(conn);
+	fwrite(&r, sizeof(r), 1, rec_file);
+	fwrite(data, 1, len, rec_file);
+}
+
+/**
+ * Start recording the traffic of all printers. Printers which are connected already are recorded from
+ * now on, without their open record.
+ * @param path File to write, it is overwritten
+ * @return 0 when OK or a negative error code otherwise
+ */
+int transcript_record_start(const char *path) {
+	std::lock_guard<std::mutex> lock(rec_mutex);
+	if(rec_file != NULL) {
+		error_message("error: already recording\n");
+		return -1;
+	}
+	rec_file = fopen(path, "wb");
+	if(rec_file == NULL) {
+		error_message("error opening %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ty_transcript_header h;
+	memcpy(h.magic, TRANSCRIPT_MAGIC, sizeof(h.magic));
+	h.version = TRANSCRIPT_VERSION;
+	h.start = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	fwrite(&h, sizeof(h), 1, rec_file);
+	rec_start = transcript_now();
+	rec_active.store(true);
+	return 0;
+}
+
+/**
+ * Stop recording and close the file.
+ */
+void transcript_record_stop() {
+	std::lock_guard<std::mutex> lock(rec_mutex);
+	rec_active.store(false);
+	if(rec_file == NULL) return;
+	if(fclose(rec_file) != 0) error_message("error writing the transcript: %s\n", strerror(errno));
+	rec_file = NULL;
+}
+
+/**
+ * Record the connection of a printer. Called by serial_connect().
+ */
+void transcript_open(ty_serial_conn *conn) {
+	if(!rec_active.load(std::memory_order_relaxed)) return;
+	const char *port = serial_conn_port(conn);
+	transcript_write(TRANSCRIPT_OPEN, conn, port, strlen(port));
+}
+
+/**
+ * Record bytes sent to a printer. Only costs a test of a flag when not recording.
+ */
+void transcript_tx(ty_serial_conn *conn, const char *data, unsigned int len) {
+	if(!rec_active.load(std::memory_order_relaxed)) return;
+	transcript_write(TRANSCRIPT_TX, conn, data, len);
+}
+
+/**
+ * Record bytes received from a printer. Only costs a test of a flag when not recording.
+ */
+void transcript_rx(ty_serial_conn *conn, const char *data, unsigned int len) {
+	if(!rec_active.load(std::memory_order_relaxed)) return;
+	transcript_write(TRANSCRIPT_RX, conn, data, len);
+}
+
+/**
+ * Create the pseudo-terminal of a printer of the replayer
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int replay_open_pty(ty_replay_printer *p) {
+	p->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(p->master_fd < 0 || grantpt(p->master_fd) < 0 || unlockpt(p->master_fd) < 0) {
+		error_message("error: could not open a pseudo-terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	// Start in raw mode so nothing is echoed back before the host configures the port
+	struct termios tty;
+	if(tcgetattr(p->master_fd, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(p->master_fd, TCSANOW, &tty);
+	}
+	snprintf(p->pty, sizeof(p->pty), "%s", ptsname(p->master_fd));
+	return 0;
+}
+
+/**
+ * Read a recording into replay_printers
+ * @return 0 when OK or a negative error code otherwise
+ */
+static int replay_load(const char *path, int max) {
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) {
+		error_message("error opening %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	ty_transcript_header h;
+	if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRANSCRIPT_MAGIC, sizeof(h.magic)) != 0) {
+		error_message("error: %s is not a transcript\n", path);
+		fclose(f);
+		return -1;
+	}
+	if(h.version != TRANSCRIPT_VERSION) {
+		error_message("error: %s has version %u, only version %i is supported\n", path, h.version, TRANSCRIPT_VERSION);
+		fclose(f);
+		return -1;
+	}
+
+	// Printer each connection number belongs to; a new open record starts a new printer
+	ty_replay_printer *by_conn[256];
+	memset(by_conn, 0, sizeof(by_conn));
+
+	ty_transcript_record r;
+	while(fread(&r, sizeof(r), 1, f) == 1) {
+		std::string data(r.len, '\0');
+		if(r.len > 0 && fread(&data[0], 1, r.len, f) != r.len) {
+			error_message("warning: %s is truncated\n", path);
+			break;
+		}
+
+		ty_replay_printer *p = by_conn[r.conn];
+		if(r.type == TRANSCRIPT_OPEN || p == NULL) {
+			// Printers connected before the recording started have no open record
+			if((int)replay_printers.size() == max) {
+				error_message("error: %s has more than %i printers\n", path, max);
+				fclose(f);
+				return -1;
+			}
+			p = new ty_replay_printer();
+			snprintf(p->port, sizeof(p->port), "%s", r.type == TRANSCRIPT_OPEN ? data.c_str() : "(connected before the recording)");
+			p->master_fd = -1;
+			p->open_time = r.time;
+			p->first_diff = -1;
+			replay_printers.push_back(p);
+			by_conn[r.conn] = p;
+			if(r.type == TRANSCRIPT_OPEN) continue;
+		}
+
+		ty_replay_event e;
+		e.time = r.time;
+		e.type = r.type;
+		e.data = data;
+		if(r.type == TRANSCRIPT_TX) p->tx += data;
+		e.tx_end = p->tx.size();
+		p->events.push_back(e);
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Play the events of a printer which are due
+ * @return Milliseconds until the next event is due, -1 when waiting for the host
+ */
+static int replay_advance(ty_replay_printer *p, uint64_t now) {
+	while(p->next < p->events.size()) {
+		ty_replay_event *e = &p->events[p->next];
+		if(e->type == TRANSCRIPT_TX) {
+			if(p->host_bytes < e->tx_end) return -1;
+			// The replies to this command are timed from now on
+			p->anchor_rec = e->time;
+			p->anchor_real = now;
+			p->next++;
+			continue;
+		}
+
+		if(replay_realtime) {
+			uint64_t due = p->anchor_real + (e->time - p->anchor_rec);
+			if(due > now) return (due - now + 999999) / 1000000;
+		}
+		int n = write(p->master_fd, e->data.data() + p->written, e->data.size() - p->written);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 1;
+			p->state = 2;
+			return -1;
+		}
+		p->written += n;
+		// The host is not reading, try again a bit later
+		if(p->written < e->data.size()) return 1;
+		p->written = 0;
+		p->next++;
+	}
+	return -1;
+}
+
+/**
+ * Read what the host sent and compare it with the recording
+ */
+static void replay_receive(ty_replay_printer *p) {
+	char buf[1024];
+	while(1) {
+		int n = read(p->master_fd, buf, sizeof(buf));
+		if(n <= 0) return;
+		for(int i=0; i<n && p->first_diff < 0; i++) {
+			size_t pos = p->host_bytes + i;
+			if(pos >= p->tx.size() || p->tx[pos] != buf[i]) p->first_diff = pos;
+		}
+		p->host_bytes += n;
+	}
+}
+
+static void replay_main() {
+	std::vector<struct pollfd> fds(replay_printers.size());
+
+	while(!replay_stop.load()) {
+		uint64_t now = transcript_now();
+		int timeout = 100;
+		bool busy = false;
+
+		for(size_t i=0; i<replay_printers.size(); i++) {
+			ty_replay_printer *p = replay_printers[i];
+			fds[i].fd = p->state == 2 ? -1 : p->master_fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			if(p->state == 0) {
+				// Without the other side of the pty opened, the master reports a hang up
+				timeout = 10;
+			} else if(p->state == 1) {
+				int wait = replay_advance(p, now);
+				if(wait >= 0 && wait < timeout) timeout = wait;
+			}
+			if(p->state != 2) busy = true;
+		}
+		if(!busy) break;
+
+		if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+			error_message("error: poll failed in the replayer: %s\n", strerror(errno));
+			break;
+		}
+		now = transcript_now();
+		for(size_t i=0; i<replay_printers.size(); i++) {
+			ty_replay_printer *p = replay_printers[i];
+			if(fds[i].fd < 0) continue;
+			if(fds[i].revents & POLLHUP) {
+				if(p->state == 1) p->state = 2;
+				continue;
+			}
+			if(p->state == 0) {
+				// The host opened the port: the printer starts
+				p->state = 1;
+				p->anchor_rec = p->open_time;
+				p->anchor_real = now;
+			}
+			if(fds[i].revents & POLLIN) replay_receive(p);
+			replay_advance(p, now);
+		}
+	}
+}
+
+/**
+ * Play the printers of a recording on pseudo-terminals. Each printer waits for the host to open its
+ * port and then answers as it did in the recording: the bytes received after a command are sent once
+ * the host sent the same number of bytes as in the recording, either with the original delay or right
+ * away. Differences between what the host sends and the recording are counted and reported by
+ * transcript_replay_stop().
+ * @param path Recording to play
+ * @param realtime Keep the original timing, otherwise reply as fast as possible
+ * @param ports Filled with the serial ports to connect to, one per printer in the recording in the
+ * order they were connected
+ * @param max Size of ports
+ * @return Number of printers or a negative error code
+ */
+int transcript_replay_start(const char *path, bool realtime, const char **ports, int max) {
+	if(!replay_printers.empty()) {
+		error_message("error: already replaying\n");
+		return -1;
+	}
+	if(replay_load(path, max) < 0) {
+		transcript_replay_stop();
+		return -1;
+	}
+	for(size_t i=0; i<replay_printers.size(); i++) {
+		if(replay_open_pty(replay_printers[i]) < 0) {
+			transcript_replay_stop();
+			return -1;
+		}
+		ports[i] = replay_printers[i]->pty;
+	}
+
+	replay_realtime = realtime;
+	replay_stop.store(false);
+	replay_thread = std::thread(replay_main);
+	return replay_printers.size();
+}
+
+/**
+ * Stop playing and print for each printer how much of the recording was played and whether the host
+ * sent the same bytes as in the recording.
+ * @return 0 when the host sent exactly the recorded bytes to all printers or 1 otherwise
+ */
+int transcript_replay_stop() {
+	replay_stop.store(true);
+	if(replay_thread.joinable()) replay_thread.join();
+
+	int res = 0;
+	for(size_t i=0; i<replay_printers.size(); i++) {
+		ty_replay_printer *p = replay_printers[i];
+		if(p->master_fd >= 0) {
+			printf("%s: played %lu of %lu events, host sent %lu of %lu bytes", p->port, (unsigned long)p->next,
+					(unsigned long)p->events.size(), (unsigned long)p->host_bytes, (unsigned long)p->tx.size());
+			if(p->first_diff >= 0) printf(", first difference at byte %li", p->first_diff);
+			printf("\n");
+			if(p->first_diff >= 0 || p->host_bytes != p->tx.size()) res = 1;
+			close(p->master_fd);
+		}
+		delete p;
+	}
+	replay_printers.clear();
+	return res;
+}
@@ -0,0 +1,94 @@
+/*
+ * transcript.h - Recorder and replayer of the serial traffic. The recorder writes every byte sent to
+ * and received from the printers with a timestamp into a compact binary file. The replayer plays the
+ * printers of a recording on pseudo-terminals, so a session runs through the real serial code
+ * (serial_cmd(), mesh_download(), get_temperature(), ...) again without a printer attached.
+ *
+ * File layout: a ty_transcript_header followed by records, each a ty_transcript_record followed by
+ * len bytes of data. All numbers are in the byte order of the recording machine.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: cyberwizzard
+ */
+
+#ifndef TRANSCRIPT_H_
+#define TRANSCRIPT_H_
+
+#include <stdint.h>
+
+#include "main.h"
+#include "serial.h"
+
+#define TRANSCRIPT_MAGIC "RUTR"
+#define TRANSCRIPT_VERSION 1
+
+// Record types
+#define TRANSCRIPT_OPEN 0	// A printer was connected, the data is the name of the serial port
+#define TRANSCRIPT_TX 1		// Bytes sent to the printer
+#define TRANSCRIPT_RX 2		// Bytes received from the printer
+
+typedef struct {
+	char magic[4];			// TRANSCRIPT_MAGIC
+	uint32_t version;		// TRANSCRIPT_VERSION
+	uint64_t start;			// Wall clock time of the start of the recording in nanoseconds (CLOCK_REALTIME)
+} ty_transcript_header;
+
+typedef struct {
+	uint64_t time;			// Nanoseconds since the start of the recording (CLOCK_MONOTONIC)
+	uint32_t len;			// Number of data bytes following the record
+	uint8_t type;			// TRANSCRIPT_*
+	uint8_t conn;			// Number of the connection (serial_conn_id()), reused after a disconnect
+	uint16_t reserved;
+} ty_transcript_record;
+
+/**
+ * Start recording the traffic of all printers. Printers which are connected already are recorded from
+ * now on, without their open record.
+ * @param path File to write, it is overwritten
+ * @return 0 when OK or a negative error code otherwise
+ */
+int transcript_record_start(const char *path);
+
+/**
+ * Stop recording and close the file.
+ */
+void transcript_record_stop();
+
+/**
+ * Record the connection of a printer. Called by serial_connect().
+ */
+void transcript_open(ty_serial_conn *conn);
+
+/**
+ * Record bytes sent to a printer. Only costs a test of a flag when not recording.
+ */
+void transcript_tx(ty_serial_conn *conn, const char *data, unsigned int len);
+
+/**
+ * Record bytes received from a printer. Only costs a test of a flag when not recording.
+ */
+void transcript_rx(ty_serial_conn *conn, const char *data, unsigned int len);
+
+/**
+ * Play the printers of a recording on pseudo-terminals. Each printer waits for the host to open its
+ * port and then answers as it did in the recording: the bytes received after a command are sent once
+ * the host sent the same number of bytes as in the recording, either with the original delay or right
+ * away. Differences between what the host sends and the recording are counted and reported by
+ * transcript_replay_stop().
+ * @param path Recording to play
+ * @param realtime Keep the original timing, otherwise reply as fast as possible
+ * @param ports Filled with the serial ports to connect to, one per printer in the recording in the
+ * order they were connected
+ * @param max Size of ports
+ * @return Number of printers or a negative error code
+ */
+int transcript_replay_start(const char *path, bool realtime, const char **ports, int max);
+
+/**
+ * Stop playing and print for each printer how much of the recording was played and whether the host
+ * sent the same bytes as in the recording.
+ * @return 0 when the host sent exactly the recorded bytes to all printers or 1 otherwise
+ */
+int transcript_replay_stop();
+
+#endif /* TRANSCRIPT_H_ */
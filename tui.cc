@@ -24,6 +24,16 @@ extern int stepsize;
 t_print_status_bar func_print_status_bar = NULL;
 
 int three_wnd_mode = 0;
+int overview_lines = MESH_SIZE_Y;	// Lines of the overview below its header (3 window mode), one per row of the mesh
+
+/**
+ * Rows of the overview including its border and header; at least MIN_HEIGHT rows are left for the other windows
+ */
+static int tui_overview_rows(int row) {
+	if(!three_wnd_mode) return 0;
+	int o_rows = overview_lines + 4;
+	return o_rows > row - MIN_HEIGHT ? row - MIN_HEIGHT : o_rows;
+}
 
 /**
  * Load curses and create all windows
@@ -31,7 +41,6 @@ int three_wnd_mode = 0;
 void tui_init(int _three_wnd_mode, t_print_status_bar func_ptr) {
 	int col, row;
 	three_wnd_mode = _three_wnd_mode;
-	int o_rows = three_wnd_mode ? MESH_SIZE_Y + 4 : 0; // OVerview rows (incl border), only exists in 3 window mode
 
 	// Store the hook to the function which is drawing the status bar
 	func_print_status_bar = func_ptr;
@@ -43,6 +52,7 @@ void tui_init(int _three_wnd_mode, t_print_status_bar func_ptr) {
 
 	// Do the window init
 	getmaxyx(stdscr,row,col);
+	int o_rows = tui_overview_rows(row); // OVerview rows (incl border), only exists in 3 window mode
 
 	// To retain the borders on a window, we first define a window 2 columns and rows larger
 	// than the window for the serial output and draw a box in it.
@@ -91,20 +101,10 @@ void tui_deinit() {
 }
 
 /**
- * Resize the current TUI - will move, resize and redraw all windows
+ * Move, resize and redraw all windows for a screen of the given size
  */
-void tui_resize() {
-	int col, row;
-	// Resize terminal event - get the current screen size
-	getmaxyx(stdscr, row, col);
-
-	// Only resize the TUI if we have a sane size
-	if(row < MIN_HEIGHT || col < MIN_WIDTH) return;
-
-	wprintw(cmd_win, "Resize detected, new size: %i (rows) x %i (cols)\n", row, col);
-	wrefresh(cmd_win);
-
-	int o_rows = three_wnd_mode ? MESH_SIZE_Y + 4 : 0; // OVerview rows (incl border), only exists in 3 window mode
+static void tui_layout(int row, int col) {
+	int o_rows = tui_overview_rows(row); // OVerview rows (incl border), only exists in 3 window mode
 	int serstart = (col / 2) - 1;
 	int cmdwidth = col / 2;
 	int serwidth = col - cmdwidth;
@@ -114,6 +114,14 @@ void tui_resize() {
 	endwin();
 	refresh();
 
+	// Windows which grow because the overview shrinks are moved up first, so they always fit on the screen
+	bool up = getbegy(cmd_win) > o_rows;
+	if(up) {
+		MVWIN(serial_border, o_rows,   serstart);
+		MVWIN(serial_win,    o_rows+1, serstart+1);
+		MVWIN(cmd_win,       o_rows,   0);
+	}
+
 	// Resize all windows
 	WRESIZE(serial_border, serheight, serwidth);
 	WRESIZE(serial_win, serheight-2, serwidth-2);
@@ -124,8 +132,11 @@ void tui_resize() {
 	}
 
 	// Move the serial windows
-	MVWIN(serial_border, o_rows,   serstart);
-	MVWIN(serial_win,    o_rows+1, serstart+1);
+	if(!up) {
+		MVWIN(serial_border, o_rows,   serstart);
+		MVWIN(serial_win,    o_rows+1, serstart+1);
+		MVWIN(cmd_win,       o_rows,   0);
+	}
 
 	// Mark the content as dirty so it gets redrawn completely (boxed windows done later)
 	touchwin(cmd_win);
@@ -168,4 +179,33 @@ void tui_resize() {
 	(*func_print_status_bar)(row - 1, stepsize);
 }
 
+/**
+ * Resize the current TUI - will move, resize and redraw all windows
+ */
+void tui_resize() {
+	int col, row;
+	// Resize terminal event - get the current screen size
+	getmaxyx(stdscr, row, col);
+
+	// Only resize the TUI if we have a sane size
+	if(row < MIN_HEIGHT || col < MIN_WIDTH) return;
+
+	wprintw(cmd_win, "Resize detected, new size: %i (rows) x %i (cols)\n", row, col);
+	wrefresh(cmd_win);
+
+	tui_layout(row, col);
+}
+
+/**
+ * Set the number of lines of the overview (3 window mode), for example one per row of the mesh; the
+ * windows are laid out again when the TUI is running
+ */
+void tui_set_overview_lines(int lines) {
+	if(lines == overview_lines) return;
+	overview_lines = lines;
+	if(cmd_win == NULL) return;
 
+	int col, row;
+	getmaxyx(stdscr, row, col);
+	if(row >= MIN_HEIGHT && col >= MIN_WIDTH) tui_layout(row, col);
+}
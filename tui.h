@@ -46,6 +46,12 @@ typedef void (*t_print_status_bar)(int,int);
  */
 void tui_init(int three_wnd_mode, t_print_status_bar func_ptr);
 
+/**
+ * Set the number of lines of the overview (3 window mode), for example one per row of the mesh; the
+ * windows are laid out again when the TUI is running
+ */
+void tui_set_overview_lines(int lines);
+
 /**
  * End curses and destroy all windows
  */